@@ -7,561 +7,5078 @@
 #include <linux/fs.h>          /* libfs stuff           */
 #include <linux/buffer_head.h> /* buffer_head           */
 #include <linux/slab.h>        /* kmem_cache            */
+#include <linux/mpage.h>       /* mpage_readpage        */
+#include <linux/highmem.h>     /* kmap                  */
+#include <linux/blkdev.h>      /* blkdev_issue_flush    */
+#include <linux/parser.h>      /* match_token           */
+#include <linux/seq_file.h>    /* seq_puts              */
+#include <linux/crc32.h>       /* crc32_le              */
+#include <linux/sched.h>       /* current               */
+#include <linux/workqueue.h>   /* delayed_work          */
+#include <linux/sort.h>        /* sort                  */
+#include <linux/jump_label.h>  /* static_branch_unlikely */
+#include <linux/moduleparam.h> /* module_param_cb       */
+#include <linux/debugfs.h>     /* debugfs_create_file   */
+#include <linux/percpu.h>      /* alloc_percpu          */
+#include <linux/percpu_counter.h> /* percpu_counter_add */
+#include <linux/ktime.h>       /* ktime_get_ns          */
+#include <linux/log2.h>        /* ilog2                 */
+#include <linux/lz4.h>         /* LZ4_compress_default  */
+#include <linux/mempool.h>     /* mempool_alloc         */
+#include <linux/sched/mm.h>    /* memalloc_nofs_save    */
 #include "assoofs.h"
 
 MODULE_LICENSE("GPL");
 
 /*
- *  Operaciones sobre ficheros
+ *  Informacion del superbloque en memoria mientras el dispositivo esta montado
  */
-ssize_t assoofs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos);
-ssize_t assoofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos);
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
-const struct file_operations assoofs_file_operations = {
-    .read = assoofs_read,
-    .write = assoofs_write,
+struct assoofs_sb_info {
+    struct assoofs_super_block_info *disk; // Copia en memoria del superbloque: los contadores cambian aqui y llegan a
+                                           // disco con assoofs_flush_sb (ver assoofs_save_sb_info)
+    struct buffer_head *sb_bh;             // Bloque 0, fijado en memoria como el mapa de bits
+    unsigned long flags;                   // ASSOOFS_SB_DIRTY
+    struct delayed_work sb_work;           // Escritura periodica del superbloque
+    struct buffer_head **bitmap_bh;        // Bloques del mapa de bits, fijados en memoria mientras este montado
+    struct buffer_head **refcount_bh;      // Bloques de los contadores de referencias, fijados igual (NULL sin
+                                           // ASSOOFS_FEATURE_REFLINK)
+    spinlock_t lock;                       // Protege la copia del superbloque, reclaim_list y los contadores de
+                                           // referencias
+    struct assoofs_group *groups;          // Grupos de asignacion, uno por bloque del mapa de bits
+    uint64_t group_count;
+    uint64_t inodes_per_group;             // Tramo de la tabla de inodos de cada grupo
+    uint64_t __percpu *cursor;             // Por CPU: el siguiente bloque libre se busca a partir de aqui
+    struct percpu_counter free_blocks;     // Totales del superbloque mientras esta montado (ver assoofs_flush_sb)
+    struct percpu_counter inodes_count;
+    unsigned long *inode_map;              // Numeros de inodo en uso (el bit ino - 1), para reutilizar los borrados
+    struct list_head reclaim_list;         // Pendiente de assoofs_reclaim: inodos que liberar y directorios que compactar
+    struct delayed_work reclaim_work;
+    struct super_block *sb;
+    bool writeback;                        // Opcion de montaje writeback (ver assoofs_dirty_bh)
+    bool compress;                         // Opcion de montaje compress: los ficheros nuevos se comprimen
+    mempool_t *cluster_pool;               // Buffers de assoofs_cluster_buf (NULL sin ASSOOFS_FEATURE_COMPRESSION)
+    struct assoofs_journal *journal;       // Journal de metadatos (NULL si el dispositivo no tiene)
+    struct assoofs_stats __percpu *stats;  // Contadores de la actividad del dispositivo (ver assoofs_stat_op)
+    struct dentry *debugfs;                // Su directorio en /sys/kernel/debug/assoofs
 };
 
-ssize_t assoofs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+static inline struct assoofs_sb_info *ASSOOFS_SB(struct super_block *sb)
 {
-    struct buffer_head *bh;
-    char *buffer;
-    int nbytes;
+    return sb->s_fs_info;
+}
 
-    // Obtener la informacion persistente del inodo a partir de filp
-    struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
+/*
+ *  Grupos de asignacion. Cada bloque del mapa de bits describe un grupo de ASSOOFS_BITS_PER_BLOCK(bs) bloques, y la
+ *  tabla de inodos se reparte entre los grupos en tramos de inodes_per_group numeros. Cada grupo lleva sus libres en
+ *  su propia linea de cache: reservar y liberar en grupos distintos no comparte nada, porque los bits de los mapas
+ *  se cambian con operaciones atomicas y los totales del superbloque son percpu_counter. Se calculan al montar a
+ *  partir del mapa de bits y de inode_map, asi que no estan en disco
+ */
+struct assoofs_group {
+    atomic64_t free_blocks;
+    atomic64_t free_inodes;
+} ____cacheline_aligned_in_smp;
 
-    printk(KERN_INFO "Read request\n");
+static inline uint64_t assoofs_block_group(struct super_block *sb, uint64_t block)
+{
+    return block / ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize);
+}
 
-    // Comprobar si el valor del pos ha llegado al final del fichero
-    if (*ppos >= inode_info->file_size)
-        return 0;
+static inline uint64_t assoofs_inode_group(struct super_block *sb, uint64_t inode_no)
+{
+    return div64_u64(inode_no - 1, ASSOOFS_SB(sb)->inodes_per_group);
+}
 
-    // Acceso al contenido del fichero almacenandolo en el buffer
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
-    buffer = (char *)bh->b_data;
+/*
+ *  Inodo en memoria: la informacion persistente va junto al inodo del VFS y los dos salen de assoofs_inode_cachep.
+ *  Cerrojos: las entradas de un directorio (y su informacion persistente) las protege el i_rwsem del VFS, que create
+ *  y mkdir tienen en exclusiva y lookup e iterate_shared compartido. En los ficheros, map_sem protege el mapa de
+ *  extents y file_size, porque la escritura de paginas sucias reserva bloques sin tener el i_rwsem
+ */
+struct assoofs_inode {
+    struct assoofs_inode_info info;
+    struct rw_semaphore map_sem;
+    struct inode vfs_inode;
+};
 
-    // Copiar el contenido del buffer a buf, la operacion copy_to_user copia la informacion entre
-    // kernel y usuario
-    nbytes = min((size_t)inode_info->file_size, len); // Hay que comparar len con el tama~no del fichero por si llegamos al
-                                                      // final del fichero
-    if(copy_to_user(buf, buffer, nbytes)!=0){
-        printk(KERN_INFO "Read ERROR\n");
-    }
+static struct kmem_cache *assoofs_inode_cachep;
 
-    // Incrementar el valor de ppos
-    *ppos += nbytes;
-    return nbytes;
+static inline struct assoofs_inode *ASSOOFS_I(struct inode *inode)
+{
+    return container_of(inode, struct assoofs_inode, vfs_inode);
 }
 
-ssize_t assoofs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
+static inline struct assoofs_inode_info *ASSOOFS_INODE(struct inode *inode)
 {
+    return &ASSOOFS_I(inode)->info;
+}
 
-    struct buffer_head *bh;
-    char *buffer;
-    
-    // Obtener la informacion persistente del inodo a partir de filp
-    struct assoofs_inode_info *inode_info = filp->f_path.dentry->d_inode->i_private;
-    
-    printk(KERN_INFO "Write request\n");
+/*
+ *  Depuracion y estadisticas. Los mensajes de cada operacion solo salen con el parametro debug del modulo
+ *  (/sys/module/assoofs/parameters/debug): mientras esta apagado, assoofs_dbg es un salto que no se toma gracias a la
+ *  static key y no cuesta nada. Las estadisticas de cada dispositivo montado son contadores por CPU, sin cerrojos, que
+ *  se suman al leer /sys/kernel/debug/assoofs/<dispositivo>/stats
+ */
+static DEFINE_STATIC_KEY_FALSE(assoofs_debug_key);
+
+#define assoofs_dbg(fmt, ...)                               \
+    do                                                      \
+    {                                                       \
+        if (static_branch_unlikely(&assoofs_debug_key))     \
+            printk(KERN_INFO fmt, ##__VA_ARGS__);           \
+    } while (0)
+
+static int assoofs_debug_set(const char *val, const struct kernel_param *kp)
+{
+    bool on;
+    int ret;
+
+    ret = kstrtobool(val, &on);
+    if (ret)
+        return ret;
+    if (on)
+        static_branch_enable(&assoofs_debug_key);
+    else
+        static_branch_disable(&assoofs_debug_key);
+    return 0;
+}
+
+static int assoofs_debug_get(char *buffer, const struct kernel_param *kp)
+{
+    return sprintf(buffer, "%d\n", static_key_enabled(&assoofs_debug_key));
+}
+
+static const struct kernel_param_ops assoofs_debug_ops = {
+    .set = assoofs_debug_set,
+    .get = assoofs_debug_get,
+};
+module_param_cb(debug, &assoofs_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Log every filesystem operation");
+
+// Operaciones que se cuentan y se miden
+enum assoofs_op {
+    ASSOOFS_OP_LOOKUP,
+    ASSOOFS_OP_CREATE,
+    ASSOOFS_OP_MKDIR,
+    ASSOOFS_OP_UNLINK,
+    ASSOOFS_OP_RMDIR,
+    ASSOOFS_OP_ITERATE,
+    ASSOOFS_OP_READ,
+    ASSOOFS_OP_WRITE,
+    ASSOOFS_OP_FSYNC,
+    ASSOOFS_OP_READPAGE,
+    ASSOOFS_OP_READAHEAD,
+    ASSOOFS_OP_WRITEPAGE,
+    ASSOOFS_OP_WRITEPAGES,
+    ASSOOFS_OP_SYNC_FS,
+    ASSOOFS_OP_COMMIT,
+    ASSOOFS_OP_RECLAIM,
+    ASSOOFS_OP_CLONE,
+    ASSOOFS_OP_MAX
+};
+
+static const char *const assoofs_op_names[ASSOOFS_OP_MAX] = {
+    [ASSOOFS_OP_LOOKUP] = "lookup",
+    [ASSOOFS_OP_CREATE] = "create",
+    [ASSOOFS_OP_MKDIR] = "mkdir",
+    [ASSOOFS_OP_UNLINK] = "unlink",
+    [ASSOOFS_OP_RMDIR] = "rmdir",
+    [ASSOOFS_OP_ITERATE] = "iterate",
+    [ASSOOFS_OP_READ] = "read",
+    [ASSOOFS_OP_WRITE] = "write",
+    [ASSOOFS_OP_FSYNC] = "fsync",
+    [ASSOOFS_OP_READPAGE] = "readpage",
+    [ASSOOFS_OP_READAHEAD] = "readahead",
+    [ASSOOFS_OP_WRITEPAGE] = "writepage",
+    [ASSOOFS_OP_WRITEPAGES] = "writepages",
+    [ASSOOFS_OP_SYNC_FS] = "sync_fs",
+    [ASSOOFS_OP_COMMIT] = "journal_commit",
+    [ASSOOFS_OP_RECLAIM] = "reclaim",
+    [ASSOOFS_OP_CLONE] = "clone",
+};
+
+#define ASSOOFS_LAT_BUCKETS 40 // Histograma de latencias: el hueco i cuenta las que tardan [2^i, 2^(i+1)) ns
+
+struct assoofs_stats {
+    u64 ops[ASSOOFS_OP_MAX];
+    u64 lat[ASSOOFS_OP_MAX][ASSOOFS_LAT_BUCKETS];
+    u64 bytes_read;
+    u64 bytes_written;
+    u64 bread_hits;             // Bloques de metadatos que ya estaban en la cache del dispositivo
+    u64 bread_misses;           // Bloques de metadatos que hubo que leer de disco
+    u64 alloc_calls;            // Busquedas de un bloque libre
+    u64 alloc_scanned;          // Bits del mapa de bits recorridos en esas busquedas
+    u64 journal_blocks;         // Bloques de metadatos escritos a traves del journal
+    u64 reclaimed_inodes;       // Inodos borrados que assoofs_reclaim ha devuelto a la tabla
+    u64 reclaimed_blocks;       // Bloques que ha devuelto al mapa de bits
+    u64 compress_in;            // Bytes de datos de ficheros comprimidos que se han escrito
+    u64 compress_out;           // Bytes que han ocupado en disco
+    u64 cloned_blocks;          // Bloques que los clones han compartido en vez de copiar
+    u64 cow_blocks;             // Bloques compartidos que se han copiado al escribir en ellos
+};
+
+#define assoofs_stat_add(sb, field, n) this_cpu_add(ASSOOFS_SB(sb)->stats->field, n)
+#define assoofs_stat_inc(sb, field) this_cpu_inc(ASSOOFS_SB(sb)->stats->field)
+
+// Cuenta una operacion op que empezo en start (ktime_get_ns) y apunta lo que ha tardado en su histograma
+static inline void assoofs_stat_op(struct super_block *sb, enum assoofs_op op, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+
+    assoofs_stat_inc(sb, ops[op]);
+    assoofs_stat_inc(sb, lat[op][min_t(unsigned int, ilog2(ns | 1), ASSOOFS_LAT_BUCKETS - 1)]);
+}
+
+// sb_bread contando si el bloque ya estaba en la cache
+static struct buffer_head *assoofs_bread(struct super_block *sb, sector_t block)
+{
+    struct buffer_head *bh = sb_find_get_block(sb, block);
+
+    if (bh && buffer_uptodate(bh))
+    {
+        assoofs_stat_inc(sb, bread_hits);
+        return bh;
+    }
+    brelse(bh);
+    assoofs_stat_inc(sb, bread_misses);
+    return sb_bread(sb, block);
+}
 
-    // Acceso al contenido del fichero
-    bh = sb_bread(filp->f_path.dentry->d_inode->i_sb, inode_info->data_block_number);
+static struct dentry *assoofs_debugfs_root; // /sys/kernel/debug/assoofs
 
-    // Escribir en el fichero los datos obtenidos de buf
-    buffer = (char *)bh->b_data;
-    buffer += *ppos;
-    if(copy_from_user(buffer, buf, len)!=0){
-        printk(KERN_INFO "Write ERROR\n");
+static int assoofs_stats_show(struct seq_file *m, void *v)
+{
+    struct super_block *sb = m->private;
+    struct assoofs_stats *sum, *stats;
+    unsigned int op, i;
+    int cpu;
+
+    sum = kzalloc(sizeof(*sum), GFP_KERNEL);
+    if (!sum)
+        return -ENOMEM;
+
+    // Sumar los contadores de todas las CPUs
+    for_each_possible_cpu(cpu)
+    {
+        stats = per_cpu_ptr(ASSOOFS_SB(sb)->stats, cpu);
+        for (op = 0; op < ASSOOFS_OP_MAX; op++)
+        {
+            sum->ops[op] += stats->ops[op];
+            for (i = 0; i < ASSOOFS_LAT_BUCKETS; i++)
+                sum->lat[op][i] += stats->lat[op][i];
+        }
+        sum->bytes_read += stats->bytes_read;
+        sum->bytes_written += stats->bytes_written;
+        sum->bread_hits += stats->bread_hits;
+        sum->bread_misses += stats->bread_misses;
+        sum->alloc_calls += stats->alloc_calls;
+        sum->alloc_scanned += stats->alloc_scanned;
+        sum->journal_blocks += stats->journal_blocks;
+        sum->reclaimed_inodes += stats->reclaimed_inodes;
+        sum->reclaimed_blocks += stats->reclaimed_blocks;
+        sum->compress_in += stats->compress_in;
+        sum->compress_out += stats->compress_out;
+        sum->cloned_blocks += stats->cloned_blocks;
+        sum->cow_blocks += stats->cow_blocks;
     }
 
-    // Incrementar el valor de ppos, marcar el bloque como sucio y sincronizar
-    *ppos += len;
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    seq_printf(m, "bytes_read %llu\nbytes_written %llu\n", sum->bytes_read, sum->bytes_written);
+    seq_printf(m, "bread_hits %llu\nbread_misses %llu\n", sum->bread_hits, sum->bread_misses);
+    seq_printf(m, "alloc_calls %llu\nalloc_scanned %llu\n", sum->alloc_calls, sum->alloc_scanned);
+    seq_printf(m, "journal_blocks %llu\n", sum->journal_blocks);
+    seq_printf(m, "reclaimed_inodes %llu\nreclaimed_blocks %llu\n", sum->reclaimed_inodes, sum->reclaimed_blocks);
+    seq_printf(m, "compress_in %llu\ncompress_out %llu\n", sum->compress_in, sum->compress_out);
+    seq_printf(m, "cloned_blocks %llu\ncow_blocks %llu\n", sum->cloned_blocks, sum->cow_blocks);
 
-    // Actualizar el campo file_size de la información persistente del inodo y devolver el numero
-    // de bytes escritos
+    // Una linea por operacion: cuantas y, de cada hueco del histograma con algo, "limite inferior en ns:cuantas"
+    for (op = 0; op < ASSOOFS_OP_MAX; op++)
+    {
+        seq_printf(m, "%s %llu", assoofs_op_names[op], sum->ops[op]);
+        for (i = 0; i < ASSOOFS_LAT_BUCKETS; i++)
+            if (sum->lat[op][i])
+                seq_printf(m, " %llu:%llu", 1ULL << i, sum->lat[op][i]);
+        seq_putc(m, '\n');
+    }
 
-    inode_info->file_size = *ppos;
-    //filp->f_path.dentry->d_inode->i_sb superbloque
-    assoofs_save_inode_info(filp->f_path.dentry->d_inode->i_sb, inode_info);
-    return len;
+    kfree(sum);
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(assoofs_stats);
 
 /*
- *  Operaciones sobre directorios
+ *  Journal de metadatos. Cada operacion que cambia metadatos abre un handle (assoofs_journal_start) y los bloques que
+ *  modifica se apuntan en la transaccion en curso en vez de escribirse. Al hacer commit se copian los bloques, se
+ *  escriben en el journal (descriptor, copias y commit con crc32), y despues las copias se llevan a su sitio. Los
+ *  handles que terminan mientras otro proceso esta haciendo commit se esperan y se escriben juntos en el siguiente:
+ *  con muchos procesos creando ficheros cada escritura al disco lleva los cambios de todos (group commit)
  */
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
-const struct file_operations assoofs_dir_operations = {
-    .owner = THIS_MODULE,
-    .iterate = assoofs_iterate,
+#define ASSOOFS_JOURNAL_HANDLE_BLOCKS 16    // Bloques que puede tocar una operacion (crear con division de hoja)
+#define ASSOOFS_JOURNAL_INTERVAL (5 * HZ)   // Con -o writeback el commit se hace como mucho cada 5 segundos
+
+// Truncar y liberar un inodo van quitando bloques desde el final en varias transacciones: en cada una como mucho
+// ASSOOFS_RELEASE_EXTENTS tramos con ASSOOFS_RELEASE_CHUNK bloques entre todos. ASSOOFS_RELEASE_BLOCKS son los bloques
+// del mapa de bits y de los contadores de referencias que pueden tocar (cada tramo puede empezar en uno y acabar en
+// el siguiente)
+#define ASSOOFS_RELEASE_EXTENTS 4
+#define ASSOOFS_RELEASE_CHUNK(bs) (ASSOOFS_REFCOUNTS_PER_BLOCK(bs) * 4)
+#define ASSOOFS_RELEASE_BLOCKS(bs) (DIV_ROUND_UP(ASSOOFS_RELEASE_CHUNK(bs), ASSOOFS_BITS_PER_BLOCK(bs)) + \
+                                    DIV_ROUND_UP(ASSOOFS_RELEASE_CHUNK(bs), ASSOOFS_REFCOUNTS_PER_BLOCK(bs)) + \
+                                    4 * ASSOOFS_RELEASE_EXTENTS)
+
+struct assoofs_transaction {
+    uint64_t tid;                 // Numero de la transaccion
+    unsigned int count;           // Bloques apuntados
+    unsigned int reserved;        // Bloques reservados por los handles que se han unido
+    struct buffer_head **bhs;     // Bloques apuntados (con una referencia cada uno)
+    struct list_head freed;       // Tramos que libera (assoofs_freed), se pueden reservar otra vez despues del commit
 };
 
-static int assoofs_iterate(struct file *filp, struct dir_context *ctx)
-{
-    struct inode *inode;
+// Tramo de bloques liberado en una transaccion. Hasta que la transaccion esta en disco el mapa de extents de disco
+// sigue apuntando a el, asi que no se puede volver a reservar (y escribir encima) antes: sus bits solo se ponen en la
+// copia del bloque del mapa que va al journal y, despues del commit, en el mapa de bits en memoria
+struct assoofs_freed {
+    struct list_head list;
+    uint64_t block;
+    uint64_t count;
+};
+
+struct assoofs_journal {
     struct super_block *sb;
-    struct assoofs_inode_info *inode_info;
-    struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i=0;
+    uint64_t block;                        // Superbloque del journal
+    unsigned int max_blocks;               // Bloques que caben en una transaccion
+    uint64_t committed;                    // Ultima transaccion que esta en disco
+    int error;                             // Error del primer commit que fallo: lo reciben todos los que vienen detras
+    spinlock_t lock;                       // Protege running
+    struct rw_semaphore barrier;           // Los handles la cogen para leer y el commit para escribir
+    struct mutex commit_mutex;             // Un solo commit a la vez
+    struct assoofs_transaction *running;   // Transaccion a la que se unen los handles
+    struct assoofs_transaction *committing;
+    struct page **pages;                   // Descriptor, copias de los bloques y commit
+    struct page *jsb_page;                 // Superbloque del journal
+    struct delayed_work commit_work;
+};
 
-    printk(KERN_INFO "Iterate request\n");
+struct assoofs_handle {
+    struct super_block *sb;
+    uint64_t tid;
+    int ref;                               // Handles anidados en el mismo proceso
+};
 
-    // Acceder al inodo, informacion persistente del inodo y superbloque correspondientes del contexto
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    inode_info = inode->i_private;
+static int assoofs_journal_commit(struct assoofs_journal *journal, uint64_t tid);
+static uint64_t assoofs_bitmap_free(struct super_block *sb, uint64_t block, uint64_t count, bool dirty);
+void assoofs_save_sb_info(struct super_block *vsb);
 
-    // Comprueba si el contexto del directorio ya estaba creado
-    if (ctx->pos) return 0;
+/*
+ *  Abre un handle para una operacion que va a modificar como mucho nblocks bloques de metadatos. El handle queda en
+ *  current->journal_info: las funciones que guardan metadatos lo encuentran ahi y un handle abierto dentro de otro
+ *  se une al de fuera. Una operacion que no cabe en una transaccion se tiene que partir (ver assoofs_truncate)
+ */
+static int assoofs_journal_start(struct super_block *sb, unsigned int nblocks)
+{
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
+    struct assoofs_handle *handle = current->journal_info;
+    uint64_t tid;
 
-    // Comprobar que el inodo del primer paso corresponde con el contexto
-    if ((!S_ISDIR(inode_info->mode))) return -1;
+    if (!journal)
+        return 0;
+    if (handle)
+    {
+        handle->ref++;
+        return 0;
+    }
+    if (READ_ONCE(journal->error))
+        return journal->error;
 
-    // Accedemos al bloque donde se almacena el contenido del directorio y con su informacion
-    // inicializamos el contexto
-    
-    bh = sb_bread(sb, inode_info->data_block_number);
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-    for (i = 0; i < inode_info->dir_children_count; i++)
+    if (nblocks > journal->max_blocks)
     {
-        dir_emit(ctx, record->filename, ASSOOFS_FILENAME_MAXLEN, record->inode_no, DT_UNKNOWN);
-        ctx->pos += sizeof(struct assoofs_dir_record_entry);
-        record++;
+        printk(KERN_ERR "A handle needs %u journal blocks but a transaction holds %u\n", nblocks, journal->max_blocks);
+        return -ENOSPC;
     }
-    brelse(bh);
 
-    // Todo ha ido bien
+    handle = kmalloc(sizeof(*handle), GFP_NOFS);
+    if (!handle)
+        return -ENOMEM;
+
+    for (;;)
+    {
+        down_read(&journal->barrier);
+        spin_lock(&journal->lock);
+        if (journal->running->reserved + nblocks <= journal->max_blocks)
+            break;
+
+        // La transaccion en curso esta llena: se escribe y se vuelve a intentar en la siguiente
+        tid = journal->running->tid;
+        spin_unlock(&journal->lock);
+        up_read(&journal->barrier);
+        assoofs_journal_commit(journal, tid);
+    }
+    journal->running->reserved += nblocks;
+    handle->tid = journal->running->tid;
+    spin_unlock(&journal->lock);
+
+    handle->sb = sb;
+    handle->ref = 1;
+    current->journal_info = handle;
     return 0;
 }
 
+// Suelta una referencia al handle del proceso. Devuelve true si era la ultima y deja en *tid su transaccion
+static bool assoofs_journal_put(struct assoofs_journal *journal, uint64_t *tid)
+{
+    struct assoofs_handle *handle = current->journal_info;
+
+    if (!handle || --handle->ref)
+        return false;
+
+    *tid = handle->tid;
+    current->journal_info = NULL;
+    kfree(handle);
+    up_read(&journal->barrier);
+    return true;
+}
+
 /*
- *  Operaciones sobre inodos
+ *  Cierra el handle. Sin -o writeback se espera a que la transaccion este en disco, como antes se esperaba a cada
+ *  sync_dirty_buffer; con -o writeback el commit se deja para mas tarde
  */
-static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
-static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
-static struct inode_operations assoofs_inode_ops = {
-    .create = assoofs_create,
-    .lookup = assoofs_lookup,
-    .mkdir = assoofs_mkdir,
-};
+static int assoofs_journal_stop(struct super_block *sb)
+{
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
+    uint64_t tid;
+
+    if (!journal || !assoofs_journal_put(journal, &tid))
+        return 0;
+
+    if (!ASSOOFS_SB(sb)->writeback)
+        return assoofs_journal_commit(journal, tid);
+    schedule_delayed_work(&journal->commit_work, ASSOOFS_JOURNAL_INTERVAL);
+    return 0;
+}
+
+// Cierra el handle sin hacer commit aunque no se haya montado con -o writeback. Es para quien hace muchas operaciones
+// seguidas y al final las lleva a disco todas juntas con assoofs_journal_commit_all (ver assoofs_reclaim), y para las
+// escrituras, que lo hacen en su fsync. Si nadie lo hace llega a disco como mucho a los ASSOOFS_JOURNAL_INTERVAL
+static void assoofs_journal_stop_nowait(struct super_block *sb)
+{
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
+    uint64_t tid;
+
+    if (journal && assoofs_journal_put(journal, &tid))
+        schedule_delayed_work(&journal->commit_work, ASSOOFS_JOURNAL_INTERVAL);
+}
+
+// Bloques que puede reservar un handle como mucho
+static unsigned int assoofs_journal_max_blocks(struct super_block *sb)
+{
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
+
+    return journal ? journal->max_blocks : UINT_MAX;
+}
+
+// Deja de escribir en el disco: los commits que vengan detras descartan sus transacciones y devuelven error
+static void assoofs_journal_abort(struct assoofs_journal *journal, int error)
+{
+    if (cmpxchg(&journal->error, 0, error))
+        return;
+    journal->sb->s_flags |= SB_RDONLY;
+    printk(KERN_ERR "Journal aborted, the device is now read-only\n");
+}
+
+// Apunta bh en la transaccion en curso. Devuelve false si no se puede (sin handle o transaccion llena)
+static bool assoofs_journal_dirty(struct assoofs_journal *journal, struct buffer_head *bh)
+{
+    struct assoofs_transaction *transaction;
+    unsigned int i;
+    bool ret = true;
+
+    if (!current->journal_info)
+        return false;
+
+    spin_lock(&journal->lock);
+    transaction = journal->running;
+    for (i = 0; i < transaction->count; i++)
+        if (transaction->bhs[i] == bh)
+            goto out;
+
+    if (transaction->count == journal->max_blocks)
+    {
+        ret = false;
+        goto out;
+    }
+    get_bh(bh);
+    transaction->bhs[transaction->count++] = bh;
+out:
+    spin_unlock(&journal->lock);
+    return ret;
+}
+
+// Apunta en la transaccion del handle que se liberan los count bloques que empiezan en block. Sus bloques del mapa de
+// bits ya tienen que estar en la transaccion. Devuelve false si no hay handle: entonces se liberan en el acto
+static bool assoofs_journal_free_blocks(struct super_block *sb, uint64_t block, uint64_t count)
+{
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
+    struct assoofs_freed *freed;
+
+    if (!journal || !current->journal_info)
+        return false;
+
+    freed = kmalloc(sizeof(*freed), GFP_NOFS | __GFP_NOFAIL);
+    freed->block = block;
+    freed->count = count;
+    spin_lock(&journal->lock);
+    list_add_tail(&freed->list, &journal->running->freed);
+    spin_unlock(&journal->lock);
+    return true;
+}
+
+// Pone libres los tramos que libera la transaccion en las copias de sus bloques del mapa de bits. Un bloque del mapa
+// que no llego a entrar en la transaccion (estaba llena) no tiene copia: sus bits llegan a disco en la siguiente
+static void assoofs_journal_copy_freed(struct assoofs_journal *journal, struct assoofs_transaction *transaction)
+{
+    struct super_block *sb = journal->sb;
+    struct buffer_head *bh;
+    struct assoofs_freed *freed;
+    uint64_t block;
+    unsigned int i = 0;
+
+    list_for_each_entry(freed, &transaction->freed, list)
+    {
+        for (block = freed->block; block < freed->block + freed->count; block++)
+        {
+            bh = ASSOOFS_SB(sb)->bitmap_bh[assoofs_block_group(sb, block)];
+            if (i >= transaction->count || transaction->bhs[i] != bh)
+                for (i = 0; i < transaction->count && transaction->bhs[i] != bh; i++)
+                    ;
+            if (i < transaction->count)
+                set_bit_le(block % ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize), page_address(journal->pages[i + 1]));
+        }
+    }
+}
+
+// Vacia la lista de tramos liberados de la transaccion. Si ha llegado a disco vuelven al mapa de bits en memoria y a
+// los contadores, y ya se pueden reservar; si no (commit fallido, desmontaje) se quedan ocupados
+static void assoofs_journal_release_freed(struct assoofs_journal *journal, struct assoofs_transaction *transaction, bool committed)
+{
+    struct assoofs_freed *freed, *next;
+
+    list_for_each_entry_safe(freed, next, &transaction->freed, list)
+    {
+        if (committed)
+            assoofs_bitmap_free(journal->sb, freed->block, freed->count, false);
+        list_del(&freed->list);
+        kfree(freed);
+    }
+    if (committed)
+        assoofs_save_sb_info(journal->sb);
+}
 
 /*
- * Obtener la información persistente del inodo del superbloque
+ *  Marca como sucio un bloque de metadatos. Con journal se apunta en la transaccion del handle abierto y no llega a
+ *  su sitio hasta el commit. Sin journal se escribe en el acto, salvo montado con -o writeback, que se deja para el
+ *  flusher del kernel y lo que llega a disco lo deciden fsync y sync_fs
  */
-struct assoofs_inode_info *assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no)
+static void assoofs_dirty_bh(struct super_block *sb, struct buffer_head *bh)
 {
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
 
-    struct assoofs_inode_info *inode_info = NULL;
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *afs_sb = sb->s_fs_info;
-    struct assoofs_inode_info *buffer = NULL;
-    int i;
+    if (journal)
+    {
+        if (assoofs_journal_dirty(journal, bh))
+            return;
+
+        // Con la transaccion llena el handle toca mas bloques de los que reservo. Escribir el bloque en su sitio
+        // podria dejar la operacion a medias tras un corte de luz: se aborta el journal y no se escribe nada mas
+        if (current->journal_info)
+        {
+            printk(KERN_ERR "Metadata block %llu does not fit in the transaction\n", (uint64_t)bh->b_blocknr);
+            assoofs_journal_abort(journal, -ENOSPC);
+            return;
+        }
+        if (READ_ONCE(journal->error))
+            return;
+        printk(KERN_ERR "Metadata block %llu written outside the journal\n", (uint64_t)bh->b_blocknr);
+    }
+
+    mark_buffer_dirty(bh);
+    if (!ASSOOFS_SB(sb)->writeback || journal)
+        sync_dirty_buffer(bh);
+}
+
+// Envia a disco una pagina del journal con un buffer_head propio: asi se escriben las copias y no lo que haya en la
+// cache del dispositivo, que puede tener ya cambios de la transaccion siguiente
+static struct buffer_head *assoofs_journal_submit(struct super_block *sb, uint64_t block, struct page *page, int op_flags)
+{
+    struct buffer_head *bh = alloc_buffer_head(GFP_NOFS);
+
+    if (!bh)
+        return NULL;
+    bh->b_bdev = sb->s_bdev;
+    bh->b_blocknr = block;
+    bh->b_size = sb->s_blocksize;
+    set_bh_page(bh, page, 0);
+    set_buffer_mapped(bh);
+    set_buffer_uptodate(bh);
+    lock_buffer(bh);
+    get_bh(bh);
+    bh->b_end_io = end_buffer_write_sync;
+    submit_bh(REQ_OP_WRITE, op_flags, bh);
+    return bh;
+}
 
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
+// Espera a que terminen las escrituras enviadas con assoofs_journal_submit
+static int assoofs_journal_wait(struct buffer_head **bhs, unsigned int count)
+{
+    unsigned int i;
+    int ret = 0;
 
-    for (i = 0; i < afs_sb->inodes_count; i++)
+    for (i = 0; i < count; i++)
     {
-        if (inode_info->inode_no == inode_no)
+        if (!bhs[i])
         {
-            buffer = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-            memcpy(buffer, inode_info, sizeof(*buffer));
-            break;
+            ret = -ENOMEM;
+            continue;
         }
-        inode_info++;
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i]))
+            ret = -EIO;
+        free_buffer_head(bhs[i]);
     }
+    return ret;
+}
 
-    brelse(bh);
-    return buffer;
+// Escribe la transaccion (sus copias ya estan en journal->pages[1..count]) en el journal y despues en su sitio
+static int assoofs_journal_write(struct assoofs_journal *journal, struct assoofs_transaction *transaction)
+{
+    struct super_block *sb = journal->sb;
+    struct assoofs_journal_descriptor *descriptor = page_address(journal->pages[0]);
+    struct assoofs_journal_commit *commit = page_address(journal->pages[transaction->count + 1]);
+    struct assoofs_journal_super_block *jsb = page_address(journal->jsb_page);
+    struct buffer_head **bhs;
+    unsigned int i, n = transaction->count + 2;
+    uint32_t crc;
+    int ret;
+
+    bhs = kmalloc_array(n, sizeof(struct buffer_head *), GFP_NOFS);
+    if (!bhs)
+        return -ENOMEM;
+
+    // 1.- Descriptor, copias y commit seguidos en el journal
+    memset(descriptor, 0, sb->s_blocksize);
+    descriptor->header.magic = ASSOOFS_JOURNAL_MAGIC;
+    descriptor->header.type = ASSOOFS_JOURNAL_DESCRIPTOR;
+    descriptor->header.sequence = transaction->tid;
+    descriptor->count = transaction->count;
+    for (i = 0; i < transaction->count; i++)
+        descriptor->blocknr[i] = transaction->bhs[i]->b_blocknr;
+
+    crc = crc32_le(~0, (unsigned char *)descriptor, sb->s_blocksize);
+    for (i = 1; i <= transaction->count; i++)
+        crc = crc32_le(crc, page_address(journal->pages[i]), sb->s_blocksize);
+
+    memset(commit, 0, sb->s_blocksize);
+    commit->header.magic = ASSOOFS_JOURNAL_MAGIC;
+    commit->header.type = ASSOOFS_JOURNAL_COMMIT;
+    commit->header.sequence = transaction->tid;
+    commit->count = transaction->count;
+    commit->checksum = crc;
+
+    for (i = 0; i < n; i++)
+        bhs[i] = assoofs_journal_submit(sb, journal->block + 1 + i, journal->pages[i], 0);
+    ret = assoofs_journal_wait(bhs, n);
+    if (!ret)
+        ret = blkdev_issue_flush(sb->s_bdev);
+    if (ret)
+        goto out;
+
+    // 2.- A partir de aqui la transaccion se recupera aunque se corte la luz: se llevan las copias a su sitio
+    for (i = 0; i < transaction->count; i++)
+        bhs[i] = assoofs_journal_submit(sb, transaction->bhs[i]->b_blocknr, journal->pages[i + 1], 0);
+    ret = assoofs_journal_wait(bhs, transaction->count);
+    if (ret)
+        goto out;
+
+    // 3.- La transaccion ya no hace falta. El flush previo asegura que sus bloques estan en su sitio antes
+    jsb->header.sequence = transaction->tid + 1;
+    bhs[0] = assoofs_journal_submit(sb, journal->block, journal->jsb_page, REQ_PREFLUSH | REQ_FUA);
+    ret = assoofs_journal_wait(bhs, 1);
+
+out:
+    if (ret)
+        printk(KERN_ERR "Journal commit %llu failed: %d\n", transaction->tid, ret);
+    kfree(bhs);
+    return ret;
 }
 
 /*
- * Funcion auxiliar: obtiene un puntero con el inodo numero ino del superbloque sb
+ *  Lleva a disco la transaccion tid (y las anteriores). Si cuando se consigue el mutex otro proceso ya la ha escrito
+ *  no se hace nada
  */
+static int assoofs_journal_commit(struct assoofs_journal *journal, uint64_t tid)
+{
+    struct assoofs_transaction *transaction;
+    unsigned int i;
+    u64 start;
+    int ret = 0;
+
+    mutex_lock(&journal->commit_mutex);
+    if (journal->committed >= tid)
+        goto out;
+
+    // Esperar a que terminen los handles de la transaccion y abrir la siguiente
+    down_write(&journal->barrier);
+    spin_lock(&journal->lock);
+    transaction = journal->running;
+    if (!transaction->count)
+    {
+        // Vacia (lo normal en fsync y sync_fs): no gasta numero. Si lo gastara, el superbloque del journal, que solo
+        // se reescribe al escribir una transaccion, se quedaria atras y el replay tomaria la siguiente por vieja
+        transaction->reserved = 0;
+        spin_unlock(&journal->lock);
+        up_write(&journal->barrier);
+        goto out;
+    }
+    journal->running = journal->committing;
+    journal->running->tid = transaction->tid + 1;
+    journal->running->count = 0;
+    journal->running->reserved = 0;
+    journal->committing = transaction;
+    spin_unlock(&journal->lock);
+
+    // Copiar los bloques mientras ningun handle los puede estar cambiando
+    for (i = 0; i < transaction->count; i++)
+        memcpy(page_address(journal->pages[i + 1]), transaction->bhs[i]->b_data, journal->sb->s_blocksize);
+    assoofs_journal_copy_freed(journal, transaction);
+    up_write(&journal->barrier);
+
+    // Despues de un commit fallido no se escribe nada mas: las transacciones se descartan para que los handles no se
+    // queden esperando sitio, y todos reciben el error
+    if (!journal->error)
+    {
+        start = ktime_get_ns();
+        ret = assoofs_journal_write(journal, transaction);
+        assoofs_stat_op(journal->sb, ASSOOFS_OP_COMMIT, start);
+        assoofs_stat_add(journal->sb, journal_blocks, transaction->count);
+        if (ret)
+            assoofs_journal_abort(journal, ret);
+    }
+    for (i = 0; i < transaction->count; i++)
+        brelse(transaction->bhs[i]);
+    assoofs_journal_release_freed(journal, transaction, !journal->error);
+    journal->committed = transaction->tid;
+
+out:
+    if (journal->error)
+        ret = journal->error;
+    mutex_unlock(&journal->commit_mutex);
+    return ret;
+}
 
-static struct inode *assoofs_get_inode(struct super_block *sb, int ino)
+// Commit de todo lo pendiente (fsync, sync_fs y desmontaje)
+static int assoofs_journal_commit_all(struct super_block *sb)
 {
-    struct inode *inode;
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
+    uint64_t tid;
 
-    // 1. Obtener la informacion persistente del inodo ino
-    struct assoofs_inode_info *inode_info;
-    inode_info = assoofs_get_inode_info(sb, ino);
+    if (!journal)
+        return 0;
 
-    // 2.Inicializar el inodo
-    inode = new_inode(sb);
+    spin_lock(&journal->lock);
+    tid = journal->running->tid;
+    spin_unlock(&journal->lock);
+    return assoofs_journal_commit(journal, tid);
+}
 
-    // Asignar valores
-    inode->i_ino = ino;               // numero de inodo
-    inode->i_sb = sb;                 // puntero al superbloque
-    inode->i_op = &assoofs_inode_ops; // direccion de una variable de tipo struct inode_operations previamente
-                                      // declarada
+static void assoofs_journal_commit_work(struct work_struct *work)
+{
+    struct assoofs_journal *journal = container_of(to_delayed_work(work), struct assoofs_journal, commit_work);
 
-    // Comprobar si es un directorio o un fichero
-    if (S_ISDIR(inode_info->mode))
-        inode->i_fop = &assoofs_dir_operations;
-    else if (S_ISREG(inode_info->mode))
-        inode->i_fop = &assoofs_file_operations;
-    else
-        printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
+    assoofs_journal_commit_all(journal->sb);
+}
 
-    // Fecha del sistema a los campos
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); // fechas.
+/*
+ *  Al montar: si el journal tiene la transaccion que sigue a la ultima aplicada y esta completa (commit con el crc
+ *  correcto) se copian sus bloques a su sitio. Una transaccion a medias se descarta
+ */
+static int assoofs_journal_replay(struct super_block *sb, struct assoofs_journal *journal, uint64_t *sequence)
+{
+    struct assoofs_super_block_info *afs_sb = ASSOOFS_SB(sb)->disk;
+    struct assoofs_journal_descriptor *descriptor;
+    struct assoofs_journal_commit *commit;
+    struct buffer_head *desc_bh, *bh, *home_bh;
+    uint64_t i, count;
+    uint32_t crc;
+    int ret = 0;
+
+    desc_bh = assoofs_bread(sb, journal->block + 1);
+    if (!desc_bh)
+        return -EIO;
+    descriptor = (struct assoofs_journal_descriptor *)desc_bh->b_data;
+    count = descriptor->count;
+    if (descriptor->header.magic != ASSOOFS_JOURNAL_MAGIC || descriptor->header.type != ASSOOFS_JOURNAL_DESCRIPTOR ||
+        descriptor->header.sequence != *sequence || count == 0 || count > journal->max_blocks)
+        goto out;
+
+    crc = crc32_le(~0, desc_bh->b_data, sb->s_blocksize);
+    for (i = 0; i < count; i++)
+    {
+        if (descriptor->blocknr[i] >= afs_sb->blocks_count)
+            goto out;
+        bh = assoofs_bread(sb, journal->block + 2 + i);
+        if (!bh)
+        {
+            ret = -EIO;
+            goto out;
+        }
+        crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+        brelse(bh);
+    }
 
-    inode->i_private = inode_info;
+    bh = assoofs_bread(sb, journal->block + 2 + count);
+    if (!bh)
+    {
+        ret = -EIO;
+        goto out;
+    }
+    commit = (struct assoofs_journal_commit *)bh->b_data;
+    if (commit->header.magic != ASSOOFS_JOURNAL_MAGIC || commit->header.type != ASSOOFS_JOURNAL_COMMIT ||
+        commit->header.sequence != *sequence || commit->count != count || commit->checksum != crc)
+    {
+        printk(KERN_INFO "Discarding incomplete journal transaction %llu\n", *sequence);
+        brelse(bh);
+        goto out;
+    }
+    brelse(bh);
 
-    return inode;
+    printk(KERN_INFO "Replaying journal transaction %llu (%llu blocks)\n", *sequence, count);
+    for (i = 0; i < count && !ret; i++)
+    {
+        bh = assoofs_bread(sb, journal->block + 2 + i);
+        home_bh = sb_getblk(sb, descriptor->blocknr[i]);
+        if (!bh || !home_bh)
+            ret = -EIO;
+        else
+        {
+            lock_buffer(home_bh);
+            memcpy(home_bh->b_data, bh->b_data, sb->s_blocksize);
+            set_buffer_uptodate(home_bh);
+            unlock_buffer(home_bh);
+            mark_buffer_dirty(home_bh);
+            if (sync_dirty_buffer(home_bh))
+                ret = -EIO;
+        }
+        brelse(bh);
+        brelse(home_bh);
+    }
+    if (!ret)
+    {
+        (*sequence)++;
+        ret = blkdev_issue_flush(sb->s_bdev);
+    }
+
+out:
+    brelse(desc_bh);
+    return ret;
 }
 
-struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
+static void assoofs_journal_free(struct assoofs_journal *journal)
 {
+    unsigned int i;
 
-    // 1. Acceder al bloque de disco con el contenido del directorio apuntado por parent_inode
-    struct assoofs_inode_info *parent_info = parent_inode->i_private;
-    struct super_block *sb = parent_inode->i_sb;
+    if (journal->pages)
+    {
+        for (i = 0; i < journal->max_blocks + 2; i++)
+            if (journal->pages[i])
+                __free_page(journal->pages[i]);
+        kfree(journal->pages);
+    }
+    if (journal->jsb_page)
+        __free_page(journal->jsb_page);
+    if (journal->running)
+        kfree(journal->running->bhs);
+    if (journal->committing)
+        kfree(journal->committing->bhs);
+    kfree(journal->running);
+    kfree(journal->committing);
+    kfree(journal);
+}
+
+/*
+ *  Carga el journal del dispositivo (si tiene) y aplica la transaccion pendiente
+ */
+static int assoofs_journal_load(struct super_block *sb)
+{
+    struct assoofs_super_block_info *afs_sb = ASSOOFS_SB(sb)->disk;
+    struct assoofs_journal_super_block *jsb;
+    struct assoofs_journal *journal;
     struct buffer_head *bh;
-    struct assoofs_dir_record_entry *record;
-    int i;
+    uint64_t sequence;
+    unsigned int i;
+    int ret;
+
+    if (!afs_sb->journal_blocks)
+    {
+        printk(KERN_INFO "Device has no journal\n");
+        return 0;
+    }
+    if (afs_sb->journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS || afs_sb->journal_block < afs_sb->inode_table_block + afs_sb->inode_table_blocks ||
+        afs_sb->journal_block + afs_sb->journal_blocks > afs_sb->blocks_count)
+    {
+        printk(KERN_ERR "The journal does not fit in the device: %lld blocks\n", afs_sb->journal_blocks);
+        return -EINVAL;
+    }
 
-    printk(KERN_INFO "Lookup request\n");
-    printk(KERN_INFO "Lookup in: ino = %llu, b=%llu\n", parent_info->inode_no, parent_info->data_block_number);
+    bh = assoofs_bread(sb, afs_sb->journal_block);
+    if (!bh)
+        return -EIO;
+    jsb = (struct assoofs_journal_super_block *)bh->b_data;
+    if (jsb->header.magic != ASSOOFS_JOURNAL_MAGIC || jsb->header.type != ASSOOFS_JOURNAL_SUPERBLOCK)
+    {
+        printk(KERN_ERR "The journal superblock is corrupted\n");
+        brelse(bh);
+        return -EINVAL;
+    }
+    sequence = jsb->header.sequence;
+    brelse(bh);
 
-    bh = sb_bread(sb, parent_info->data_block_number);
+    journal = kzalloc(sizeof(*journal), GFP_KERNEL);
+    if (!journal)
+        return -ENOMEM;
+    journal->sb = sb;
+    journal->block = afs_sb->journal_block;
+    journal->max_blocks = min_t(uint64_t, afs_sb->journal_blocks - 3, ASSOOFS_JOURNAL_DESCRIPTOR_MAX(sb->s_blocksize));
+    if (journal->max_blocks < ASSOOFS_JOURNAL_HANDLE_BLOCKS + ASSOOFS_RELEASE_BLOCKS(sb->s_blocksize))
+    {
+        printk(KERN_ERR "The journal is too small (%llu blocks)\n", afs_sb->journal_blocks);
+        kfree(journal);
+        return -EINVAL;
+    }
 
-    // 2. Recorrer el contenido del directorio buscando la entrada cuyo nombre se corresponda con el que buscamos.
-    // Si se localiza la entrada entonces debe creare el inodo correponsidente
-    record = (struct assoofs_dir_record_entry *)bh->b_data;
-    for (i = 0; i < parent_info->dir_children_count; i++)
+    ret = assoofs_journal_replay(sb, journal, &sequence);
+    if (ret)
+        goto fail;
+
+    ret = -ENOMEM;
+    journal->running = kzalloc(sizeof(struct assoofs_transaction), GFP_KERNEL);
+    journal->committing = kzalloc(sizeof(struct assoofs_transaction), GFP_KERNEL);
+    if (!journal->running || !journal->committing)
+        goto fail;
+    INIT_LIST_HEAD(&journal->running->freed);
+    INIT_LIST_HEAD(&journal->committing->freed);
+    journal->running->bhs = kcalloc(journal->max_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    journal->committing->bhs = kcalloc(journal->max_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    journal->pages = kcalloc(journal->max_blocks + 2, sizeof(struct page *), GFP_KERNEL);
+    journal->jsb_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+    if (!journal->running->bhs || !journal->committing->bhs || !journal->pages || !journal->jsb_page)
+        goto fail;
+    for (i = 0; i < journal->max_blocks + 2; i++)
     {
-        if (!strcmp(record->filename, child_dentry->d_name.name))
-        {
-            struct inode *inode = assoofs_get_inode(sb, record->inode_no); // Funcion auxiliar que obtine la informaci ́on de
-                                                                           // un inodo a partir de su n ́umero de inodo.
-            printk(KERN_INFO "Have file: %s, ino=%llu\n", record->filename, record->inode_no);
-            inode_init_owner(sb->s_user_ns, inode, parent_inode, ((struct assoofs_inode_info *)inode->i_private)->mode);
-            d_add(child_dentry, inode);
-            return NULL;
-        }
-        record++;
+        journal->pages[i] = alloc_page(GFP_KERNEL);
+        if (!journal->pages[i])
+            goto fail;
     }
 
-    // 3.Devolver siempre NULL
-    return NULL;
+    jsb = page_address(journal->jsb_page);
+    jsb->header.magic = ASSOOFS_JOURNAL_MAGIC;
+    jsb->header.type = ASSOOFS_JOURNAL_SUPERBLOCK;
+    jsb->header.sequence = sequence;
+    journal->running->tid = sequence;
+    journal->committed = sequence - 1;
+
+    spin_lock_init(&journal->lock);
+    init_rwsem(&journal->barrier);
+    mutex_init(&journal->commit_mutex);
+    INIT_DELAYED_WORK(&journal->commit_work, assoofs_journal_commit_work);
+    ASSOOFS_SB(sb)->journal = journal;
+    return 0;
+
+fail:
+    assoofs_journal_free(journal);
+    return ret;
+}
+
+// Al desmontar: escribir lo pendiente y liberar el journal
+static void assoofs_journal_destroy(struct super_block *sb)
+{
+    struct assoofs_journal *journal = ASSOOFS_SB(sb)->journal;
+
+    if (!journal)
+        return;
+    cancel_delayed_work_sync(&journal->commit_work);
+    assoofs_journal_commit_all(sb);
+    assoofs_journal_free(journal);
+    ASSOOFS_SB(sb)->journal = NULL;
+}
+
+/*
+ *  Operaciones sobre ficheros. Los datos pasan por la cache de paginas: read_iter/write_iter son los genericos del
+ *  kernel y las paginas se leen y escriben a traves de assoofs_aops, que traduce los bloques del fichero con el
+ *  mapa de extents. Con O_DIRECT los genericos llaman a assoofs_direct_IO y los datos no pasan por la cache. mmap,
+ *  splice y sendfile usan las mismas paginas, asi que se sirven sin copiar a espacio de usuario. copy_file_range y los
+ *  ioctl FICLONE/FICLONERANGE no copian nada: el destino comparte los bloques del origen (assoofs_remap_file_range)
+ */
+static ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to);
+static ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from);
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma);
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info);
+int assoofs_sb_get_a_freeblock_near(struct super_block *sb, uint64_t inode_no, uint64_t *block);
+int assoofs_sb_get_the_freeblock(struct super_block *sb, uint64_t block);
+static uint64_t assoofs_bitmap_release(struct super_block *sb, uint64_t block, uint64_t count);
+static void assoofs_reclaim_queue(struct super_block *sb, uint64_t inode_no, bool compact);
+static uint64_t assoofs_refcount_unshared(struct super_block *sb, uint64_t block, uint64_t count);
+static int assoofs_refcount_get(struct super_block *sb, uint64_t block, uint64_t count);
+static int assoofs_cow_block(struct inode *inode, uint64_t iblock, uint64_t old, uint64_t *block);
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags);
+const struct file_operations assoofs_file_operations = {
+    .llseek = generic_file_llseek,
+    .read_iter = assoofs_read_iter,
+    .write_iter = assoofs_write_iter,
+    .mmap = assoofs_file_mmap,
+    .splice_read = generic_file_splice_read,
+    .splice_write = iter_file_splice_write,
+    .fsync = assoofs_fsync,
+    .remap_file_range = assoofs_remap_file_range,
+};
+
+/*
+ *  Mapa de extents: traduce bloques logicos del fichero a bloques fisicos del dispositivo
+ */
+
+// Devuelve un puntero al extent numero index. Los ASSOOFS_INODE_EXTENTS primeros estan en el propio inodo,
+// el resto en el bloque de desbordamiento, que se deja leido en *bh (el llamador hace brelse)
+static struct assoofs_extent *assoofs_get_extent(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t index, struct buffer_head **bh)
+{
+    if (index < ASSOOFS_INODE_EXTENTS)
+        return &inode_info->extents[index];
+
+    if (!*bh)
+    {
+        *bh = assoofs_bread(sb, inode_info->extent_block);
+        if (!*bh)
+            return NULL;
+    }
+    return (struct assoofs_extent *)(*bh)->b_data + (index - ASSOOFS_INODE_EXTENTS);
+}
+
+// Busca el bloque fisico del bloque logico iblock. En *count se devuelve cuantos bloques contiguos hay a partir de
+// el, de forma que una lectura secuencial recorra tramos enteros. Si iblock es un hueco *block vale 0 y *count es
+// la distancia hasta el siguiente extent
+static int assoofs_map_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t *block, uint64_t *count)
+{
+    struct buffer_head *bh = NULL;
+    struct assoofs_extent *ext;
+    uint64_t i;
+
+    *block = 0;
+    *count = U64_MAX;
+
+    for (i = 0; i < inode_info->extent_count; i++)
+    {
+        ext = assoofs_get_extent(sb, inode_info, i, &bh);
+        if (!ext)
+            return -EIO;
+
+        if (iblock >= ext->ee_block && iblock < ext->ee_block + ext->ee_len)
+        {
+            *block = ext->ee_start + (iblock - ext->ee_block);
+            *count = ext->ee_len - (iblock - ext->ee_block);
+            break;
+        }
+        if (ext->ee_block > iblock && ext->ee_block - iblock < *count)
+            *count = ext->ee_block - iblock;
+    }
+
+    brelse(bh);
+    return 0;
+}
+
+// Apunta en el mapa de extents que los bloques logicos iblock..iblock+n-1 estan en los n bloques fisicos que empiezan
+// en start, que ya estan reservados. Si el tramo va justo detras del de un extent se alarga ese extent
+static int assoofs_add_extent(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t start, uint64_t n)
+{
+    struct buffer_head *bh = NULL;
+    struct buffer_head *ext_bh;
+    struct assoofs_extent *ext;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < inode_info->extent_count; i++)
+    {
+        ext = assoofs_get_extent(sb, inode_info, i, &bh);
+        if (!ext)
+            return -EIO;
+
+        if (!(ext->ee_len & ASSOOFS_EXTENT_COMPRESSED) && ext->ee_block + ext->ee_len == iblock && ext->ee_start + ext->ee_len == start)
+        {
+            ext->ee_len += n;
+            if (i < ASSOOFS_INODE_EXTENTS)
+            {
+                brelse(bh);
+                bh = NULL;
+            }
+            goto out;
+        }
+    }
+
+    if (inode_info->extent_count >= ASSOOFS_MAX_EXTENTS(sb->s_blocksize))
+    {
+        brelse(bh);
+        return -EFBIG;
+    }
+
+    if (inode_info->extent_count == ASSOOFS_INODE_EXTENTS && !inode_info->extent_block)
+    {
+        ret = assoofs_sb_get_a_freeblock_near(sb, inode_info->inode_no, &inode_info->extent_block);
+        if (ret)
+            return ret;
+        ext_bh = sb_getblk(sb, inode_info->extent_block);
+        lock_buffer(ext_bh);
+        memset(ext_bh->b_data, 0, sb->s_blocksize);
+        set_buffer_uptodate(ext_bh);
+        unlock_buffer(ext_bh);
+        assoofs_dirty_bh(sb, ext_bh);
+        brelse(ext_bh);
+    }
+
+    ext = assoofs_get_extent(sb, inode_info, inode_info->extent_count, &bh);
+    if (!ext)
+        return -EIO;
+    ext->ee_block = iblock;
+    ext->ee_len = n;
+    ext->ee_start = start;
+    inode_info->extent_count++;
+
+out:
+    if (iblock == 0)
+        inode_info->data_block_number = start;
+    if (bh)
+    {
+        assoofs_dirty_bh(sb, bh);
+        brelse(bh);
+    }
+    return 0;
+}
+
+// Asigna bloques fisicos a los bloques logicos desde iblock, hasta n seguidos en disco. El primero se busca detras del
+// bloque fisico del bloque logico anterior, para alargar su extent; si no esta libre va donde haya sitio. Devuelve en
+// *count cuantos se han reservado (al menos uno). Si no se pueden apuntar en el mapa de extents se devuelven
+static int assoofs_alloc_file_block(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t iblock, uint64_t n, uint64_t *block, uint64_t *count)
+{
+    uint64_t prev = 0, i;
+    int ret;
+
+    if (iblock)
+        assoofs_map_block(sb, inode_info, iblock - 1, &prev, &i);
+    if (!prev || assoofs_sb_get_the_freeblock(sb, prev + 1))
+    {
+        ret = assoofs_sb_get_a_freeblock_near(sb, inode_info->inode_no, block);
+        if (ret)
+            return ret;
+    }
+    else
+        *block = prev + 1;
+
+    for (i = 1; i < n && !assoofs_sb_get_the_freeblock(sb, *block + i); i++)
+        ;
+    ret = assoofs_add_extent(sb, inode_info, iblock, *block, i);
+    if (ret)
+    {
+        assoofs_bitmap_release(sb, *block, i);
+        assoofs_save_sb_info(sb);
+        return ret;
+    }
+    *count = i;
+    return 0;
+}
+
+/*
+ *  Paginas de los ficheros
+ */
+
+// Bloques que assoofs_get_block reserva como mucho en un handle: tocan 5 bloques del mapa de bits
+#define ASSOOFS_ALLOC_BLOCKS_MAX(bs) (4 * ASSOOFS_BITS_PER_BLOCK(bs))
+
+// Traduce el bloque logico iblock del fichero para la cache de paginas. Si bh_result pide varios bloques se mapea
+// todo el tramo contiguo de una vez. Con create se reservan los huecos, tambien de una vez y en el mismo handle lo que
+// pida bh_result (O_DIRECT), y en un fichero clonado los bloques compartidos se copian antes (el tramo acaba en el
+// primero compartido). El handle no espera al commit: lo hace el fsync de la escritura (write_iter pide IOCB_DSYNC
+// sin -o writeback), asi que una escritura de muchos bloques lleva a disco sus metadatos una sola vez
+static int assoofs_get_block(struct inode *inode, sector_t iblock, struct buffer_head *bh_result, int create)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    uint64_t block, count, want = bh_result->b_size >> inode->i_blkbits;
+    bool fresh = false;
+    int ret;
+
+    down_read(&ai->map_sem);
+    ret = assoofs_map_block(sb, &ai->info, iblock, &block, &count);
+    if (!ret && block && create && (ai->info.flags & ASSOOFS_INODE_SHARED))
+        count = assoofs_refcount_unshared(sb, block, min(count, want));
+    up_read(&ai->map_sem);
+    if (ret)
+        return ret;
+
+    if (!block || !count)
+    {
+        // Un hueco sin create se deja sin mapear y la pagina se rellena con ceros
+        if (!create)
+            return 0;
+
+        ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS);
+        if (ret)
+            return ret;
+        down_write(&ai->map_sem);
+
+        // Otro proceso ha podido reservarlo (o copiarlo) mientras se esperaba el cerrojo
+        ret = assoofs_map_block(sb, &ai->info, iblock, &block, &count);
+        if (!ret && !block)
+        {
+            count = min3(count, want, ASSOOFS_ALLOC_BLOCKS_MAX(sb->s_blocksize));
+            ret = assoofs_alloc_file_block(sb, &ai->info, iblock, count, &block, &count);
+            if (!ret)
+                ret = assoofs_save_inode_info(sb, &ai->info); // Ha cambiado el mapa de extents
+            fresh = true;
+        }
+        else if (!ret && (ai->info.flags & ASSOOFS_INODE_SHARED))
+        {
+            count = assoofs_refcount_unshared(sb, block, min(count, want));
+            if (!count)
+            {
+                ret = assoofs_cow_block(inode, iblock, block, &block);
+                count = 1;
+            }
+        }
+
+        up_write(&ai->map_sem);
+        assoofs_journal_stop_nowait(sb);
+        if (ret)
+            return ret;
+    }
+
+    map_bh(bh_result, sb, block);
+    if (fresh)
+        set_buffer_new(bh_result); // El bloque no se lee de disco, lo que no cubra la escritura se pone a cero
+    bh_result->b_size = min(count, want) << inode->i_blkbits;
+    return 0;
+}
+
+/*
+ *  Ficheros inline: mientras un fichero cabe en ASSOOFS_INLINE_DATA_MAX bytes su contenido va dentro del inodo, que ya
+ *  esta en memoria, asi que leerlo no cuesta ninguna lectura mas. Sus paginas nunca se quedan sucias: write_end copia
+ *  lo escrito al inodo. Cuando una escritura no cabe, el contenido pasa a la pagina 0, que se marca sucia, y el bloque
+ *  se reserva al escribirla como en cualquier otro fichero
+ */
+
+static inline bool assoofs_is_inline(struct assoofs_inode *ai)
+{
+    return ai->info.flags & ASSOOFS_INODE_INLINE;
+}
+
+// Rellena la pagina con el contenido inline (solo la pagina 0 tiene datos)
+static void assoofs_read_inline(struct assoofs_inode *ai, struct page *page)
+{
+    size_t size = page->index ? 0 : min_t(uint64_t, ai->info.file_size, ASSOOFS_INLINE_DATA_MAX);
+    char *kaddr = kmap_atomic(page);
+
+    memcpy(kaddr, ai->info.inline_data, size);
+    memset(kaddr + size, 0, PAGE_SIZE - size);
+    kunmap_atomic(kaddr);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+}
+
+// Saca el contenido del inodo a la pagina 0 para que el fichero pueda crecer en bloques
+static int assoofs_inline_to_blocks(struct inode *inode)
+{
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct page *page;
+    int ret;
+
+    page = find_or_create_page(inode->i_mapping, 0, GFP_NOFS);
+    if (!page)
+        return -ENOMEM;
+
+    ret = assoofs_journal_start(inode->i_sb, 1);
+    if (ret)
+        goto out;
+    down_write(&ai->map_sem);
+    if (assoofs_is_inline(ai))
+    {
+        if (!PageUptodate(page))
+            assoofs_read_inline(ai, page);
+
+        // El sitio de los datos pasa a ser el de los extents, sin ninguno todavia
+        ai->info.flags &= ~ASSOOFS_INODE_INLINE;
+        memset(ai->info.inline_data, 0, ASSOOFS_INLINE_DATA_MAX);
+        ai->info.extent_count = 0;
+        ai->info.extent_block = 0;
+        ai->info.data_block_number = 0;
+        ret = assoofs_save_inode_info(inode->i_sb, &ai->info);
+        if (ai->info.file_size)
+            set_page_dirty(page);
+    }
+    up_write(&ai->map_sem);
+    if (assoofs_journal_stop(inode->i_sb) && !ret)
+        ret = -EIO;
+
+out:
+    unlock_page(page);
+    put_page(page);
+    return ret;
+}
+
+// Lleva a la informacion persistente del inodo el i_size que ha dejado una escritura que alarga el fichero. Como en
+// assoofs_get_block no se espera al commit: el tamannio va a disco con los bloques nuevos en el fsync de la escritura
+static int assoofs_save_file_size(struct inode *inode)
+{
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret;
+
+    if (i_size_read(inode) <= ai->info.file_size)
+        return 0;
+    ret = assoofs_journal_start(inode->i_sb, 1);
+    if (ret)
+        return ret;
+    down_write(&ai->map_sem);
+    ai->info.file_size = i_size_read(inode);
+    ret = assoofs_save_inode_info(inode->i_sb, &ai->info);
+    up_write(&ai->map_sem);
+    assoofs_journal_stop_nowait(inode->i_sb);
+    return ret;
+}
+
+/*
+ *  Ficheros comprimidos (ASSOOFS_INODE_COMPRESSED, formato en assoofs.h). Las paginas de un cluster se leen y se
+ *  escriben juntas: leer una descomprime el cluster entero y mete tambien las demas en la cache, y escribir una lleva
+ *  a disco en la misma pasada las sucias de su cluster. Sus bloques van por la cache del dispositivo y no por los
+ *  bios de mpage, porque una pagina ya no corresponde a un tramo de bloques. Un cluster que comprimido no ahorra
+ *  ningun bloque se guarda tal cual. Un cluster que se vuelve a escribir va siempre a bloques nuevos y los viejos se
+ *  liberan en la misma transaccion que cambia el mapa de extents: hasta el commit el mapa que hay en disco sigue
+ *  apuntando a los viejos, que no se pueden haber pisado
+ */
+#define ASSOOFS_CLUSTER_PAGES (ASSOOFS_CLUSTER_SIZE / PAGE_SIZE)
+#define ASSOOFS_CLUSTER_ZSIZE (sizeof(struct assoofs_cluster_header) + LZ4_COMPRESSBOUND(ASSOOFS_CLUSTER_SIZE))
+#define ASSOOFS_CLUSTER_MAX_BLOCKS (ASSOOFS_CLUSTER_SIZE / ASSOOFS_MIN_BLOCK_SIZE)
+#define ASSOOFS_CLUSTER_POOL_MIN 2  // Buffers reservados: escribir paginas sucias tiene que poder avanzar sin memoria
+#define ASSOOFS_ALLOC_RUN_TRIES 8   // Tramos libres que se prueban para un cluster comprimido antes de guardarlo tal cual
+
+// Memoria para trabajar con un cluster. Son mas de 100K, asi que sale de cluster_pool y no de la pila
+struct assoofs_cluster_buf {
+    char data[ASSOOFS_CLUSTER_SIZE];                        // El cluster sin comprimir
+    char zdata[ASSOOFS_CLUSTER_ZSIZE];                      // Comprimido, con su cabecera delante
+    char wrkmem[LZ4_MEM_COMPRESS] __aligned(8);             // Memoria de trabajo de LZ4_compress_default
+    struct buffer_head *bhs[ASSOOFS_CLUSTER_MAX_BLOCKS];    // Bloques que se estan leyendo o escribiendo
+    struct assoofs_extent ext[ASSOOFS_MAX_EXTENTS(PAGE_SIZE)];  // Mapa de extents del fichero
+    struct assoofs_extent out[ASSOOFS_MAX_EXTENTS(PAGE_SIZE) + ASSOOFS_CLUSTER_MAX_BLOCKS + 2]; // El mapa nuevo
+    struct assoofs_extent new_ext[ASSOOFS_CLUSTER_MAX_BLOCKS]; // Donde queda el cluster que se escribe
+    struct assoofs_extent freed[ASSOOFS_MAX_EXTENTS(PAGE_SIZE)]; // Lo que deja libre (solo ee_start y ee_len)
+};
+
+// Los buffers salen de cluster_pool en un ambito NOFS: asi kvmalloc puede usar vmalloc y reclamar memoria no vuelve a
+// entrar en el sistema de ficheros. Si no hay memoria se espera a uno de los reservados
+static struct assoofs_cluster_buf *assoofs_cluster_buf_get(struct super_block *sb)
+{
+    unsigned int nofs = memalloc_nofs_save();
+    struct assoofs_cluster_buf *cbuf = mempool_alloc(ASSOOFS_SB(sb)->cluster_pool, GFP_KERNEL);
+
+    memalloc_nofs_restore(nofs);
+    return cbuf;
+}
+
+static void assoofs_cluster_buf_put(struct super_block *sb, struct assoofs_cluster_buf *cbuf)
+{
+    mempool_free(cbuf, ASSOOFS_SB(sb)->cluster_pool);
+}
+
+static inline bool assoofs_is_compressed(struct assoofs_inode *ai)
+{
+    return ai->info.flags & ASSOOFS_INODE_COMPRESSED;
+}
+
+// Copia en ext el mapa de extents del fichero. El llamador tiene map_sem
+static int assoofs_load_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, struct assoofs_extent *ext)
+{
+    struct buffer_head *bh;
+    uint64_t n = inode_info->extent_count;
+
+    if (n > ASSOOFS_MAX_EXTENTS(sb->s_blocksize))
+        return -EIO;
+    memcpy(ext, inode_info->extents, min_t(uint64_t, n, ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    if (n <= ASSOOFS_INODE_EXTENTS)
+        return 0;
+
+    bh = assoofs_bread(sb, inode_info->extent_block);
+    if (!bh)
+        return -EIO;
+    memcpy(ext + ASSOOFS_INODE_EXTENTS, bh->b_data, (n - ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    brelse(bh);
+    return 0;
+}
+
+// Deja como mapa del fichero los count extents de ext. Los que no caben en el inodo van al bloque de desbordamiento,
+// que se reserva la primera vez que hace falta. Guarda el inodo
+static int assoofs_store_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, struct assoofs_extent *ext, uint64_t count)
+{
+    struct buffer_head *bh;
+    int ret;
+
+    if (count > ASSOOFS_MAX_EXTENTS(sb->s_blocksize))
+        return -EFBIG;
+
+    if (count > ASSOOFS_INODE_EXTENTS)
+    {
+        if (!inode_info->extent_block)
+        {
+            ret = assoofs_sb_get_a_freeblock_near(sb, inode_info->inode_no, &inode_info->extent_block);
+            if (ret)
+                return ret;
+            bh = sb_getblk(sb, inode_info->extent_block);
+        }
+        else
+        {
+            bh = assoofs_bread(sb, inode_info->extent_block);
+            if (!bh)
+                return -EIO;
+        }
+        lock_buffer(bh);
+        memset(bh->b_data, 0, sb->s_blocksize);
+        memcpy(bh->b_data, ext + ASSOOFS_INODE_EXTENTS, (count - ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+        set_buffer_uptodate(bh);
+        unlock_buffer(bh);
+        assoofs_dirty_bh(sb, bh);
+        brelse(bh);
+    }
+
+    memset(inode_info->extents, 0, sizeof(inode_info->extents));
+    memcpy(inode_info->extents, ext, min_t(uint64_t, count, ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    inode_info->extent_count = count;
+    inode_info->data_block_number = count && !ext[0].ee_block ? ext[0].ee_start : 0;
+    return assoofs_save_inode_info(sb, inode_info);
+}
+
+// Lee n bloques seguidos del dispositivo en buf. Se piden todos a la vez y despues se espera a cada uno
+static int assoofs_cluster_read_blocks(struct super_block *sb, uint64_t block, uint64_t n, char *buf, struct buffer_head **bhs)
+{
+    uint64_t i;
+    int ret = 0;
+
+    for (i = 0; i < n; i++)
+        bhs[i] = sb_getblk(sb, block + i);
+    ll_rw_block(REQ_OP_READ, 0, n, bhs);
+    for (i = 0; i < n; i++)
+    {
+        wait_on_buffer(bhs[i]);
+        if (buffer_uptodate(bhs[i]))
+            memcpy(buf + i * sb->s_blocksize, bhs[i]->b_data, sb->s_blocksize);
+        else
+            ret = -EIO;
+        brelse(bhs[i]);
+    }
+    return ret;
+}
+
+// Escribe n bloques de buf a partir de block a traves de la cache del dispositivo y espera a que esten en disco. Van
+// antes que el commit que los pone en el mapa
+static int assoofs_cluster_write_blocks(struct super_block *sb, uint64_t block, uint64_t n, const char *buf, struct buffer_head **bhs)
+{
+    struct blk_plug plug;
+    uint64_t i;
+    int ret = 0;
+
+    blk_start_plug(&plug);
+    for (i = 0; i < n; i++)
+    {
+        bhs[i] = sb_getblk(sb, block + i);
+        lock_buffer(bhs[i]);
+        memcpy(bhs[i]->b_data, buf + i * sb->s_blocksize, sb->s_blocksize);
+        set_buffer_uptodate(bhs[i]);
+        clear_buffer_dirty(bhs[i]);
+        get_bh(bhs[i]);
+        bhs[i]->b_end_io = end_buffer_write_sync;
+        submit_bh(REQ_OP_WRITE, 0, bhs[i]);
+    }
+    blk_finish_plug(&plug);
+
+    for (i = 0; i < n; i++)
+    {
+        wait_on_buffer(bhs[i]);
+        if (!buffer_uptodate(bhs[i]))
+            ret = -EIO;
+        brelse(bhs[i]);
+    }
+    return ret;
+}
+
+// Lee un cluster comprimido de plen bloques que empieza en block y lo descomprime en cbuf->data
+static int assoofs_cluster_decompress(struct super_block *sb, uint64_t block, uint64_t plen, struct assoofs_cluster_buf *cbuf)
+{
+    struct assoofs_cluster_header *hdr = (struct assoofs_cluster_header *)cbuf->zdata;
+    int ret;
+
+    if (!plen || plen >= ASSOOFS_CLUSTER_BLOCKS(sb->s_blocksize))
+        return -EIO;
+    ret = assoofs_cluster_read_blocks(sb, block, plen, cbuf->zdata, cbuf->bhs);
+    if (ret)
+        return ret;
+
+    if (hdr->size > plen * sb->s_blocksize - sizeof(*hdr) || crc32_le(~0, (u8 *)(hdr + 1), hdr->size) != hdr->checksum ||
+        LZ4_decompress_safe((char *)(hdr + 1), cbuf->data, hdr->size, ASSOOFS_CLUSTER_SIZE) < 0)
+    {
+        printk(KERN_ERR "Corrupted compressed cluster at block %llu\n", block);
+        return -EIO;
+    }
+    return 0;
+}
+
+// Deja en cbuf->data el cluster cluster del fichero: descomprime el suyo o copia los bloques que tenga sin comprimir.
+// Los huecos y lo que haya detras del final quedan a cero. El llamador tiene map_sem
+static int assoofs_read_cluster(struct inode *inode, uint64_t cluster, struct assoofs_cluster_buf *cbuf)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INODE(inode);
+    uint64_t cb = ASSOOFS_CLUSTER_BLOCKS(sb->s_blocksize), first = cluster * cb;
+    uint64_t i, len, from, to, plen;
+    struct buffer_head *bh = NULL;
+    struct assoofs_extent *ext;
+    int ret = 0;
+
+    memset(cbuf->data, 0, ASSOOFS_CLUSTER_SIZE);
+    for (i = 0; i < inode_info->extent_count && !ret; i++)
+    {
+        ext = assoofs_get_extent(sb, inode_info, i, &bh);
+        if (!ext)
+        {
+            ret = -EIO;
+            break;
+        }
+        len = ASSOOFS_EXTENT_LEN(ext->ee_len);
+        if (ext->ee_block >= first + cb || ext->ee_block + len <= first)
+            continue;
+
+        // Un cluster comprimido esta entero en un extent: no hay nada mas que buscar
+        if (ext->ee_len & ASSOOFS_EXTENT_COMPRESSED)
+        {
+            plen = ASSOOFS_EXTENT_PLEN(ext->ee_len);
+            ret = assoofs_cluster_decompress(sb, ext->ee_start + div_u64(first - ext->ee_block, cb) * plen, plen, cbuf);
+            break;
+        }
+
+        from = max(first, ext->ee_block);
+        to = min(first + cb, ext->ee_block + len);
+        ret = assoofs_cluster_read_blocks(sb, ext->ee_start + (from - ext->ee_block), to - from,
+                                          cbuf->data + (from - first) * sb->s_blocksize, cbuf->bhs);
+    }
+    brelse(bh);
+    return ret;
+}
+
+// Copia a la pagina su parte del cluster que hay en cbuf->data
+static void assoofs_cluster_fill_page(struct page *page, struct assoofs_cluster_buf *cbuf)
+{
+    char *kaddr = kmap_atomic(page);
+
+    memcpy(kaddr, cbuf->data + (page->index % ASSOOFS_CLUSTER_PAGES) * PAGE_SIZE, PAGE_SIZE);
+    kunmap_atomic(kaddr);
+    flush_dcache_page(page);
+    SetPageUptodate(page);
+}
+
+// Mete en la cache las paginas del cluster que faltan, ya descomprimido en cbuf, menos la pagina skip. No se espera
+// a ninguna: una pagina bloqueada la esta leyendo o escribiendo otro
+static void assoofs_cluster_fill_cache(struct address_space *mapping, uint64_t cluster, struct assoofs_cluster_buf *cbuf, pgoff_t skip)
+{
+    pgoff_t index = cluster * ASSOOFS_CLUSTER_PAGES, end = DIV_ROUND_UP(i_size_read(mapping->host), PAGE_SIZE);
+    struct page *page;
+
+    for (end = min_t(pgoff_t, end, index + ASSOOFS_CLUSTER_PAGES); index < end; index++)
+    {
+        if (index == skip)
+            continue;
+        page = grab_cache_page_nowait(mapping, index);
+        if (!page)
+            continue;
+        if (!PageUptodate(page))
+            assoofs_cluster_fill_page(page, cbuf);
+        unlock_page(page);
+        put_page(page);
+    }
+}
+
+// Reserva n bloques seguidos para el fichero inode_no, a ser posible a partir de hint (detras del cluster anterior del
+// fichero, para que su extent siga creciendo). Si un tramo libre se queda corto se devuelve y se prueba con el siguiente
+static int assoofs_alloc_run(struct super_block *sb, uint64_t inode_no, uint64_t n, uint64_t hint, uint64_t *start)
+{
+    uint64_t block, i, tries;
+    int ret;
+
+    for (tries = 0; tries < ASSOOFS_ALLOC_RUN_TRIES; tries++)
+    {
+        if (tries || !hint || assoofs_sb_get_the_freeblock(sb, hint))
+        {
+            ret = assoofs_sb_get_a_freeblock_near(sb, inode_no, &hint);
+            if (ret)
+                return ret;
+        }
+        block = hint;
+        for (i = 1; i < n && !assoofs_sb_get_the_freeblock(sb, block + i); i++)
+            ;
+        if (i == n)
+        {
+            *start = block;
+            return 0;
+        }
+        assoofs_bitmap_release(sb, block, i);
+        this_cpu_write(*ASSOOFS_SB(sb)->cursor, block + i + 1); // La siguiente busqueda empieza detras de lo ocupado
+    }
+    assoofs_save_sb_info(sb);
+    return -ENOSPC;
+}
+
+// Devuelve al mapa de bits los bloques de los count extents de ext
+static void assoofs_release_extents(struct super_block *sb, struct assoofs_extent *ext, uint64_t count)
+{
+    uint64_t i;
+
+    for (i = 0; i < count; i++)
+        assoofs_bitmap_release(sb, ext[i].ee_start, assoofs_extent_blocks(&ext[i], sb->s_blocksize));
+    assoofs_save_sb_info(sb);
+}
+
+// Cambia en el mapa de extents (cargado en cbuf->ext) el cluster que empieza en el bloque logico first por los nnew
+// extents de cbuf->new_ext. Los extents que lo cubrian se parten y sus bloques se liberan una vez guardado el mapa nuevo
+static int assoofs_cluster_remap(struct inode *inode, uint64_t first, struct assoofs_cluster_buf *cbuf, uint64_t nnew)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INODE(inode);
+    uint64_t cb = ASSOOFS_CLUSTER_BLOCKS(sb->s_blocksize), i, j = 0, n = 0, nfreed = 0, len, plen, k, from, to;
+    struct assoofs_extent *e, *out = cbuf->out;
+    int ret;
+
+    for (i = 0; i < inode_info->extent_count; i++)
+    {
+        e = &cbuf->ext[i];
+        len = ASSOOFS_EXTENT_LEN(e->ee_len);
+        if (e->ee_block >= first + cb || e->ee_block + len <= first)
+        {
+            out[n++] = *e;
+            continue;
+        }
+
+        if (e->ee_len & ASSOOFS_EXTENT_COMPRESSED)
+        {
+            // Los clusters de delante y los de detras siguen en sus bloques, cada tramo en su extent
+            plen = ASSOOFS_EXTENT_PLEN(e->ee_len);
+            k = div_u64(first - e->ee_block, cb);
+            cbuf->freed[nfreed].ee_start = e->ee_start + k * plen;
+            cbuf->freed[nfreed++].ee_len = plen;
+            if (k)
+                out[n++] = (struct assoofs_extent){e->ee_block, ASSOOFS_EXTENT_MAKE_COMPRESSED(k * cb, plen), e->ee_start};
+            if ((k + 1) * cb < len)
+                out[n++] = (struct assoofs_extent){first + cb, ASSOOFS_EXTENT_MAKE_COMPRESSED(len - (k + 1) * cb, plen),
+                                                   e->ee_start + (k + 1) * plen};
+        }
+        else
+        {
+            from = max(first, e->ee_block);
+            to = min(first + cb, e->ee_block + len);
+            cbuf->freed[nfreed].ee_start = e->ee_start + (from - e->ee_block);
+            cbuf->freed[nfreed++].ee_len = to - from;
+            if (from > e->ee_block)
+                out[n++] = (struct assoofs_extent){e->ee_block, from - e->ee_block, e->ee_start};
+            if (to < e->ee_block + len)
+                out[n++] = (struct assoofs_extent){to, e->ee_block + len - to, e->ee_start + (to - e->ee_block)};
+        }
+    }
+
+    // El primero de los nuevos alarga el extent que termina justo antes del cluster si es de la misma clase (comprimido
+    // con el mismo plen o sin comprimir) y sigue en disco a continuacion
+    for (i = 0; i < n && nnew; i++)
+    {
+        if (out[i].ee_block + ASSOOFS_EXTENT_LEN(out[i].ee_len) == first &&
+            (out[i].ee_len & ~0xffffffffULL) == (cbuf->new_ext[0].ee_len & ~0xffffffffULL) &&
+            out[i].ee_start + assoofs_extent_blocks(&out[i], sb->s_blocksize) == cbuf->new_ext[0].ee_start)
+        {
+            out[i].ee_len += ASSOOFS_EXTENT_LEN(cbuf->new_ext[0].ee_len);
+            j = 1;
+            break;
+        }
+    }
+    for (; j < nnew; j++)
+        out[n++] = cbuf->new_ext[j];
+
+    ret = assoofs_store_extents(sb, inode_info, out, n);
+    if (!ret)
+        assoofs_release_extents(sb, cbuf->freed, nfreed);
+    return ret;
+}
+
+/*
+ *   Escribe en disco el cluster cluster del fichero con el contenido de cbuf->data. Se comprime lo que hay hasta el
+ *   final del fichero y, si asi ocupa menos bloques, se guarda comprimido; si no, tal cual. El llamador tiene un handle
+ *   del journal y map_sem para escribir
+ */
+static int assoofs_write_cluster(struct inode *inode, uint64_t cluster, struct assoofs_cluster_buf *cbuf)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INODE(inode);
+    struct assoofs_cluster_header *hdr = (struct assoofs_cluster_header *)cbuf->zdata;
+    uint64_t bs = sb->s_blocksize, cb = ASSOOFS_CLUSTER_BLOCKS(bs), first = cluster * cb;
+    uint64_t valid, n, plen = 0, hint = 0, block, i, nnew = 0;
+    struct assoofs_extent *e;
+    const char *src;
+    int clen, ret;
+
+    valid = min_t(uint64_t, ASSOOFS_CLUSTER_SIZE, i_size_read(inode) - cluster * ASSOOFS_CLUSTER_SIZE);
+    memset(cbuf->data + valid, 0, ASSOOFS_CLUSTER_SIZE - valid);
+    n = DIV_ROUND_UP(valid, bs);
+
+    // plen: bloques que ocupa comprimido, redondeados a una potencia de 2. 0 si no merece la pena
+    clen = LZ4_compress_default(cbuf->data, (char *)(hdr + 1), valid, ASSOOFS_CLUSTER_ZSIZE - sizeof(*hdr), cbuf->wrkmem);
+    if (clen > 0)
+    {
+        plen = roundup_pow_of_two(DIV_ROUND_UP(sizeof(*hdr) + clen, bs));
+        if (plen >= n)
+            plen = 0;
+    }
+    if (plen)
+    {
+        hdr->size = clen;
+        hdr->checksum = crc32_le(~0, (u8 *)(hdr + 1), clen);
+    }
+
+    ret = assoofs_load_extents(sb, inode_info, cbuf->ext);
+    if (ret)
+        return ret;
+
+    // Los bloques que ya tiene el cluster no se reescriben: el mapa que hay en disco apunta a ellos hasta el commit y
+    // un corte a medio escribir dejaria el cluster viejo roto
+    for (i = 0; i < inode_info->extent_count; i++)
+    {
+        e = &cbuf->ext[i];
+        if (e->ee_block + ASSOOFS_EXTENT_LEN(e->ee_len) == first)
+            hint = e->ee_start + assoofs_extent_blocks(e, bs);
+    }
+
+    // Bloques nuevos: comprimido en un tramo seguido y, si no lo hay, tal cual en los bloques que se encuentren
+    if (plen)
+    {
+        ret = assoofs_alloc_run(sb, inode->i_ino, plen, hint, &block);
+        if (ret && ret != -ENOSPC)
+            return ret;
+        if (ret)
+            plen = ret = 0;
+        else
+        {
+            cbuf->new_ext[nnew++] = (struct assoofs_extent){first, ASSOOFS_EXTENT_MAKE_COMPRESSED(cb, plen), block};
+            memset((char *)(hdr + 1) + clen, 0, plen * bs - sizeof(*hdr) - clen);
+        }
+    }
+    for (i = 0; !plen && i < n; i++)
+    {
+        if (!hint || assoofs_sb_get_the_freeblock(sb, hint))
+            ret = assoofs_sb_get_a_freeblock_near(sb, inode->i_ino, &hint);
+        if (ret)
+        {
+            assoofs_release_extents(sb, cbuf->new_ext, nnew);
+            return ret;
+        }
+        if (nnew && cbuf->new_ext[nnew - 1].ee_start + cbuf->new_ext[nnew - 1].ee_len == hint)
+            cbuf->new_ext[nnew - 1].ee_len++;
+        else
+            cbuf->new_ext[nnew++] = (struct assoofs_extent){first + i, 1, hint};
+        hint++;
+    }
+
+    for (i = 0; i < nnew && !ret; i++)
+    {
+        src = plen ? cbuf->zdata : cbuf->data + (cbuf->new_ext[i].ee_block - first) * bs;
+        ret = assoofs_cluster_write_blocks(sb, cbuf->new_ext[i].ee_start, assoofs_extent_blocks(&cbuf->new_ext[i], bs), src, cbuf->bhs);
+    }
+    if (!ret)
+        ret = assoofs_cluster_remap(inode, first, cbuf, nnew);
+    if (ret)
+        assoofs_release_extents(sb, cbuf->new_ext, nnew);
+    else
+    {
+        assoofs_stat_add(sb, compress_in, valid);
+        assoofs_stat_add(sb, compress_out, (plen ? plen : n) * bs);
+    }
+    return ret;
+}
+
+static int assoofs_readpage_compressed(struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_cluster_buf *cbuf = assoofs_cluster_buf_get(inode->i_sb);
+    uint64_t cluster = page->index / ASSOOFS_CLUSTER_PAGES;
+    int ret;
+
+    down_read(&ai->map_sem);
+    ret = assoofs_read_cluster(inode, cluster, cbuf);
+    up_read(&ai->map_sem);
+    if (!ret)
+    {
+        assoofs_cluster_fill_page(page, cbuf);
+        assoofs_cluster_fill_cache(page->mapping, cluster, cbuf, page->index);
+    }
+    else
+        SetPageError(page);
+    unlock_page(page);
+
+    assoofs_cluster_buf_put(inode->i_sb, cbuf);
+    return ret;
+}
+
+// Cada cluster se descomprime una vez para todas sus paginas de la lectura anticipada
+static void assoofs_readahead_compressed(struct readahead_control *rac)
+{
+    struct inode *inode = rac->mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_cluster_buf *cbuf = assoofs_cluster_buf_get(inode->i_sb);
+    uint64_t cluster = U64_MAX;
+    struct page *page;
+    int ret = 0;
+
+    while ((page = readahead_page(rac)))
+    {
+        if (page->index / ASSOOFS_CLUSTER_PAGES != cluster)
+        {
+            cluster = page->index / ASSOOFS_CLUSTER_PAGES;
+            down_read(&ai->map_sem);
+            ret = assoofs_read_cluster(inode, cluster, cbuf);
+            up_read(&ai->map_sem);
+        }
+        if (!ret)
+            assoofs_cluster_fill_page(page, cbuf);
+        else
+            SetPageError(page);
+        unlock_page(page);
+        put_page(page);
+    }
+
+    assoofs_cluster_buf_put(inode->i_sb, cbuf);
+}
+
+/*
+ *   Escribe el cluster de la pagina junto con las demas paginas sucias que tenga en la cache. Las que no estan en la
+ *   cache (o no estan al dia) se sacan del cluster que hay en disco. Las que tiene bloqueadas otro se copian igual y
+ *   siguen sucias para la siguiente vez
+ */
+static int assoofs_writepage_compressed(struct page *page, struct writeback_control *wbc)
+{
+    struct inode *inode = page->mapping->host;
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_cluster_buf *cbuf;
+    struct page *pages[ASSOOFS_CLUSTER_PAGES];
+    bool writeback[ASSOOFS_CLUSTER_PAGES];
+    uint64_t cluster = page->index / ASSOOFS_CLUSTER_PAGES;
+    pgoff_t index = cluster * ASSOOFS_CLUSTER_PAGES, end = DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE);
+    bool missing = false;
+    unsigned int i;
+    char *kaddr;
+    int ret;
+
+    // Una pagina que ha quedado detras del final del fichero no tiene nada que escribir
+    if (page->index >= end)
+    {
+        unlock_page(page);
+        return 0;
+    }
+
+    cbuf = assoofs_cluster_buf_get(sb);
+    for (i = 0; i < ASSOOFS_CLUSTER_PAGES; i++, index++)
+    {
+        pages[i] = NULL;
+        writeback[i] = false;
+        if (index == page->index)
+        {
+            pages[i] = page;
+            continue;
+        }
+        if (index >= end)
+            continue;
+
+        pages[i] = find_get_page(page->mapping, index);
+        if (pages[i] && trylock_page(pages[i]))
+        {
+            if (PageDirty(pages[i]) && !PageWriteback(pages[i]) && clear_page_dirty_for_io(pages[i]))
+            {
+                set_page_writeback(pages[i]);
+                writeback[i] = true;
+            }
+            unlock_page(pages[i]);
+        }
+        if (pages[i] && !PageUptodate(pages[i]))
+        {
+            put_page(pages[i]);
+            pages[i] = NULL;
+        }
+        missing |= !pages[i];
+    }
+    set_page_writeback(page);
+    unlock_page(page);
+
+    ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS);
+    if (ret)
+        goto out;
+    down_write(&ai->map_sem);
+
+    ret = missing ? assoofs_read_cluster(inode, cluster, cbuf) : 0;
+    for (i = 0; i < ASSOOFS_CLUSTER_PAGES && !ret; i++)
+    {
+        if (!pages[i])
+            continue;
+        kaddr = kmap_atomic(pages[i]);
+        memcpy(cbuf->data + i * PAGE_SIZE, kaddr, PAGE_SIZE);
+        kunmap_atomic(kaddr);
+    }
+    if (!ret)
+        ret = assoofs_write_cluster(inode, cluster, cbuf);
+
+    up_write(&ai->map_sem);
+    if (assoofs_journal_stop(sb) && !ret)
+        ret = -EIO;
+
+out:
+    if (ret)
+    {
+        SetPageError(page);
+        mapping_set_error(page->mapping, ret);
+    }
+    for (i = 0; i < ASSOOFS_CLUSTER_PAGES; i++)
+    {
+        if (writeback[i])
+            end_page_writeback(pages[i]);
+        if (pages[i] && pages[i] != page)
+            put_page(pages[i]);
+    }
+    end_page_writeback(page);
+    assoofs_cluster_buf_put(sb, cbuf);
+    return ret;
+}
+
+// write_begin de un fichero comprimido: la pagina se trae del cluster (y de paso las demas de su cluster) salvo que
+// este detras del final o se vaya a escribir entera
+static int assoofs_write_begin_compressed(struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep)
+{
+    struct inode *inode = mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_cluster_buf *cbuf;
+    struct page *page;
+    int ret = 0;
+
+    page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+    if (!page)
+        return -ENOMEM;
+
+    if (!PageUptodate(page) && len != PAGE_SIZE)
+    {
+        if (page_offset(page) >= i_size_read(inode))
+        {
+            zero_user(page, 0, PAGE_SIZE);
+            SetPageUptodate(page);
+        }
+        else
+        {
+            cbuf = assoofs_cluster_buf_get(inode->i_sb);
+            down_read(&ai->map_sem);
+            ret = assoofs_read_cluster(inode, page->index / ASSOOFS_CLUSTER_PAGES, cbuf);
+            up_read(&ai->map_sem);
+            if (!ret)
+            {
+                assoofs_cluster_fill_page(page, cbuf);
+                assoofs_cluster_fill_cache(mapping, page->index / ASSOOFS_CLUSTER_PAGES, cbuf, page->index);
+            }
+            assoofs_cluster_buf_put(inode->i_sb, cbuf);
+        }
+    }
+
+    if (ret)
+    {
+        unlock_page(page);
+        put_page(page);
+        return ret;
+    }
+    *pagep = page;
+    return 0;
+}
+
+// write_end de un fichero comprimido: la pagina queda sucia y el cluster se comprime al escribirla
+static int assoofs_write_end_compressed(struct inode *inode, loff_t pos, unsigned len, unsigned copied, struct page *page)
+{
+    int ret;
+
+    // Una pagina entera que no estaba al dia y no se ha llegado a copiar entera se repite
+    if (!PageUptodate(page))
+    {
+        if (copied < len)
+            copied = 0;
+        else
+            SetPageUptodate(page);
+    }
+    if (copied)
+    {
+        set_page_dirty(page);
+        if (pos + copied > i_size_read(inode))
+            i_size_write(inode, pos + copied);
+    }
+    unlock_page(page);
+    put_page(page);
+
+    ret = assoofs_save_file_size(inode);
+    return ret ? ret : copied;
+}
+
+/*
+ *  Ficheros clonados (ASSOOFS_FEATURE_REFLINK). Clonar no copia datos: el destino apunta a los mismos bloques que el
+ *  origen y cada bloque suma un duenno en su contador de referencias. Los dos ficheros quedan marcados con
+ *  ASSOOFS_INODE_SHARED y la primera escritura en un bloque compartido lo copia a uno nuevo (assoofs_cow_block) desde
+ *  assoofs_get_block. Los ficheros comprimidos e inline no se clonan: copy_file_range vuelve entonces a la copia normal
+ */
+
+#define ASSOOFS_CLONE_CHUNK(bs) (ASSOOFS_REFCOUNTS_PER_BLOCK(bs) * 4) // Bloques que se clonan en cada transaccion
+
+// Copia en out los count extents (sin comprimir) de ext quitando los bloques logicos [from, to). Los tramos quitados
+// se dejan en freed para liberarlos despues. Devuelve cuantos extents quedan en out (count + 1 como mucho)
+static uint64_t assoofs_extents_punch(const struct assoofs_extent *ext, uint64_t count, uint64_t from, uint64_t to, struct assoofs_extent *out, struct assoofs_extent *freed, uint64_t *nfreed)
+{
+    const struct assoofs_extent *e;
+    uint64_t i, n = 0, lo, hi;
+
+    for (i = 0; i < count; i++)
+    {
+        e = &ext[i];
+        if (e->ee_block >= to || e->ee_block + e->ee_len <= from)
+        {
+            out[n++] = *e;
+            continue;
+        }
+        lo = max(from, e->ee_block);
+        hi = min(to, e->ee_block + e->ee_len);
+        freed[(*nfreed)++] = (struct assoofs_extent){lo, hi - lo, e->ee_start + (lo - e->ee_block)};
+        if (lo > e->ee_block)
+            out[n++] = (struct assoofs_extent){e->ee_block, lo - e->ee_block, e->ee_start};
+        if (hi < e->ee_block + e->ee_len)
+            out[n++] = (struct assoofs_extent){hi, e->ee_block + e->ee_len - hi, e->ee_start + (hi - e->ee_block)};
+    }
+    return n;
+}
+
+// Anniade a los n extents de out el tramo new, alargando el que termina justo antes si sigue en disco a continuacion
+static uint64_t assoofs_extents_add(struct assoofs_extent *out, uint64_t n, const struct assoofs_extent *new)
+{
+    uint64_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (out[i].ee_block + out[i].ee_len == new->ee_block && out[i].ee_start + out[i].ee_len == new->ee_start)
+        {
+            out[i].ee_len += new->ee_len;
+            return n;
+        }
+    }
+    out[n] = *new;
+    return n + 1;
+}
+
+// Copia el bloque from en el bloque to con un buffer_head propio. Los datos de los ficheros se escriben con bios, asi
+// que la cache del dispositivo puede tener una copia vieja de from
+static int assoofs_copy_block(struct super_block *sb, uint64_t from, uint64_t to)
+{
+    struct page *page = alloc_page(GFP_NOFS);
+    struct buffer_head *bh;
+    int ret = -EIO;
+
+    if (!page)
+        return -ENOMEM;
+    bh = alloc_buffer_head(GFP_NOFS);
+    if (!bh)
+    {
+        __free_page(page);
+        return -ENOMEM;
+    }
+    bh->b_bdev = sb->s_bdev;
+    bh->b_size = sb->s_blocksize;
+    set_bh_page(bh, page, 0);
+    set_buffer_mapped(bh);
+
+    bh->b_blocknr = from;
+    lock_buffer(bh);
+    get_bh(bh);
+    bh->b_end_io = end_buffer_read_sync;
+    submit_bh(REQ_OP_READ, 0, bh);
+    wait_on_buffer(bh);
+    if (buffer_uptodate(bh))
+    {
+        bh->b_blocknr = to;
+        lock_buffer(bh);
+        get_bh(bh);
+        bh->b_end_io = end_buffer_write_sync;
+        submit_bh(REQ_OP_WRITE, 0, bh);
+        wait_on_buffer(bh);
+        if (buffer_uptodate(bh))
+            ret = 0;
+    }
+
+    free_buffer_head(bh);
+    __free_page(page);
+    return ret;
+}
+
+/*
+ *   Copia en escritura: el bloque logico iblock esta en el bloque compartido old. Se copia a un bloque nuevo, que es
+ *   solo de este fichero, y old pierde un duenno. El nuevo se busca detras del que tiene el bloque logico anterior
+ *   para que reescribir un clon de principio a fin lo vuelva a dejar en un extent. El llamador tiene un handle del
+ *   journal y map_sem para escribir
+ */
+static int assoofs_cow_block(struct inode *inode, uint64_t iblock, uint64_t old, uint64_t *block)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_inode_info *inode_info = ASSOOFS_INODE(inode);
+    uint64_t max = ASSOOFS_MAX_EXTENTS(sb->s_blocksize), prev = 0, count, n, nfreed = 0;
+    struct assoofs_extent *ext, *out, freed;
+    int ret;
+
+    if (iblock)
+        assoofs_map_block(sb, inode_info, iblock - 1, &prev, &count);
+    if (!prev || assoofs_sb_get_the_freeblock(sb, prev + 1))
+    {
+        ret = assoofs_sb_get_a_freeblock_near(sb, inode->i_ino, block);
+        if (ret)
+            return ret;
+    }
+    else
+        *block = prev + 1;
+
+    ext = kmalloc_array(2 * max + 2, sizeof(*ext), GFP_NOFS);
+    if (!ext)
+    {
+        ret = -ENOMEM;
+        goto fail;
+    }
+    out = ext + max;
+    ret = assoofs_load_extents(sb, inode_info, ext);
+    if (!ret)
+        ret = assoofs_copy_block(sb, old, *block);
+    if (ret)
+        goto fail;
+
+    n = assoofs_extents_punch(ext, inode_info->extent_count, iblock, iblock + 1, out, &freed, &nfreed);
+    n = assoofs_extents_add(out, n, &(struct assoofs_extent){iblock, 1, *block});
+    ret = assoofs_store_extents(sb, inode_info, out, n);
+    if (ret)
+        goto fail;
+
+    kfree(ext);
+    assoofs_release_extents(sb, &freed, nfreed);
+    assoofs_stat_inc(sb, cow_blocks);
+    return 0;
+
+fail:
+    kfree(ext);
+    assoofs_bitmap_release(sb, *block, 1);
+    assoofs_save_sb_info(sb);
+    return ret;
+}
+
+// Una pagina de un fichero clonado puede tener buffers mapeados a bloques que ahora son compartidos (la leyo
+// block_read_full_page, que no pide create). Se desmapean para que escribirla pase por assoofs_get_block con create
+static void assoofs_unshare_buffers(struct inode *inode, struct page *page)
+{
+    struct buffer_head *head, *bh;
+
+    if (!(ASSOOFS_INODE(inode)->flags & ASSOOFS_INODE_SHARED) || !page_has_buffers(page))
+        return;
+    bh = head = page_buffers(page);
+    do
+    {
+        if (buffer_mapped(bh) && !assoofs_refcount_unshared(inode->i_sb, bh->b_blocknr, 1))
+            clear_buffer_mapped(bh);
+        bh = bh->b_this_page;
+    } while (bh != head);
+}
+
+/*
+ *   Clona n bloques logicos: los de src a partir de sblk pasan a estar tambien en dst a partir de dblk, con un duenno
+ *   mas cada uno, y lo que tenia dst en ese rango se suelta. buf tiene sitio para 6 * ASSOOFS_MAX_EXTENTS + 1. El
+ *   llamador tiene un handle del journal y map_sem de los dos ficheros
+ */
+static int assoofs_clone_extents(struct super_block *sb, struct assoofs_inode_info *src, struct assoofs_inode_info *dst, uint64_t sblk, uint64_t dblk, uint64_t n, struct assoofs_extent *buf)
+{
+    uint64_t max = ASSOOFS_MAX_EXTENTS(sb->s_blocksize), count, i, lo, hi, nfreed = 0, nshared = 0, cloned = 0;
+    struct assoofs_extent *sext = buf, *dext = buf + max, *freed = buf + 2 * max, *shared = buf + 3 * max, *out = buf + 4 * max;
+    struct assoofs_extent *e;
+    int ret;
+
+    ret = assoofs_load_extents(sb, src, sext);
+    if (!ret && dst != src)
+        ret = assoofs_load_extents(sb, dst, dext);
+    if (ret)
+        return ret;
+    if (dst == src)
+        dext = sext;
+
+    count = assoofs_extents_punch(dext, dst->extent_count, dblk, dblk + n, out, freed, &nfreed);
+
+    // Los tramos del origen que caen en el rango, llevados al destino
+    for (i = 0; i < src->extent_count && !ret; i++)
+    {
+        e = &sext[i];
+        if (e->ee_block >= sblk + n || e->ee_block + e->ee_len <= sblk)
+            continue;
+        lo = max(sblk, e->ee_block);
+        hi = min(sblk + n, e->ee_block + e->ee_len);
+        shared[nshared] = (struct assoofs_extent){dblk + (lo - sblk), hi - lo, e->ee_start + (lo - e->ee_block)};
+        ret = assoofs_refcount_get(sb, shared[nshared].ee_start, shared[nshared].ee_len);
+        if (!ret)
+        {
+            count = assoofs_extents_add(out, count, &shared[nshared]);
+            cloned += shared[nshared++].ee_len;
+        }
+    }
+
+    if (!ret)
+    {
+        src->flags |= ASSOOFS_INODE_SHARED;
+        dst->flags |= ASSOOFS_INODE_SHARED;
+        ret = assoofs_store_extents(sb, dst, out, count);
+        if (!ret && dst != src)
+            ret = assoofs_save_inode_info(sb, src);
+    }
+    if (ret)
+    {
+        // Lo que ya habia sumado un duenno lo pierde: el destino se queda como estaba
+        assoofs_release_extents(sb, shared, nshared);
+        return ret;
+    }
+
+    assoofs_release_extents(sb, freed, nfreed);
+    assoofs_stat_add(sb, cloned_blocks, cloned);
+    return 0;
+}
+
+// Clona count bloques por tramos de ASSOOFS_CLONE_CHUNK, cada uno en su transaccion, y los lleva a disco juntos al
+// final como assoofs_reclaim
+static int assoofs_clone_blocks(struct inode *src, struct inode *dst, uint64_t sblk, uint64_t dblk, uint64_t count)
+{
+    struct super_block *sb = src->i_sb;
+    struct assoofs_inode *sai = ASSOOFS_I(src), *dai = ASSOOFS_I(dst);
+    uint64_t done, n;
+    struct assoofs_extent *buf;
+    unsigned int nblocks;
+    int ret = 0;
+
+    buf = kvmalloc_array(6 * ASSOOFS_MAX_EXTENTS(sb->s_blocksize) + 1, sizeof(*buf), GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    for (done = 0; done < count && !ret; done += n)
+    {
+        // Inodos, superbloque, desbordamiento y los bloques del mapa y de contadores de cada tramo. Con ficheros muy
+        // fragmentados el tramo se acorta hasta que cabe en una transaccion: cada extent que toca tiene un bloque al
+        // menos
+        for (n = min_t(uint64_t, count - done, ASSOOFS_CLONE_CHUNK(sb->s_blocksize));; n = DIV_ROUND_UP(n, 2))
+        {
+            nblocks = ASSOOFS_JOURNAL_HANDLE_BLOCKS + 4 * DIV_ROUND_UP(n, ASSOOFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize)) +
+                      4 * (min(n, sai->info.extent_count) + min(n, dai->info.extent_count));
+            if (n == 1 || nblocks <= assoofs_journal_max_blocks(sb))
+                break;
+        }
+        ret = assoofs_journal_start(sb, nblocks);
+        if (ret)
+            break;
+        down_write(&dai->map_sem);
+        if (src != dst)
+            down_read_nested(&sai->map_sem, SINGLE_DEPTH_NESTING);
+        ret = assoofs_clone_extents(sb, &sai->info, &dai->info, sblk + done, dblk + done, n, buf);
+        if (src != dst)
+            up_read(&sai->map_sem);
+        up_write(&dai->map_sem);
+        assoofs_journal_stop_nowait(sb);
+    }
+
+    kvfree(buf);
+    if (!ASSOOFS_SB(sb)->writeback && assoofs_journal_commit_all(sb) && !ret)
+        ret = -EIO;
+    return ret;
+}
+
+// Solo se clonan ficheros con extents normales. Un destino vacio toma el formato del origen aunque haya nacido inline
+// o comprimido (con -o compress todos los ficheros nuevos lo son)
+static int assoofs_clone_prepare(struct inode *src, struct inode *dst)
+{
+    struct assoofs_inode *sai = ASSOOFS_I(src), *dai = ASSOOFS_I(dst);
+    int ret;
+
+    if (assoofs_is_inline(sai) || assoofs_is_compressed(sai))
+        return -EOPNOTSUPP;
+    if (!assoofs_is_inline(dai) && !assoofs_is_compressed(dai))
+        return 0;
+    if (i_size_read(dst) || (!assoofs_is_inline(dai) && dai->info.extent_count))
+        return -EOPNOTSUPP;
+
+    ret = assoofs_journal_start(dst->i_sb, 1);
+    if (ret)
+        return ret;
+    down_write(&dai->map_sem);
+    if (assoofs_is_inline(dai))
+    {
+        memset(dai->info.inline_data, 0, ASSOOFS_INLINE_DATA_MAX);
+        dai->info.extent_count = 0;
+        dai->info.extent_block = 0;
+        dai->info.data_block_number = 0;
+    }
+    dai->info.flags &= ~(ASSOOFS_INODE_INLINE | ASSOOFS_INODE_COMPRESSED);
+    ret = assoofs_save_inode_info(dst->i_sb, &dai->info);
+    up_write(&dai->map_sem);
+    if (assoofs_journal_stop(dst->i_sb) && !ret)
+        ret = -EIO;
+    return ret;
+}
+
+// FICLONE, FICLONERANGE y copy_file_range (el VFS lo intenta primero como clon). Deduplicar no esta soportado
+static loff_t assoofs_remap_file_range(struct file *file_in, loff_t pos_in, struct file *file_out, loff_t pos_out, loff_t len, unsigned int remap_flags)
+{
+    struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+    struct super_block *sb = src->i_sb;
+    u64 start = ktime_get_ns();
+    loff_t ret;
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+    if ((remap_flags & REMAP_FILE_DEDUP) || !ASSOOFS_SB(sb)->refcount_bh)
+        return -EOPNOTSUPP;
+
+    lock_two_nondirectories(src, dst);
+    // Comprueba los rangos (alineados al bloque salvo al final del origen) y escribe las paginas sucias de los dos
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+    if (ret < 0 || !len)
+        goto out;
+
+    ret = assoofs_clone_prepare(src, dst);
+    // Las paginas del origen pueden tener buffers mapeados a los bloques que van a ser compartidos
+    if (!ret)
+        ret = invalidate_inode_pages2_range(src->i_mapping, pos_in >> PAGE_SHIFT, (pos_in + len - 1) >> PAGE_SHIFT);
+    if (!ret)
+        ret = assoofs_clone_blocks(src, dst, pos_in >> sb->s_blocksize_bits, pos_out >> sb->s_blocksize_bits, DIV_ROUND_UP(len, sb->s_blocksize));
+
+    // Las del destino tienen lo de antes
+    truncate_inode_pages_range(&dst->i_data, round_down(pos_out, PAGE_SIZE), round_up(pos_out + len, PAGE_SIZE) - 1);
+    if (!ret && pos_out + len > i_size_read(dst))
+    {
+        i_size_write(dst, pos_out + len);
+        ret = assoofs_save_file_size(dst);
+        if (!ASSOOFS_SB(sb)->writeback && assoofs_journal_commit_all(sb) && !ret)
+            ret = -EIO;
+    }
+    assoofs_stat_op(sb, ASSOOFS_OP_CLONE, start);
+
+out:
+    unlock_two_nondirectories(src, dst);
+    return ret < 0 ? ret : len;
+}
+
+static int assoofs_readpage(struct file *file, struct page *page)
+{
+    struct inode *inode = page->mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    down_read(&ai->map_sem);
+    if (assoofs_is_inline(ai))
+    {
+        assoofs_read_inline(ai, page);
+        up_read(&ai->map_sem);
+        unlock_page(page);
+    }
+    else
+    {
+        up_read(&ai->map_sem);
+        if (assoofs_is_compressed(ai))
+            ret = assoofs_readpage_compressed(page);
+        else
+            ret = mpage_readpage(page, assoofs_get_block);
+    }
+
+    assoofs_stat_op(inode->i_sb, ASSOOFS_OP_READPAGE, start);
+    return ret;
+}
+
+static void assoofs_readahead(struct readahead_control *rac)
+{
+    struct inode *inode = rac->mapping->host;
+    u64 start = ktime_get_ns();
+
+    // Las paginas de un fichero inline se dejan para readpage, que las saca del inodo
+    if (assoofs_is_compressed(ASSOOFS_I(inode)) && !assoofs_is_inline(ASSOOFS_I(inode)))
+        assoofs_readahead_compressed(rac);
+    else if (!assoofs_is_inline(ASSOOFS_I(inode)))
+        mpage_readahead(rac, assoofs_get_block);
+    assoofs_stat_op(inode->i_sb, ASSOOFS_OP_READAHEAD, start);
+}
+
+static int assoofs_writepage(struct page *page, struct writeback_control *wbc)
+{
+    struct inode *inode = page->mapping->host;
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    // Un fichero inline ya tiene sus datos en el inodo
+    if (assoofs_is_inline(ASSOOFS_I(inode)))
+        unlock_page(page);
+    else if (assoofs_is_compressed(ASSOOFS_I(inode)))
+        ret = assoofs_writepage_compressed(page, wbc);
+    else
+        ret = block_write_full_page(page, assoofs_get_block, wbc);
+
+    assoofs_stat_op(inode->i_sb, ASSOOFS_OP_WRITEPAGE, start);
+    return ret;
+}
+
+static int assoofs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    u64 start = ktime_get_ns();
+    int ret = 0;
+
+    // Los clusters comprimidos se escriben pagina a pagina con writepage, que se lleva las sucias de cada cluster
+    if (assoofs_is_compressed(ASSOOFS_I(mapping->host)) && !assoofs_is_inline(ASSOOFS_I(mapping->host)))
+        ret = generic_writepages(mapping, wbc);
+    else if (!assoofs_is_inline(ASSOOFS_I(mapping->host)))
+        ret = mpage_writepages(mapping, wbc, assoofs_get_block);
+    assoofs_stat_op(mapping->host->i_sb, ASSOOFS_OP_WRITEPAGES, start);
+    return ret;
+}
+
+static int assoofs_write_begin(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned flags, struct page **pagep, void **fsdata)
+{
+    struct assoofs_inode *ai = ASSOOFS_I(mapping->host);
+    struct page *page;
+    int ret;
+
+    if (assoofs_is_inline(ai))
+    {
+        // Si lo que se escribe sigue cabiendo en el inodo basta con la pagina 0 al dia
+        if (pos + len <= ASSOOFS_INLINE_DATA_MAX)
+        {
+            page = grab_cache_page_write_begin(mapping, 0, flags);
+            if (!page)
+                return -ENOMEM;
+            if (!PageUptodate(page))
+            {
+                down_read(&ai->map_sem);
+                assoofs_read_inline(ai, page);
+                up_read(&ai->map_sem);
+            }
+            *pagep = page;
+            return 0;
+        }
+
+        ret = assoofs_inline_to_blocks(mapping->host);
+        if (ret)
+            return ret;
+    }
+
+    if (assoofs_is_compressed(ai))
+        return assoofs_write_begin_compressed(mapping, pos, len, flags, pagep);
+
+    // block_write_begin, pero antes de preparar los buffers se desmapean los que esten en bloques compartidos
+    page = grab_cache_page_write_begin(mapping, pos >> PAGE_SHIFT, flags);
+    if (!page)
+        return -ENOMEM;
+    assoofs_unshare_buffers(mapping->host, page);
+    ret = __block_write_begin(page, pos, len, assoofs_get_block);
+    if (ret < 0)
+    {
+        unlock_page(page);
+        put_page(page);
+        truncate_pagecache(mapping->host, i_size_read(mapping->host)); // No dejar en la cache paginas mas alla del final
+        return ret;
+    }
+    *pagep = page;
+    return 0;
+}
+
+// write_end de un fichero inline: lo escrito en la pagina se copia al inodo y la pagina queda limpia
+static int assoofs_write_end_inline(struct inode *inode, loff_t pos, unsigned copied, struct page *page)
+{
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    char *kaddr;
+    int ret;
+
+    ret = assoofs_journal_start(inode->i_sb, 1);
+    if (ret)
+        goto out;
+
+    down_write(&ai->map_sem);
+    kaddr = kmap(page);
+    memcpy(ai->info.inline_data + pos, kaddr + pos, copied);
+    kunmap(page);
+    if (pos + copied > i_size_read(inode))
+    {
+        i_size_write(inode, pos + copied);
+        ai->info.file_size = pos + copied;
+    }
+    ret = assoofs_save_inode_info(inode->i_sb, &ai->info);
+    up_write(&ai->map_sem);
+
+    if (assoofs_journal_stop(inode->i_sb) && !ret)
+        ret = -EIO;
+
+out:
+    unlock_page(page);
+    put_page(page);
+    return ret ? ret : copied;
+}
+
+static int assoofs_write_end(struct file *file, struct address_space *mapping, loff_t pos, unsigned len, unsigned copied, struct page *page, void *fsdata)
+{
+    struct inode *inode = mapping->host;
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret, err;
+
+    if (assoofs_is_inline(ai))
+        return assoofs_write_end_inline(inode, pos, copied, page);
+
+    if (assoofs_is_compressed(ai))
+        return assoofs_write_end_compressed(inode, pos, len, copied, page);
+
+    ret = generic_write_end(file, mapping, pos, len, copied, page, fsdata);
+
+    // generic_write_end ya ha actualizado i_size, hay que llevarlo tambien a la informacion persistente del inodo
+    err = assoofs_save_file_size(inode);
+    return err ? err : ret;
+}
+
+// O_DIRECT: los bloques van del buffer del usuario al dispositivo (y al reves) sin pasar por la cache de paginas.
+// blockdev_direct_IO traduce los bloques con assoofs_get_block, igual que mpage, y reserva los huecos al escribir. Un
+// fichero inline no tiene bloques: si lo escrito no cabe en el inodo se pasa a bloques antes (un fichero nuevo
+// empieza siendo inline); si no, se devuelve 0 y los genericos siguen por la cache de paginas. Lo mismo con un fichero
+// comprimido, cuyos bloques no se corresponden con los del fichero
+static ssize_t assoofs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    loff_t end = iocb->ki_pos + iov_iter_count(iter);
+    ssize_t ret;
+    int err;
+
+    if (assoofs_is_compressed(ai))
+        return 0;
+
+    if (assoofs_is_inline(ai))
+    {
+        if (iov_iter_rw(iter) != WRITE || end <= ASSOOFS_INLINE_DATA_MAX)
+            return 0;
+        // El contenido queda en la pagina 0 sucia: se escribe ya para que tenga su bloque antes que la escritura directa
+        ret = assoofs_inline_to_blocks(inode);
+        if (!ret)
+            ret = filemap_write_and_wait_range(inode->i_mapping, 0, PAGE_SIZE - 1);
+        if (ret)
+            return ret;
+    }
+
+    // assoofs_get_block reserva de una vez todo el hueco que le pide cada llamada
+    ret = blockdev_direct_IO(iocb, inode, iter, assoofs_get_block);
+
+    // Como en write_end: si la escritura ha alargado el fichero el tamannio nuevo pasa al inodo. i_size lo actualiza
+    // el llamador (una escritura que alarga el fichero nunca es asincrona, asi que ret ya es lo escrito). Si no se
+    // puede guardar se devuelve el error: los datos estan en bloques que el inodo no cubre. El commit, como el de los
+    // bloques que ha reservado assoofs_get_block, lo hace el fsync de la escritura y su error es el de write
+    end = iocb->ki_pos + ret;
+    if (iov_iter_rw(iter) == WRITE && ret > 0 && end > ai->info.file_size)
+    {
+        err = assoofs_journal_start(inode->i_sb, 1);
+        if (err)
+            return err;
+        down_write(&ai->map_sem);
+        if (end > ai->info.file_size)
+            ai->info.file_size = end;
+        err = assoofs_save_inode_info(inode->i_sb, &ai->info);
+        up_write(&ai->map_sem);
+        assoofs_journal_stop_nowait(inode->i_sb);
+        if (err)
+            return err;
+    }
+    return ret;
+}
+
+static sector_t assoofs_bmap(struct address_space *mapping, sector_t block)
+{
+    if (assoofs_is_inline(ASSOOFS_I(mapping->host)) || assoofs_is_compressed(ASSOOFS_I(mapping->host)))
+        return 0; // No tiene bloques o no son los del fichero
+    return generic_block_bmap(mapping, block, assoofs_get_block);
+}
+
+const struct address_space_operations assoofs_aops = {
+    .readpage = assoofs_readpage,
+    .readahead = assoofs_readahead,
+    .writepage = assoofs_writepage,
+    .writepages = assoofs_writepages,
+    .write_begin = assoofs_write_begin,
+    .write_end = assoofs_write_end,
+    .direct_IO = assoofs_direct_IO,
+    .bmap = assoofs_bmap,
+};
+
+static ssize_t assoofs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct super_block *sb = file_inode(iocb->ki_filp)->i_sb;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    assoofs_dbg("Read request\n");
+
+    ret = generic_file_read_iter(iocb, to);
+    if (ret > 0)
+        assoofs_stat_add(sb, bytes_read, ret);
+    assoofs_stat_op(sb, ASSOOFS_OP_READ, start);
+    return ret;
+}
+
+static ssize_t assoofs_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct super_block *sb = file_inode(iocb->ki_filp)->i_sb;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    assoofs_dbg("Write request\n");
+
+    // Por defecto las escrituras llegan a disco antes de volver, como cuando se hacia sync_dirty_buffer de cada
+    // bloque. Con -o writeback las paginas sucias se quedan en memoria hasta que el kernel las escriba o haya un fsync
+    if (!ASSOOFS_SB(sb)->writeback)
+        iocb->ki_flags |= IOCB_DSYNC;
+    ret = generic_file_write_iter(iocb, from);
+    if (ret > 0)
+        assoofs_stat_add(sb, bytes_written, ret);
+    assoofs_stat_op(sb, ASSOOFS_OP_WRITE, start);
+    return ret;
+}
+
+// Lleva a disco los datos del rango y los metadatos pendientes. Los metadatos (extents, tabla de inodos, mapa de bits,
+// directorios) son buffers del dispositivo compartidos entre ficheros, asi que se escriben todos con sync_blockdev.
+// Al final se vacia la cache de escritura del dispositivo
+static int assoofs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct super_block *sb = file_inode(file)->i_sb;
+    u64 time = ktime_get_ns();
+    int ret;
+
+    assoofs_dbg("Fsync request\n");
+
+    ret = file_write_and_wait_range(file, start, end);
+    if (!ret)
+        ret = assoofs_journal_commit_all(sb);
+    if (!ret && ASSOOFS_SB(sb)->writeback)
+        ret = sync_blockdev(sb->s_bdev);
+    if (!ret)
+        ret = blkdev_issue_flush(sb->s_bdev);
+
+    assoofs_stat_op(sb, ASSOOFS_OP_FSYNC, time);
+    return ret;
+}
+
+// Primera escritura en una pagina proyectada con mmap. Se reservan ya los bloques de la pagina para que un disco lleno
+// sea un SIGBUS ahora y no datos perdidos al escribirla. Las paginas de un fichero inline no se escriben nunca
+// (writepage las ignora), asi que antes el fichero pasa a bloques. En un clon los bloques compartidos de la pagina se
+// copian aqui (assoofs_unshare_buffers). En un fichero comprimido no se sabe cuantos bloques
+// hacen falta hasta comprimir el cluster: la pagina solo se marca sucia
+static vm_fault_t assoofs_page_mkwrite(struct vm_fault *vmf)
+{
+    struct inode *inode = file_inode(vmf->vma->vm_file);
+    struct page *page = vmf->page;
+    vm_fault_t fault;
+    int ret = 0;
+
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vmf->vma->vm_file);
+    if (assoofs_is_inline(ASSOOFS_I(inode)))
+        ret = assoofs_inline_to_blocks(inode);
+    if (ret)
+        fault = vmf_error(ret);
+    else if (assoofs_is_compressed(ASSOOFS_I(inode)))
+    {
+        lock_page(page);
+        if (page->mapping != inode->i_mapping)
+        {
+            unlock_page(page);
+            fault = VM_FAULT_NOPAGE; // La han quitado de la cache mientras tanto
+        }
+        else
+        {
+            set_page_dirty(page);
+            wait_for_stable_page(page);
+            fault = VM_FAULT_LOCKED;
+        }
+    }
+    else
+    {
+        lock_page(page);
+        assoofs_unshare_buffers(inode, page);
+        unlock_page(page);
+        fault = block_page_mkwrite_return(block_page_mkwrite(vmf->vma, vmf, assoofs_get_block));
+    }
+    sb_end_pagefault(inode->i_sb);
+    return fault;
+}
+
+static const struct vm_operations_struct assoofs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = assoofs_page_mkwrite,
+};
+
+static int assoofs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &assoofs_file_vm_ops;
+    return 0;
+}
+
+/*
+ *  Cambio de tamanno (truncate, ftruncate, O_TRUNC). Crecer solo deja un hueco. Al encoger, lo que queda detras del
+ *  nuevo final en su ultimo bloque se pone a cero para que no reaparezca si el fichero vuelve a crecer, y los bloques
+ *  que quedan enteros detras salen del mapa de extents y vuelven al mapa de bits en la misma transaccion. En un
+ *  fichero comprimido se quitan los clusters enteros y el del final se vuelve a escribir con lo que queda
+ */
+
+// Pone a cero los bytes [from, to) pasando por write_begin/write_end, que ya copian un bloque compartido y escriben en
+// el inodo si el fichero es inline. to no pasa de i_size: escribir no alarga el fichero
+static int assoofs_zero_range(struct inode *inode, loff_t from, loff_t to)
+{
+    struct page *page;
+    void *fsdata;
+    unsigned int offset, len;
+    int ret;
+
+    while (from < to)
+    {
+        offset = from & (PAGE_SIZE - 1);
+        len = min_t(loff_t, PAGE_SIZE - offset, to - from);
+        ret = pagecache_write_begin(NULL, inode->i_mapping, from, len, 0, &page, &fsdata);
+        if (ret)
+            return ret;
+        zero_user(page, offset, len);
+        ret = pagecache_write_end(NULL, inode->i_mapping, from, len, len, page, fsdata);
+        if (ret < 0)
+            return ret;
+        from += len;
+    }
+    return 0;
+}
+
+/*
+ *  Quita del mapa de extents los bloques logicos desde cut en adelante y los libera, empezando por el final y como
+ *  mucho lo que cabe en una transaccion (ASSOOFS_RELEASE_EXTENTS tramos con ASSOOFS_RELEASE_CHUNK bloques). Devuelve 1
+ *  si quedan bloques por quitar. En un fichero comprimido cut es el principio de un cluster y solo se quitan clusters
+ *  enteros. El llamador tiene un handle del journal y map_sem para escribir
+ */
+static int assoofs_truncate_extents(struct super_block *sb, struct assoofs_inode_info *inode_info, uint64_t cut)
+{
+    uint64_t max = ASSOOFS_MAX_EXTENTS(sb->s_blocksize), cb = ASSOOFS_CLUSTER_BLOCKS(sb->s_blocksize);
+    uint64_t i, n = 0, nfreed = 0, len, plen, k, end, from, step = U64_MAX, room = ASSOOFS_RELEASE_CHUNK(sb->s_blocksize);
+    struct assoofs_extent *ext, *out, *freed, *e, *last;
+    int ret;
+
+    ext = kmalloc_array(3 * max, sizeof(*ext), GFP_NOFS);
+    if (!ext)
+        return -ENOMEM;
+    out = ext + max;
+    freed = out + max;
+    ret = assoofs_load_extents(sb, inode_info, ext);
+    if (ret)
+        goto out;
+
+    // Hasta donde se quita en esta llamada (step): se van tomando extents desde el final mientras quepan. Del ultimo
+    // que no cabe entero se toman los bloques (o clusters) del final que quepan
+    for (k = 0; k < ASSOOFS_RELEASE_EXTENTS; k++)
+    {
+        last = NULL;
+        for (i = 0; i < inode_info->extent_count; i++)
+        {
+            e = &ext[i];
+            end = e->ee_block + ASSOOFS_EXTENT_LEN(e->ee_len);
+            if (end > cut && end <= step && (!last || e->ee_block > last->ee_block))
+                last = e;
+        }
+        if (!last)
+        {
+            step = cut;
+            break;
+        }
+
+        len = ASSOOFS_EXTENT_LEN(last->ee_len);
+        end = last->ee_block + len;
+        from = max(cut, last->ee_block);
+        if (last->ee_len & ASSOOFS_EXTENT_COMPRESSED)
+        {
+            plen = max_t(uint64_t, ASSOOFS_EXTENT_PLEN(last->ee_len), 1);
+            if (div64_u64(end - from, cb) * plen > room)
+                from = end - div64_u64(room, plen) * cb;
+            room -= div64_u64(end - from, cb) * plen;
+        }
+        else
+        {
+            if (end - from > room)
+            {
+                from = end - room;
+                if (inode_info->flags & ASSOOFS_INODE_COMPRESSED)
+                    from = min(round_up(from, cb), end);
+            }
+            room -= end - from;
+        }
+        if (from == end)
+            break;
+        step = from;
+        if (from > max(cut, last->ee_block) || !room)
+            break;
+    }
+
+    for (i = 0; i < inode_info->extent_count; i++)
+    {
+        e = &ext[i];
+        len = ASSOOFS_EXTENT_LEN(e->ee_len);
+        if (e->ee_block + len <= step)
+            out[n++] = *e;
+        else if (e->ee_block >= step)
+            freed[nfreed++] = *e;
+        else if (e->ee_len & ASSOOFS_EXTENT_COMPRESSED)
+        {
+            // Los clusters de delante siguen en sus bloques
+            plen = ASSOOFS_EXTENT_PLEN(e->ee_len);
+            k = div_u64(step - e->ee_block, cb);
+            out[n++] = (struct assoofs_extent){e->ee_block, ASSOOFS_EXTENT_MAKE_COMPRESSED(k * cb, plen), e->ee_start};
+            freed[nfreed++] = (struct assoofs_extent){step, ASSOOFS_EXTENT_MAKE_COMPRESSED(len - k * cb, plen), e->ee_start + k * plen};
+        }
+        else
+        {
+            out[n++] = (struct assoofs_extent){e->ee_block, step - e->ee_block, e->ee_start};
+            freed[nfreed++] = (struct assoofs_extent){step, e->ee_block + len - step, e->ee_start + (step - e->ee_block)};
+        }
+    }
+
+    if (nfreed)
+    {
+        ret = assoofs_store_extents(sb, inode_info, out, n);
+        if (!ret)
+            assoofs_release_extents(sb, freed, nfreed);
+    }
+    if (!ret && nfreed && step > cut)
+        ret = 1;
+out:
+    kfree(ext);
+    return ret;
+}
+
+// Deja el fichero en size bytes. El llamador tiene i_rwsem
+static int assoofs_truncate(struct inode *inode, loff_t size)
+{
+    struct super_block *sb = inode->i_sb;
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    struct assoofs_cluster_buf *cbuf = NULL;
+    uint64_t bs = sb->s_blocksize, cb = ASSOOFS_CLUSTER_BLOCKS(bs), cut, cluster = 0, block, count;
+    loff_t old = i_size_read(inode);
+    int ret;
+
+    if (size > old)
+    {
+        if (assoofs_is_inline(ai) && size > ASSOOFS_INLINE_DATA_MAX)
+        {
+            ret = assoofs_inline_to_blocks(inode);
+            if (ret)
+                return ret;
+        }
+        truncate_setsize(inode, size);
+        ret = assoofs_save_file_size(inode);
+        if (!sbi->writeback && assoofs_journal_commit_all(sb) && !ret)
+            ret = -EIO;
+        return ret;
+    }
+
+    if (!assoofs_is_compressed(ai))
+    {
+        ret = assoofs_zero_range(inode, size, min_t(loff_t, round_up(size, bs), old));
+        if (ret)
+            return ret;
+    }
+    truncate_setsize(inode, size);
+
+    if (assoofs_is_compressed(ai))
+    {
+        cluster = div_u64(size, ASSOOFS_CLUSTER_SIZE);
+        cut = DIV_ROUND_UP(size, ASSOOFS_CLUSTER_SIZE) * cb;
+        if (size % ASSOOFS_CLUSTER_SIZE)
+            cbuf = assoofs_cluster_buf_get(sb);
+    }
+    else
+        cut = DIV_ROUND_UP(size, bs);
+
+    // Primero el tamannio nuevo. El cluster del final se vuelve a comprimir con lo que queda a cero detras del final,
+    // salvo que sea un hueco
+    ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS);
+    if (ret)
+        goto out;
+    down_write(&ai->map_sem);
+    ai->info.file_size = size;
+    if (cbuf)
+    {
+        ret = assoofs_map_block(sb, &ai->info, cluster * cb, &block, &count);
+        if (!ret && (block || count < cb))
+        {
+            ret = assoofs_read_cluster(inode, cluster, cbuf);
+            if (!ret)
+                ret = assoofs_write_cluster(inode, cluster, cbuf);
+        }
+    }
+    if (!ret)
+        ret = assoofs_save_inode_info(sb, &ai->info);
+    up_write(&ai->map_sem);
+    assoofs_journal_stop_nowait(sb);
+
+    // Despues los bloques de detras, desde el final y por tramos, cada uno en su transaccion como en
+    // assoofs_clone_blocks: los de un fichero grande no caben en una. Si se corta la luz a medias el fichero ya tiene
+    // su tamannio y solo le quedan bloques detras del final
+    while (!ret && !assoofs_is_inline(ai))
+    {
+        ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS + ASSOOFS_RELEASE_BLOCKS(bs));
+        if (ret)
+            break;
+        down_write(&ai->map_sem);
+        ret = assoofs_truncate_extents(sb, &ai->info, cut);
+        up_write(&ai->map_sem);
+        assoofs_journal_stop_nowait(sb);
+        if (ret <= 0)
+            break;
+        ret = 0;
+    }
+
+    if (!sbi->writeback && assoofs_journal_commit_all(sb) && !ret)
+        ret = -EIO;
+out:
+    if (cbuf)
+        assoofs_cluster_buf_put(sb, cbuf);
+    return ret;
+}
+
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr)
+{
+    struct inode *inode = d_inode(dentry);
+    int ret;
+
+    ret = setattr_prepare(mnt_userns, dentry, attr);
+    if (ret)
+        return ret;
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode))
+    {
+        inode_dio_wait(inode);
+        ret = assoofs_truncate(inode, attr->ia_size);
+        if (ret)
+            return ret;
+    }
+
+    setattr_copy(mnt_userns, inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+/*
+ *  Contenido de los directorios. Un directorio pequenio guarda sus entradas en un unico bloque, una detras de otra
+ *  (formato lineal, el de siempre). Cuando ese bloque se llena el directorio se convierte en indexado: el bloque
+ *  logico 0 pasa a ser un indice ordenado por hash del nombre (assoofs_dx_root) y las entradas se reparten en hojas,
+ *  de forma que buscar un nombre lee el indice y una sola hoja. Si el indice se llena pasa a tener dos niveles
+ *  (assoofs_dx_grow) y la busqueda lee ademas un nodo intermedio. Los directorios lineales se siguen leyendo igual.
+ *  Dentro de cada bloque las entradas pueden ser las fijas de siempre (v1) o las de longitud variable (v2, con
+ *  ASSOOFS_INODE_DIR_V2); solo assoofs_dir_next y las funciones assoofs_dir_block_* conocen la diferencia. Estan en
+ *  assoofs.h porque libassoofs las usa tambien
+ */
+
+// Lee el bloque logico lblk del directorio
+static struct buffer_head *assoofs_dir_bread(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t lblk)
+{
+    uint64_t block, count;
+
+    if (assoofs_map_block(sb, dir_info, lblk, &block, &count) || !block)
+        return NULL;
+    return assoofs_bread(sb, block);
+}
+
+// Deja vacio el bloque logico lblk del directorio. Si aun no tiene bloque se reserva un tramo contiguo para el y los
+// siguientes (assoofs_dir_prealloc) detras del bloque logico anterior: asi las hojas no acaban cada una en su extent
+// cuando se crean ficheros entre medias. Si no hay un tramo tan largo libre se prueba con uno de la mitad
+static struct buffer_head *assoofs_dir_new_block(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t lblk)
+{
+    struct buffer_head *bh;
+    uint64_t block, count, n, hint = 0;
+    int ret;
+
+    if (assoofs_map_block(sb, dir_info, lblk, &block, &count))
+        return NULL;
+    if (!block)
+    {
+        n = min(assoofs_dir_prealloc(lblk), count);
+        if (lblk && !assoofs_map_block(sb, dir_info, lblk - 1, &hint, &count) && hint)
+            hint++;
+        while ((ret = assoofs_alloc_run(sb, dir_info->inode_no, n, hint, &block)) == -ENOSPC && n > 1)
+            n /= 2;
+        if (ret)
+            return NULL;
+        if (assoofs_add_extent(sb, dir_info, lblk, block, n))
+        {
+            assoofs_bitmap_release(sb, block, n);
+            assoofs_save_sb_info(sb);
+            return NULL;
+        }
+    }
+
+    bh = sb_getblk(sb, block);
+    lock_buffer(bh);
+    assoofs_dir_block_init(dir_info, bh->b_data, sb->s_blocksize);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    return bh;
+}
+
+// Busca name (de longitud len) en un bloque del directorio
+static bool assoofs_dir_block_find(struct super_block *sb, struct assoofs_inode_info *dir_info, char *data, const char *name, unsigned int len, uint64_t *inode_no)
+{
+    struct assoofs_dirent de;
+    unsigned int offset = 0, limit = assoofs_dir_limit(dir_info, sb->s_blocksize);
+
+    while (assoofs_dir_next(dir_info, data, limit, &offset, &de))
+    {
+        if (de.len == len && !memcmp(de.name, name, len))
+        {
+            *inode_no = de.inode_no;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lee el indice de un directorio indexado comprobando que tiene sentido
+static struct buffer_head *assoofs_dx_bread_root(struct super_block *sb, struct assoofs_inode_info *dir_info)
+{
+    struct buffer_head *bh = assoofs_dir_bread(sb, dir_info, 0);
+    struct assoofs_dx_root *root;
+
+    if (!bh)
+        return NULL;
+
+    root = (struct assoofs_dx_root *)bh->b_data;
+    if (!assoofs_dx_valid(root, sb->s_blocksize, true))
+    {
+        printk(KERN_ERR "Corrupted directory index in inode %llu\n", dir_info->inode_no);
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+// Lee el nodo intermedio del indice que esta en el bloque logico lblk comprobando que tiene sentido
+static struct buffer_head *assoofs_dx_bread_node(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t lblk)
+{
+    struct buffer_head *bh = NULL;
+
+    if (lblk >= ASSOOFS_DX_NODE_BASE)
+        bh = assoofs_dir_bread(sb, dir_info, lblk);
+    if (bh && !assoofs_dx_valid((struct assoofs_dx_root *)bh->b_data, sb->s_blocksize, false))
+    {
+        brelse(bh);
+        bh = NULL;
+    }
+    if (!bh)
+        printk(KERN_ERR "Corrupted directory index in inode %llu\n", dir_info->inode_no);
+    return bh;
+}
+
+// Camino por el indice hasta la hoja de un hash: la raiz y, si el indice tiene dos niveles, el nodo intermedio.
+// index[i] es la entrada de bh[i] que se sigue y el ultimo bloque del camino es el que apunta a la hoja
+struct assoofs_dx_path {
+    struct buffer_head *bh[2];
+    uint64_t index[2];
+    int depth;
+};
+
+static inline struct assoofs_dx_root *assoofs_dx_at(struct assoofs_dx_path *path, int level)
+{
+    return (struct assoofs_dx_root *)path->bh[level]->b_data;
+}
+
+// Bloque logico de la hoja a la que lleva el camino
+static inline uint64_t assoofs_dx_path_leaf(struct assoofs_dx_path *path)
+{
+    return assoofs_dx_at(path, path->depth - 1)->entries[path->index[path->depth - 1]].block;
+}
+
+static void assoofs_dx_path_release(struct assoofs_dx_path *path)
+{
+    brelse(path->bh[0]);
+    brelse(path->bh[1]);
+}
+
+// Baja por el indice siguiendo hash y deja el camino en path (el llamador lo suelta con assoofs_dx_path_release)
+static int assoofs_dx_walk(struct super_block *sb, struct assoofs_inode_info *dir_info, uint64_t hash, struct assoofs_dx_path *path)
+{
+    struct assoofs_dx_root *root;
+
+    path->bh[1] = NULL;
+    path->bh[0] = assoofs_dx_bread_root(sb, dir_info);
+    if (!path->bh[0])
+        return -EIO;
+    root = assoofs_dx_at(path, 0);
+    path->index[0] = assoofs_dx_find(root, hash);
+    path->depth = 1;
+    if (!root->levels)
+        return 0;
+
+    path->bh[1] = assoofs_dx_bread_node(sb, dir_info, root->entries[path->index[0]].block);
+    if (!path->bh[1])
+    {
+        brelse(path->bh[0]);
+        return -EIO;
+    }
+    path->index[1] = assoofs_dx_find(assoofs_dx_at(path, 1), hash);
+    path->depth = 2;
+    return 0;
+}
+
+// Lee el bloque del directorio donde esta (o iria) el nombre name de longitud len
+static struct buffer_head *assoofs_dir_bread_leaf(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, unsigned int len)
+{
+    struct assoofs_dx_path path;
+    uint64_t leaf = 0;
+
+    if (dir_info->flags & ASSOOFS_INODE_DIR_INDEX)
+    {
+        // Indexado: el hash del nombre dice en que hoja esta
+        if (assoofs_dx_walk(sb, dir_info, assoofs_name_hash(name, len), &path))
+            return NULL;
+        leaf = assoofs_dx_path_leaf(&path);
+        assoofs_dx_path_release(&path);
+    }
+
+    // Lineal: todas las entradas estan en el bloque 0 del directorio
+    return assoofs_dir_bread(sb, dir_info, leaf);
+}
+
+/*
+ *   Busca una entrada del directorio por nombre y devuelve su numero de inodo
+ */
+
+static int assoofs_find_dir_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, uint64_t *inode_no)
+{
+    struct buffer_head *bh;
+    unsigned int len = strlen(name);
+    bool found;
+
+    bh = assoofs_dir_bread_leaf(sb, dir_info, name, len);
+    if (!bh)
+        return -EIO;
+    found = assoofs_dir_block_find(sb, dir_info, bh->b_data, name, len, inode_no);
+    brelse(bh);
+    return found ? 0 : -ENOENT;
+}
+
+// Comparar hashes para ordenarlos con sort()
+static int assoofs_cmp_hash(const void *a, const void *b)
+{
+    uint64_t ha = *(const uint64_t *)a, hb = *(const uint64_t *)b;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+// Convierte un directorio lineal lleno en indexado: sus entradas pasan a la hoja 1 y el bloque 0 al indice
+static int assoofs_dx_convert(struct super_block *sb, struct assoofs_inode_info *dir_info)
+{
+    struct buffer_head *root_bh, *leaf_bh;
+    struct assoofs_dx_root *root;
+
+    printk(KERN_INFO "Indexing directory %llu\n", dir_info->inode_no);
+
+    root_bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!root_bh)
+        return -EIO;
+    leaf_bh = assoofs_dir_new_block(sb, dir_info, 1);
+    if (!leaf_bh)
+    {
+        brelse(root_bh);
+        return -ENOSPC;
+    }
+
+    // Primero la hoja con las entradas y despues el indice que apunta a ella. En v1 solo se copian los huecos
+    // ocupados: el resto del bloque de un directorio antiguo puede no estar a cero
+    memcpy(leaf_bh->b_data, root_bh->b_data, assoofs_dir_limit(dir_info, sb->s_blocksize));
+    assoofs_dirty_bh(sb, leaf_bh);
+    brelse(leaf_bh);
+
+    memset(root_bh->b_data, 0, sb->s_blocksize);
+    root = (struct assoofs_dx_root *)root_bh->b_data;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    assoofs_dirty_bh(sb, root_bh);
+    brelse(root_bh);
+
+    dir_info->flags |= ASSOOFS_INODE_DIR_INDEX;
+    return 0;
+}
+
+// Activa la caracteristica feature en el superbloque dentro de la transaccion en curso, junto con el primer cambio
+// que la necesita
+static void assoofs_set_feature(struct super_block *sb, uint64_t feature)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    if (READ_ONCE(sbi->disk->features) & feature)
+        return;
+    spin_lock(&sbi->lock);
+    sbi->disk->features |= feature;
+    memcpy(sbi->sb_bh->b_data, sbi->disk, sizeof(struct assoofs_super_block_info));
+    spin_unlock(&sbi->lock);
+    assoofs_dirty_bh(sb, sbi->sb_bh);
+}
+
+// Deja sitio para una entrada mas en el bloque del indice que apunta a la hoja de hash. Si es la raiz de un indice de
+// un nivel, todas sus entradas bajan al primer nodo intermedio y el indice pasa a tener dos niveles; un nodo
+// intermedio lleno se parte y la mitad de arriba va a un nodo nuevo que se apunta en la raiz. path queda apuntando
+// al bloque donde va hash. El limite es ASSOOFS_DX_LIMIT nodos de ASSOOFS_DX_LIMIT hojas
+static int assoofs_dx_grow(struct super_block *sb, struct assoofs_inode_info *dir_info, struct assoofs_dx_path *path, uint64_t hash)
+{
+    struct assoofs_dx_root *root = assoofs_dx_at(path, 0), *node;
+    struct buffer_head *new_bh;
+    uint64_t lblk, mid, split, limit = ASSOOFS_DX_LIMIT(sb->s_blocksize);
+
+    if (assoofs_dx_at(path, path->depth - 1)->count < limit)
+        return 0;
+
+    if (path->depth == 1)
+    {
+        new_bh = assoofs_dir_new_block(sb, dir_info, ASSOOFS_DX_NODE_LBLK(0));
+        if (!new_bh)
+            return -ENOSPC;
+        memcpy(new_bh->b_data, root, sb->s_blocksize);
+        assoofs_dirty_bh(sb, new_bh);
+
+        printk(KERN_INFO "Directory %llu index has two levels\n", dir_info->inode_no);
+        assoofs_set_feature(sb, ASSOOFS_FEATURE_DX_TREE);
+        root->leaves = root->count;
+        root->levels = 1;
+        root->count = 1;
+        memset(root->entries, 0, limit * sizeof(struct assoofs_dx_entry));
+        root->entries[0].block = ASSOOFS_DX_NODE_LBLK(0);
+        assoofs_dirty_bh(sb, path->bh[0]);
+
+        path->bh[1] = new_bh;
+        path->index[1] = path->index[0];
+        path->index[0] = 0;
+        path->depth = 2;
+    }
+
+    if (root->count >= limit)
+    {
+        printk(KERN_INFO "Directory %llu index is full\n", dir_info->inode_no);
+        return -ENOSPC;
+    }
+
+    // Los nodos tambien se numeran seguidos: el nuevo va detras del ultimo
+    lblk = ASSOOFS_DX_NODE_LBLK(root->count);
+    new_bh = assoofs_dir_new_block(sb, dir_info, lblk);
+    if (!new_bh)
+        return -ENOSPC;
+    node = assoofs_dx_at(path, 1);
+    mid = node->count / 2;
+    split = node->entries[mid].hash;
+    memset(new_bh->b_data, 0, sb->s_blocksize);
+    ((struct assoofs_dx_root *)new_bh->b_data)->count = node->count - mid;
+    memcpy(((struct assoofs_dx_root *)new_bh->b_data)->entries, &node->entries[mid], (node->count - mid) * sizeof(struct assoofs_dx_entry));
+    node->count = mid;
+    assoofs_dirty_bh(sb, new_bh);
+    assoofs_dirty_bh(sb, path->bh[1]);
+
+    memmove(&root->entries[path->index[0] + 2], &root->entries[path->index[0] + 1], (root->count - path->index[0] - 1) * sizeof(struct assoofs_dx_entry));
+    root->entries[path->index[0] + 1].hash = split;
+    root->entries[path->index[0] + 1].block = lblk;
+    root->count++;
+    assoofs_dirty_bh(sb, path->bh[0]);
+
+    if (hash >= split)
+    {
+        swap(path->bh[1], new_bh);
+        path->index[0]++;
+    }
+    brelse(new_bh);
+    path->index[1] = assoofs_dx_find(assoofs_dx_at(path, 1), hash);
+    return 0;
+}
+
+// Entradas que puede tener como mucho un bloque de directorio, en cualquiera de los dos formatos
+#define ASSOOFS_DIR_MAX_ENTRIES(bs) ((bs) / ASSOOFS_DIR_V2_REC_LEN(1))
+
+// Parte la hoja a la que lleva path, que esta llena, moviendo la mitad superior de sus hashes a una hoja nueva.
+// Devuelve en *leaf_bh la hoja donde debe ir un nombre con hash hash
+static int assoofs_dx_split(struct super_block *sb, struct assoofs_inode_info *dir_info, struct assoofs_dx_path *path, struct buffer_head **leaf_bh, uint64_t hash)
+{
+    struct assoofs_dx_root *root = assoofs_dx_at(path, 0), *parent;
+    struct assoofs_dirent de;
+    struct buffer_head *new_bh;
+    unsigned int offset = 0;
+    uint64_t *hashes, split, new_lblk, index, i, n = 0;
+    char *data = (*leaf_bh)->b_data;
+    int ret;
+
+    hashes = kmalloc_array(ASSOOFS_DIR_MAX_ENTRIES(sb->s_blocksize), sizeof(uint64_t), GFP_KERNEL);
+    if (!hashes)
+        return -ENOMEM;
+    while (n < ASSOOFS_DIR_MAX_ENTRIES(sb->s_blocksize) && assoofs_dir_next(dir_info, data, sb->s_blocksize, &offset, &de))
+        hashes[n++] = assoofs_name_hash(de.name, de.len);
+    if (n < 2)
+    {
+        // Con una entrada (nombres largos en bloques pequennos) no hay por donde partir la hoja
+        kfree(hashes);
+        return -ENOSPC;
+    }
+    sort(hashes, n, sizeof(uint64_t), assoofs_cmp_hash, NULL);
+
+    // El corte tiene que caer entre dos hashes distintos para que cada hash este en una sola hoja: se busca el mas
+    // cercano a la mitad
+    for (i = n / 2; i < n && hashes[i] == hashes[i - 1]; i++)
+        ;
+    if (i == n)
+        for (i = n / 2 - 1; i > 0 && hashes[i] == hashes[i - 1]; i--)
+            ;
+    split = hashes[i];
+    kfree(hashes);
+    if (i == 0)
+        return -ENOSPC; // Todos los nombres de la hoja tienen el mismo hash
+
+    ret = assoofs_dx_grow(sb, dir_info, path, hash);
+    if (ret)
+        return ret;
+    parent = assoofs_dx_at(path, path->depth - 1);
+    index = path->index[path->depth - 1];
+
+    // Las hojas se numeran seguidas: la nueva va detras de la ultima
+    new_lblk = assoofs_dx_leaves(root) + 1;
+    new_bh = assoofs_dir_new_block(sb, dir_info, new_lblk);
+    if (!new_bh)
+        return -ENOSPC;
+
+    // Las entradas que se quedan no se mueven de sitio: un readdir a medias de esta hoja no se salta ninguna
+    offset = 0;
+    while (assoofs_dir_next(dir_info, data, sb->s_blocksize, &offset, &de))
+    {
+        if (assoofs_name_hash(de.name, de.len) < split)
+            continue;
+        assoofs_dir_block_add(dir_info, new_bh->b_data, sb->s_blocksize, &de);
+        assoofs_dir_block_del(dir_info, data, &de);
+    }
+    assoofs_dirty_bh(sb, new_bh);
+    assoofs_dirty_bh(sb, *leaf_bh);
+
+    // Insertar la hoja nueva en el indice justo despues de la que se ha partido
+    memmove(&parent->entries[index + 2], &parent->entries[index + 1], (parent->count - index - 1) * sizeof(struct assoofs_dx_entry));
+    parent->entries[index + 1].hash = split;
+    parent->entries[index + 1].block = new_lblk;
+    parent->count++;
+    assoofs_dirty_bh(sb, path->bh[path->depth - 1]);
+    if (root->levels)
+    {
+        root->leaves++;
+        assoofs_dirty_bh(sb, path->bh[0]);
+    }
+
+    if (hash >= split)
+        swap(*leaf_bh, new_bh);
+    brelse(new_bh);
+    return 0;
+}
+
+// Annade una entrada a un directorio indexado
+static int assoofs_dx_add(struct super_block *sb, struct assoofs_inode_info *dir_info, const struct assoofs_dirent *de)
+{
+    struct buffer_head *leaf_bh;
+    struct assoofs_dx_path path;
+    uint64_t hash = assoofs_name_hash(de->name, de->len);
+    int ret;
+
+    ret = assoofs_dx_walk(sb, dir_info, hash, &path);
+    if (ret)
+        return ret;
+
+    leaf_bh = assoofs_dir_bread(sb, dir_info, assoofs_dx_path_leaf(&path));
+    if (!leaf_bh)
+    {
+        assoofs_dx_path_release(&path);
+        return -EIO;
+    }
+
+    // Si la hoja esta llena se parte en dos. Con entradas v2 de tamannos muy distintos puede que la mitad que le toca
+    // siga sin tener sitio, asi que se repite hasta que quepa o no se pueda partir mas
+    while ((ret = assoofs_dir_block_add(dir_info, leaf_bh->b_data, sb->s_blocksize, de)) == -ENOSPC)
+    {
+        ret = assoofs_dx_split(sb, dir_info, &path, &leaf_bh, hash);
+        if (ret)
+            break;
+        path.index[path.depth - 1] = assoofs_dx_find(assoofs_dx_at(&path, path.depth - 1), hash);
+    }
+    if (!ret)
+        assoofs_dirty_bh(sb, leaf_bh);
+
+    brelse(leaf_bh);
+    assoofs_dx_path_release(&path);
+    return ret;
+}
+
+static inline bool assoofs_dir_is_linear_v1(struct assoofs_inode_info *dir_info)
+{
+    return !(dir_info->flags & (ASSOOFS_INODE_DIR_INDEX | ASSOOFS_INODE_DIR_V2));
+}
+
+/*
+ *   Compacta un directorio lineal v1: las entradas que quedan se juntan al principio del bloque, en el mismo orden,
+ *   y dir_children_count vuelve a ser el numero de entradas. Lo llama assoofs_reclaim despues de varios unlink, y create
+ *   si el bloque se llena antes. Las entradas que se mueven pueden no salir en un readdir que ya hubiera pasado por su
+ *   nuevo hueco; un directorio lineal cabe entero en un getdents, asi que en la practica no pasa. Devuelve true si ha
+ *   quedado sitio libre
+ */
+
+static bool assoofs_dir_compact(struct super_block *sb, struct assoofs_inode_info *dir_info)
+{
+    struct buffer_head *bh;
+    struct assoofs_dir_record_entry *records;
+    uint64_t i, n, count = min_t(uint64_t, dir_info->dir_children_count, ASSOOFS_DIR_RECORDS_PER_BLOCK(sb->s_blocksize));
+
+    if (!assoofs_dir_is_linear_v1(dir_info))
+        return false; // Se ha indexado despues del unlink: los huecos de las hojas se reutilizan solos
+
+    bh = assoofs_dir_bread(sb, dir_info, 0);
+    if (!bh)
+        return false;
+    records = (struct assoofs_dir_record_entry *)bh->b_data;
+    for (i = n = 0; i < count; i++)
+    {
+        if (!records[i].inode_no)
+            continue;
+        if (i != n)
+            records[n] = records[i];
+        n++;
+    }
+
+    // Si ya estaba compacto (otra entrada de la cola o un create lo han hecho antes) no se escribe nada
+    if (n != dir_info->dir_children_count)
+    {
+        memset(records + n, 0, (count - n) * sizeof(*records));
+        assoofs_dirty_bh(sb, bh);
+        dir_info->dir_children_count = n;
+        assoofs_save_inode_info(sb, dir_info);
+    }
+    brelse(bh);
+    return n < count;
+}
+
+/*
+ *   Annade la entrada <name, inode_no> al directorio y actualiza su informacion persistente
+ */
+
+static int assoofs_add_dir_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, uint64_t inode_no, umode_t mode)
+{
+    struct buffer_head *bh;
+    struct assoofs_dirent de = {
+        .name = name,
+        .len = strlen(name),
+        .inode_no = inode_no,
+        .type = fs_umode_to_ftype(mode),
+    };
+    int ret;
+
+    if (!(dir_info->flags & ASSOOFS_INODE_DIR_INDEX))
+    {
+        // Mientras quepa en el bloque del directorio se annade ahi como siempre
+        bh = assoofs_dir_bread(sb, dir_info, 0);
+        if (!bh)
+            return -EIO;
+        ret = assoofs_dir_block_add(dir_info, bh->b_data, sb->s_blocksize, &de);
+        // Si esta lleno pero tiene huecos de unlink que aun no se han compactado se compacta ya y cabe sin indexar
+        if (ret == -ENOSPC && assoofs_dir_compact(sb, dir_info))
+            ret = assoofs_dir_block_add(dir_info, bh->b_data, sb->s_blocksize, &de);
+        if (!ret)
+            assoofs_dirty_bh(sb, bh);
+        brelse(bh);
+        if (!ret)
+            goto out;
+        if (ret != -ENOSPC)
+            return ret;
+
+        ret = assoofs_dx_convert(sb, dir_info);
+        if (ret)
+            return ret;
+    }
+
+    ret = assoofs_dx_add(sb, dir_info, &de);
+    if (ret)
+    {
+        assoofs_save_inode_info(sb, dir_info); // Puede haber cambiado el mapa de bloques del directorio
+        return ret;
+    }
+
+out:
+    // Actualizar la información persistente del inodo padre indicando que ahora tiene un archivo más
+    dir_info->dir_children_count++;
+    assoofs_save_inode_info(sb, dir_info);
+    return 0;
+}
+
+/*
+ *   Quita del directorio la entrada <name, inode_no>. Es la parte rapida del borrado y solo toca el bloque de la
+ *   entrada: en v1 el registro se queda en su sitio vacio y marcado como borrado, y en v2 pasa a ser hueco del
+ *   anterior. En un directorio lineal v1 los huecos no se reutilizan (las entradas se annaden al final), asi que el
+ *   directorio se apunta para que assoofs_dir_compact lo compacte en segundo plano
+ */
+
+static int assoofs_remove_dir_entry(struct super_block *sb, struct assoofs_inode_info *dir_info, const char *name, uint64_t inode_no)
+{
+    struct buffer_head *bh;
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dirent de;
+    unsigned int len = strlen(name), offset = 0, limit = assoofs_dir_limit(dir_info, sb->s_blocksize);
+    bool found = false;
+
+    bh = assoofs_dir_bread_leaf(sb, dir_info, name, len);
+    if (!bh)
+        return -EIO;
+    while (!found && assoofs_dir_next(dir_info, bh->b_data, limit, &offset, &de))
+        found = de.len == len && !memcmp(de.name, name, len) && de.inode_no == inode_no;
+    if (!found)
+    {
+        brelse(bh);
+        return -ENOENT;
+    }
+
+    if (!assoofs_dir_is_v2(dir_info))
+    {
+        record = (struct assoofs_dir_record_entry *)(bh->b_data + de.offset);
+        record->inode_no = 0;
+        record->remove_flag = REMOVED;
+    }
+    else
+        assoofs_dir_block_del(dir_info, bh->b_data, &de);
+    assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+
+    // En un directorio lineal v1 dir_children_count son los huecos ocupados del bloque, y el borrado tambien ocupa
+    // el suyo hasta que se compacta
+    if (assoofs_dir_is_linear_v1(dir_info))
+        assoofs_reclaim_queue(sb, dir_info->inode_no, true);
+    else
+        dir_info->dir_children_count--;
+    return assoofs_save_inode_info(sb, dir_info);
+}
+
+/*
+ *   Comprueba que el directorio no tiene ninguna entrada (rmdir). Devuelve 0 si esta vacio y -ENOTEMPTY si no
+ */
+
+static int assoofs_dir_empty(struct super_block *sb, struct assoofs_inode_info *dir_info)
+{
+    struct buffer_head *bh;
+    struct assoofs_dirent de;
+    unsigned int offset, limit = assoofs_dir_limit(dir_info, sb->s_blocksize);
+    uint64_t lblk = 0, last = 0;
+    bool found;
+
+    // En un directorio indexado se miran todas las hojas; en uno lineal solo el bloque 0
+    if (dir_info->flags & ASSOOFS_INODE_DIR_INDEX)
+    {
+        bh = assoofs_dx_bread_root(sb, dir_info);
+        if (!bh)
+            return -EIO;
+        lblk = 1;
+        last = assoofs_dx_leaves((struct assoofs_dx_root *)bh->b_data);
+        brelse(bh);
+    }
+
+    for (; lblk <= last; lblk++)
+    {
+        bh = assoofs_dir_bread(sb, dir_info, lblk);
+        if (!bh)
+            return -EIO;
+        offset = 0;
+        found = assoofs_dir_next(dir_info, bh->b_data, limit, &offset, &de);
+        brelse(bh);
+        if (found)
+            return -ENOTEMPTY;
+    }
+    return 0;
+}
+
+/*
+ *  Operaciones sobre directorios
+ */
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx);
+const struct file_operations assoofs_dir_operations = {
+    .owner = THIS_MODULE,
+    .llseek = generic_file_llseek,
+    .read = generic_read_dir,
+    .iterate_shared = assoofs_iterate,
+};
+
+// Posicion de readdir de un registro: 0 y 1 son . y .., y despues el bloque logico y el desplazamiento dentro de el.
+// Asi un getdents que no cabe en el buffer del usuario sigue en la siguiente llamada donde lo dejo
+#define ASSOOFS_DIR_POS(sb, lblk, offset) (2 + (loff_t)(lblk) * (sb)->s_blocksize + (offset))
+
+// Pasa a ctx las entradas del bloque logico lblk desde ctx->pos. Devuelve false si ctx no admite mas
+static bool assoofs_dir_block_emit(struct super_block *sb, struct assoofs_inode_info *dir_info, char *data, uint64_t lblk, struct dir_context *ctx)
+{
+    struct assoofs_dirent de;
+    unsigned int offset = 0, limit = assoofs_dir_limit(dir_info, sb->s_blocksize);
+
+    while (assoofs_dir_next(dir_info, data, limit, &offset, &de))
+    {
+        if (ASSOOFS_DIR_POS(sb, lblk, de.offset) < ctx->pos)
+            continue;
+        ctx->pos = ASSOOFS_DIR_POS(sb, lblk, de.offset);
+        if (!dir_emit(ctx, de.name, de.len, de.inode_no, fs_ftype_to_dtype(de.type)))
+            return false;
+    }
+    ctx->pos = ASSOOFS_DIR_POS(sb, lblk + 1, 0);
+    return true;
+}
+
+// Recorre las hojas de un directorio indexado desde ctx->pos. Van por numero de bloque y no en el orden del indice:
+// una hoja nueva siempre se annade al final, asi que si se parte una hoja durante el readdir las entradas que se
+// mueven pueden salir dos veces, pero ninguna se pierde
+static int assoofs_dx_iterate(struct super_block *sb, struct assoofs_inode_info *dir_info, struct dir_context *ctx)
+{
+    struct buffer_head *root_bh, *bh;
+    uint64_t lblk, count;
+    bool more = true;
+
+    root_bh = assoofs_dx_bread_root(sb, dir_info);
+    if (!root_bh)
+        return -EIO;
+    count = assoofs_dx_leaves((struct assoofs_dx_root *)root_bh->b_data);
+    brelse(root_bh);
+
+    for (lblk = max_t(uint64_t, 1, div_u64(ctx->pos - 2, sb->s_blocksize)); more && lblk <= count; lblk++)
+    {
+        bh = assoofs_dir_bread(sb, dir_info, lblk);
+        if (!bh)
+            return -EIO;
+        more = assoofs_dir_block_emit(sb, dir_info, bh->b_data, lblk, ctx);
+        brelse(bh);
+    }
+    return 0;
+}
+
+static int __assoofs_iterate(struct file *filp, struct dir_context *ctx)
+{
+    struct inode *inode;
+    struct super_block *sb;
+    struct assoofs_inode_info *inode_info;
+    struct buffer_head *bh;
+
+    assoofs_dbg("Iterate request\n");
+
+    // Acceder al inodo, informacion persistente del inodo y superbloque correspondientes del contexto
+    inode = file_inode(filp);
+    sb = inode->i_sb;
+    inode_info = ASSOOFS_INODE(inode);
+
+    // Comprobar que el inodo del primer paso corresponde con el contexto
+    if ((!S_ISDIR(inode_info->mode))) return -ENOTDIR;
+
+    // . y .. primero; si el buffer no da ni para eso se sigue en la siguiente llamada
+    if (!dir_emit_dots(filp, ctx))
+        return 0;
+
+    // Accedemos a los bloques donde se almacena el contenido del directorio y seguimos llenando el contexto
+    // desde la posicion en la que se quedo
+    if (inode_info->flags & ASSOOFS_INODE_DIR_INDEX)
+        return assoofs_dx_iterate(sb, inode_info, ctx);
+
+    if (ctx->pos >= ASSOOFS_DIR_POS(sb, 1, 0))
+        return 0; // Ya se devolvio todo el bloque
+
+    bh = assoofs_dir_bread(sb, inode_info, 0);
+    if (!bh)
+        return -EIO;
+    assoofs_dir_block_emit(sb, inode_info, bh->b_data, 0, ctx);
+    brelse(bh);
+
+    // Todo ha ido bien
+    return 0;
+}
+
+static int assoofs_iterate(struct file *filp, struct dir_context *ctx)
+{
+    u64 start = ktime_get_ns();
+    int ret = __assoofs_iterate(filp, ctx);
+
+    assoofs_stat_op(file_inode(filp)->i_sb, ASSOOFS_OP_ITERATE, start);
+    return ret;
+}
+
+/*
+ *  Operaciones sobre inodos
+ */
+static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl);
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags);
+static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode);
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry);
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry);
+static int assoofs_setattr(struct user_namespace *mnt_userns, struct dentry *dentry, struct iattr *attr);
+static struct inode_operations assoofs_inode_ops = {
+    .create = assoofs_create,
+    .lookup = assoofs_lookup,
+    .mkdir = assoofs_mkdir,
+    .unlink = assoofs_unlink,
+    .rmdir = assoofs_rmdir,
+    .setattr = assoofs_setattr,
+};
+
+/*
+ *   Permitira obtener un puntero a la informacion persistente de un inodo concreto. La posicion en la tabla de
+ *   inodos se calcula a partir del numero de inodo, asi que solo se lee un bloque. El bloque queda en *bh
+ */
+
+struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, uint64_t inode_no, struct buffer_head **bh)
+{
+    struct assoofs_super_block_info *afs_sb = ASSOOFS_SB(sb)->disk;
+
+    if (inode_no < ASSOOFS_ROOTDIR_INODE_NUMBER || inode_no > afs_sb->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize))
+    {
+        printk(KERN_ERR "Inode number out of range: %llu\n", inode_no);
+        return NULL;
+    }
+
+    *bh = assoofs_bread(sb, ASSOOFS_INODE_BLOCK(afs_sb->inode_table_block, inode_no, sb->s_blocksize));
+    if (!*bh)
+        return NULL;
+
+    return (struct assoofs_inode_info *)(*bh)->b_data + ASSOOFS_INODE_SLOT(inode_no, sb->s_blocksize);
+}
+
+/*
+ * Obtener la información persistente del inodo del superbloque
+ */
+static int assoofs_get_inode_info(struct super_block *sb, uint64_t inode_no, struct assoofs_inode_info *buffer)
+{
+
+    struct assoofs_inode_info *inode_info = NULL;
+    struct buffer_head *bh;
+    int ret = -EIO;
+
+    inode_info = assoofs_search_inode_info(sb, inode_no, &bh);
+    if (!inode_info)
+        return -EIO;
+
+    // Un hueco libre de la tabla no tiene numero de inodo
+    if (inode_info->inode_no == inode_no)
+    {
+        memcpy(buffer, inode_info, sizeof(*buffer));
+        ret = 0;
+    }
+
+    brelse(bh);
+    return ret;
+}
+
+/*
+ * Funcion auxiliar: obtiene un puntero con el inodo numero ino del superbloque sb. Si el inodo ya esta en la cache
+ * de inodos del VFS se devuelve sin ir a disco
+ */
+
+static struct inode *assoofs_get_inode(struct super_block *sb, uint64_t ino)
+{
+    struct inode *inode;
+    struct assoofs_inode_info *inode_info;
+
+    inode = iget_locked(sb, ino);
+    if (!inode)
+        return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    // 1. Obtener la informacion persistente del inodo ino
+    inode_info = ASSOOFS_INODE(inode);
+    if (assoofs_get_inode_info(sb, ino, inode_info))
+    {
+        iget_failed(inode);
+        return ERR_PTR(-EIO);
+    }
+    // Un fichero comprimido necesita los buffers de cluster_pool, que solo hay con ASSOOFS_FEATURE_COMPRESSION
+    if ((inode_info->flags & ASSOOFS_INODE_COMPRESSED) && !ASSOOFS_SB(sb)->cluster_pool)
+    {
+        printk(KERN_ERR "Inode %llu is compressed but the device does not have the compression feature\n", ino);
+        iget_failed(inode);
+        return ERR_PTR(-EIO);
+    }
+
+    // 2.Inicializar el inodo
+    inode->i_op = &assoofs_inode_ops; // direccion de una variable de tipo struct inode_operations previamente
+                                      // declarada
+    inode_init_owner(sb->s_user_ns, inode, NULL, inode_info->mode);
+
+    // Comprobar si es un directorio o un fichero
+    if (S_ISDIR(inode_info->mode))
+        inode->i_fop = &assoofs_dir_operations;
+    else if (S_ISREG(inode_info->mode))
+    {
+        inode->i_fop = &assoofs_file_operations;
+        inode->i_mapping->a_ops = &assoofs_aops;
+    }
+    else
+        printk(KERN_ERR "Unknown inode type. Neither a directory nor a file.");
+
+    // Fecha del sistema a los campos
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode); // fechas.
+
+    if (S_ISREG(inode_info->mode))
+        inode->i_size = inode_info->file_size;
+
+    unlock_new_inode(inode);
+    return inode;
+}
+
+static struct dentry *__assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
+{
+
+    // 1. Acceder al contenido del directorio apuntado por parent_inode
+    struct assoofs_inode_info *parent_info = ASSOOFS_INODE(parent_inode);
+    struct super_block *sb = parent_inode->i_sb;
+    struct inode *inode;
+    uint64_t inode_no;
+    int ret;
+
+    assoofs_dbg("Lookup request\n");
+    assoofs_dbg("Lookup in: ino = %llu, b=%llu\n", parent_info->inode_no, parent_info->data_block_number);
+
+    if (child_dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN)
+        return ERR_PTR(-ENAMETOOLONG);
+
+    // 2. Buscar la entrada cuyo nombre se corresponda con el que buscamos (en los directorios indexados solo se lee
+    // la hoja que le corresponde por hash). Si se localiza la entrada entonces debe crearse el inodo correspondiente
+    ret = assoofs_find_dir_entry(sb, parent_info, child_dentry->d_name.name, &inode_no);
+    if (ret == -ENOENT)
+        return NULL; // 3.Devolver NULL si no existe
+    if (ret)
+        return ERR_PTR(ret);
+
+    inode = assoofs_get_inode(sb, inode_no); // Funcion auxiliar que obtiene la informacion de un inodo a partir de su numero de inodo
+    if (IS_ERR(inode))
+        return ERR_CAST(inode);
+    assoofs_dbg("Have file: %s, ino=%llu\n", child_dentry->d_name.name, inode_no);
+    d_add(child_dentry, inode);
+    return NULL;
+}
+
+struct dentry *assoofs_lookup(struct inode *parent_inode, struct dentry *child_dentry, unsigned int flags)
+{
+    u64 start = ktime_get_ns();
+    struct dentry *ret = __assoofs_lookup(parent_inode, child_dentry, flags);
+
+    assoofs_stat_op(parent_inode->i_sb, ASSOOFS_OP_LOOKUP, start);
+    return ret;
+}
+
+/*
+ *   Permite actualizar la informacion persistente del superbloque cuando hay un cambio en memoria. Los cambios (casi
+ *   siempre inodes_count y free_blocks) se quedan en sbi->disk y se juntan: el bloque 0 se escribe cada
+ *   ASSOOFS_SB_INTERVAL, en sync_fs y al desmontar. Si el sistema cae antes, el superbloque de disco no esta CLEAN y el
+ *   siguiente montaje vuelve a contar (ver assoofs_fill_super)
+ */
+#define ASSOOFS_SB_DIRTY 0
+#define ASSOOFS_SB_INTERVAL (5 * HZ)
+
+void assoofs_save_sb_info(struct super_block *vsb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(vsb);
+
+    // Casi siempre ya esta sucio: mirar antes de escribir evita que todas las CPUs se peleen por la linea de flags
+    if (!test_bit(ASSOOFS_SB_DIRTY, &sbi->flags) && !test_and_set_bit(ASSOOFS_SB_DIRTY, &sbi->flags))
+        schedule_delayed_work(&sbi->sb_work, ASSOOFS_SB_INTERVAL);
+}
+
+// Copia sbi->disk en el bloque 0 si ha cambiado. Va en una transaccion propia del journal como cualquier otro
+// metadato, asi que nunca llega a disco a medias
+static int assoofs_flush_sb(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    s64 free_blocks, inodes_count;
+    int ret;
+
+    if (!test_and_clear_bit(ASSOOFS_SB_DIRTY, &sbi->flags))
+        return 0;
+    ret = assoofs_journal_start(sb, 1);
+    if (ret)
+    {
+        set_bit(ASSOOFS_SB_DIRTY, &sbi->flags);
+        return ret;
+    }
+
+    free_blocks = percpu_counter_sum_positive(&sbi->free_blocks);
+    inodes_count = percpu_counter_sum_positive(&sbi->inodes_count);
+    spin_lock(&sbi->lock);
+    sbi->disk->free_blocks = free_blocks;
+    sbi->disk->inodes_count = inodes_count;
+    memcpy(sbi->sb_bh->b_data, sbi->disk, sizeof(struct assoofs_super_block_info));
+    spin_unlock(&sbi->lock);
+    assoofs_dirty_bh(sb, sbi->sb_bh);
+    return assoofs_journal_stop(sb);
+}
+
+static void assoofs_sb_work(struct work_struct *work)
+{
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, sb_work);
+
+    assoofs_flush_sb(sbi->sb);
+}
+
+/*
+ *   Reserva en el mapa de bits el bloque block. Devuelve 0 si estaba libre
+ */
+
+static int assoofs_bitmap_claim(struct super_block *sb, uint64_t block)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *bh;
+    uint64_t group = assoofs_block_group(sb, block);
+
+    if (block >= sbi->disk->blocks_count)
+        return -ENOSPC;
+
+    bh = sbi->bitmap_bh[group];
+    if (!test_and_clear_bit_le(block % ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize), bh->b_data))
+        return -ENOSPC; // Ya estaba ocupado
+
+    // Actualizar el bloque del mapa y los contadores de libres del grupo y del superbloque. Ninguno necesita cerrojo
+    assoofs_dirty_bh(sb, bh);
+    atomic64_dec(&sbi->groups[group].free_blocks);
+    percpu_counter_dec(&sbi->free_blocks);
+    assoofs_save_sb_info(sb);
+    return 0;
+}
+
+/*
+ *   Contadores de referencias (ASSOOFS_FEATURE_REFLINK). Cada bloque tiene uno con los duennos que tiene ademas del
+ *   primero; los cambia sbi->lock
+ */
+
+static inline uint16_t *assoofs_refcount(struct super_block *sb, uint64_t block, struct buffer_head **bh)
+{
+    *bh = ASSOOFS_SB(sb)->refcount_bh[block / ASSOOFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize)];
+    return (uint16_t *)(*bh)->b_data + block % ASSOOFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize);
+}
+
+// Cuantos de los count bloques que empiezan en block son de un solo fichero, hasta el primero compartido
+static uint64_t assoofs_refcount_unshared(struct super_block *sb, uint64_t block, uint64_t count)
+{
+    struct buffer_head *bh;
+    uint64_t i;
+
+    if (!ASSOOFS_SB(sb)->refcount_bh)
+        return count;
+    for (i = 0; i < count && block + i < ASSOOFS_SB(sb)->disk->blocks_count; i++)
+        if (READ_ONCE(*assoofs_refcount(sb, block + i, &bh)))
+            break;
+    return i;
+}
+
+// Suma un duenno a los count bloques que empiezan en block. Si alguno ya tiene el maximo no se cambia ninguno
+static int assoofs_refcount_get(struct super_block *sb, uint64_t block, uint64_t count)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *bh;
+    uint64_t i;
+
+    if (!sbi->refcount_bh)
+        return -EOPNOTSUPP;
+    if (block + count > sbi->disk->blocks_count)
+        return -EIO;
+
+    spin_lock(&sbi->lock);
+    for (i = 0; i < count; i++)
+    {
+        if (*assoofs_refcount(sb, block + i, &bh) == ASSOOFS_REFCOUNT_MAX)
+        {
+            spin_unlock(&sbi->lock);
+            return -EMLINK;
+        }
+    }
+    for (i = 0; i < count; i++)
+        (*assoofs_refcount(sb, block + i, &bh))++;
+    spin_unlock(&sbi->lock);
+
+    // Se apunta cada bloque de contadores una vez
+    for (i = 0; i < count; i += ASSOOFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize) - (block + i) % ASSOOFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize))
+    {
+        assoofs_refcount(sb, block + i, &bh);
+        assoofs_dirty_bh(sb, bh);
+    }
+    return 0;
+}
+
+/*
+ *   Pone libres en el mapa de bits en memoria los count bloques que empiezan en block y los suma a los contadores. Con
+ *   dirty apunta los bloques del mapa que cambian; sin dirty ya estan en disco (tramos de una transaccion que acaba de
+ *   hacer commit, ver assoofs_journal_release_freed)
+ */
+
+static uint64_t assoofs_bitmap_free(struct super_block *sb, uint64_t block, uint64_t count, bool dirty)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *bh, *last_bh = NULL;
+    uint64_t freed = 0, group = 0, group_freed = 0;
+
+    for (; count && block < sbi->disk->blocks_count; block++, count--)
+    {
+        bh = sbi->bitmap_bh[assoofs_block_group(sb, block)];
+        if (test_and_set_bit_le(block % ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize), bh->b_data))
+        {
+            printk(KERN_ERR "Freeing block %llu, which is already free\n", block);
+            continue;
+        }
+        freed++;
+        // Un extent suele caer entero en el mismo bloque del mapa (el mismo grupo): se apunta y se cuenta una vez y
+        // no por cada bit
+        if (bh != last_bh)
+        {
+            if (group_freed)
+                atomic64_add(group_freed, &sbi->groups[group].free_blocks);
+            if (dirty)
+                assoofs_dirty_bh(sb, bh);
+            group = assoofs_block_group(sb, block);
+            group_freed = 0;
+        }
+        group_freed++;
+        last_bh = bh;
+    }
+
+    if (group_freed)
+        atomic64_add(group_freed, &sbi->groups[group].free_blocks);
+    percpu_counter_add(&sbi->free_blocks, freed);
+    return freed;
+}
+
+// Libera count bloques seguidos que ya no son de ningun fichero. Dentro de un handle del journal sus bloques del mapa
+// de bits se apuntan en la transaccion, pero no se pueden volver a reservar hasta despues del commit
+static uint64_t assoofs_blocks_free(struct super_block *sb, uint64_t block, uint64_t count)
+{
+    uint64_t bpb = ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize), i;
+
+    if (!count)
+        return 0;
+    if (!assoofs_journal_free_blocks(sb, block, count))
+        return assoofs_bitmap_free(sb, block, count, true);
+
+    for (i = block; i < block + count && i < ASSOOFS_SB(sb)->disk->blocks_count; i += bpb - i % bpb)
+        assoofs_dirty_bh(sb, ASSOOFS_SB(sb)->bitmap_bh[assoofs_block_group(sb, i)]);
+    return count;
+}
+
+/*
+ *   Libera los count bloques que empiezan en block. Un bloque compartido solo pierde un duenno y sigue ocupado. No
+ *   guarda el superbloque: quien libera varios tramos (assoofs_reclaim, los clusters comprimidos) lo guarda una vez al
+ *   final
+ */
+
+static uint64_t assoofs_bitmap_release(struct super_block *sb, uint64_t block, uint64_t count)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct buffer_head *ref_bh, *last_ref_bh = NULL;
+    uint16_t *ref;
+    uint64_t freed = 0, run = 0; // run: bloques sin mas duennos seguidos que terminan justo antes de block
+    bool shared;
+
+    for (; count && block < sbi->disk->blocks_count; block++, count--)
+    {
+        if (sbi->refcount_bh)
+        {
+            spin_lock(&sbi->lock);
+            ref = assoofs_refcount(sb, block, &ref_bh);
+            shared = *ref;
+            if (shared)
+                (*ref)--;
+            spin_unlock(&sbi->lock);
+            if (shared)
+            {
+                if (ref_bh != last_ref_bh)
+                    assoofs_dirty_bh(sb, ref_bh);
+                last_ref_bh = ref_bh;
+                freed += assoofs_blocks_free(sb, block - run, run);
+                run = 0;
+                continue;
+            }
+        }
+        run++;
+    }
+
+    return freed + assoofs_blocks_free(sb, block - run, run);
+}
+
+/*
+ *   Busca y reserva un bloque libre a partir de goal, dando la vuelta al llegar al final. Los grupos que no tienen
+ *   libres se saltan sin mirar su bloque del mapa; en los demas find_next_bit_le compara palabras enteras, no bit a bit
+ */
+
+static int assoofs_find_free_block(struct super_block *sb, uint64_t goal, uint64_t *block)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t bpg = ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize), group, first, limit, found, n, scanned = 0;
+
+    if (goal >= sbi->disk->blocks_count)
+        goal = 0;
+    group = assoofs_block_group(sb, goal);
+    first = goal - group * bpg;
+
+    // El grupo de goal se mira dos veces: al principio desde goal y al final lo que quedaba antes de goal
+    for (n = 0; n <= sbi->group_count; n++)
+    {
+        if (atomic64_read(&sbi->groups[group].free_blocks) > 0)
+        {
+            limit = min(bpg, sbi->disk->blocks_count - group * bpg);
+            while ((found = find_next_bit_le(sbi->bitmap_bh[group]->b_data, limit, first)) < limit)
+            {
+                scanned += found + 1 - first;
+                if (!assoofs_bitmap_claim(sb, group * bpg + found))
+                {
+                    *block = group * bpg + found;
+                    assoofs_stat_add(sb, alloc_scanned, scanned);
+                    assoofs_dbg("Freeblock --> %llu\n", *block);
+                    return 0;
+                }
+                first = found + 1; // Lo ha ocupado otro entre la busqueda y la reserva: seguir a continuacion
+            }
+            scanned += limit - first;
+        }
+        group = group + 1 < sbi->group_count ? group + 1 : 0;
+        first = 0;
+    }
+
+    assoofs_stat_add(sb, alloc_scanned, scanned);
+    assoofs_dbg("No free blocks left\n");
+    return -ENOSPC;
+}
+
+/*
+ *   Permite obtener un blque libre para el fichero o directorio inode_no. Se busca en el grupo de su inodo, para que
+ *   los datos queden cerca del inodo y de los demas del mismo directorio. Cada CPU tiene su cursor y, si ya esta en
+ *   ese grupo, sigue desde el: los que escriben a la vez desde CPUs distintas no se disputan los mismos bits
+ */
+
+int assoofs_sb_get_a_freeblock_near(struct super_block *sb, uint64_t inode_no, uint64_t *block)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t group = assoofs_inode_group(sb, inode_no), goal = this_cpu_read(*sbi->cursor);
+    int ret;
+
+    assoofs_dbg("assoofs_sb_get_a_freeblock_near request\n");
+    assoofs_stat_inc(sb, alloc_calls);
+
+    if (assoofs_block_group(sb, goal) != group)
+        goal = group * ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize);
+    ret = assoofs_find_free_block(sb, goal, block);
+    if (!ret)
+        this_cpu_write(*sbi->cursor, *block + 1);
+    return ret;
+}
+
+/*
+ *   Permite reservar un bloque concreto si esta libre (para alargar un extent sin fragmentar el fichero)
+ */
+
+int assoofs_sb_get_the_freeblock(struct super_block *sb, uint64_t block)
+{
+    return assoofs_bitmap_claim(sb, block);
+}
+
+/*
+ *   Guardar en disco la informacion persistente del nuevo inodo
+ */
+
+int assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode)
+{
+    int ret;
+
+    assoofs_dbg("assoofs_add_inode_info request\n");
+
+    // Escribir el inodo en su hueco de la tabla de inodos
+    ret = assoofs_save_inode_info(sb, inode);
+
+    // El contador de inodos ya lo ha incrementado assoofs_new_inode_no: guardar los cambios del superbloque
+    assoofs_save_sb_info(sb);
+    return ret;
+}
+
+/*
+ *   Grupo para un directorio nuevo que cuelga de la raiz: el de la CPU si tiene al menos la media de bloques libres y,
+ *   si no, el que mas tenga. Asi los arboles que se crean en paralelo se reparten por el dispositivo
+ */
+
+static uint64_t assoofs_spread_group(struct super_block *sb)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t group = assoofs_block_group(sb, this_cpu_read(*sbi->cursor)), best, i;
+    s64 avg = div64_u64(percpu_counter_read_positive(&sbi->free_blocks), sbi->group_count), most = -1, free;
+
+    if (group >= sbi->group_count)
+        group = 0;
+    if (atomic64_read(&sbi->groups[group].free_inodes) > 0 && atomic64_read(&sbi->groups[group].free_blocks) >= avg)
+        return group;
+    for (i = 0, best = group; i < sbi->group_count; i++)
+    {
+        free = atomic64_read(&sbi->groups[i].free_blocks);
+        if (atomic64_read(&sbi->groups[i].free_inodes) > 0 && free > most)
+        {
+            best = i;
+            most = free;
+        }
+    }
+    return best;
+}
+
+/*
+ *   Reserva el numero de un inodo nuevo en el directorio dir. Dos creates a la vez no pueden llevarse el mismo: el bit
+ *   de inode_map se coge con una operacion atomica. El inodo va al grupo de su directorio, salvo los directorios que
+ *   cuelgan de la raiz (assoofs_spread_group), y si ese grupo esta lleno a los siguientes. Dentro del grupo se coge el
+ *   numero libre mas bajo, asi que los de los inodos que ha liberado assoofs_reclaim se vuelven a usar
+ */
+
+static int assoofs_new_inode_no(struct super_block *sb, struct inode *dir, umode_t mode, uint64_t *inode_no)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t max = sbi->disk->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize);
+    uint64_t group, first, end, bit, n;
+
+    if (S_ISDIR(mode) && dir->i_ino == ASSOOFS_ROOTDIR_INODE_NUMBER)
+        group = assoofs_spread_group(sb);
+    else
+        group = assoofs_inode_group(sb, dir->i_ino);
+
+    for (n = 0; n < sbi->group_count; n++, group = group + 1 < sbi->group_count ? group + 1 : 0)
+    {
+        if (atomic64_read(&sbi->groups[group].free_inodes) <= 0)
+            continue;
+        first = group * sbi->inodes_per_group;
+        end = min(first + sbi->inodes_per_group, max);
+        for (bit = first; (bit = find_next_zero_bit(sbi->inode_map, end, bit)) < end; bit++)
+        {
+            if (test_and_set_bit(bit, sbi->inode_map))
+                continue; // Se lo ha llevado otro create
+            atomic64_dec(&sbi->groups[group].free_inodes);
+            percpu_counter_inc(&sbi->inodes_count);
+            *inode_no = bit + 1;
+            return 0;
+        }
+    }
+    return -ENOSPC;
+}
+
+// Deja libre un numero de inodo. Su hueco de la tabla ya tiene que estar a cero
+static void assoofs_free_inode_no(struct super_block *sb, uint64_t inode_no)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+
+    clear_bit(inode_no - 1, sbi->inode_map);
+    atomic64_inc(&sbi->groups[assoofs_inode_group(sb, inode_no)].free_inodes);
+    percpu_counter_dec(&sbi->inodes_count);
+}
+
+// Deshace en disco un create o un mkdir que ha fallado: el bloque del directorio vuelve al mapa de bits, el hueco de
+// la tabla vuelve a cero y el numero queda libre. El llamador tiene un handle del journal
+static void assoofs_new_inode_undo(struct super_block *sb, struct assoofs_inode_info *inode_info)
+{
+    struct assoofs_inode_info *slot;
+    struct buffer_head *bh;
+
+    if (S_ISDIR(inode_info->mode) && inode_info->extent_count)
+        assoofs_bitmap_release(sb, inode_info->extents[0].ee_start, inode_info->extents[0].ee_len);
+
+    slot = assoofs_search_inode_info(sb, inode_info->inode_no, &bh);
+    if (slot)
+    {
+        memset(slot, 0, sizeof(*slot));
+        assoofs_dirty_bh(sb, bh);
+        brelse(bh);
+    }
+    assoofs_free_inode_no(sb, inode_info->inode_no);
+    assoofs_save_sb_info(sb);
+}
+
+/*
+ *   Permite actualizar en disco la informacion persistente de un inodo
+ */
+
+int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info)
+{
+    struct assoofs_inode_info *inode_pos;
+    struct buffer_head *bh;
+
+    assoofs_dbg("assoofs_save_inode_info request\n");
+
+    // Obtener de disco el bloque de la tabla de inodos que contiene el inodo
+    inode_pos = assoofs_search_inode_info(sb, inode_info->inode_no, &bh);
+    if (!inode_pos)
+        return -EIO;
+
+    // Actualizar el inodo, marcar como sucio y sincronizar
+    memcpy(inode_pos, inode_info, sizeof(*inode_pos));
+    assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+
+    // 0 todo va bien
+    return 0;
+}
+
+static int __assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+    // 1. Crear el nuevo i-nodo
+    struct super_block *sb;
+    struct inode *inode;
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_inode_info *parent_inode_info;
+    uint64_t inode_no;
+    int ret;
+
+    assoofs_dbg("New file request\n");
+
+    if (dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+
+    // El nuevo inodo se asigna a traves de la iformacion persistente del superbloque. assoofs_new_inode_no comprueba
+    // que no se excede el numero maximo de objetos soportados por assoofs y reserva el numero con el cerrojo cogido
+    sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
+    if (assoofs_new_inode_no(sb, dir, mode, &inode_no))
+    {
+        assoofs_dbg("Exceded max number of files\n");
+        return -ENOSPC;
+    }
+
+    inode = new_inode(sb);
+    if (!inode)
+    {
+        assoofs_free_inode_no(sb, inode_no);
+        return -ENOMEM;
+    }
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_ino = inode_no;
+    insert_inode_hash(inode); // Para que los lookups siguientes lo encuentren en la cache de inodos
+
+    // La informacion persistente del i-nodo va en el propio inodo (assoofs_alloc_inode la deja a cero)
+    inode_info = ASSOOFS_INODE(inode);
+    inode_info->inode_no = inode->i_ino;
+    inode_info->mode = mode; // El segundo mode me llega como argumento
+    inode_info->file_size = 0;
+    inode_info->flags = ASSOOFS_INODE_INLINE; // Los ficheros nuevos empiezan dentro del inodo
+    if (ASSOOFS_SB(sb)->compress)
+        inode_info->flags |= ASSOOFS_INODE_COMPRESSED; // Y sus datos se comprimiran cuando salgan de el
+    inode->i_fop = &assoofs_file_operations; // Para indicar que las operaciones son sobre ficheros
+    inode->i_mapping->a_ops = &assoofs_aops;
+
+    // Asignar propietario y permisos, guardar el nuevo inodo en el arbol de direcciones
+    // Tuve que anniadir sb->s_user_ns por la signatura del metodo, en los apuntes no estaba
+    inode_init_owner(sb->s_user_ns, inode, dir, mode);
+
+    // Los bloques de datos del fichero se reservan a medida que se escribe (assoofs_alloc_file_block), un fichero
+    // vacio no ocupa ningun bloque
+
+    // Guardar la informacion persistente del nuevo inodo en disco. Todos los cambios de metadatos de la operacion
+    // (superbloque, tabla de inodos y directorio padre) van juntos en una transaccion del journal
+
+    ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS);
+    if (ret)
+    {
+        assoofs_free_inode_no(sb, inode_no);
+        goto fail;
+    }
+    ret = assoofs_add_inode_info(sb, inode_info);
+
+    // Modificar el contenido del directorio padre, añadiendo una nueva entrada para el nuevo archivo
+
+    // La entrada se annade al final del bloque del directorio o, si el directorio esta indexado, en la hoja que le
+    // corresponde por el hash del nombre. assoofs_add_dir_entry tambien actualiza la informacion persistente del
+    // inodo padre indicando que ahora tiene un archivo mas
+
+    parent_inode_info = ASSOOFS_INODE(dir);
+    if (!ret)
+        ret = assoofs_add_dir_entry(sb, parent_inode_info, dentry->d_name.name, inode_info->inode_no, inode_info->mode);
+    if (ret)
+    {
+        assoofs_new_inode_undo(sb, inode_info);
+        assoofs_journal_stop(sb);
+        goto fail;
+    }
+    if (assoofs_journal_stop(sb))
+        ret = -EIO;
+
+    // El dentry apunta al inodo solo cuando ya esta en el directorio
+    d_instantiate(dentry, inode);
+
+    // 0 todo ha ido bien, -EIO si la entrada esta hecha pero no ha llegado a disco
+    return ret;
+
+fail:
+    // Sin enlaces y sin REMOVED: al soltarlo no se apunta para liberarlo, lo que tenia en disco ya se ha deshecho
+    clear_nlink(inode);
+    iput(inode);
+    return ret;
+}
+
+static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+    u64 start = ktime_get_ns();
+    int ret = __assoofs_create(mnt_userns, dir, dentry, mode, excl);
+
+    assoofs_stat_op(dir->i_sb, ASSOOFS_OP_CREATE, start);
+    return ret;
+}
+
+static int __assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    // 1. Crear el nuevo i-nodo
+    struct super_block *sb;
+    struct inode *inode;
+    struct assoofs_inode_info *inode_info;
+    struct assoofs_inode_info *parent_inode_info;
+    struct buffer_head *bh;
+    uint64_t inode_no;
+    int ret;
+
+    assoofs_dbg("New directory request\n");
+
+    if (dentry->d_name.len >= ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+
+    // El nuevo inodo se asigna a traves de la iformacion persistente del superbloque. assoofs_new_inode_no comprueba
+    // que no se excede el numero maximo de objetos soportados por assoofs y reserva el numero con el cerrojo cogido
+    sb = dir->i_sb; // obtengo un puntero al superbloque desde dir
+    if (assoofs_new_inode_no(sb, dir, S_IFDIR | mode, &inode_no))
+    {
+        assoofs_dbg("Exceded max number of files\n");
+        return -ENOSPC;
+    }
+
+    inode = new_inode(sb);
+    if (!inode)
+    {
+        assoofs_free_inode_no(sb, inode_no);
+        return -ENOMEM;
+    }
+    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
+    inode->i_op = &assoofs_inode_ops;
+    inode->i_ino = inode_no;
+    insert_inode_hash(inode); // Para que los lookups siguientes lo encuentren en la cache de inodos
+
+    // La informacion persistente del i-nodo va en el propio inodo (assoofs_alloc_inode la deja a cero)
+    inode_info = ASSOOFS_INODE(inode);
+    inode_info->inode_no = inode->i_ino;
+    inode_info->mode = S_IFDIR | mode; // El segundo mode me llega como argumento
+
+    inode_info->dir_children_count = 0;
+    inode->i_fop = &assoofs_dir_operations; // Para indicar que las operaciones son sobre directorios
+
+    // Asignar propietario y permisos, guardar el nuevo inodo en el arbol de direcciones
+    // Tuve que anniadir sb->s_user_ns por la signatura del metodo, en los apuntes no estaba
+    inode_init_owner(sb->s_user_ns, inode, dir, inode_info->mode);
+
+    // Hay que asignarle un bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits del superbloque.
+    // para ello funcion auxiliar (se utilizara mucho) assoofs_sb_get_a_freeblock_near a su vez, tendrá que actualizar
+    // la información persistente del superbloque, en concreto el valor del campo free blocks. Esta operación
+    // tambien se repite en más lugares por lo que se recomienda definir una función auxiliar: assoofs save sb info
+
+    // Todos los cambios de metadatos de la operacion van juntos en una transaccion del journal
+    ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS);
+    if (ret)
+    {
+        assoofs_free_inode_no(sb, inode_no);
+        goto fail;
+    }
+    // El bloque del directorio es el primer extent y se deja vacio en el formato que toque: v2 si el dispositivo
+    // se creo con directorios v2
+    if (ASSOOFS_SB(sb)->disk->features & ASSOOFS_FEATURE_DIR_V2)
+        inode_info->flags |= ASSOOFS_INODE_DIR_V2;
+    bh = assoofs_dir_new_block(sb, inode_info, 0);
+    if (!bh)
+    {
+        ret = -ENOSPC;
+        goto undo;
+    }
+    assoofs_dirty_bh(sb, bh);
+    brelse(bh);
+
+    // Guardar la informacion persistente del nuevo inodo en disco
+
+    ret = assoofs_add_inode_info(sb, inode_info);
+    if (ret)
+        goto undo;
+
+    // Modificar el contenido del directorio padre, añadiendo una nueva entrada para el nuevo archivo
+
+    // La entrada se annade al final del bloque del directorio o, si el directorio esta indexado, en la hoja que le
+    // corresponde por el hash del nombre. assoofs_add_dir_entry tambien actualiza la informacion persistente del
+    // inodo padre indicando que ahora tiene un archivo mas
+
+    parent_inode_info = ASSOOFS_INODE(dir);
+    ret = assoofs_add_dir_entry(sb, parent_inode_info, dentry->d_name.name, inode_info->inode_no, inode_info->mode);
+    if (ret)
+        goto undo;
+    if (assoofs_journal_stop(sb))
+        ret = -EIO;
+
+    // El dentry apunta al inodo solo cuando ya esta en el directorio
+    d_instantiate(dentry, inode);
+
+    // 0 todo ha ido bien, -EIO si la entrada esta hecha pero no ha llegado a disco
+    return ret;
+
+undo:
+    assoofs_new_inode_undo(sb, inode_info);
+    assoofs_journal_stop(sb);
+fail:
+    // Sin enlaces y sin REMOVED: al soltarlo no se apunta para liberarlo, lo que tenia en disco ya se ha deshecho
+    clear_nlink(inode);
+    iput(inode);
+    return ret;
+}
+
+static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    u64 start = ktime_get_ns();
+    int ret = __assoofs_mkdir(mnt_userns, dir, dentry, mode);
+
+    assoofs_stat_op(dir->i_sb, ASSOOFS_OP_MKDIR, start);
+    return ret;
+}
+
+/*
+ *  Borrado. unlink y rmdir solo quitan la entrada del directorio padre y marcan el inodo como borrado (remove_flag) en
+ *  la tabla, todo en una transaccion. Cuando el VFS suelta el inodo (en el ultimo close si alguien lo tenia abierto)
+ *  assoofs_evict_inode lo apunta en reclaim_list, y assoofs_reclaim devuelve sus bloques al mapa de bits y su numero
+ *  a inode_map en segundo plano y por lotes: con muchos borrados seguidos se hace un solo commit por lote y no uno por
+ *  unlink. Un inodo marcado que no se llego a liberar (corte de luz, falta de memoria) se recoge al montar
+ */
+#define ASSOOFS_RECLAIM_DELAY (HZ / 10) // Lo que se espera a que se junten mas borrados antes de liberarlos
+
+static struct workqueue_struct *assoofs_reclaim_wq;
+
+// Inodo borrado pendiente de liberar o directorio lineal pendiente de compactar
+struct assoofs_reclaim {
+    struct list_head list;
+    uint64_t inode_no;
+    bool compact;
+};
+
+static void assoofs_reclaim_queue(struct super_block *sb, uint64_t inode_no, bool compact)
+{
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_reclaim *r = kmalloc(sizeof(*r), GFP_NOFS);
+
+    // Sin memoria el inodo se queda marcado en disco hasta el siguiente montaje, y el directorio sin compactar hasta
+    // que se vuelva a borrar algo en el
+    if (!r)
+        return;
+    r->inode_no = inode_no;
+    r->compact = compact;
+    spin_lock(&sbi->lock);
+    list_add_tail(&r->list, &sbi->reclaim_list);
+    spin_unlock(&sbi->lock);
+    queue_delayed_work(assoofs_reclaim_wq, &sbi->reclaim_work, ASSOOFS_RECLAIM_DELAY);
+}
+
+// Quita el nombre de dentry de dir. assoofs no tiene enlaces duros, asi que el inodo se queda sin ninguno
+static int assoofs_remove(struct inode *dir, struct dentry *dentry)
+{
+    struct super_block *sb = dir->i_sb;
+    struct inode *inode = d_inode(dentry);
+    struct assoofs_inode *ai = ASSOOFS_I(inode);
+    int ret;
+
+    ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS);
+    if (ret)
+        return ret;
+
+    ret = assoofs_remove_dir_entry(sb, ASSOOFS_INODE(dir), dentry->d_name.name, inode->i_ino);
+    if (!ret)
+    {
+        dir->i_ctime = dir->i_mtime = inode->i_ctime = current_time(dir);
+        clear_nlink(inode);
+        down_write(&ai->map_sem);
+        ai->info.remove_flag = REMOVED;
+        ret = assoofs_save_inode_info(sb, &ai->info);
+        up_write(&ai->map_sem);
+    }
+
+    if (assoofs_journal_stop(sb) && !ret)
+        ret = -EIO;
+    return ret;
+}
+
+static int assoofs_unlink(struct inode *dir, struct dentry *dentry)
+{
+    u64 start = ktime_get_ns();
+    int ret;
+
+    assoofs_dbg("Unlink request\n");
+    ret = assoofs_remove(dir, dentry);
+    assoofs_stat_op(dir->i_sb, ASSOOFS_OP_UNLINK, start);
+    return ret;
+}
+
+static int assoofs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    u64 start = ktime_get_ns();
+    int ret;
+
+    assoofs_dbg("Rmdir request\n");
+    ret = assoofs_dir_empty(dir->i_sb, ASSOOFS_INODE(d_inode(dentry)));
+    if (!ret)
+        ret = assoofs_remove(dir, dentry);
+    assoofs_stat_op(dir->i_sb, ASSOOFS_OP_RMDIR, start);
+    return ret;
+}
+
+// El VFS suelta el inodo. Si ya no tiene nombres nadie puede volver a abrirlo y sus bloques se pueden liberar
+static void assoofs_evict_inode(struct inode *inode)
+{
+    truncate_inode_pages_final(&inode->i_data);
+    clear_inode(inode);
+    if (!inode->i_nlink && ASSOOFS_INODE(inode)->remove_flag == REMOVED)
+        assoofs_reclaim_queue(inode->i_sb, inode->i_ino, false);
 }
 
 /*
- *   Permite actualizar la informacion persistente del superbloque cuando hay un cambio en memoria
+ *   Libera un inodo borrado: sus bloques (datos, bloques de directorio y el de desbordamiento de los extents) vuelven
+ *   al mapa de bits, y su hueco de la tabla y su numero quedan libres para el siguiente create. Los bloques se quitan
+ *   por tramos, cada uno en su transaccion como al truncar. Si se corta la luz a medias el inodo sigue borrado con
+ *   menos extents y se termina de liberar al montar
  */
 
-void assoofs_save_sb_info(struct super_block *vsb)
+static int assoofs_reclaim_inode(struct super_block *sb, uint64_t inode_no)
 {
+    struct assoofs_inode_info info, *slot;
+    struct assoofs_extent *ext;
+    struct buffer_head *bh = NULL, *table_bh;
+    uint64_t i, freed = 0;
+    int ret;
 
-    // Leer de disco la información persistente del superbloque con sb bread y sobreescribir el campo
-    // b_data con la información en memoria
+    ret = assoofs_get_inode_info(sb, inode_no, &info);
+    if (ret)
+        return ret;
+    if (info.remove_flag != REMOVED)
+    {
+        printk(KERN_ERR "Inode %llu has not been removed\n", inode_no);
+        return -EIO;
+    }
+    if (info.flags & ASSOOFS_INODE_INLINE)
+        info.extent_count = 0; // Sus datos estan en el propio inodo
+    if (info.extent_count > ASSOOFS_MAX_EXTENTS(sb->s_blocksize))
+        return -EIO;
 
-    struct buffer_head *bh;
-    struct assoofs_super_block_info *sb = vsb->s_fs_info; // Información persistente del superbloque en memoria
+    // Para las estadisticas: lo que se libera dentro de un handle no vuelve a los contadores hasta el commit
+    for (i = 0; i < info.extent_count; i++)
+    {
+        ext = assoofs_get_extent(sb, &info, i, &bh);
+        if (!ext)
+        {
+            brelse(bh);
+            return -EIO;
+        }
+        freed += assoofs_extent_blocks(ext, sb->s_blocksize);
+    }
+    brelse(bh);
+
+    do
+    {
+        ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS + ASSOOFS_RELEASE_BLOCKS(sb->s_blocksize));
+        if (ret)
+            return ret;
+        ret = assoofs_truncate_extents(sb, &info, 0);
+        assoofs_journal_stop_nowait(sb);
+    } while (ret > 0);
+    if (ret)
+        return ret;
 
-    printk(KERN_INFO "assoofs_save_sb_info request\n");
+    ret = assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS);
+    if (ret)
+        return ret;
+    if (info.extent_block)
+        freed += assoofs_bitmap_release(sb, info.extent_block, 1);
 
-    bh = sb_bread(vsb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    bh->b_data = (char *)sb; // Sobreescribo los datos de disco con la información en memoria
+    // El hueco a cero es un inodo libre (inode_no 0). El numero se libera despues, cuando el hueco ya esta vacio
+    slot = assoofs_search_inode_info(sb, inode_no, &table_bh);
+    if (slot)
+    {
+        memset(slot, 0, sizeof(*slot));
+        assoofs_dirty_bh(sb, table_bh);
+        brelse(table_bh);
 
-    // Para que el cambio pase a disco, marcar el buffer como sucio y sincronizar
+        assoofs_free_inode_no(sb, inode_no);
+    }
+    else
+        ret = -EIO;
+    assoofs_save_sb_info(sb);
+    assoofs_journal_stop_nowait(sb);
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    assoofs_stat_inc(sb, reclaimed_inodes);
+    assoofs_stat_add(sb, reclaimed_blocks, freed);
+    assoofs_dbg("Reclaimed inode %llu (%llu blocks)\n", inode_no, freed);
+    return ret;
 }
 
 /*
- *   Permite obtener un blque libre
+ *   Procesa todo lo que hay en reclaim_list. Los cambios de todo el lote van juntos en las mismas transacciones y se
+ *   escriben de una vez al final
  */
 
-int assoofs_sb_get_a_freeblock(struct super_block *sb, uint64_t *block)
+static void assoofs_reclaim(struct super_block *sb)
 {
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_reclaim *r, *tmp;
+    struct inode *dir;
+    LIST_HEAD(batch);
+    u64 start = ktime_get_ns();
+
+    spin_lock(&sbi->lock);
+    list_splice_init(&sbi->reclaim_list, &batch);
+    spin_unlock(&sbi->lock);
+    if (list_empty(&batch))
+        return;
+
+    // Los unlink que dejaron estos inodos sin nombre tienen que estar en disco antes de que sus bloques se puedan
+    // reutilizar: si no, tras un corte de luz el fichero volveria a aparecer con los datos de otro
+    assoofs_journal_commit_all(sb);
+
+    list_for_each_entry_safe(r, tmp, &batch, list)
+    {
+        if (!r->compact)
+        {
+            if (assoofs_reclaim_inode(sb, r->inode_no))
+                printk(KERN_ERR "Could not reclaim inode %llu\n", r->inode_no);
+        }
+        else if ((dir = ilookup(sb, r->inode_no)))
+        {
+            // Solo si el directorio sigue en memoria: si el VFS ya lo ha soltado se compacta la proxima vez
+            inode_lock(dir);
+            if (dir->i_nlink && !assoofs_journal_start(sb, ASSOOFS_JOURNAL_HANDLE_BLOCKS))
+            {
+                assoofs_dir_compact(sb, ASSOOFS_INODE(dir));
+                assoofs_journal_stop_nowait(sb);
+            }
+            inode_unlock(dir);
+            iput(dir);
+        }
+        list_del(&r->list);
+        kfree(r);
+    }
 
-    // Obtenemos la informacion persistente del superbloque
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
-    int i;
-
-    printk(KERN_INFO "assoofs_sb_get_a_freeblock request\n");
-
-    // Recorremos el mapa de bits en busca de uno libre (bit=1)
-    for (i = 2; i < ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED; i++)
-        if (assoofs_sb->free_blocks & (1 << i))
-            break; // cuando aparece el primer bit 1 en free_block dejamos de recorrer el mapa de bits, i tiene la posición
-                   // del primer bloque libre
-    *block = i;    // Escribimos el valor de i en la dirección de memoria indicada como segundo argumento en la función
-
-    // Actuaziar el valor de free_block y guardar los cambios en el superbloque
-    assoofs_sb->free_blocks &= ~(1 << i);
-    assoofs_save_sb_info(sb);
+    assoofs_journal_commit_all(sb);
+    assoofs_stat_op(sb, ASSOOFS_OP_RECLAIM, start);
+}
 
-    // Comprobar si es el valor de i
-    printk(KERN_INFO "Freeblock --> %d\n", i);
+static void assoofs_reclaim_work(struct work_struct *work)
+{
+    struct assoofs_sb_info *sbi = container_of(to_delayed_work(work), struct assoofs_sb_info, reclaim_work);
 
-    return 0;
+    assoofs_reclaim(sbi->sb);
 }
 
 /*
- *   Guardar en disco la informacion persistente del nuevo inodo
+ *   Al montar se recorre la tabla de inodos para saber que numeros estan en uso (inode_map), y los inodos borrados que
+ *   no se llegaron a liberar se apuntan en reclaim_list. Basta con leer hasta encontrar los inodes_count que estan en
+ *   uso: como los numeros bajos se reutilizan primero, suelen estar todos al principio de la tabla. Si el superbloque
+ *   no se guardo al desmontar (recount) inodes_count no es de fiar y se lee la tabla entera (assoofs_load_groups
+ *   lo vuelve a contar en inode_map)
  */
 
-void assoofs_add_inode_info(struct super_block *sb, struct assoofs_inode_info *inode)
+static int assoofs_load_inode_map(struct super_block *sb, bool recount)
 {
-
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    struct assoofs_super_block_info *afs_sb = sbi->disk;
+    struct assoofs_inode_info *slot;
     struct buffer_head *bh;
-    struct assoofs_inode_info *inode_info;
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize);
+    uint64_t block, i, ino, found = 0, orphans = 0;
 
-    // Obtener el contador de inodos del superbloque
-    struct assoofs_super_block_info *assoofs_sb = sb->s_fs_info;
+    sbi->inode_map = kvcalloc(BITS_TO_LONGS(afs_sb->inode_table_blocks * per_block), sizeof(unsigned long), GFP_KERNEL);
+    if (!sbi->inode_map)
+        return -ENOMEM;
 
-    printk(KERN_INFO "assoofs_add_inode_info request\n");
+    for (block = 0; block < afs_sb->inode_table_blocks && (recount || found < afs_sb->inodes_count); block++)
+    {
+        bh = assoofs_bread(sb, afs_sb->inode_table_block + block);
+        if (!bh)
+            return -EIO;
+        for (i = 0; i < per_block; i++)
+        {
+            ino = block * per_block + i + 1;
+            slot = (struct assoofs_inode_info *)bh->b_data + i;
+            if (slot->inode_no != ino)
+                continue; // Hueco libre
+            __set_bit(ino - 1, sbi->inode_map);
+            found++;
+            if (slot->remove_flag == REMOVED)
+            {
+                assoofs_reclaim_queue(sb, ino, false);
+                orphans++;
+            }
+        }
+        brelse(bh);
+    }
 
-    // leer de disco el bloque que contiene el almacen de inodos
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    // Obtener un nuevo puntero al final del almacen y escribir un nuevo valor al final
-    inode_info = (struct assoofs_inode_info *)bh->b_data;
-    inode_info += assoofs_sb->inodes_count;
-    memcpy(inode_info, inode, sizeof(struct assoofs_inode_info));
-    // Marcar el bloque como sucio y sincronizar
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    // Actualizar el contador de inodos de la informacion persistente del superbloque y guardar los cambios
-    assoofs_sb->inodes_count++;
-    assoofs_save_sb_info(sb);
+    if (orphans)
+        printk(KERN_INFO "Reclaiming %llu removed inodes\n", orphans);
+    return 0;
 }
 
 /*
- *   Permitira obtener un puntero a la informacion persistente de un inodo concreto
+ *   Prepara los grupos de asignacion con el mapa de bits y inode_map ya cargados. Los libres de cada grupo se cuentan
+ *   en su bloque del mapa (los bits que hay despues del ultimo bloque del dispositivo estan a 0, ocupados), asi que
+ *   los totales del superbloque salen exactos aunque no se guardaran al desmontar. Cada CPU empieza con el cursor en
+ *   un grupo distinto
  */
 
-struct assoofs_inode_info *assoofs_search_inode_info(struct super_block *sb, struct assoofs_inode_info *start, struct assoofs_inode_info *search)
+static int assoofs_load_groups(struct super_block *sb)
 {
-    uint64_t count = 0;
-
-    printk(KERN_INFO "assoofs_inode_info request\n");
-
-    while (start->inode_no != search->inode_no && count < ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count)
-    {
-        count++;
-        start++;
-    }
-    if (start->inode_no == search->inode_no)
-    {
-        // printk(KERN_INFO "i-nodo found. no-> &lld\n", start->inode_no);
-        return start;
-    }
-    else
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(sb);
+    uint64_t max = sbi->disk->inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(sb->s_blocksize);
+    uint64_t group, first, free, free_blocks = 0, free_inodes = 0;
+    int cpu, ret;
+
+    sbi->group_count = sbi->disk->bitmap_blocks;
+    sbi->inodes_per_group = round_up(DIV_ROUND_UP(max, sbi->group_count), BITS_PER_LONG); // inode_map por palabras
+    sbi->groups = kvcalloc(sbi->group_count, sizeof(struct assoofs_group), GFP_KERNEL);
+    sbi->cursor = alloc_percpu(uint64_t);
+    if (!sbi->groups || !sbi->cursor)
+        return -ENOMEM;
+
+    for (group = 0; group < sbi->group_count; group++)
     {
-        return NULL;
+        free = bitmap_weight((unsigned long *)sbi->bitmap_bh[group]->b_data, ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize));
+        atomic64_set(&sbi->groups[group].free_blocks, free);
+        free_blocks += free;
+
+        first = group * sbi->inodes_per_group;
+        free = first < max ? min(sbi->inodes_per_group, max - first) : 0;
+        free -= free ? bitmap_weight(sbi->inode_map + first / BITS_PER_LONG, free) : 0;
+        atomic64_set(&sbi->groups[group].free_inodes, free);
+        free_inodes += free;
     }
+    for_each_possible_cpu(cpu)
+        *per_cpu_ptr(sbi->cursor, cpu) = (cpu % sbi->group_count) * ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize);
+
+    sbi->disk->free_blocks = free_blocks;
+    sbi->disk->inodes_count = max - free_inodes;
+    ret = percpu_counter_init(&sbi->free_blocks, sbi->disk->free_blocks, GFP_KERNEL);
+    if (!ret)
+        ret = percpu_counter_init(&sbi->inodes_count, sbi->disk->inodes_count, GFP_KERNEL);
+    return ret;
 }
 
 /*
- *   Permite actualizar en disco la informacion persistente de un inodo
+ *  Operaciones sobre el superbloque
  */
+static void assoofs_put_super(struct super_block *sb);
+static int assoofs_sync_fs(struct super_block *sb, int wait);
+static int assoofs_show_options(struct seq_file *m, struct dentry *root);
+static struct inode *assoofs_alloc_inode(struct super_block *sb);
+static void assoofs_free_inode(struct inode *inode);
+static const struct super_operations assoofs_sops = {
+    .alloc_inode = assoofs_alloc_inode,
+    .free_inode = assoofs_free_inode,
+    .drop_inode = generic_drop_inode,
+    .evict_inode = assoofs_evict_inode,
+    .put_super = assoofs_put_super,
+    .sync_fs = assoofs_sync_fs,
+    .show_options = assoofs_show_options,
+};
 
-int assoofs_save_inode_info(struct super_block *sb, struct assoofs_inode_info *inode_info)
+/*
+ *  Inodos en memoria: se reservan de assoofs_inode_cachep y el VFS los guarda en su cache mientras haya memoria, asi
+ *  que abrir otra vez un fichero no vuelve a leer la tabla de inodos
+ */
+static struct inode *assoofs_alloc_inode(struct super_block *sb)
 {
-    struct assoofs_inode_info *inode_pos;
-    struct buffer_head *bh;
-
-    printk(KERN_INFO "assoofs_save_inode_info request\n");
-
-    // Obtener de disco el bloque que contiene el alamcen de inodos
-    bh = sb_bread(sb, ASSOOFS_INODESTORE_BLOCK_NUMBER);
-    // Buscar los datos de inode_info en el almacen de inodos
-    inode_pos = assoofs_search_inode_info(sb, (struct assoofs_inode_info *)bh->b_data, inode_info);
-
-    // Actualizar el inodo, marcar como sucio y sincronizar
-    memcpy(inode_pos, inode_info, sizeof(*inode_pos));
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    struct assoofs_inode *ai = kmem_cache_alloc(assoofs_inode_cachep, GFP_KERNEL);
 
-    // 0 todo va bien
-    return 0;
+    if (!ai)
+        return NULL;
+    memset(&ai->info, 0, sizeof(ai->info));
+    return &ai->vfs_inode;
 }
 
-static int assoofs_create(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+static void assoofs_free_inode(struct inode *inode)
 {
-    // 1. Crear el nuevo i-nodo
-    struct super_block *sb;
-    struct buffer_head *bh;
-    struct inode *inode;
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    uint64_t count;
-
-    printk(KERN_INFO "New file request\n");
-
-    // El nuevo inodo se asigna a traves de la iformacion persistente del superbloque
-    sb = dir->i_sb;                                                           // obtengo un puntero al superbloque desde dir
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el número de inodos de la
-                                                                              // información persistente del superbloque
-    inode = new_inode(sb);
-    inode->i_sb = sb;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_ino = count + 1; // Asigno número al nuevo inodo a partir de count
-    // BORRAR---------------------------------------------------
-    // Para ver cuanto vale count y saber si tngo que restarle los dos inodos que ya estan en memoria
-    printk(KERN_INFO "COUNT--------------------- %lld\n", count);
-
-    // Comprobar que el valor de count no excede el numero maximo de de objetos soportados por assofs
-    if (count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED - 2)
-    {
-        printk(KERN_INFO "Exceded max number of files\n");
-        return -1;
-    }
-
-    // Guardar en el campo i_private la informacion persistente del i-nodo creando una nueva estructura
-    // de assoofs_inode_info
-    inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-    inode_info->inode_no = inode->i_ino;
-    inode_info->mode = mode; // El segundo mode me llega como argumento
-    inode_info->file_size = 0;
-    inode->i_private = inode_info;
-    inode->i_fop = &assoofs_file_operations; // Para indicar que las operaciones son sobre ficheros
-
-    // Asignar propietario y permisos, guardar el nuevo inodo en el arbol de direcciones
-    // Tuve que anniadir sb->s_user_ns por la signatura del metodo, en los apuntes no estaba
-    inode_init_owner(sb->s_user_ns, inode, dir, mode);
-    d_add(dentry, inode);
-
-    // Hay que asignarle un bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits del superbloque.
-    // para ello funcion auxiliar (se utilizara mucho) assoofs_sb_get_a_freeblock a su vez, tendrá que actualizar
-    // la información persistente del superbloque, en concreto el valor del campo free blocks. Esta operación
-    // tambien se repite en más lugares por lo que se recomienda definir una función auxiliar: assoofs save sb info
-
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-
-    // Guardar la informacion persistente del nuevo inodo en disco
+    kmem_cache_free(assoofs_inode_cachep, ASSOOFS_I(inode));
+}
 
-    assoofs_add_inode_info(sb, inode_info);
+// Constructor de los objetos de la cache: inode_init_once solo hace falta la primera vez
+static void assoofs_inode_init_once(void *obj)
+{
+    struct assoofs_inode *ai = obj;
 
-    // Modificar el contenido del directorio padre, añadiendo una nueva entrada para el nuevo archivo
+    init_rwsem(&ai->map_sem);
+    inode_init_once(&ai->vfs_inode);
+}
 
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
+/*
+ *  Opciones de montaje
+ */
+enum {
+    Opt_writeback,
+    Opt_nowriteback,
+    Opt_compress,
+    Opt_nocompress,
+    Opt_err
+};
 
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
+static const match_table_t assoofs_tokens = {
+    {Opt_writeback, "writeback"},     // Los metadatos y los datos se escriben en segundo plano
+    {Opt_nowriteback, "nowriteback"}, // Cada cambio se escribe en el acto (por defecto)
+    {Opt_compress, "compress"},       // Los ficheros nuevos se comprimen (por defecto si el dispositivo ya tiene alguno)
+    {Opt_nocompress, "nocompress"},   // Los ficheros nuevos no se comprimen; los que ya lo estan se siguen leyendo
+    {Opt_err, NULL}
+};
 
-    strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+static int assoofs_parse_options(char *options, struct assoofs_sb_info *sbi)
+{
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
 
-    // Actualizar la información persistente del inodo padre indicando que ahora tiene un archivo más. Se recomienda definir
-    // una función auxiliar para esta operación: assoofs save inode info. Para actualizar la información persistente de un
-    // inodo es necesario recorrer el almacen y localizar dicho inodo, para ello se recomienda definir otra función auxiliar:
-    // assoofs_search_inode_info.
+    if (!options)
+        return 0;
 
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
+    while ((p = strsep(&options, ",")) != NULL)
+    {
+        if (!*p)
+            continue;
 
-    // 0 todo ha ido bien
+        switch (match_token(p, assoofs_tokens, args))
+        {
+        case Opt_writeback:
+            sbi->writeback = true;
+            break;
+        case Opt_nowriteback:
+            sbi->writeback = false;
+            break;
+        case Opt_compress:
+            sbi->compress = true;
+            break;
+        case Opt_nocompress:
+            sbi->compress = false;
+            break;
+        default:
+            printk(KERN_ERR "Unknown mount option: %s\n", p);
+            return -EINVAL;
+        }
+    }
     return 0;
 }
 
-static int assoofs_mkdir(struct user_namespace *mnt_userns, struct inode *dir, struct dentry *dentry, umode_t mode)
+static int assoofs_show_options(struct seq_file *m, struct dentry *root)
 {
-    // 1. Crear el nuevo i-nodo
-    struct super_block *sb;
-    struct buffer_head *bh;
-    struct inode *inode;
-    struct assoofs_inode_info *inode_info;
-    struct assoofs_inode_info *parent_inode_info;
-    struct assoofs_dir_record_entry *dir_contents;
-    uint64_t count;
-
-    printk(KERN_INFO "New directory request\n");
-
-    // El nuevo inodo se asigna a traves de la iformacion persistente del superbloque
-    sb = dir->i_sb;                                                           // obtengo un puntero al superbloque desde dir
-    count = ((struct assoofs_super_block_info *)sb->s_fs_info)->inodes_count; // obtengo el número de inodos de la
-                                                                              // información persistente del superbloque
-    inode = new_inode(sb);
-    inode->i_sb = sb;
-    inode->i_atime = inode->i_mtime = inode->i_ctime = current_time(inode);
-    inode->i_op = &assoofs_inode_ops;
-    inode->i_ino = count + 1; // Asigno número al nuevo inodo a partir de count
-    // BORRAR---------------------------------------------------
-    // Para ver cuanto vale count y saber si tngo que restarle los dos inodos que ya estan en memoria
-    printk(KERN_INFO "COUNT--------------------- %lld\n", count);
+    struct assoofs_sb_info *sbi = ASSOOFS_SB(root->d_sb);
+
+    if (sbi->writeback)
+        seq_puts(m, ",writeback");
+    if (sbi->compress)
+        seq_puts(m, ",compress");
+    else if (sbi->disk->features & ASSOOFS_FEATURE_COMPRESSION)
+        seq_puts(m, ",nocompress");
+    return 0;
+}
 
-    // Comprobar que el valor de count no excede el numero maximo de de objetos soportados por assofs
-    if (count >= ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED)
+/*
+ *  Liberar la informacion del superbloque en memoria (bloques del mapa de bits incluidos)
+ */
+static void assoofs_free_sb_info(struct assoofs_sb_info *sbi)
+{
+    struct assoofs_reclaim *r, *tmp;
+    uint64_t i;
+
+    debugfs_remove_recursive(sbi->debugfs);
+    cancel_delayed_work_sync(&sbi->reclaim_work);
+    cancel_delayed_work_sync(&sbi->sb_work);
+    list_for_each_entry_safe(r, tmp, &sbi->reclaim_list, list)
+        kfree(r);
+    kvfree(sbi->inode_map);
+    mempool_destroy(sbi->cluster_pool);
+    if (sbi->journal)
+        assoofs_journal_free(sbi->journal);
+
+    if (sbi->bitmap_bh)
     {
-        printk(KERN_INFO "Exceded max number of files\n");
-        return -1;
+        for (i = 0; i < sbi->disk->bitmap_blocks; i++)
+            brelse(sbi->bitmap_bh[i]);
+        kfree(sbi->bitmap_bh);
     }
+    if (sbi->refcount_bh)
+    {
+        for (i = 0; i < sbi->disk->refcount_blocks; i++)
+            brelse(sbi->refcount_bh[i]);
+        kfree(sbi->refcount_bh);
+    }
+    percpu_counter_destroy(&sbi->free_blocks);
+    percpu_counter_destroy(&sbi->inodes_count);
+    free_percpu(sbi->cursor);
+    kvfree(sbi->groups);
+    brelse(sbi->sb_bh);
+    kfree(sbi->disk);
+    free_percpu(sbi->stats);
+    kfree(sbi);
+}
 
-    // Guardar en el campo i_private la informacion persistente del i-nodo creando una nueva estructura
-    // de assoofs_inode_info
-    inode_info = kmalloc(sizeof(struct assoofs_inode_info), GFP_KERNEL);
-    inode_info->inode_no = inode->i_ino;
-    inode_info->mode = S_IFDIR | mode; // El segundo mode me llega como argumento
-
-    inode_info->dir_children_count = 0;
-    inode->i_private = inode_info;
-    inode->i_fop = &assoofs_dir_operations; // Para indicar que las operaciones son sobre directorios
-
-    // Asignar propietario y permisos, guardar el nuevo inodo en el arbol de direcciones
-    // Tuve que anniadir sb->s_user_ns por la signatura del metodo, en los apuntes no estaba
-    inode_init_owner(sb->s_user_ns, inode, dir, inode_info->mode);
-    d_add(dentry, inode);
-
-    // Hay que asignarle un bloque al nuevo inodo, por lo que habrá que consultar el mapa de bits del superbloque.
-    // para ello funcion auxiliar (se utilizara mucho) assoofs_sb_get_a_freeblock a su vez, tendrá que actualizar
-    // la información persistente del superbloque, en concreto el valor del campo free blocks. Esta operación
-    // tambien se repite en más lugares por lo que se recomienda definir una función auxiliar: assoofs save sb info
-
-    assoofs_sb_get_a_freeblock(sb, &inode_info->data_block_number);
-
-    // Guardar la informacion persistente del nuevo inodo en disco
-
-    assoofs_add_inode_info(sb, inode_info);
-
-    // Modificar el contenido del directorio padre, añadiendo una nueva entrada para el nuevo archivo
-
-    parent_inode_info = dir->i_private;
-    bh = sb_bread(sb, parent_inode_info->data_block_number);
-
-    dir_contents = (struct assoofs_dir_record_entry *)bh->b_data;
-    dir_contents += parent_inode_info->dir_children_count;
-    dir_contents->inode_no = inode_info->inode_no; // inode_info es la información persistente del inodo creado en el paso 2.
-
-    strcpy(dir_contents->filename, dentry->d_name.name);
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+/*
+ *  sync(2) y syncfs(2): con -o writeback los metadatos sucios siguen en la cache del dispositivo, se escriben aqui y
+ *  despues se vacia la cache de escritura del disco. El superbloque en memoria va en el mismo commit
+ */
+static int assoofs_sync_fs(struct super_block *sb, int wait)
+{
+    u64 start = ktime_get_ns();
+    int ret;
 
-    // Actualizar la información persistente del inodo padre indicando que ahora tiene un archivo más. Se recomienda definir
-    // una función auxiliar para esta operación: assoofs save inode info. Para actualizar la información persistente de un
-    // inodo es necesario recorrer el almacen y localizar dicho inodo, para ello se recomienda definir otra función auxiliar:
-    // assoofs_search_inode_info.
+    assoofs_dbg("assoofs_sync_fs request\n");
 
-    parent_inode_info->dir_children_count++;
-    assoofs_save_inode_info(sb, parent_inode_info);
+    if (!wait)
+        return 0;
 
-    // 0 todo ha ido bien
-    return 0;
+    // Primero los borrados pendientes, para que despues del sync el espacio ya este libre
+    flush_delayed_work(&ASSOOFS_SB(sb)->reclaim_work);
+    ret = assoofs_flush_sb(sb);
+    if (!ret)
+        ret = assoofs_journal_commit_all(sb);
+    if (!ret)
+        ret = sync_blockdev(sb->s_bdev);
+    if (!ret)
+        ret = blkdev_issue_flush(sb->s_bdev);
+
+    assoofs_stat_op(sb, ASSOOFS_OP_SYNC_FS, start);
+    return ret;
 }
 
-/*
- *  Operaciones sobre el superbloque
- */
-static const struct super_operations assoofs_sops = {
-    .drop_inode = generic_delete_inode,
-};
+static void assoofs_put_super(struct super_block *sb)
+{
+    printk(KERN_INFO "assoofs_put_super request\n");
+
+    // Los inodos que se acaban de soltar al desmontar tambien se liberan antes de cerrar el journal
+    cancel_delayed_work_sync(&ASSOOFS_SB(sb)->reclaim_work);
+    assoofs_reclaim(sb);
+
+    // Con los contadores ya definitivos el superbloque se escribe como CLEAN: el siguiente montaje se los puede creer
+    cancel_delayed_work_sync(&ASSOOFS_SB(sb)->sb_work);
+    ASSOOFS_SB(sb)->disk->state = ASSOOFS_STATE_CLEAN;
+    set_bit(ASSOOFS_SB_DIRTY, &ASSOOFS_SB(sb)->flags);
+    if (assoofs_flush_sb(sb))
+        printk(KERN_ERR "Could not write the superblock\n");
+    assoofs_journal_destroy(sb);
+    assoofs_free_sb_info(ASSOOFS_SB(sb));
+    sb->s_fs_info = NULL;
+}
 
 /*
  *  Inicialización del superbloque
@@ -571,7 +5088,11 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent)
 
     struct buffer_head *bh;
     struct assoofs_super_block_info *assoofs_sb;
+    struct assoofs_sb_info *sbi;
     struct inode *root_inode;
+    uint64_t i;
+    bool recount;
+    int ret;
 
     printk(KERN_INFO "assoofs_fill_super request\n");
 
@@ -579,57 +5100,241 @@ int assoofs_fill_super(struct super_block *sb, void *data, int silent)
 
     // 2.3.4 del guion de practicas
 
-    // 1.- Leer la información persistente del superbloque del dispositivo de bloques
+    // 1.- Leer la información persistente del superbloque del dispositivo de bloques. Todavia no se sabe el tamannio
+    // del bloque: se lee con el minimo (el superbloque esta al principio del bloque 0 sea cual sea) y si el
+    // dispositivo tiene otro se vuelve a leer con el suyo mas abajo
 
+    if (!sb_min_blocksize(sb, ASSOOFS_MIN_BLOCK_SIZE))
+    {
+        printk(KERN_ERR "Could not set the minimum block size\n");
+        return -EINVAL;
+    }
     bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
-    assoofs_sb = (struct assoofs_super_block_info *)bh->b_data; // Casteo a la estructura
-    brelse(bh);                                                 // Liberar memoria asignada
+    if (!bh)
+        return -EIO;
+
+    // Se trabaja sobre una copia propia: el bloque se puede volver a leer con otro tamannio y al final se fija aparte
+    assoofs_sb = kmemdup(bh->b_data, sizeof(struct assoofs_super_block_info), GFP_KERNEL); // Casteo a la estructura
+    brelse(bh);                                                                             // Liberar memoria asignada
+    if (!assoofs_sb)
+        return -ENOMEM;
 
     // 2.- Comprobar los parámetros del superbloque
+    ret = -EINVAL;
     if (assoofs_sb->magic != ASSOOFS_MAGIC)
     {
         printk("The magic number is wrong:%lld\n", assoofs_sb->magic);
-        return -1;
+        goto fail_sb;
     }
 
-    if (assoofs_sb->block_size != ASSOOFS_DEFAULT_BLOCK_SIZE)
+    // La cache de buffers no admite bloques mayores que una pagina
+    if (!assoofs_block_size_valid(assoofs_sb->block_size, assoofs_sb->features) || assoofs_sb->block_size > PAGE_SIZE)
     {
         printk("The block size is wrong:%lld\n", assoofs_sb->block_size);
-        return -1;
+        goto fail_sb;
+    }
+
+    if (assoofs_sb->block_size != sb->s_blocksize)
+    {
+        if (!sb_set_blocksize(sb, assoofs_sb->block_size))
+        {
+            printk(KERN_ERR "The device does not support %lld byte blocks\n", assoofs_sb->block_size);
+            goto fail_sb;
+        }
+        bh = sb_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+        if (!bh)
+        {
+            ret = -EIO;
+            goto fail_sb;
+        }
+        memcpy(assoofs_sb, bh->b_data, sizeof(struct assoofs_super_block_info));
+        brelse(bh);
+        if (assoofs_sb->magic != ASSOOFS_MAGIC || assoofs_sb->block_size != sb->s_blocksize)
+            goto fail_sb;
+    }
+
+    if (assoofs_sb->features & ~ASSOOFS_FEATURES_SUPPORTED)
+    {
+        printk("Unsupported features:%llx\n", assoofs_sb->features & ~ASSOOFS_FEATURES_SUPPORTED);
+        goto fail_sb;
+    }
+
+    if (assoofs_sb->bitmap_blocks != DIV_ROUND_UP(assoofs_sb->blocks_count, ASSOOFS_BITS_PER_BLOCK(sb->s_blocksize)) ||
+        assoofs_sb->blocks_count * sb->s_blocksize > i_size_read(sb->s_bdev->bd_inode))
+    {
+        printk("The free space bitmap does not match the device: %lld blocks, %lld bitmap blocks\n", assoofs_sb->blocks_count, assoofs_sb->bitmap_blocks);
+        goto fail_sb;
+    }
+
+    if (assoofs_sb->inode_table_block + assoofs_sb->inode_table_blocks > assoofs_sb->blocks_count)
+    {
+        printk("The inode table does not fit in the device: %lld blocks\n", assoofs_sb->inode_table_blocks);
+        goto fail_sb;
+    }
+
+    if ((assoofs_sb->features & ASSOOFS_FEATURE_REFLINK) &&
+        (assoofs_sb->refcount_blocks != DIV_ROUND_UP(assoofs_sb->blocks_count, ASSOOFS_REFCOUNTS_PER_BLOCK(sb->s_blocksize)) ||
+         assoofs_sb->refcount_block + assoofs_sb->refcount_blocks > assoofs_sb->blocks_count))
+    {
+        printk("The reference counts do not match the device: %lld blocks\n", assoofs_sb->refcount_blocks);
+        goto fail_sb;
     }
 
     printk("The magic number is :%lld, and the block size:%lld\n", assoofs_sb->magic, assoofs_sb->block_size);
 
+    // Cargar el mapa de bits de bloques libres. Sus bloques se quedan fijados en memoria mientras el dispositivo
+    // este montado para que buscar un bloque libre no tenga que ir a disco
+    sbi = kzalloc(sizeof(struct assoofs_sb_info), GFP_KERNEL);
+    if (!sbi)
+    {
+        ret = -ENOMEM;
+        goto fail_sb;
+    }
+    sbi->disk = assoofs_sb;
+    sbi->sb = sb;
+    spin_lock_init(&sbi->lock);
+    INIT_LIST_HEAD(&sbi->reclaim_list);
+    INIT_DELAYED_WORK(&sbi->reclaim_work, assoofs_reclaim_work);
+    INIT_DELAYED_WORK(&sbi->sb_work, assoofs_sb_work);
+    sbi->compress = assoofs_sb->features & ASSOOFS_FEATURE_COMPRESSION;
+    sbi->stats = alloc_percpu(struct assoofs_stats);
+    sbi->sb_bh = assoofs_bread(sb, ASSOOFS_SUPERBLOCK_BLOCK_NUMBER);
+    if (!sbi->stats || !sbi->sb_bh || assoofs_parse_options(data, sbi))
+    {
+        ret = !sbi->stats ? -ENOMEM : !sbi->sb_bh ? -EIO : -EINVAL;
+        assoofs_free_sb_info(sbi);
+        return ret;
+    }
+
+    // Antes de leer nada mas se aplica lo que haya quedado pendiente en el journal. La transaccion puede traer una
+    // version mas nueva del bloque 0: la copia en memoria se vuelve a tomar del bloque fijado
+    sb->s_fs_info = sbi;
+    ret = assoofs_journal_load(sb);
+    if (ret)
+    {
+        assoofs_free_sb_info(sbi);
+        sb->s_fs_info = NULL;
+        return ret;
+    }
+    memcpy(assoofs_sb, sbi->sb_bh->b_data, sizeof(struct assoofs_super_block_info));
+    sbi->bitmap_bh = kcalloc(assoofs_sb->bitmap_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!sbi->bitmap_bh)
+    {
+        assoofs_free_sb_info(sbi);
+        sb->s_fs_info = NULL;
+        return -ENOMEM;
+    }
+    for (i = 0; i < assoofs_sb->bitmap_blocks; i++)
+    {
+        sbi->bitmap_bh[i] = assoofs_bread(sb, assoofs_sb->bitmap_block + i);
+        if (!sbi->bitmap_bh[i])
+        {
+            printk(KERN_ERR "Could not read the free space bitmap\n");
+            assoofs_free_sb_info(sbi);
+            sb->s_fs_info = NULL;
+            return -EIO;
+        }
+    }
+
+    // Los contadores de referencias se fijan igual: liberar un bloque tiene que mirar el suyo
+    if (assoofs_sb->features & ASSOOFS_FEATURE_REFLINK)
+    {
+        sbi->refcount_bh = kcalloc(assoofs_sb->refcount_blocks, sizeof(struct buffer_head *), GFP_KERNEL);
+        for (i = 0; sbi->refcount_bh && i < assoofs_sb->refcount_blocks; i++)
+        {
+            sbi->refcount_bh[i] = assoofs_bread(sb, assoofs_sb->refcount_block + i);
+            if (!sbi->refcount_bh[i])
+                break;
+        }
+        if (!sbi->refcount_bh || i < assoofs_sb->refcount_blocks)
+        {
+            printk(KERN_ERR "Could not read the reference counts\n");
+            ret = sbi->refcount_bh ? -EIO : -ENOMEM;
+            assoofs_free_sb_info(sbi);
+            sb->s_fs_info = NULL;
+            return ret;
+        }
+    }
+
+    // Numeros de inodo en uso e inodos borrados pendientes de liberar. Si no se desmonto bien los contadores del
+    // superbloque pueden ser de antes de los ultimos cambios y se vuelven a contar
+    recount = assoofs_sb->state != ASSOOFS_STATE_CLEAN;
+    ret = assoofs_load_inode_map(sb, recount);
+    if (ret)
+    {
+        assoofs_free_sb_info(sbi);
+        sb->s_fs_info = NULL;
+        return ret;
+    }
+    ret = assoofs_load_groups(sb);
+    if (ret)
+    {
+        assoofs_free_sb_info(sbi);
+        sb->s_fs_info = NULL;
+        return ret;
+    }
+    if (recount)
+        printk(KERN_INFO "Device was not cleanly unmounted: %llu inodes, %llu free blocks\n", assoofs_sb->inodes_count, assoofs_sb->free_blocks);
+
+    // Mientras este montado el superbloque de disco no esta CLEAN. Montar con -o compress por primera vez ademas activa
+    // la caracteristica: desde entonces puede haber ficheros comprimidos
+    assoofs_sb->state = 0;
+    if (sbi->compress)
+        assoofs_sb->features |= ASSOOFS_FEATURE_COMPRESSION;
+    set_bit(ASSOOFS_SB_DIRTY, &sbi->flags);
+    ret = assoofs_flush_sb(sb);
+    if (!ret && (assoofs_sb->features & ASSOOFS_FEATURE_COMPRESSION))
+
+    {
+        sbi->cluster_pool = mempool_create_kvmalloc_pool(ASSOOFS_CLUSTER_POOL_MIN, sizeof(struct assoofs_cluster_buf));
+        if (!sbi->cluster_pool)
+            ret = -ENOMEM;
+    }
+    if (ret)
+    {
+        assoofs_free_sb_info(sbi);
+        sb->s_fs_info = NULL;
+        return ret;
+    }
+
     // 3.- Escribir la información persistente leída del dispositivo de bloques en el superbloque sb, incluído el campo s_op con las operaciones que soporta.
     sb->s_magic = ASSOOFS_MAGIC;
-    sb->s_maxbytes = ASSOOFS_DEFAULT_BLOCK_SIZE;
+    sb->s_maxbytes = MAX_LFS_FILESIZE; // El tamannio lo limitan los extents y el espacio libre, no un bloque
     sb->s_op = &assoofs_sops;
-    sb->s_fs_info = assoofs_sb;
-
-    // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop)
-    // Declaracion del inodo raiz
-    root_inode = new_inode(sb);
-    inode_init_owner(sb->s_user_ns, root_inode, NULL, S_IFDIR);
-
-    // Asignacion de informacion al inodo
-    root_inode->i_ino = ASSOOFS_ROOTDIR_INODE_NUMBER;                                           // número de inodo
-    root_inode->i_sb = sb;                                                                      // puntero al superbloque
-    root_inode->i_op = &assoofs_inode_ops;                                                      // dirección de una variable de tipo struct inode_operations previamente
-                                                                                                // declarada
-    root_inode->i_fop = &assoofs_dir_operations;                                                // dirección de una variable de tipo struct file_operations previamente
-                                                                                                // declarada. En la práctica tenemos 2: assoofs_dir_operations y assoofs_file_operations. La primera la
-                                                                                                // utilizaremos cuando creemos inodos para directorios (como el directorio raı́z) y la segunda cuando creemos
-                                                                                                // inodos para ficheros.
-    root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime = current_time(root_inode); // fechas.
-    root_inode->i_private = assoofs_get_inode_info(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);           // Informacion persistente del inodo
+    sb->s_fs_info = sbi;
+
+    // 4.- Crear el inodo raíz y asignarle operaciones sobre inodos (i_op) y sobre directorios (i_fop). Se lee de la
+    // tabla de inodos como cualquier otro (assoofs_get_inode)
+    root_inode = assoofs_get_inode(sb, ASSOOFS_ROOTDIR_INODE_NUMBER);
+    if (IS_ERR(root_inode))
+    {
+        printk(KERN_ERR "Could not read the root inode\n");
+        assoofs_free_sb_info(sbi);
+        sb->s_fs_info = NULL;
+        return PTR_ERR(root_inode);
+    }
 
     // Introducir el nuevo inodo en el arbol de inodos
     // Fijar inodo raiz en el superbloque, solo se realiza una vez
 
     sb->s_root = d_make_root(root_inode);
+    if (!sb->s_root)
+    {
+        assoofs_free_sb_info(sbi);
+        sb->s_fs_info = NULL;
+        return -ENOMEM;
+    }
+
+    // Estadisticas en /sys/kernel/debug/assoofs/<dispositivo>/stats. Sin debugfs el dispositivo se monta igual
+    sbi->debugfs = debugfs_create_dir(sb->s_id, assoofs_debugfs_root);
+    debugfs_create_file("stats", 0444, sbi->debugfs, sb, &assoofs_stats_fops);
 
     // Devuelve 0 si todo va bien
     return 0;
+
+fail_sb:
+    kfree(assoofs_sb);
+    return ret;
 }
 
 /*
@@ -664,7 +5369,7 @@ static struct file_system_type assoofs_type = {
     .owner = THIS_MODULE,
     .name = "assoofs",            // Nombre del modulo. Tiene que ser correcto sino no monta
     .mount = assoofs_mount,       // Funcion que debe llamar cuando se haga el montaje
-    .kill_sb = kill_litter_super, // Al desmontar llama a la funcion de kill_litter_super (es funcion de la libreria)
+    .kill_sb = kill_block_super, // Al desmontar llama a la funcion de kill_block_super (es funcion de la libreria)
 };
 
 /**
@@ -677,6 +5382,22 @@ static int __init assoofs_init(void)
 
     int ret;
     printk(KERN_INFO "assoofs_init request\n");
+    BUILD_BUG_ON(ASSOOFS_CLUSTER_SIZE < PAGE_SIZE); // Un cluster son paginas enteras
+
+    // Cache de inodos en memoria (assoofs_alloc_inode)
+    assoofs_inode_cachep = kmem_cache_create("assoofs_inode_cache", sizeof(struct assoofs_inode), 0,
+                                             SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT, assoofs_inode_init_once);
+    if (!assoofs_inode_cachep)
+        return -ENOMEM;
+    // Liberacion de los inodos borrados en segundo plano (assoofs_reclaim)
+    assoofs_reclaim_wq = alloc_workqueue("assoofs_reclaim", WQ_UNBOUND, 0);
+    if (!assoofs_reclaim_wq)
+    {
+        kmem_cache_destroy(assoofs_inode_cachep);
+        return -ENOMEM;
+    }
+    assoofs_debugfs_root = debugfs_create_dir("assoofs", NULL);
+
     ret = register_filesystem(&assoofs_type);
     // Control de errores a partir del valor de ret
     // Returns 0 on success, or a negative errno code on an error.
@@ -684,6 +5405,9 @@ static int __init assoofs_init(void)
     if (ret != 0)
     {
         printk(KERN_INFO "assoofs has not been registered\n");
+        debugfs_remove_recursive(assoofs_debugfs_root);
+        destroy_workqueue(assoofs_reclaim_wq);
+        kmem_cache_destroy(assoofs_inode_cachep);
         return ret;
     }
 
@@ -713,6 +5437,12 @@ static void __exit assoofs_exit(void)
         printk(KERN_INFO "Sucessfully unregistered assoofs");
     }
 
+    // Los inodos se liberan tras un periodo de gracia RCU: esperar a que terminen antes de destruir la cache
+    rcu_barrier();
+    destroy_workqueue(assoofs_reclaim_wq);
+    kmem_cache_destroy(assoofs_inode_cachep);
+    debugfs_remove_recursive(assoofs_debugfs_root);
+
     printk(KERN_INFO "Adios----------------------------------\n");
 }
 
@@ -1,46 +1,484 @@
 //DECLARACION DE ESTRUCTURAS DE DATOS Y CONSTANTES
+//Lo comparten el modulo del kernel, mkassoofs y libassoofs: fuera del kernel trae lo que necesita de la libc
+
+#ifndef ASSOOFS_H
+#define ASSOOFS_H
+
+#ifdef __KERNEL__
+#define assoofs_format_error(...) printk(KERN_ERR __VA_ARGS__)
+#else
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#define assoofs_format_error(...) fprintf(stderr, __VA_ARGS__)
+#endif
 
 #define ASSOOFS_MAGIC 0x20200406    //Identificar al dispositivo (es aleatorio)
-#define ASSOOFS_DEFAULT_BLOCK_SIZE 4096 //Tamannio del bloque
+#define ASSOOFS_DEFAULT_BLOCK_SIZE 4096 //Tamannio del bloque si mkassoofs no recibe otro con -b
+#define ASSOOFS_MIN_BLOCK_SIZE 1024     //El tamannio del bloque es una potencia de 2 entre estos dos
+#define ASSOOFS_MAX_BLOCK_SIZE 65536    //(el modulo ademas no admite bloques mayores que una pagina)
 #define ASSOOFS_FILENAME_MAXLEN 255     //Longitud maxima del nombre de un fichero 255 caracteres
-#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_ROOTDIR_BLOCK_NUMBER    //Ultimo bloque reservado
+#define ASSOOFS_LAST_RESERVED_BLOCK ASSOOFS_SUPERBLOCK_BLOCK_NUMBER //Ultimo bloque reservado (el resto se calcula)
 #define ASSOOFS_LAST_RESERVED_INODE ASSOOFS_ROOTDIR_INODE_NUMBER    //Ultimo inodo reservado
-//Flag para eliminar   
+//Flag para eliminar: lo ponen unlink y rmdir y lo recoge el modulo en segundo plano (ver assoofs_reclaim)
 #define REMOVED 1
 #define NO_REMOVED 0
-const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;  //Bloque donde esta el SUPERBLOQUE
-const int ASSOOFS_INODESTORE_BLOCK_NUMBER = 1;  //Numero de bloque donde se almacenan lo inodos
-const int ASSOOFS_ROOTDIR_BLOCK_NUMBER = 2;     
-const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
-const int ASSOOFS_MAX_FILESYSTEM_OBJECTS_SUPPORTED = 64;    //Numero maximo de ficheros o carpetas
+static const int ASSOOFS_SUPERBLOCK_BLOCK_NUMBER = 0;  //Bloque donde esta el SUPERBLOQUE
+static const int ASSOOFS_ROOTDIR_INODE_NUMBER = 1;
 
 //Estructura para el supebloque
 struct assoofs_super_block_info {
     uint64_t version;
     uint64_t magic;
-    uint64_t block_size;    
-    uint64_t inodes_count;  //1 libre 0 ocupado
-    uint64_t free_blocks;   //entero 64 bits
-    //Hasta aqui 40 bytes
-    //Se para dejar un hueco hasta 4096 (4096-5variablesAnteriores(x8bytes))=4056
-    char padding[4056];
+    uint64_t block_size;    //Tamannio del bloque (ASSOOFS_MIN_BLOCK_SIZE..ASSOOFS_MAX_BLOCK_SIZE)
+    uint64_t inodes_count;  //Inodos en uso, el raiz incluido (los numeros de los borrados se reutilizan)
+    uint64_t free_blocks;   //Numero de bloques libres que quedan en el mapa de bits
+    uint64_t blocks_count;  //Numero total de bloques del dispositivo
+    uint64_t bitmap_block;  //Primer bloque del mapa de bits de bloques libres (1 libre 0 ocupado)
+    uint64_t bitmap_blocks; //Numero de bloques que ocupa el mapa de bits
+    uint64_t inode_table_block;     //Primer bloque de la tabla de inodos
+    uint64_t inode_table_blocks;    //Numero de bloques de la tabla de inodos
+    uint64_t journal_block;         //Primer bloque del journal de metadatos
+    uint64_t journal_blocks;        //Numero de bloques del journal (0 si no tiene)
+    uint64_t features;              //Caracteristicas del formato activadas (ASSOOFS_FEATURE_*)
+    uint64_t refcount_block;        //Primer bloque de los contadores de referencias (ASSOOFS_FEATURE_REFLINK)
+    uint64_t refcount_blocks;       //Numero de bloques de los contadores (0 sin ASSOOFS_FEATURE_REFLINK)
+    uint64_t state;                 //ASSOOFS_STATE_CLEAN si los contadores de arriba estan al dia
+    //Hasta aqui 128 bytes. El resto del bloque 0 va a cero: el superbloque cabe hasta en el bloque mas pequenio
 };
 
+//Caracteristicas del formato. Un dispositivo con alguna que el modulo no conoce no se monta
+#define ASSOOFS_FEATURE_DIR_V2 0x1  //Los directorios nuevos usan entradas de longitud variable
+#define ASSOOFS_FEATURE_COMPRESSION 0x2 //Hay ficheros comprimidos (ASSOOFS_INODE_COMPRESSED)
+#define ASSOOFS_FEATURE_REFLINK 0x4 //Los ficheros clonados comparten bloques (contadores de referencias)
+#define ASSOOFS_FEATURE_DX_TREE 0x8 //Hay directorios con el indice en dos niveles (assoofs_dx_root con levels 1)
+#define ASSOOFS_FEATURES_SUPPORTED (ASSOOFS_FEATURE_DIR_V2 | ASSOOFS_FEATURE_COMPRESSION | ASSOOFS_FEATURE_REFLINK | \
+                                    ASSOOFS_FEATURE_DX_TREE)
+
+//Estado del superbloque. El modulo no escribe inodes_count y free_blocks en cada cambio sino de vez en cuando y al
+//desmontar: mientras esta montado el estado en disco no es CLEAN y, si no se llega a desmontar, el siguiente montaje
+//los vuelve a contar en la tabla de inodos y el mapa de bits
+#define ASSOOFS_STATE_CLEAN 0x1
+
+//Disposicion del dispositivo: superbloque | mapa de bits | [contadores] | tabla de inodos | journal | bloques de datos
+//El mapa de bits empieza justo despues de los bloques reservados y ocupa los bloques necesarios para
+//cubrir todo el dispositivo: cada bloque del mapa describe ASSOOFS_BITS_PER_BLOCK(bs) bloques
+//Todo lo que depende del tamannio del bloque recibe el del dispositivo (bs) como parametro
+#define ASSOOFS_BITMAP_BLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
+#define ASSOOFS_BITS_PER_BLOCK(bs) ((uint64_t)(bs) * 8)
+
+//Contadores de referencias (ASSOOFS_FEATURE_REFLINK): van justo despues del mapa de bits, un uint16_t por bloque del
+//dispositivo con cuantos duennos tiene ademas del primero. Un bloque ocupado con el contador a 0 es de un solo
+//fichero; liberar uno compartido solo baja su contador y el bit del mapa no cambia hasta que se va el ultimo
+#define ASSOOFS_REFCOUNTS_PER_BLOCK(bs) ((uint64_t)(bs) / sizeof(uint16_t))
+#define ASSOOFS_REFCOUNT_MAX 0xffff
+
+//Journal de metadatos: los cambios de una operacion (crear un fichero toca el superbloque, el mapa de bits, la tabla
+//de inodos y el directorio padre) se escriben primero juntos en el journal y despues en su sitio. Al montar, una
+//transaccion completa que no se llego a llevar a su sitio se vuelve a aplicar
+//Disposicion: superbloque del journal | descriptor | copias de los bloques | commit
+#define ASSOOFS_JOURNAL_MAGIC 0x4a524e4c    //"JRNL"
+#define ASSOOFS_JOURNAL_SUPERBLOCK 1
+#define ASSOOFS_JOURNAL_DESCRIPTOR 2
+#define ASSOOFS_JOURNAL_COMMIT 3
+#define ASSOOFS_JOURNAL_MIN_BLOCKS 64 //Una transaccion tiene que poder llevar la operacion mas grande del modulo
+
+struct assoofs_journal_header {
+    uint64_t magic;
+    uint64_t type;      //ASSOOFS_JOURNAL_*
+    uint64_t sequence;  //Numero de la transaccion
+};
+
+//Primer bloque del journal. sequence es la siguiente transaccion: si el journal tiene esa, hay que aplicarla
+struct assoofs_journal_super_block {
+    struct assoofs_journal_header header;
+};
+
+//Bloques que lleva la transaccion; sus copias van detras en el mismo orden
+struct assoofs_journal_descriptor {
+    struct assoofs_journal_header header;
+    uint64_t count;
+    uint64_t blocknr[];
+};
+
+//Cierra la transaccion. checksum es el crc32 del descriptor y de las copias: si no coincide no se llego a escribir
+struct assoofs_journal_commit {
+    struct assoofs_journal_header header;
+    uint64_t count;
+    uint32_t checksum;
+};
+
+#define ASSOOFS_JOURNAL_DESCRIPTOR_MAX(bs) (((bs) - sizeof(struct assoofs_journal_descriptor)) / sizeof(uint64_t))
+
 //Identificar los directorios y lo que hay dentro
 struct assoofs_dir_record_entry {
     char filename[ASSOOFS_FILENAME_MAXLEN]; //Nombre del archivo
-    uint64_t inode_no;  //Inodo
-    uint64_t remove_flag; 
+    uint8_t file_type;  //Tipo de fichero (ASSOOFS_FT_*), en el byte de relleno que habia antes de inode_no
+    uint64_t inode_no;  //Inodo (0 si el hueco esta libre)
+    uint64_t remove_flag;   //REMOVED: hueco que ha dejado un unlink y que falta por compactar
+};
+
+//Entradas de directorio que caben en un bloque
+#define ASSOOFS_DIR_RECORDS_PER_BLOCK(bs) ((bs) / sizeof(struct assoofs_dir_record_entry))
+
+//Formato v2 de los directorios: registros de longitud variable encadenados que cubren el bloque entero. rec_len lleva
+//al registro siguiente (siempre multiplo de 8) y un registro con inode_no 0 es espacio libre, asi que un bloque vacio
+//es un unico registro libre que ocupa todo el bloque. Con nombres de 20 caracteres caben 128 por bloque de 4K. Como
+//rec_len es de 16 bits, v2 no admite bloques mayores que ASSOOFS_DIR_V2_MAX_BLOCK_SIZE
+struct assoofs_dir_record_v2 {
+    uint64_t inode_no;  //Inodo (0 si el registro esta libre)
+    uint16_t rec_len;   //Bytes del registro, incluido el hueco libre que le sigue
+    uint8_t name_len;   //Longitud del nombre, sin '\0'
+    uint8_t file_type;  //Tipo de fichero (ASSOOFS_FT_*)
+    char name[];
+};
+
+#define ASSOOFS_DIR_V2_MAX_BLOCK_SIZE 32768
+
+//Tipos de fichero de las entradas (los mismos valores que FT_* del kernel)
+#define ASSOOFS_FT_UNKNOWN 0
+#define ASSOOFS_FT_REG_FILE 1
+#define ASSOOFS_FT_DIR 2
+#define ASSOOFS_FT_MAX 8
+
+//Bytes minimos de un registro v2 con un nombre de name_len caracteres
+#define ASSOOFS_DIR_V2_REC_LEN(name_len) ((offsetof(struct assoofs_dir_record_v2, name) + (name_len) + 7) & ~7UL)
+
+//Directorios indexados: cuando las entradas no caben en un bloque, el bloque logico 0 del directorio pasa a ser un
+//indice ordenado por hash del nombre y las entradas se reparten en hojas (bloques logicos 1..n). Cada entrada del
+//indice apunta a la hoja con los nombres cuyo hash es >= hash y menor que el de la entrada siguiente. Cuando la raiz
+//se llena el indice pasa a tener dos niveles (ASSOOFS_FEATURE_DX_TREE): la raiz apunta a nodos intermedios con el
+//mismo formato, que son los que apuntan a las hojas. Los nodos van en los bloques logicos desde ASSOOFS_DX_NODE_BASE,
+//asi que las hojas siguen numeradas seguidas
+struct assoofs_dx_entry {
+    uint64_t hash;  //Menor hash de la hoja o del nodo (el de la primera entrada del bloque es el del propio bloque)
+    uint64_t block; //Bloque logico de la hoja o del nodo dentro del directorio
+};
+
+//Cabecera de la raiz y de los nodos. Ocupa lo mismo que el count de 64 bits de antes, que nunca pasaba de 16 bits:
+//en una raiz antigua levels y leaves valen 0
+struct assoofs_dx_root {
+    uint16_t count;     //Entradas usadas del bloque
+    uint8_t levels;     //Solo en la raiz: 1 si sus entradas apuntan a nodos intermedios y no a hojas
+    uint8_t reserved;
+    uint32_t leaves;    //Solo en la raiz con levels 1: numero de hojas (con levels 0 son count y aqui va 0)
+    struct assoofs_dx_entry entries[];
+};
+
+#define ASSOOFS_DX_LIMIT(bs) (((bs) - sizeof(struct assoofs_dx_root)) / sizeof(struct assoofs_dx_entry))
+#define ASSOOFS_DX_NODE_BASE (1ULL << 32)   //Bloque logico del primer nodo intermedio, detras de cualquier hoja
+#define ASSOOFS_DX_NODE_LBLK(k) (ASSOOFS_DX_NODE_BASE + (k))
+//Bloques de un directorio que se reservan como mucho de una vez (ver assoofs_dir_prealloc)
+#define ASSOOFS_DIR_PREALLOC_MAX 256
+
+//Hash de los nombres para el indice de directorios (FNV-1a de 32 bits)
+static inline uint64_t assoofs_name_hash(const char *name, size_t len)
+{
+    uint32_t hash = 2166136261u;
+
+    while (len--) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+//Extent: tramo de bloques contiguos en disco que pertenecen a un mismo fichero
+struct assoofs_extent {
+    uint64_t ee_block;  //Primer bloque logico del fichero que cubre el extent
+    uint64_t ee_len;    //Numero de bloques del tramo
+    uint64_t ee_start;  //Primer bloque fisico del tramo en el dispositivo
+};
+
+#define ASSOOFS_INODE_EXTENTS 4 //Extents que caben dentro del propio inodo
+//Extents que caben en el bloque de desbordamiento (ficheros muy fragmentados)
+#define ASSOOFS_EXTENTS_PER_BLOCK(bs) ((bs) / sizeof(struct assoofs_extent))
+#define ASSOOFS_MAX_EXTENTS(bs) (ASSOOFS_INODE_EXTENTS + ASSOOFS_EXTENTS_PER_BLOCK(bs))
+
+/*
+ *  Ficheros comprimidos. Los datos se comprimen con LZ4 en clusters de ASSOOFS_CLUSTER_SIZE bytes. Un cluster que
+ *  comprimido ocupa menos bloques se guarda en un extent marcado con ASSOOFS_EXTENT_COMPRESSED en ee_len: la parte
+ *  baja sigue siendo la longitud logica (clusters enteros) y los bits 32..47 los bloques que ocupa en disco cada
+ *  cluster (plen, potencia de 2 para que los clusters seguidos con una compresion parecida compartan extent). El
+ *  cluster k del extent empieza en ee_start + k * plen con una assoofs_cluster_header. Lo que no se comprime se
+ *  guarda en extents normales, como en cualquier otro fichero
+ */
+#define ASSOOFS_CLUSTER_SIZE 65536
+#define ASSOOFS_CLUSTER_BLOCKS(bs) (ASSOOFS_CLUSTER_SIZE / (bs))
+#define ASSOOFS_EXTENT_COMPRESSED (1ULL << 63)
+#define ASSOOFS_EXTENT_LEN(ee_len) ((ee_len) & 0xffffffffULL)
+#define ASSOOFS_EXTENT_PLEN(ee_len) (((ee_len) >> 32) & 0xffffULL)
+#define ASSOOFS_EXTENT_MAKE_COMPRESSED(len, plen) (ASSOOFS_EXTENT_COMPRESSED | ((uint64_t)(plen) << 32) | (len))
+
+struct assoofs_cluster_header {
+    uint32_t size;      //Bytes de datos LZ4 que siguen a la cabecera
+    uint32_t checksum;  //crc32_le(~0) de esos bytes: un cluster a medio escribir no se descomprime
 };
 
-//Informacion de los inodos
+//Bloques que ocupa en disco un extent
+static inline uint64_t assoofs_extent_blocks(const struct assoofs_extent *ext, uint64_t bs)
+{
+    if (!(ext->ee_len & ASSOOFS_EXTENT_COMPRESSED))
+        return ext->ee_len;
+    return ASSOOFS_EXTENT_LEN(ext->ee_len) / ASSOOFS_CLUSTER_BLOCKS(bs) * ASSOOFS_EXTENT_PLEN(ext->ee_len);
+}
+
+//Flags del inodo
+#define ASSOOFS_INODE_DIR_INDEX 0x1 //Directorio con indice hash (ver assoofs_dx_root)
+#define ASSOOFS_INODE_INLINE 0x2    //Fichero pequenio guardado dentro del propio inodo (inline_data)
+#define ASSOOFS_INODE_DIR_V2 0x4    //Directorio con entradas de longitud variable (assoofs_dir_record_v2)
+#define ASSOOFS_INODE_COMPRESSED 0x8    //Fichero con los datos comprimidos por clusters (ver assoofs_cluster_header)
+#define ASSOOFS_INODE_SHARED 0x10   //Fichero clonado: puede tener bloques compartidos que se copian antes de escribir
+
+//Bytes de datos que caben dentro del inodo. Comparten sitio con los extents: un fichero inline no tiene bloques
+#define ASSOOFS_INLINE_DATA_MAX 192
+
+//Informacion de los inodos (256 bytes por inodo)
 struct assoofs_inode_info {
     mode_t mode;                //Permisos
     uint64_t inode_no;          //Numero de inodo
-    uint64_t data_block_number; //Numero de bloque
-    uint64_t remove_flag;       
+    uint64_t data_block_number; //Numero de bloque (primer bloque de datos, 0 si no tiene)
+    uint64_t remove_flag;       //REMOVED: ya no tiene nombre y sus bloques estan pendientes de liberar
     union {
         uint64_t file_size;             //Si es un archivo usa esta (tamannio archivo)
         uint64_t dir_children_count;    //Si es un directorio usa esta (numero de archivos dentro)
     };
+    uint64_t flags;             //ASSOOFS_INODE_*
+    uint64_t extent_count;      //Numero de extents usados
+    uint64_t extent_block;      //Bloque con los extents que no caben en el inodo (0 si no hay)
+    union {
+        struct assoofs_extent extents[ASSOOFS_INODE_EXTENTS];   //Mapa de bloques del fichero
+        char inline_data[ASSOOFS_INLINE_DATA_MAX];              //Contenido si el fichero es inline
+    };
 };
+
+//Inodos que caben en cada bloque de la tabla de inodos
+#define ASSOOFS_INODES_PER_BLOCK(bs) ((bs) / sizeof(struct assoofs_inode_info))
+//La tabla de inodos es un array de tamannio fijo: el inodo ino ocupa el hueco ino-1, asi que su bloque y su posicion
+//dentro del bloque se calculan directamente sin recorrer la tabla
+#define ASSOOFS_INODE_BLOCK(table_block, ino, bs) ((table_block) + ((ino) - 1) / ASSOOFS_INODES_PER_BLOCK(bs))
+#define ASSOOFS_INODE_SLOT(ino, bs) (((ino) - 1) % ASSOOFS_INODES_PER_BLOCK(bs))
+
+//Comprueba un tamannio de bloque leido del superbloque o pedido a mkassoofs
+static inline bool assoofs_block_size_valid(uint64_t bs, uint64_t features)
+{
+    if (bs < ASSOOFS_MIN_BLOCK_SIZE || bs > ASSOOFS_MAX_BLOCK_SIZE || (bs & (bs - 1)))
+        return false;
+    return !(features & ASSOOFS_FEATURE_DIR_V2) || bs <= ASSOOFS_DIR_V2_MAX_BLOCK_SIZE;
+}
+
+/*
+ *  Bloques de directorio. Un directorio pequenio guarda sus entradas en un unico bloque; cuando se llena, el bloque
+ *  logico 0 pasa a ser un indice (assoofs_dx_root) y las entradas se reparten en hojas. Dentro de cada bloque las
+ *  entradas pueden ser las fijas de siempre (v1) o las de longitud variable (v2, con ASSOOFS_INODE_DIR_V2). Estas
+ *  funciones son las unicas que conocen la diferencia y las usan igual el modulo y libassoofs
+ */
+
+//Entrada de un bloque de directorio, sea cual sea su formato
+struct assoofs_dirent {
+    const char *name;   //Sin '\0' al final en v2
+    unsigned int len;
+    uint64_t inode_no;
+    unsigned char type;     //ASSOOFS_FT_*
+    unsigned int offset;    //Donde empieza el registro dentro del bloque
+};
+
+static inline bool assoofs_dir_is_v2(struct assoofs_inode_info *dir_info)
+{
+    return dir_info->flags & ASSOOFS_INODE_DIR_V2;
+}
+
+//Bytes de un bloque del directorio que hay que recorrer. Un directorio v1 lineal solo tiene ocupados los
+//dir_children_count primeros huecos; las hojas y los bloques v2 se recorren enteros. bs es el tamannio del bloque
+static inline unsigned int assoofs_dir_limit(struct assoofs_inode_info *dir_info, unsigned int bs)
+{
+    if (assoofs_dir_is_v2(dir_info) || (dir_info->flags & ASSOOFS_INODE_DIR_INDEX))
+        return bs;
+    if (dir_info->dir_children_count < ASSOOFS_DIR_RECORDS_PER_BLOCK(bs))
+        return dir_info->dir_children_count * sizeof(struct assoofs_dir_record_entry);
+    return ASSOOFS_DIR_RECORDS_PER_BLOCK(bs) * sizeof(struct assoofs_dir_record_entry);
+}
+
+//Devuelve en de la siguiente entrada ocupada de data a partir de *offset, sin pasar de limit, y deja *offset justo
+//detras de ella. Devuelve false cuando no quedan mas (o el bloque esta corrupto)
+static inline bool assoofs_dir_next(struct assoofs_inode_info *dir_info, char *data, unsigned int limit, unsigned int *offset, struct assoofs_dirent *de)
+{
+    struct assoofs_dir_record_entry *record;
+    struct assoofs_dir_record_v2 *rec;
+
+    if (!assoofs_dir_is_v2(dir_info))
+    {
+        for (; *offset + sizeof(*record) <= limit; *offset += sizeof(*record))
+        {
+            record = (struct assoofs_dir_record_entry *)(data + *offset);
+            if (!record->inode_no)
+                continue;
+            de->name = record->filename;
+            de->len = strnlen(record->filename, ASSOOFS_FILENAME_MAXLEN);
+            de->inode_no = record->inode_no;
+            //Los directorios de antes no rellenaban este byte: si no es un tipo valido se deja sin tipo
+            de->type = record->file_type < ASSOOFS_FT_MAX ? record->file_type : ASSOOFS_FT_UNKNOWN;
+            de->offset = *offset;
+            *offset += sizeof(*record);
+            return true;
+        }
+        return false;
+    }
+
+    while (*offset < limit)
+    {
+        rec = (struct assoofs_dir_record_v2 *)(data + *offset);
+        if (rec->rec_len < ASSOOFS_DIR_V2_REC_LEN(rec->inode_no ? rec->name_len : 0) || rec->rec_len % 8 ||
+            *offset + rec->rec_len > limit)
+        {
+            assoofs_format_error("Corrupted directory record in inode %llu at offset %u\n", (unsigned long long)dir_info->inode_no, *offset);
+            return false;
+        }
+        de->offset = *offset;
+        *offset += rec->rec_len;
+        if (!rec->inode_no)
+            continue;
+        de->name = rec->name;
+        de->len = rec->name_len;
+        de->inode_no = rec->inode_no;
+        de->type = rec->file_type;
+        return true;
+    }
+    return false;
+}
+
+//Deja vacio un bloque del directorio: a cero en v1 y un unico registro libre que lo cubre entero en v2
+static inline void assoofs_dir_block_init(struct assoofs_inode_info *dir_info, char *data, unsigned int bs)
+{
+    memset(data, 0, bs);
+    if (assoofs_dir_is_v2(dir_info))
+        ((struct assoofs_dir_record_v2 *)data)->rec_len = bs;
+}
+
+//Mete de en el primer sitio libre del bloque donde quepa. Devuelve -ENOSPC si el bloque esta lleno
+static inline int assoofs_dir_block_add(struct assoofs_inode_info *dir_info, char *data, unsigned int bs, const struct assoofs_dirent *de)
+{
+    struct assoofs_dir_record_entry *record = (struct assoofs_dir_record_entry *)data;
+    struct assoofs_dir_record_v2 *rec, *new_rec;
+    unsigned int offset, used, need = ASSOOFS_DIR_V2_REC_LEN(de->len);
+    uint64_t i;
+
+    if (!assoofs_dir_is_v2(dir_info))
+    {
+        //Un directorio lineal crece por el final; en las hojas los huecos libres tienen inode_no 0
+        if (dir_info->flags & ASSOOFS_INODE_DIR_INDEX)
+            for (i = 0; i < ASSOOFS_DIR_RECORDS_PER_BLOCK(bs) && record[i].inode_no; i++)
+                ;
+        else
+            i = dir_info->dir_children_count;
+        if (i >= ASSOOFS_DIR_RECORDS_PER_BLOCK(bs))
+            return -ENOSPC;
+
+        memset(record[i].filename, 0, ASSOOFS_FILENAME_MAXLEN);
+        memcpy(record[i].filename, de->name, de->len);
+        record[i].file_type = de->type;
+        record[i].inode_no = de->inode_no;
+        record[i].remove_flag = NO_REMOVED;
+        return 0;
+    }
+
+    for (offset = 0; offset < bs; offset += rec->rec_len)
+    {
+        rec = (struct assoofs_dir_record_v2 *)(data + offset);
+        if (rec->rec_len < ASSOOFS_DIR_V2_REC_LEN(0) || rec->rec_len % 8 || offset + rec->rec_len > bs)
+        {
+            assoofs_format_error("Corrupted directory record in inode %llu at offset %u\n", (unsigned long long)dir_info->inode_no, offset);
+            return -EIO;
+        }
+
+        used = rec->inode_no ? ASSOOFS_DIR_V2_REC_LEN(rec->name_len) : 0;
+        if (rec->rec_len < used + need)
+            continue;
+
+        if (used)
+        {
+            //El registro tiene sitio de sobra detras de su nombre: se queda con lo suyo y el resto es la entrada nueva
+            new_rec = (struct assoofs_dir_record_v2 *)(data + offset + used);
+            new_rec->rec_len = rec->rec_len - used;
+            rec->rec_len = used;
+            rec = new_rec;
+        }
+        rec->inode_no = de->inode_no;
+        rec->name_len = de->len;
+        rec->file_type = de->type;
+        memcpy(rec->name, de->name, de->len);
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+//Quita de un bloque la entrada de (devuelta por assoofs_dir_next) sin mover las demas, para que las posiciones de
+//readdir de las que quedan sigan valiendo
+static inline void assoofs_dir_block_del(struct assoofs_inode_info *dir_info, char *data, const struct assoofs_dirent *de)
+{
+    struct assoofs_dir_record_v2 *rec, *prev = NULL;
+    unsigned int offset;
+
+    if (!assoofs_dir_is_v2(dir_info))
+    {
+        memset(data + de->offset, 0, sizeof(struct assoofs_dir_record_entry));
+        return;
+    }
+
+    //En v2 el registro pasa a ser hueco del anterior; si es el primero del bloque se queda como registro libre
+    for (offset = 0; offset < de->offset; offset += prev->rec_len)
+        prev = (struct assoofs_dir_record_v2 *)(data + offset);
+    rec = (struct assoofs_dir_record_v2 *)(data + de->offset);
+    if (prev)
+        prev->rec_len += rec->rec_len;
+    else
+        rec->inode_no = 0;
+}
+
+//Numero de hojas de un directorio indexado: las hojas son los bloques logicos 1..assoofs_dx_leaves
+static inline uint64_t assoofs_dx_leaves(const struct assoofs_dx_root *root)
+{
+    return root->levels ? root->leaves : root->count;
+}
+
+//Comprueba la cabecera de la raiz (is_root) o de un nodo intermedio del indice. bs es el tamannio del bloque
+static inline bool assoofs_dx_valid(const struct assoofs_dx_root *dx, uint64_t bs, bool is_root)
+{
+    if (dx->count == 0 || dx->count > ASSOOFS_DX_LIMIT(bs) || dx->reserved)
+        return false;
+    if (!is_root || !dx->levels)
+        return !dx->levels && !dx->leaves;
+    return dx->levels == 1 && dx->leaves >= dx->count;
+}
+
+//Bloques que se reservan de una vez al estrenar el bloque logico lblk de un directorio: tantos como hojas (o nodos)
+//hay antes, hasta ASSOOFS_DIR_PREALLOC_MAX. Asi las hojas de un directorio grande quedan en pocos extents aunque
+//entre una y otra se reserven bloques para otros ficheros. Los que sobran no se leen hasta que se usan
+static inline uint64_t assoofs_dir_prealloc(uint64_t lblk)
+{
+    uint64_t n = lblk >= ASSOOFS_DX_NODE_BASE ? lblk - ASSOOFS_DX_NODE_BASE : lblk;
+
+    return n < 1 ? 1 : n > ASSOOFS_DIR_PREALLOC_MAX ? ASSOOFS_DIR_PREALLOC_MAX : n;
+}
+
+//Entrada de un bloque del indice que le corresponde a hash: la ultima con hash <= hash
+static inline uint64_t assoofs_dx_find(const struct assoofs_dx_root *root, uint64_t hash)
+{
+    uint64_t lo = 0, hi = root->count - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi + 1) / 2;
+        if (root->entries[mid].hash <= hash)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+#endif
@@ -0,0 +1,484 @@
+//BENCHMARK DE ASSOOFS: CARGAS FIJAS DE METADATOS Y DATOS CON SALIDA EN JSON
+//Uso: assoofs_bench [-n ficheros] [-s MB] [-r repeticiones] (-d <directorio montado> | -i <imagen>)
+//Con -d mide el modulo a traves de las llamadas al sistema sobre un assoofs montado; con -i mide libassoofs
+//directamente sobre la imagen (sin root ni modulo). Las dos pasan por las mismas cargas con las mismas semillas
+//El truncate de small_file_churn es el de verdad en las dos: con -d ftruncate pasa por assoofs_setattr, que libera los
+//bloques de detras del nuevo final; con -i assoofs_set_size los pone a cero y los deja en el fichero. El JSON lo dice
+//en "truncate" para que no se comparen sin saberlo
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+#define IO_SIZE (64 * 1024)     //Tamannio de cada escritura/lectura secuencial
+#define RAND_IO_SIZE 4096       //Tamannio de cada escritura/lectura aleatoria
+#define CHURN_MAX_SIZE 4096     //Los ficheros pequennios tienen entre 1 byte y 4K
+#define SEED 20200406           //Semilla fija para que dos ejecuciones hagan exactamente lo mismo
+
+static int nfiles = 10000;      //Ficheros de las cargas de metadatos (/big pasa a tener el indice en dos niveles)
+static int file_mb = 64;        //Tamannio del fichero de las cargas de datos
+static int repeat = 20;         //Veces que se lista el directorio grande
+
+//Operaciones que necesita cada carga. Un handle es un descriptor (-d) o un numero de inodo (-i)
+struct bench_backend {
+    const char *name;
+    int (*create)(const char *path, int64_t *handle);
+    int (*mkdir)(const char *path);
+    int (*open)(const char *path, int64_t *handle);
+    void (*close)(int64_t handle);
+    int (*stat)(const char *path);
+    int (*readdir)(const char *path, uint64_t *count);
+    ssize_t (*pread)(int64_t handle, void *buf, size_t len, uint64_t off);
+    ssize_t (*pwrite)(int64_t handle, const void *buf, size_t len, uint64_t off);
+    int (*truncate)(int64_t handle, uint64_t size);
+    int (*sync)(void);
+    const char *truncate_mode;  //Que hace truncate con los bloques de detras del nuevo final (sale en el JSON)
+};
+
+/*
+ *  Modulo del kernel: llamadas al sistema sobre el punto de montaje
+ */
+
+static const char *mountpoint;
+
+static const char *kpath(const char *path) {
+    static char buf[4096];
+
+    snprintf(buf, sizeof(buf), "%s%s", mountpoint, path);
+    return buf;
+}
+
+static int k_create(const char *path, int64_t *handle) {
+    int fd = open(kpath(path), O_CREAT | O_EXCL | O_RDWR, 0644);
+
+    *handle = fd;
+    return fd == -1 ? -1 : 0;
+}
+
+static int k_mkdir(const char *path) {
+    return mkdir(kpath(path), 0755);
+}
+
+static int k_open(const char *path, int64_t *handle) {
+    int fd = open(kpath(path), O_RDWR);
+
+    *handle = fd;
+    return fd == -1 ? -1 : 0;
+}
+
+static void k_close(int64_t handle) {
+    close(handle);
+}
+
+static int k_stat(const char *path) {
+    struct stat st;
+
+    return stat(kpath(path), &st);
+}
+
+static int k_readdir(const char *path, uint64_t *count) {
+    DIR *dir = opendir(kpath(path));
+
+    if (!dir)
+        return -1;
+    for (*count = 0; readdir(dir); (*count)++)
+        ;
+    closedir(dir);
+    return 0;
+}
+
+static ssize_t k_pread(int64_t handle, void *buf, size_t len, uint64_t off) {
+    return pread(handle, buf, len, off);
+}
+
+static ssize_t k_pwrite(int64_t handle, const void *buf, size_t len, uint64_t off) {
+    return pwrite(handle, buf, len, off);
+}
+
+static int k_truncate(int64_t handle, uint64_t size) {
+    return ftruncate(handle, size);
+}
+
+static int k_sync(void) {
+    sync();
+    return 0;
+}
+
+static const struct bench_backend kernel_backend = {
+    .name = "kernel",
+    .create = k_create,
+    .mkdir = k_mkdir,
+    .open = k_open,
+    .close = k_close,
+    .stat = k_stat,
+    .readdir = k_readdir,
+    .pread = k_pread,
+    .pwrite = k_pwrite,
+    .truncate = k_truncate,
+    .sync = k_sync,
+    .truncate_mode = "setattr frees blocks",
+};
+
+/*
+ *  libassoofs sobre la imagen
+ */
+
+static struct assoofs_fs *fs;
+
+//libassoofs devuelve -errno: se pasa a errno para que los errores se cuenten igual que con el modulo
+static ssize_t l_ret(ssize_t ret) {
+    if (ret >= 0)
+        return ret;
+    errno = -ret;
+    return -1;
+}
+
+//Directorio padre y nombre final de path
+static int l_parent(const char *path, uint64_t *dir, const char **name) {
+    char parent[4096];
+    const char *slash = strrchr(path, '/');
+
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+    *name = slash + 1;
+    return l_ret(assoofs_resolve(fs, parent, dir));
+}
+
+static int l_create(const char *path, int64_t *handle) {
+    const char *name;
+    uint64_t dir, ino;
+
+    if (l_parent(path, &dir, &name) || l_ret(assoofs_create(fs, dir, name, 0644, &ino)))
+        return -1;
+    *handle = ino;
+    return 0;
+}
+
+static int l_mkdir(const char *path) {
+    const char *name;
+    uint64_t dir, ino;
+
+    return l_parent(path, &dir, &name) || l_ret(assoofs_mkdir(fs, dir, name, 0755, &ino)) ? -1 : 0;
+}
+
+static int l_open(const char *path, int64_t *handle) {
+    uint64_t ino;
+
+    if (l_ret(assoofs_resolve(fs, path, &ino)))
+        return -1;
+    *handle = ino;
+    return 0;
+}
+
+static void l_close(int64_t handle) {
+    (void)handle;
+}
+
+static int l_stat(const char *path) {
+    struct assoofs_inode_info info;
+    uint64_t ino;
+
+    return l_ret(assoofs_resolve(fs, path, &ino)) || l_ret(assoofs_get_inode(fs, ino, &info)) ? -1 : 0;
+}
+
+static int l_count(void *arg, const char *name, unsigned int len, uint64_t ino, unsigned int type, uint64_t next_pos) {
+    (void)name;
+    (void)len;
+    (void)ino;
+    (void)type;
+    (void)next_pos;
+    (*(uint64_t *)arg)++;
+    return 0;
+}
+
+static int l_readdir(const char *path, uint64_t *count) {
+    uint64_t ino, pos = 0;
+
+    *count = 2; //. y .., como readdir(3)
+    return l_ret(assoofs_resolve(fs, path, &ino)) || l_ret(assoofs_readdir(fs, ino, &pos, l_count, count)) ? -1 : 0;
+}
+
+static ssize_t l_pread(int64_t handle, void *buf, size_t len, uint64_t off) {
+    return l_ret(assoofs_read(fs, handle, buf, len, off));
+}
+
+static ssize_t l_pwrite(int64_t handle, const void *buf, size_t len, uint64_t off) {
+    return l_ret(assoofs_write(fs, handle, buf, len, off));
+}
+
+static int l_truncate(int64_t handle, uint64_t size) {
+    return l_ret(assoofs_set_size(fs, handle, size));
+}
+
+static int l_sync(void) {
+    return l_ret(assoofs_sync(fs));
+}
+
+static const struct bench_backend lib_backend = {
+    .name = "libassoofs",
+    .create = l_create,
+    .mkdir = l_mkdir,
+    .open = l_open,
+    .close = l_close,
+    .stat = l_stat,
+    .readdir = l_readdir,
+    .pread = l_pread,
+    .pwrite = l_pwrite,
+    .truncate = l_truncate,
+    .sync = l_sync,
+    .truncate_mode = "set_size zeroes blocks",
+};
+
+/*
+ *  Medidas
+ */
+
+static const struct bench_backend *be;
+static uint64_t *lat;       //Latencia de cada operacion de la carga en curso (ns)
+static uint64_t nlat;
+static uint64_t start_ns;   //Inicio de la carga en curso
+static int first = 1;       //Para las comas del JSON
+
+//Sale por un error. Con -i antes cierra la imagen: si no, fsck la encuentra sin desmontar
+static void bench_exit(void) {
+    if (fs)
+        assoofs_close(fs);
+    exit(1);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void begin(uint64_t ops) {
+    lat = realloc(lat, ops * sizeof(*lat));
+    if (!lat) {
+        perror("Error allocating the latency array");
+        bench_exit();
+    }
+    nlat = 0;
+    start_ns = now_ns();
+}
+
+//Macro para medir una operacion: guarda su latencia y sale si falla
+#define TIMED(expr, what) do { \
+    uint64_t t0 = now_ns(); \
+    if ((expr) < 0) { \
+        perror("Error in " what); \
+        bench_exit(); \
+    } \
+    lat[nlat++] = now_ns() - t0; \
+} while (0)
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+//Escribe el resultado de la carga: ops/s sobre el tiempo total y percentiles de las latencias individuales
+static void end(const char *name, uint64_t bytes) {
+    double secs = (now_ns() - start_ns) / 1e9;
+
+    qsort(lat, nlat, sizeof(*lat), cmp_u64);
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f",
+           first ? "" : ",", name, (unsigned long long)nlat, secs, nlat / secs,
+           lat[nlat / 2] / 1e3, lat[nlat * 99 / 100] / 1e3, lat[nlat - 1] / 1e3);
+    if (bytes)
+        printf(", \"mb_per_sec\": %.1f", bytes / secs / (1024 * 1024));
+    printf("}");
+    first = 0;
+}
+
+/*
+ *  Cargas
+ */
+
+//Crea nfiles ficheros vacios en un directorio nuevo (directorio grande: pasa a indexado enseguida)
+static void bench_create(void) {
+    char path[64];
+    int64_t h;
+    int i;
+
+    if (be->mkdir("/big")) {
+        perror("Error creating /big");
+        bench_exit();
+    }
+    begin(nfiles);
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "/big/f%08d", i);
+        TIMED(be->create(path, &h), "create");
+        be->close(h);
+    }
+    end("create", 0);
+}
+
+//stat de los ficheros de /big en un orden aleatorio fijo (cada uno es un lookup en frio de la entrada)
+static void bench_stat(void) {
+    char path[64];
+    int i;
+
+    begin(nfiles);
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "/big/f%08d", (int)(lrand48() % nfiles));
+        TIMED(be->stat(path), "stat");
+    }
+    end("stat", 0);
+}
+
+static void bench_readdir(void) {
+    uint64_t count;
+    int i;
+
+    begin(repeat);
+    for (i = 0; i < repeat; i++) {
+        TIMED(be->readdir("/big", &count), "readdir");
+        if (count != (uint64_t)nfiles + 2) {
+            fprintf(stderr, "readdir returned %llu entries instead of %d\n", (unsigned long long)count, nfiles + 2);
+            bench_exit();
+        }
+    }
+    end("readdir", 0);
+}
+
+static void bench_seq(char *buf) {
+    uint64_t size = (uint64_t)file_mb * 1024 * 1024, off;
+    int64_t h;
+
+    if (be->create("/data", &h)) {
+        perror("Error creating /data");
+        bench_exit();
+    }
+    begin(size / IO_SIZE);
+    for (off = 0; off < size; off += IO_SIZE)
+        TIMED(be->pwrite(h, buf, IO_SIZE, off), "sequential write");
+    be->sync();
+    end("seq_write", size);
+
+    begin(size / IO_SIZE);
+    for (off = 0; off < size; off += IO_SIZE)
+        TIMED(be->pread(h, buf, IO_SIZE, off), "sequential read");
+    end("seq_read", size);
+    be->close(h);
+}
+
+static void bench_rand(char *buf) {
+    uint64_t blocks = (uint64_t)file_mb * 1024 * 1024 / RAND_IO_SIZE, ops = blocks / 4, i;
+    int64_t h;
+
+    if (be->open("/data", &h)) {
+        perror("Error opening /data");
+        bench_exit();
+    }
+    begin(ops);
+    for (i = 0; i < ops; i++)
+        TIMED(be->pwrite(h, buf, RAND_IO_SIZE, (lrand48() % blocks) * RAND_IO_SIZE), "random write");
+    be->sync();
+    end("rand_write", ops * RAND_IO_SIZE);
+
+    begin(ops);
+    for (i = 0; i < ops; i++)
+        TIMED(be->pread(h, buf, RAND_IO_SIZE, (lrand48() % blocks) * RAND_IO_SIZE), "random read");
+    end("rand_read", ops * RAND_IO_SIZE);
+    be->close(h);
+}
+
+//Ficheros pequennios: crear, escribir, leer y vaciar (cada vuelta son cuatro operaciones medidas por separado)
+static void bench_churn(char *buf) {
+    char path[64];
+    size_t size;
+    int64_t h;
+    int i;
+
+    if (be->mkdir("/small")) {
+        perror("Error creating /small");
+        bench_exit();
+    }
+    begin((uint64_t)nfiles * 4);
+    for (i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "/small/s%08d", i);
+        size = 1 + lrand48() % CHURN_MAX_SIZE;
+        TIMED(be->create(path, &h), "churn create");
+        TIMED(be->pwrite(h, buf, size, 0), "churn write");
+        TIMED(be->pread(h, buf, size, 0), "churn read");
+        TIMED(be->truncate(h, 0), "churn truncate");
+        be->close(h);
+    }
+    end("small_file_churn", 0);
+}
+
+int main(int argc, char **argv) {
+    const char *image = NULL;
+    char *buf;
+    int opt, ret;
+
+    while ((opt = getopt(argc, argv, "n:s:r:d:i:")) != -1) {
+        switch (opt) {
+        case 'n':
+            nfiles = atoi(optarg);
+            break;
+        case 's':
+            file_mb = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            mountpoint = optarg;
+            be = &kernel_backend;
+            break;
+        case 'i':
+            image = optarg;
+            be = &lib_backend;
+            break;
+        default:
+            be = NULL;
+            optind = argc;
+            break;
+        }
+    }
+    if (!be || optind != argc || nfiles <= 0 || file_mb <= 0 || repeat <= 0) {
+        fprintf(stderr, "Usage: assoofs_bench [-n files] [-s MB] [-r repeat] (-d <mountpoint> | -i <image>)\n");
+        return 1;
+    }
+
+    if (image && (ret = assoofs_open(image, false, &fs))) {
+        fprintf(stderr, "Error opening %s: %s\n", image, strerror(-ret));
+        return 1;
+    }
+
+    buf = malloc(IO_SIZE);
+    if (!buf) {
+        perror("Error allocating the I/O buffer");
+        bench_exit();
+    }
+    memset(buf, 0xa5, IO_SIZE);
+    srand48(SEED);
+
+    printf("{\n  \"backend\": \"%s\", \"files\": %d, \"file_mb\": %d, \"seed\": %d, \"truncate\": \"%s\",\n  \"workloads\": [",
+           be->name, nfiles, file_mb, SEED, be->truncate_mode);
+    bench_create();
+    bench_stat();
+    bench_readdir();
+    bench_seq(buf);
+    bench_rand(buf);
+    bench_churn(buf);
+    printf("\n  ]\n}\n");
+
+    free(buf);
+    free(lat);
+    if (fs)
+        assoofs_close(fs);
+    return 0;
+}
@@ -0,0 +1,41 @@
+#!/bin/sh
+#Ejecuta assoofs_bench sobre una imagen recien formateada con mkassoofs y deja el resultado en JSON
+#Con root y assoofs.ko compilado monta la imagen con un loop y mide el modulo; si no, mide libassoofs sobre la imagen
+#Variables: BENCH_SIZE (tamannio de la imagen, 512M), BENCH_ARGS (opciones de assoofs_bench), BENCH_MKFS (opciones de
+#mkassoofs, p.ej. "-O dir_v2"), BENCH_OUT (fichero de salida, bench.json)
+#El truncate de la carga small_file_churn es real con el modulo (assoofs_setattr libera los bloques); el campo
+#"truncate" del JSON dice que ha hecho cada backend
+
+set -e
+
+SIZE=${BENCH_SIZE:-512M}
+OUT=${BENCH_OUT:-bench.json}
+DIR=$(mktemp -d)
+IMG=$DIR/assoofs.img
+MNT=$DIR/mnt
+LOOP=
+
+cleanup() {
+    if mountpoint -q "$MNT" 2>/dev/null; then umount "$MNT"; fi
+    if [ -n "$LOOP" ]; then losetup -d "$LOOP"; fi
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+truncate -s "$SIZE" "$IMG"
+./mkassoofs $BENCH_MKFS "$IMG" >/dev/null
+
+if [ "$(id -u)" = 0 ] && [ -f assoofs.ko ]; then
+    #insmod no carga dependencias: el modulo usa el LZ4 del kernel, que puede ser un modulo aparte
+    modprobe -a lz4_compress lz4_decompress 2>/dev/null || true
+    grep -q '^assoofs ' /proc/modules || insmod assoofs.ko
+    LOOP=$(losetup -f --show "$IMG")
+    mkdir "$MNT"
+    mount -t assoofs "$LOOP" "$MNT"
+    ./assoofs_bench $BENCH_ARGS -d "$MNT" > "$OUT"
+else
+    echo "Not root or assoofs.ko not built: measuring libassoofs on the image" >&2
+    ./assoofs_bench $BENCH_ARGS -i "$IMG" > "$OUT"
+fi
+
+cat "$OUT"
@@ -0,0 +1,223 @@
+//DEMONIO FUSE: MONTA UNA IMAGEN ASSOOFS SIN EL MODULO DEL KERNEL, SOBRE LIBASSOOFS
+//Uso: assoofs_fuse <imagen> <punto de montaje> [opciones de fuse]
+
+#define FUSE_USE_VERSION 31
+
+#include <fuse.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+static uint64_t block_size;     //Tamannio del bloque de la imagen
+
+static struct assoofs_fs *get_fs(void) {
+    return fuse_get_context()->private_data;
+}
+
+static int afs_getattr(const char *path, struct stat *st, struct fuse_file_info *fi) {
+    struct assoofs_inode_info info;
+    uint64_t ino;
+    int ret;
+
+    if (fi && fi->fh)
+        ino = fi->fh;
+    else if ((ret = assoofs_resolve(get_fs(), path, &ino)))
+        return ret;
+    if ((ret = assoofs_get_inode(get_fs(), ino, &info)))
+        return ret;
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    st->st_mode = info.mode;
+    st->st_nlink = S_ISDIR(info.mode) ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = S_ISDIR(info.mode) ? block_size : info.file_size;
+    st->st_blksize = block_size;
+    st->st_blocks = (st->st_size + 511) / 512;
+    return 0;
+}
+
+struct readdir_ctx {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+static int afs_filldir(void *arg, const char *name, unsigned int len, uint64_t ino, unsigned int type, uint64_t next_pos) {
+    struct readdir_ctx *ctx = arg;
+    struct stat st = { .st_ino = ino };
+    char fname[ASSOOFS_FILENAME_MAXLEN + 1];
+
+    memcpy(fname, name, len);
+    fname[len] = '\0';
+    st.st_mode = type == ASSOOFS_FT_DIR ? S_IFDIR : S_IFREG;
+    return ctx->filler(ctx->buf, fname, &st, next_pos, 0);
+}
+
+//Con offsets: si el buffer se llena fuse vuelve a llamar desde la ultima entrada que cupo
+static int afs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    struct readdir_ctx ctx = { .buf = buf, .filler = filler };
+    uint64_t ino, pos = offset;
+    int ret;
+
+    (void)flags;
+    if (fi && fi->fh)
+        ino = fi->fh;
+    else if ((ret = assoofs_resolve(get_fs(), path, &ino)))
+        return ret;
+
+    //. y .. no estan en disco, como en assoofs_iterate
+    if (pos == 0 && filler(buf, ".", NULL, ++pos, 0))
+        return 0;
+    if (pos == 1 && filler(buf, "..", NULL, ++pos, 0))
+        return 0;
+    return assoofs_readdir(get_fs(), ino, &pos, afs_filldir, &ctx);
+}
+
+static int afs_open(const char *path, struct fuse_file_info *fi) {
+    uint64_t ino;
+    int ret;
+
+    if ((ret = assoofs_resolve(get_fs(), path, &ino)))
+        return ret;
+    fi->fh = ino;
+    if (fi->flags & O_TRUNC)
+        return assoofs_set_size(get_fs(), ino, 0);
+    return 0;
+}
+
+static int afs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    (void)path;
+    return assoofs_read(get_fs(), fi->fh, buf, size, offset);
+}
+
+static int afs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    (void)path;
+    return assoofs_write(get_fs(), fi->fh, buf, size, offset);
+}
+
+//Separa path en el inodo del directorio padre y el nombre final
+static int resolve_parent(const char *path, uint64_t *dir, const char **name) {
+    char parent[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+    size_t len = slash - path;
+
+    if (!slash || len >= sizeof(parent))
+        return -ENOENT;
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+    *name = slash + 1;
+    return assoofs_resolve(get_fs(), parent, dir);
+}
+
+static int afs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    const char *name;
+    uint64_t dir, ino;
+    int ret;
+
+    if (!S_ISREG(mode) && (mode & S_IFMT))
+        return -EPERM; //Solo ficheros normales y directorios
+    if ((ret = resolve_parent(path, &dir, &name)) || (ret = assoofs_create(get_fs(), dir, name, mode, &ino)))
+        return ret;
+    fi->fh = ino;
+    return 0;
+}
+
+static int afs_mkdir(const char *path, mode_t mode) {
+    const char *name;
+    uint64_t dir, ino;
+    int ret;
+
+    if ((ret = resolve_parent(path, &dir, &name)))
+        return ret;
+    return assoofs_mkdir(get_fs(), dir, name, mode, &ino);
+}
+
+static int afs_truncate(const char *path, off_t size, struct fuse_file_info *fi) {
+    uint64_t ino;
+    int ret;
+
+    if (fi && fi->fh)
+        ino = fi->fh;
+    else if ((ret = assoofs_resolve(get_fs(), path, &ino)))
+        return ret;
+    return assoofs_set_size(get_fs(), ino, size);
+}
+
+//assoofs no guarda fechas: se aceptan para que touch y compania no fallen
+static int afs_utimens(const char *path, const struct timespec tv[2], struct fuse_file_info *fi) {
+    (void)path;
+    (void)tv;
+    (void)fi;
+    return 0;
+}
+
+static int afs_statfs(const char *path, struct statvfs *st) {
+    struct assoofs_super_block_info sb;
+
+    (void)path;
+    assoofs_statfs(get_fs(), &sb);
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = st->f_frsize = sb.block_size;
+    st->f_blocks = sb.blocks_count;
+    st->f_bfree = st->f_bavail = sb.free_blocks;
+    st->f_files = sb.inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(sb.block_size);
+    st->f_ffree = st->f_favail = st->f_files - sb.inodes_count;
+    st->f_namemax = ASSOOFS_FILENAME_MAXLEN - 1;
+    return 0;
+}
+
+static int afs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void)path;
+    (void)datasync;
+    (void)fi;
+    return assoofs_sync(get_fs());
+}
+
+static void afs_destroy(void *private_data) {
+    assoofs_close(private_data);
+}
+
+static const struct fuse_operations afs_ops = {
+    .getattr = afs_getattr,
+    .readdir = afs_readdir,
+    .open = afs_open,
+    .read = afs_read,
+    .write = afs_write,
+    .create = afs_create,
+    .mkdir = afs_mkdir,
+    .truncate = afs_truncate,
+    .utimens = afs_utimens,
+    .statfs = afs_statfs,
+    .fsync = afs_fsync,
+    .destroy = afs_destroy,
+};
+
+int main(int argc, char **argv) {
+    struct assoofs_super_block_info sb;
+    struct assoofs_fs *fs;
+    int ret;
+
+    if (argc < 3) {
+        fprintf(stderr, "Usage: assoofs_fuse <image> <mountpoint> [fuse options]\n");
+        return 1;
+    }
+
+    ret = assoofs_open(argv[1], false, &fs);
+    if (ret) {
+        fprintf(stderr, "Error opening %s: %s\n", argv[1], strerror(-ret));
+        return 1;
+    }
+    assoofs_statfs(fs, &sb);
+    block_size = sb.block_size;
+
+    //La imagen no es una opcion de fuse: se quita de los argumentos
+    argv[1] = argv[0];
+    return fuse_main(argc - 1, argv + 1, &afs_ops, fs);
+}
@@ -0,0 +1,718 @@
+//FSCK.ASSOOFS: COMPRUEBA UNA IMAGEN ASSOOFS DESMONTADA Y, CON -y, REPARA LO QUE SE PUEDE
+//Uso: fsck.assoofs [-n | -y] [-j hilos] <imagen>
+
+/*
+ *  La imagen se mapea entera con mmap y se recorre en tres pasadas, cada una repartida por trozos entre varios hilos:
+ *    1. Tabla de inodos: cada inodo en uso tiene que tener sentido (tipo, flags, extents dentro de los bloques de
+ *       datos) y se apuntan las referencias a cada bloque. Un inodo que no lo tiene se borra de la tabla
+ *    2. Directorios: cada entrada tiene que apuntar a un inodo en uso y no borrado, y cada inodo tiene un solo nombre
+ *       (assoofs no tiene enlaces duros). Se comprueba dir_children_count y el indice de los directorios indexados
+ *    3. Mapa de bits: un bloque esta ocupado si y solo si es de los metadatos o algun inodo lo usa, y con reflink su
+ *       contador de referencias es el numero de duennos menos uno
+ *  Entre la 2 y la 3 se busca, siguiendo los padres, a que inodos no se llega desde el raiz: se marcan como borrados
+ *  (remove_flag) y el modulo los libera al montar, igual que los que quedan a medio borrar tras un corte de luz. Al
+ *  final se comprueban inodes_count y free_blocks del superbloque
+ *  Con -n (lo normal) la imagen se abre solo para leer. Codigos de salida los de e2fsck: 0 sin problemas, 1 todos
+ *  reparados, 4 quedan problemas sin reparar, 8 error al comprobar
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/fs.h>   //BLKGETSIZE64
+#include "assoofs.h"
+
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+#define CHUNK_BLOCKS 64 //Cada hilo coge la tabla de inodos y el mapa de bits por trozos de 64 bloques
+#define MAX_EXTENTS ASSOOFS_MAX_EXTENTS(ASSOOFS_MAX_BLOCK_SIZE)
+
+//Estado de cada hueco de la tabla de inodos (istate[ino - 1])
+#define I_USED 0x1      //Tiene el inodo ino y tiene sentido
+#define I_DIR 0x2
+#define I_REMOVED 0x4   //Borrado pendiente de liberar: no puede tener nombre pero sus bloques siguen siendo suyos
+#define I_REACHABLE 0x8 //Se llega a el desde el raiz
+#define I_LOST 0x10     //No se llega
+#define I_VISITING 0x20
+
+static bool repair;             //-y
+static long threads;            //-j (0 para uno por CPU)
+static char *image;             //La imagen entera, mapeada
+static struct assoofs_super_block_info sb;
+static uint64_t bs;             //Tamannio del bloque
+static uint64_t data_start;     //Primer bloque de datos (los anteriores son metadatos)
+static uint64_t inode_slots;    //Huecos de la tabla de inodos
+static uint8_t *istate;         //I_* de cada hueco
+static uint64_t *parent;        //Directorio donde esta el nombre de cada inodo (0 si no tiene)
+static uint32_t *refs;          //Extents (o bloques de desbordamiento) que usan cada bloque
+static bool tree_incomplete;    //Hay directorios que no se han podido leer enteros: no se sabe que inodos se pierden
+
+//Resultados, sumados por todos los hilos
+static uint64_t fixed, uncorrected, inodes_in_use, free_blocks;
+static pthread_mutex_t print_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *block(uint64_t nr) {
+    return image + nr * bs;
+}
+
+static struct assoofs_inode_info *inode(uint64_t ino) {
+    return (struct assoofs_inode_info *)block(ASSOOFS_INODE_BLOCK(sb.inode_table_block, ino, bs)) + ASSOOFS_INODE_SLOT(ino, bs);
+}
+
+//Cuenta y escribe un problema. fix dice como se arregla (NULL si no se puede): devuelve true si hay que arreglarlo
+static bool report(const char *fix, const char *fmt, ...) {
+    bool apply = repair && fix;
+    va_list ap;
+
+    pthread_mutex_lock(&print_lock);
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    printf(apply ? " (%s)\n" : "\n", fix);
+    pthread_mutex_unlock(&print_lock);
+    __atomic_fetch_add(apply ? &fixed : &uncorrected, 1, __ATOMIC_RELAXED);
+    return apply;
+}
+
+/*
+ *  Pasadas en paralelo: los hilos cogen el siguiente trozo de [0, total) hasta que no quedan
+ */
+
+static void (*pass_fn)(uint64_t first, uint64_t end);
+static uint64_t pass_total, pass_chunk, pass_next;
+
+static void *pass_worker(void *arg) {
+    uint64_t first;
+
+    (void)arg;
+    while ((first = __atomic_fetch_add(&pass_next, pass_chunk, __ATOMIC_RELAXED)) < pass_total)
+        pass_fn(first, first + pass_chunk < pass_total ? first + pass_chunk : pass_total);
+    return NULL;
+}
+
+static void run_pass(void (*fn)(uint64_t first, uint64_t end), uint64_t total, uint64_t chunk) {
+    pthread_t *tids = calloc(threads, sizeof(*tids));
+    long started = 0;
+
+    pass_fn = fn;
+    pass_total = total;
+    pass_chunk = chunk;
+    pass_next = 0;
+    while (tids && started < threads && !pthread_create(&tids[started], NULL, pass_worker, NULL))
+        started++;
+    if (!started)
+        pass_worker(NULL);  //Sin hilos lo hace este
+    while (started--)
+        pthread_join(tids[started], NULL);
+    free(tids);
+}
+
+/*
+ *  Journal: una transaccion completa que no se llego a aplicar se aplica antes de comprobar nada, como al montar
+ */
+
+//crc32_le del kernel (polinomio 0xedb88320, sin invertir al final)
+static uint32_t crc32_le(uint32_t crc, const unsigned char *p, size_t len) {
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+    }
+    return crc;
+}
+
+static int check_journal(void) {
+    struct assoofs_journal_super_block *jsb;
+    struct assoofs_journal_descriptor *descriptor;
+    struct assoofs_journal_commit *commit;
+    uint64_t max_blocks, count, i;
+    uint32_t crc;
+
+    if (!sb.journal_blocks)
+        return 0;
+    jsb = (struct assoofs_journal_super_block *)block(sb.journal_block);
+    descriptor = (struct assoofs_journal_descriptor *)block(sb.journal_block + 1);
+    max_blocks = sb.journal_blocks - 3;
+    count = descriptor->count;
+    if (jsb->header.magic != ASSOOFS_JOURNAL_MAGIC || jsb->header.type != ASSOOFS_JOURNAL_SUPERBLOCK) {
+        //Vacio como lo deja mkassoofs: la primera transaccion sera la 1
+        if (report("reinitialized", "The journal superblock is corrupted")) {
+            memset(block(sb.journal_block), 0, sb.journal_blocks * bs);
+            jsb->header.magic = ASSOOFS_JOURNAL_MAGIC;
+            jsb->header.type = ASSOOFS_JOURNAL_SUPERBLOCK;
+            jsb->header.sequence = 1;
+        }
+        return 0;
+    }
+
+    if (max_blocks > ASSOOFS_JOURNAL_DESCRIPTOR_MAX(bs))
+        max_blocks = ASSOOFS_JOURNAL_DESCRIPTOR_MAX(bs);
+    if (descriptor->header.magic != ASSOOFS_JOURNAL_MAGIC || descriptor->header.type != ASSOOFS_JOURNAL_DESCRIPTOR ||
+        descriptor->header.sequence != jsb->header.sequence || count == 0 || count > max_blocks)
+        return 0;
+    crc = crc32_le(~0, (unsigned char *)descriptor, bs);
+    for (i = 0; i < count; i++) {
+        if (descriptor->blocknr[i] >= sb.blocks_count)
+            return 0;
+        crc = crc32_le(crc, (unsigned char *)block(sb.journal_block + 2 + i), bs);
+    }
+    commit = (struct assoofs_journal_commit *)block(sb.journal_block + 2 + count);
+    if (commit->header.magic != ASSOOFS_JOURNAL_MAGIC || commit->header.type != ASSOOFS_JOURNAL_COMMIT ||
+        commit->header.sequence != jsb->header.sequence || commit->count != count || commit->checksum != crc)
+        return 0; //Transaccion a medias: el modulo la descarta
+
+    if (!repair) {
+        printf("The journal has a committed transaction that has not been applied: run with -y (or mount the image) to replay it before checking.\n");
+        return -1;
+    }
+    for (i = 0; i < count; i++)
+        memcpy(block(descriptor->blocknr[i]), block(sb.journal_block + 2 + i), bs);
+    jsb->header.sequence++;
+    printf("Replayed journal transaction %llu (%llu blocks).\n", (unsigned long long)jsb->header.sequence - 1, (unsigned long long)count);
+    memcpy(&sb, image, sizeof(sb)); //Puede traer un superbloque mas nuevo
+    return 0;
+}
+
+//Las mismas comprobaciones que assoofs_fill_super, y que todas las zonas del dispositivo esten en orden y dentro de el
+static bool sb_valid(void) {
+    if (sb.magic != ASSOOFS_MAGIC || !assoofs_block_size_valid(sb.block_size, sb.features)) {
+        printf("Not an assoofs image: magic %llx, block size %llu\n", (unsigned long long)sb.magic, (unsigned long long)sb.block_size);
+        return false;
+    }
+    if (sb.features & ~ASSOOFS_FEATURES_SUPPORTED) {
+        printf("Unsupported features:%llx\n", (unsigned long long)(sb.features & ~ASSOOFS_FEATURES_SUPPORTED));
+        return false;
+    }
+    bs = sb.block_size;
+    data_start = sb.journal_block + sb.journal_blocks;
+    if (sb.bitmap_block != ASSOOFS_BITMAP_BLOCK_NUMBER ||
+        sb.bitmap_blocks != (sb.blocks_count + ASSOOFS_BITS_PER_BLOCK(bs) - 1) / ASSOOFS_BITS_PER_BLOCK(bs) ||
+        ((sb.features & ASSOOFS_FEATURE_REFLINK) &&
+         (sb.refcount_block != sb.bitmap_block + sb.bitmap_blocks ||
+          sb.refcount_blocks != (sb.blocks_count + ASSOOFS_REFCOUNTS_PER_BLOCK(bs) - 1) / ASSOOFS_REFCOUNTS_PER_BLOCK(bs))) ||
+        sb.inode_table_block < sb.bitmap_block + sb.bitmap_blocks + sb.refcount_blocks || !sb.inode_table_blocks ||
+        sb.journal_block < sb.inode_table_block + sb.inode_table_blocks ||
+        (sb.journal_blocks && sb.journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS) || data_start > sb.blocks_count) {
+        printf("The superblock does not match the image\n");
+        return false;
+    }
+    inode_slots = sb.inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(bs);
+    return true;
+}
+
+/*
+ *  Pasada 1: tabla de inodos
+ */
+
+static bool in_data(uint64_t start, uint64_t count) {
+    return start >= data_start && start < sb.blocks_count && count <= sb.blocks_count - start;
+}
+
+//Copia en ext los extents del inodo (los del inodo y los del bloque de desbordamiento). Devuelve cuantos son o -1
+static long load_extents(const struct assoofs_inode_info *info, struct assoofs_extent *ext) {
+    uint64_t n = info->extent_count;
+
+    if (info->flags & ASSOOFS_INODE_INLINE)
+        return 0;   //Sus datos estan en el propio inodo
+    if (n > ASSOOFS_MAX_EXTENTS(bs) || (n > ASSOOFS_INODE_EXTENTS && !in_data(info->extent_block, 1)))
+        return -1;
+    memcpy(ext, info->extents, (n < ASSOOFS_INODE_EXTENTS ? n : ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    if (n > ASSOOFS_INODE_EXTENTS)
+        memcpy(ext + ASSOOFS_INODE_EXTENTS, block(info->extent_block), (n - ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    return n;
+}
+
+static int cmp_extents(const void *a, const void *b) {
+    const struct assoofs_extent *ea = a, *eb = b;
+
+    return ea->ee_block < eb->ee_block ? -1 : ea->ee_block > eb->ee_block;
+}
+
+//Devuelve por que el inodo no tiene sentido, o NULL si lo tiene. Deja en ext y *count sus extents
+static const char *check_inode(const struct assoofs_inode_info *info, struct assoofs_extent *ext, long *count) {
+    uint64_t cb = ASSOOFS_CLUSTER_BLOCKS(bs), len, plen, end = 0;
+    struct assoofs_extent sorted[MAX_EXTENTS];
+    long i;
+
+    if (!S_ISDIR(info->mode) && !S_ISREG(info->mode))
+        return "unknown file type";
+    if (info->remove_flag != NO_REMOVED && info->remove_flag != REMOVED)
+        return "bad remove flag";
+    if (S_ISDIR(info->mode) && (info->flags & (ASSOOFS_INODE_INLINE | ASSOOFS_INODE_COMPRESSED | ASSOOFS_INODE_SHARED)))
+        return "directory with file flags";
+    if (S_ISREG(info->mode) && (info->flags & (ASSOOFS_INODE_DIR_INDEX | ASSOOFS_INODE_DIR_V2)))
+        return "file with directory flags";
+    if ((*count = load_extents(info, ext)) < 0)
+        return "bad extent count or extent block";
+    if (info->extent_block && !in_data(info->extent_block, 1))
+        return "extent block outside the data blocks";
+
+    for (i = 0; i < *count; i++) {
+        len = ASSOOFS_EXTENT_LEN(ext[i].ee_len);
+        if (!len || ext[i].ee_block + len < ext[i].ee_block)
+            return "bad extent length";
+        if (ext[i].ee_len & ASSOOFS_EXTENT_COMPRESSED) {
+            plen = ASSOOFS_EXTENT_PLEN(ext[i].ee_len);
+            if (!(info->flags & ASSOOFS_INODE_COMPRESSED))
+                return "compressed extent in a file that is not compressed";
+            if (!plen || plen >= cb || ext[i].ee_block % cb || len % cb)
+                return "bad compressed extent";
+        } else if (ext[i].ee_len != len) {
+            return "bad extent length";
+        }
+        if (!in_data(ext[i].ee_start, assoofs_extent_blocks(&ext[i], bs)))
+            return "extent outside the data blocks";
+    }
+
+    //Los tramos logicos no se pueden pisar (los extents no tienen por que estar en orden)
+    memcpy(sorted, ext, *count * sizeof(*ext));
+    qsort(sorted, *count, sizeof(*sorted), cmp_extents);
+    for (i = 0; i < *count; end = sorted[i].ee_block + ASSOOFS_EXTENT_LEN(sorted[i].ee_len), i++)
+        if (i && sorted[i].ee_block < end)
+            return "overlapping extents";
+    if (S_ISDIR(info->mode) && (!*count || sorted[0].ee_block))
+        return "directory without blocks";
+    return NULL;
+}
+
+static void check_inodes(uint64_t first, uint64_t end) {
+    struct assoofs_extent ext[MAX_EXTENTS];
+    struct assoofs_inode_info *info;
+    uint64_t slot, ino, b, used = 0;
+    const char *why;
+    long count, i;
+
+    for (slot = first; slot < end; slot++) {
+        ino = slot + 1;
+        info = inode(ino);
+        if (!info->inode_no)
+            continue;   //Libre
+        if (info->inode_no != ino) {
+            //El modulo lo trata como libre y lo machaca en el siguiente create
+            if (report("cleared", "Inode slot %llu holds inode %llu", (unsigned long long)ino, (unsigned long long)info->inode_no))
+                memset(info, 0, sizeof(*info));
+            continue;
+        }
+
+        if ((why = check_inode(info, ext, &count))) {
+            //Si era un directorio sus hijos se quedan sin nombre, pero tampoco se sabe cuales son
+            if (S_ISDIR(info->mode))
+                tree_incomplete = true;
+            if (ino == ASSOOFS_ROOTDIR_INODE_NUMBER)
+                report(NULL, "The root directory inode is corrupted: %s", why);
+            if (ino != ASSOOFS_ROOTDIR_INODE_NUMBER && report("cleared", "Inode %llu is corrupted: %s", (unsigned long long)ino, why))
+                memset(info, 0, sizeof(*info));
+            else
+                used++; //Sigue ocupando su hueco
+            continue;
+        }
+
+        used++;
+        istate[slot] = I_USED | (S_ISDIR(info->mode) ? I_DIR : 0) | (info->remove_flag == REMOVED ? I_REMOVED : 0);
+        if ((info->flags & ASSOOFS_INODE_INLINE) && info->file_size > ASSOOFS_INLINE_DATA_MAX &&
+            report("size truncated", "Inline inode %llu has size %llu", (unsigned long long)ino, (unsigned long long)info->file_size))
+            info->file_size = ASSOOFS_INLINE_DATA_MAX;
+        if (S_ISREG(info->mode) && info->file_size > INT64_MAX &&
+            report("size truncated", "Inode %llu has size %llu", (unsigned long long)ino, (unsigned long long)info->file_size)) {
+            //Hasta el final del ultimo bloque que tiene
+            for (i = 0, info->file_size = 0; i < count; i++)
+                if ((ext[i].ee_block + ASSOOFS_EXTENT_LEN(ext[i].ee_len)) * bs > info->file_size)
+                    info->file_size = (ext[i].ee_block + ASSOOFS_EXTENT_LEN(ext[i].ee_len)) * bs;
+        }
+
+        //Referencias a los bloques: los borrados pendientes tambien, hasta que el modulo los libere
+        for (i = 0; i < count; i++)
+            for (b = ext[i].ee_start; b < ext[i].ee_start + assoofs_extent_blocks(&ext[i], bs); b++)
+                __atomic_fetch_add(&refs[b], 1, __ATOMIC_RELAXED);
+        if (info->extent_block)
+            __atomic_fetch_add(&refs[info->extent_block], 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&inodes_in_use, used, __ATOMIC_RELAXED);
+}
+
+/*
+ *  Pasada 2: directorios
+ */
+
+//Bloque fisico del bloque logico lblk (0 si es un hueco)
+static uint64_t map_block(const struct assoofs_extent *ext, long count, uint64_t lblk) {
+    long i;
+
+    for (i = 0; i < count; i++)
+        if (!(ext[i].ee_len & ASSOOFS_EXTENT_COMPRESSED) && lblk >= ext[i].ee_block && lblk < ext[i].ee_block + ext[i].ee_len)
+            return ext[i].ee_start + (lblk - ext[i].ee_block);
+    return 0;
+}
+
+static unsigned char ftype(const struct assoofs_inode_info *info) {
+    return S_ISDIR(info->mode) ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG_FILE;
+}
+
+//Comprueba las entradas de un bloque del directorio dir. Con indice los hashes tienen que estar en [lo, hi]. Devuelve
+//cuantas entradas quedan
+static uint64_t check_dir_block(struct assoofs_inode_info *dir, uint64_t lblk, char *data, bool indexed, uint64_t lo, uint64_t hi) {
+    unsigned int offset = 0, limit = assoofs_dir_limit(dir, bs);
+    struct assoofs_dirent de;
+    uint64_t child, expected, live = 0, hash;
+    const char *why;
+
+    while (assoofs_dir_next(dir, data, limit, &offset, &de)) {
+        child = de.inode_no;
+        expected = 0;
+        hash = assoofs_name_hash(de.name, de.len);
+        why = NULL;
+        if (!de.len || memchr(de.name, '/', de.len))
+            why = "a bad name";
+        else if (child > inode_slots || !(istate[child - 1] & I_USED))
+            why = "an inode that is not in use";
+        else if (istate[child - 1] & I_REMOVED)
+            why = "a removed inode";
+        else if (!__atomic_compare_exchange_n(&parent[child - 1], &expected, dir->inode_no, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            why = "an inode that already has a name";   //O al raiz
+
+        if (why) {
+            if (report("entry removed", "Directory %llu: entry %.*s in block %llu points to %s (%llu)", (unsigned long long)dir->inode_no,
+                       (int)de.len, de.name, (unsigned long long)lblk, why, (unsigned long long)child)) {
+                if (assoofs_dir_is_v2(dir)) {
+                    assoofs_dir_block_del(dir, data, &de);
+                } else {
+                    ((struct assoofs_dir_record_entry *)(data + de.offset))->inode_no = 0;
+                    ((struct assoofs_dir_record_entry *)(data + de.offset))->remove_flag = REMOVED;
+                }
+                continue;
+            }
+            live++;
+            continue;
+        }
+
+        live++;
+        if (indexed && (hash < lo || hash > hi))
+            report(NULL, "Directory %llu: entry %.*s is in the wrong leaf of the index", (unsigned long long)dir->inode_no, (int)de.len, de.name);
+        if (de.type != ASSOOFS_FT_UNKNOWN && de.type != ftype(inode(child)) &&
+            report("type corrected", "Directory %llu: entry %.*s has the wrong file type", (unsigned long long)dir->inode_no, (int)de.len, de.name)) {
+            if (assoofs_dir_is_v2(dir))
+                ((struct assoofs_dir_record_v2 *)(data + de.offset))->file_type = ftype(inode(child));
+            else
+                ((struct assoofs_dir_record_entry *)(data + de.offset))->file_type = ftype(inode(child));
+        }
+    }
+
+    if (assoofs_dir_is_v2(dir) && offset < limit) {
+        //assoofs_dir_next ya ha dicho donde: lo que queda del bloque no se puede leer
+        report(NULL, "Directory %llu: block %llu is corrupted", (unsigned long long)dir->inode_no, (unsigned long long)lblk);
+        tree_incomplete = true;
+    }
+    return live;
+}
+
+//Entradas de un bloque del indice (la raiz o un nodo intermedio) con hashes entre lo y hi: en orden, el primero lo,
+//y cada una apuntando a una hoja 1..leaves que no se haya visto (o, si nodes, a un nodo intermedio valido)
+static uint64_t check_dx_block(struct assoofs_inode_info *dir, const struct assoofs_extent *ext, long count, struct assoofs_dx_root *dx,
+                               uint64_t lo, uint64_t hi, bool nodes, uint64_t leaves, bool *seen) {
+    struct assoofs_dx_root *node;
+    uint64_t i, lblk, b, next, live = 0;
+
+    for (i = 0; i < dx->count; i++) {
+        lblk = dx->entries[i].block;
+        next = i + 1 < dx->count ? dx->entries[i + 1].hash - 1 : hi;
+        b = map_block(ext, count, lblk);
+        node = b ? (struct assoofs_dx_root *)block(b) : NULL;
+        if (!b || (i ? dx->entries[i].hash <= dx->entries[i - 1].hash : dx->entries[i].hash != lo) || dx->entries[i].hash > hi ||
+            (nodes ? lblk < ASSOOFS_DX_NODE_BASE || lblk >= ASSOOFS_DX_NODE_LBLK(ASSOOFS_DX_LIMIT(bs)) || seen[leaves + 1 + lblk - ASSOOFS_DX_NODE_BASE] ||
+                     !assoofs_dx_valid(node, bs, false)
+                   : lblk == 0 || lblk > leaves || seen[lblk])) {
+            report(NULL, "Directory %llu: entry %llu of the index is corrupted", (unsigned long long)dir->inode_no, (unsigned long long)i);
+            tree_incomplete = true;
+            continue;
+        }
+        if (nodes) {
+            seen[leaves + 1 + lblk - ASSOOFS_DX_NODE_BASE] = true;
+            live += check_dx_block(dir, ext, count, node, dx->entries[i].hash, next, false, leaves, seen);
+        } else {
+            seen[lblk] = true;
+            live += check_dir_block(dir, lblk, block(b), true, dx->entries[i].hash, next);
+        }
+    }
+    return live;
+}
+
+//Indice de un directorio indexado: hojas 1..leaves, cada una una vez, con los hashes en orden y el primero 0. Con dos
+//niveles la raiz apunta a nodos intermedios que cubren cada uno el tramo de hashes de su entrada. Los bloques que
+//hay reservados detras de la ultima hoja o del ultimo nodo aun no se usan y no se miran
+static uint64_t check_dir_index(struct assoofs_inode_info *dir, const struct assoofs_extent *ext, long count) {
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)block(map_block(ext, count, 0));
+    uint64_t leaves, live;
+    bool *seen;
+
+    if (!assoofs_dx_valid(root, bs, true) || (root->levels && !(sb.features & ASSOOFS_FEATURE_DX_TREE))) {
+        report(NULL, "Directory %llu: the index is corrupted", (unsigned long long)dir->inode_no);
+        tree_incomplete = true;
+        return dir->dir_children_count;
+    }
+    leaves = assoofs_dx_leaves(root);
+    seen = calloc(leaves + 1 + ASSOOFS_DX_LIMIT(bs), sizeof(*seen));   //Las hojas y detras los nodos
+    if (!seen) {
+        tree_incomplete = true;
+        return dir->dir_children_count;
+    }
+    live = check_dx_block(dir, ext, count, root, 0, UINT64_MAX, root->levels, leaves, seen);
+    free(seen);
+    return live;
+}
+
+static void check_dirs(uint64_t first, uint64_t end) {
+    struct assoofs_extent ext[MAX_EXTENTS];
+    struct assoofs_inode_info *dir;
+    uint64_t slot, live;
+    long count;
+
+    for (slot = first; slot < end; slot++) {
+        if ((istate[slot] & (I_USED | I_DIR | I_REMOVED)) != (I_USED | I_DIR))
+            continue;   //rmdir solo borra directorios vacios: los borrados no tienen nada que mirar
+        dir = inode(slot + 1);
+        count = load_extents(dir, ext);
+
+        if (dir->flags & ASSOOFS_INODE_DIR_INDEX) {
+            live = check_dir_index(dir, ext, count);
+        } else {
+            //En uno lineal v1 son los huecos ocupados del bloque, borrados sin compactar incluidos
+            if (!assoofs_dir_is_v2(dir) && dir->dir_children_count > ASSOOFS_DIR_RECORDS_PER_BLOCK(bs) &&
+                report("corrected", "Directory %llu has %llu children but its block only holds %llu", (unsigned long long)dir->inode_no,
+                       (unsigned long long)dir->dir_children_count, (unsigned long long)ASSOOFS_DIR_RECORDS_PER_BLOCK(bs)))
+                dir->dir_children_count = ASSOOFS_DIR_RECORDS_PER_BLOCK(bs);
+            live = check_dir_block(dir, 0, block(map_block(ext, count, 0)), false, 0, UINT64_MAX);
+            if (!assoofs_dir_is_v2(dir))
+                continue;
+        }
+        if (dir->dir_children_count != live &&
+            report("corrected", "Directory %llu has %llu children but %llu entries", (unsigned long long)dir->inode_no,
+                   (unsigned long long)dir->dir_children_count, (unsigned long long)live))
+            dir->dir_children_count = live;
+    }
+}
+
+//Sigue los padres de ino hasta el raiz o hasta uno ya visto, y marca todo el camino como alcanzable o perdido
+static void mark_reachable(uint64_t ino) {
+    uint64_t i;
+    uint8_t result = I_LOST;
+
+    for (i = ino; i; i = parent[i - 1]) {
+        if (istate[i - 1] & (I_REACHABLE | I_LOST)) {
+            result = istate[i - 1] & (I_REACHABLE | I_LOST);
+            break;
+        }
+        if (istate[i - 1] & I_VISITING)
+            break;  //Ciclo: ninguno llega al raiz
+        istate[i - 1] |= I_VISITING;
+    }
+    for (i = ino; i && (istate[i - 1] & I_VISITING); i = parent[i - 1])
+        istate[i - 1] = (istate[i - 1] & ~I_VISITING) | result;
+}
+
+static void check_reachable(void) {
+    uint64_t ino;
+
+    for (ino = ASSOOFS_ROOTDIR_INODE_NUMBER + 1; ino <= inode_slots; ino++) {
+        if ((istate[ino - 1] & (I_USED | I_REMOVED)) != I_USED)
+            continue;
+        mark_reachable(ino);
+        if (!(istate[ino - 1] & I_LOST))
+            continue;
+        //Borrado: el modulo lo libera al montar. Si hay directorios que no se han podido leer puede que este en uno
+        if (report(tree_incomplete ? NULL : "marked as removed", "Inode %llu is not reachable from the root directory", (unsigned long long)ino))
+            inode(ino)->remove_flag = REMOVED;
+    }
+}
+
+/*
+ *  Pasada 3: mapa de bits y contadores de referencias
+ */
+
+//Escribe de una vez un tramo de bloques seguidos con el mismo problema
+static void report_run(int kind, uint64_t first, uint64_t end) {
+    static const char *const what[] = { NULL, "in use but marked free", "marked in use but not used by any inode", "past the end of the device but marked free" };
+    static const char *const fix[] = { NULL, "marked in use", "marked free", "marked in use" };
+
+    if (kind && first + 1 == end)
+        report(fix[kind], "Block %llu is %s", (unsigned long long)first, what[kind]);
+    else if (kind)
+        report(fix[kind], "Blocks %llu-%llu are %s", (unsigned long long)first, (unsigned long long)end - 1, what[kind]);
+}
+
+static void check_bitmap(uint64_t first, uint64_t end) {
+    unsigned char *bitmap = (unsigned char *)block(sb.bitmap_block);
+    uint16_t *refcounts = (uint16_t *)block(sb.refcount_block);
+    bool reflink = sb.features & ASSOOFS_FEATURE_REFLINK, free_bit;
+    uint64_t b, want, run_start = 0, nfree = 0;
+    int kind, run_kind = 0;
+
+    for (b = first * ASSOOFS_BITS_PER_BLOCK(bs); b < end * ASSOOFS_BITS_PER_BLOCK(bs); b++) {
+        free_bit = bitmap[b / 8] & (1 << (b % 8));
+        kind = 0;
+        if (b >= sb.blocks_count) {
+            if (free_bit)
+                kind = 3;   //Los bits de despues del ultimo bloque van a 0 (ocupados) para que nunca se reserven
+        } else if ((b < data_start || refs[b]) && free_bit) {
+            kind = 1;
+        } else if (b >= data_start && !refs[b] && !free_bit) {
+            kind = 2;
+        }
+        if (kind != run_kind) {
+            report_run(run_kind, run_start, b);
+            run_kind = kind;
+            run_start = b;
+        }
+        if (kind && repair)
+            bitmap[b / 8] ^= 1 << (b % 8);
+        nfree += (bitmap[b / 8] >> (b % 8)) & 1;
+
+        if (b >= sb.blocks_count || b < data_start)
+            continue;
+        if (!reflink && refs[b] > 1)
+            report(NULL, "Block %llu is used by %u extents", (unsigned long long)b, refs[b]);
+        want = refs[b] ? refs[b] - 1 : 0;
+        if (reflink && refcounts[b] != want && report(want <= ASSOOFS_REFCOUNT_MAX ? "corrected" : NULL,
+                                                      "Block %llu has reference count %u and %llu owners", (unsigned long long)b, refcounts[b], (unsigned long long)refs[b]))
+            refcounts[b] = want;
+    }
+    report_run(run_kind, run_start, b);
+    __atomic_fetch_add(&free_blocks, nfree, __ATOMIC_RELAXED);
+}
+
+//Tamannio del dispositivo o de la imagen
+static uint64_t device_size(int fd) {
+    struct stat st;
+    uint64_t size = 0;
+
+    if (fstat(fd, &st) == -1)
+        return 0;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1)
+        return 0;
+    return S_ISBLK(st.st_mode) ? size : (uint64_t)st.st_size;
+}
+
+int main(int argc, char *argv[]) {
+    struct assoofs_super_block_info *disk;
+    uint64_t size;
+    int fd, opt, ret = FSCK_ERROR;
+
+    //Opciones: -n solo comprueba (por defecto), -y repara, -j el numero de hilos
+    while ((opt = getopt(argc, argv, "nyj:")) != -1) {
+        if (opt == 'n') {
+            repair = false;
+        } else if (opt == 'y') {
+            repair = true;
+        } else if (opt == 'j') {
+            threads = atol(optarg);
+            if (threads <= 0)
+                break;
+        } else {
+            break;
+        }
+    }
+    if (opt != -1 || optind != argc - 1) {
+        printf("Usage: fsck.assoofs [-n | -y] [-j threads] <device>\n");
+        return FSCK_ERROR;
+    }
+    if (!threads)
+        threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
+    fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening the device");
+        return FSCK_ERROR;
+    }
+    size = device_size(fd);
+    if (size < sizeof(sb) || pread(fd, &sb, sizeof(sb), 0) != sizeof(sb)) {
+        printf("Could not read the superblock.\n");
+        goto out_fd;
+    }
+    if (!sb_valid())
+        goto out_fd;
+    if (sb.blocks_count > size / bs) {
+        printf("The superblock says %llu blocks but the device only has %llu.\n", (unsigned long long)sb.blocks_count, (unsigned long long)(size / bs));
+        goto out_fd;
+    }
+
+    image = mmap(NULL, sb.blocks_count * bs, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        perror("Error mapping the device");
+        goto out_fd;
+    }
+    madvise(image, data_start * bs, MADV_WILLNEED); //Los metadatos se leen enteros
+
+    ret = FSCK_UNCORRECTED;
+    if (check_journal() || !sb_valid())
+        goto out_map;
+
+    ret = FSCK_ERROR;
+    istate = calloc(inode_slots, sizeof(*istate));
+    parent = calloc(inode_slots, sizeof(*parent));
+    refs = calloc(sb.blocks_count, sizeof(*refs));
+    if (!istate || !parent || !refs) {
+        printf("Out of memory.\n");
+        goto out_mem;
+    }
+
+    run_pass(check_inodes, inode_slots, CHUNK_BLOCKS * ASSOOFS_INODES_PER_BLOCK(bs));
+    if ((istate[0] & (I_USED | I_DIR | I_REMOVED)) != (I_USED | I_DIR)) {
+        if (inode(ASSOOFS_ROOTDIR_INODE_NUMBER)->inode_no != ASSOOFS_ROOTDIR_INODE_NUMBER || (istate[0] & I_USED))
+            report(NULL, "The root directory is missing"); //Si no, ya se ha dicho que esta corrupto
+        tree_incomplete = true;
+    } else {
+        parent[0] = ASSOOFS_ROOTDIR_INODE_NUMBER;   //Asi una entrada que apunte al raiz es un segundo nombre
+        istate[0] |= I_REACHABLE;
+        run_pass(check_dirs, inode_slots, CHUNK_BLOCKS * ASSOOFS_INODES_PER_BLOCK(bs));
+    }
+    check_reachable();
+    run_pass(check_bitmap, sb.bitmap_blocks, CHUNK_BLOCKS);
+
+    //Contadores del superbloque. Si no se desmonto bien no se comprueban: el siguiente montaje los vuelve a contar
+    disk = (struct assoofs_super_block_info *)image;
+    if (sb.state == ASSOOFS_STATE_CLEAN && sb.inodes_count != inodes_in_use &&
+        report("corrected", "The superblock says %llu inodes in use and there are %llu", (unsigned long long)sb.inodes_count, (unsigned long long)inodes_in_use))
+        disk->inodes_count = inodes_in_use;
+    if (sb.state == ASSOOFS_STATE_CLEAN && sb.free_blocks != free_blocks &&
+        report("corrected", "The superblock says %llu free blocks and there are %llu", (unsigned long long)sb.free_blocks, (unsigned long long)free_blocks))
+        disk->free_blocks = free_blocks;
+    if (sb.state != ASSOOFS_STATE_CLEAN && !uncorrected) {
+        printf("The image was not cleanly unmounted%s.\n", repair ? ": counters updated" : "");
+        if (repair) {
+            disk->inodes_count = inodes_in_use;
+            disk->free_blocks = free_blocks;
+            disk->state = ASSOOFS_STATE_CLEAN;
+        }
+    }
+
+    if (repair && msync(image, sb.blocks_count * bs, MS_SYNC)) {
+        perror("Error writing the repairs");
+        goto out_mem;
+    }
+    printf("%s: %llu/%llu inodes, %llu/%llu blocks free, %llu problems fixed, %llu left.\n", argv[optind],
+           (unsigned long long)inodes_in_use, (unsigned long long)inode_slots, (unsigned long long)free_blocks,
+           (unsigned long long)sb.blocks_count, (unsigned long long)fixed, (unsigned long long)uncorrected);
+    ret = uncorrected ? FSCK_UNCORRECTED : fixed ? FSCK_FIXED : FSCK_OK;
+
+out_mem:
+    free(istate);
+    free(parent);
+    free(refs);
+out_map:
+    munmap(image, sb.blocks_count * bs);
+out_fd:
+    close(fd);
+    return ret;
+}
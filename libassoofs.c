@@ -0,0 +1,1478 @@
+//libassoofs: el formato de assoofs en espacio de usuario (ver libassoofs.h). Las funciones internas siguen a las del
+//modulo (assoofs.c) una a una, cambiando la cache de buffers del kernel por pread/pwrite sobre la imagen
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "libassoofs.h"
+
+#define DIR_POS(fs, lblk, offset) (2 + (uint64_t)(lblk) * (fs)->bs + (offset)) //Igual que ASSOOFS_DIR_POS en el modulo
+//Los bloques se leen en buffers de la pila del tamannio maximo; de cada uno solo se usan los fs->bs primeros bytes
+#define MAX_EXTENTS ASSOOFS_MAX_EXTENTS(ASSOOFS_MAX_BLOCK_SIZE)
+
+struct assoofs_fs {
+    int fd;
+    bool readonly;
+    unsigned int bs;                    //Tamannio del bloque de la imagen
+    struct assoofs_super_block_info sb; //Superbloque: se escribe entero cada vez que cambia un contador
+    unsigned char *bitmap;              //Mapa de bits entero en memoria (1 libre, 0 ocupado)
+    uint64_t next_free;                 //Pista: el siguiente bloque libre se busca a partir de aqui
+    uint64_t next_ino;                  //Pista: el siguiente inodo libre se busca a partir de este hueco de la tabla
+    pthread_mutex_t lock;               //Las operaciones publicas van de una en una
+};
+
+/*
+ *  Bloques de la imagen
+ */
+
+static int read_block(struct assoofs_fs *fs, uint64_t block, void *buf) {
+    if (block >= fs->sb.blocks_count || pread(fs->fd, buf, fs->bs, (off_t)block * fs->bs) != (ssize_t)fs->bs)
+        return -EIO;
+    return 0;
+}
+
+static int write_block(struct assoofs_fs *fs, uint64_t block, const void *buf) {
+    if (fs->readonly)
+        return -EROFS;
+    if (block >= fs->sb.blocks_count || pwrite(fs->fd, buf, fs->bs, (off_t)block * fs->bs) != (ssize_t)fs->bs)
+        return -EIO;
+    return 0;
+}
+
+static int save_sb(struct assoofs_fs *fs) {
+    if (fs->readonly)
+        return -EROFS;
+    return pwrite(fs->fd, &fs->sb, sizeof(fs->sb), 0) == sizeof(fs->sb) ? 0 : -EIO; //El resto del bloque 0 ya es cero
+}
+
+/*
+ *  Journal: al abrir se aplica la transaccion pendiente como en assoofs_journal_replay. La libreria escribe despues
+ *  directamente en su sitio, asi que deja el superbloque del journal apuntando a la transaccion siguiente para que el
+ *  modulo no vuelva a aplicar una vieja encima
+ */
+
+//crc32_le del kernel (polinomio 0xedb88320, sin invertir al final)
+static uint32_t crc32_le(uint32_t crc, const unsigned char *p, size_t len) {
+    int i;
+
+    while (len--) {
+        crc ^= *p++;
+        for (i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (crc & 1 ? 0xedb88320 : 0);
+    }
+    return crc;
+}
+
+static int journal_replay(struct assoofs_fs *fs) {
+    char jsb_block[ASSOOFS_MAX_BLOCK_SIZE], desc_block[ASSOOFS_MAX_BLOCK_SIZE], block[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_journal_super_block *jsb = (struct assoofs_journal_super_block *)jsb_block;
+    struct assoofs_journal_descriptor *descriptor = (struct assoofs_journal_descriptor *)desc_block;
+    struct assoofs_journal_commit *commit = (struct assoofs_journal_commit *)block;
+    uint64_t journal = fs->sb.journal_block, max_blocks, sequence, count, i;
+    uint32_t crc;
+    int ret;
+
+    if (!fs->sb.journal_blocks)
+        return 0;
+    if (fs->sb.journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS || journal + fs->sb.journal_blocks > fs->sb.blocks_count)
+        return -EINVAL;
+    max_blocks = fs->sb.journal_blocks - 3;
+    if (max_blocks > ASSOOFS_JOURNAL_DESCRIPTOR_MAX(fs->bs))
+        max_blocks = ASSOOFS_JOURNAL_DESCRIPTOR_MAX(fs->bs);
+
+    if ((ret = read_block(fs, journal, jsb_block)))
+        return ret;
+    if (jsb->header.magic != ASSOOFS_JOURNAL_MAGIC || jsb->header.type != ASSOOFS_JOURNAL_SUPERBLOCK) {
+        assoofs_format_error("The journal superblock is corrupted\n");
+        return -EINVAL;
+    }
+    sequence = jsb->header.sequence;
+
+    if ((ret = read_block(fs, journal + 1, desc_block)))
+        return ret;
+    count = descriptor->count;
+    if (descriptor->header.magic != ASSOOFS_JOURNAL_MAGIC || descriptor->header.type != ASSOOFS_JOURNAL_DESCRIPTOR ||
+        descriptor->header.sequence != sequence || count == 0 || count > max_blocks)
+        return 0;
+
+    crc = crc32_le(~0, (unsigned char *)desc_block, fs->bs);
+    for (i = 0; i < count; i++) {
+        if (descriptor->blocknr[i] >= fs->sb.blocks_count)
+            return 0;
+        if ((ret = read_block(fs, journal + 2 + i, block)))
+            return ret;
+        crc = crc32_le(crc, (unsigned char *)block, fs->bs);
+    }
+    if ((ret = read_block(fs, journal + 2 + count, block)))
+        return ret;
+    if (commit->header.magic != ASSOOFS_JOURNAL_MAGIC || commit->header.type != ASSOOFS_JOURNAL_COMMIT ||
+        commit->header.sequence != sequence || commit->count != count || commit->checksum != crc)
+        return 0; //Transaccion a medias: se descarta
+
+    if (fs->readonly) {
+        assoofs_format_error("The journal needs recovery, the image cannot be opened read-only\n");
+        return -EROFS;
+    }
+    for (i = 0; i < count; i++) {
+        if ((ret = read_block(fs, journal + 2 + i, block)) || (ret = write_block(fs, descriptor->blocknr[i], block)))
+            return ret;
+    }
+    if (fsync(fs->fd))
+        return -EIO;
+
+    jsb->header.sequence = sequence + 1;
+    if ((ret = write_block(fs, journal, jsb_block)))
+        return ret;
+    return fsync(fs->fd) ? -EIO : 0;
+}
+
+/*
+ *  Mapa de bits de bloques libres
+ */
+
+//Reserva el bloque block si esta libre, como assoofs_bitmap_claim
+static int claim_block(struct assoofs_fs *fs, uint64_t block) {
+    uint64_t map_block = block / ASSOOFS_BITS_PER_BLOCK(fs->bs);
+    int ret;
+
+    if (block >= fs->sb.blocks_count || !(fs->bitmap[block / 8] & (1 << (block % 8))))
+        return -ENOSPC;
+
+    fs->bitmap[block / 8] &= ~(1 << (block % 8));
+    fs->sb.free_blocks--;
+    ret = write_block(fs, fs->sb.bitmap_block + map_block, fs->bitmap + map_block * fs->bs);
+    if (!ret)
+        ret = save_sb(fs);
+    return ret;
+}
+
+//Primer bloque libre a partir de la pista next_free, dando la vuelta al llegar al final
+static int alloc_block(struct assoofs_fs *fs, uint64_t *block) {
+    uint64_t b = fs->next_free, scanned;
+
+    if (!fs->sb.free_blocks)
+        return -ENOSPC;
+
+    for (scanned = 0; scanned < fs->sb.blocks_count; scanned++, b++) {
+        if (b >= fs->sb.blocks_count)
+            b = 0;
+        if (!fs->bitmap[b / 8] && b % 8 == 0) { //Ocho ocupados de golpe
+            scanned += 7;
+            b += 7;
+            continue;
+        }
+        if (fs->bitmap[b / 8] & (1 << (b % 8))) {
+            *block = b;
+            fs->next_free = b + 1;
+            return claim_block(fs, b);
+        }
+    }
+    return -ENOSPC;
+}
+
+//Reserva n bloques contiguos: los que empiezan en hint si estan libres y si no el primer tramo libre a partir de
+//next_free. Los bloques del mapa de bits y el superbloque se escriben una sola vez
+static int alloc_run(struct assoofs_fs *fs, uint64_t n, uint64_t hint, uint64_t *start) {
+    uint64_t b, i, run = 0, scanned;
+    int ret;
+
+    if (fs->sb.free_blocks < n)
+        return -ENOSPC;
+    for (i = 0; hint && i < n && hint + i < fs->sb.blocks_count && (fs->bitmap[(hint + i) / 8] & (1 << ((hint + i) % 8))); i++)
+        ;
+    if (hint && i == n) {
+        *start = hint;
+    } else {
+        for (scanned = 0, b = fs->next_free; run < n && scanned < fs->sb.blocks_count; scanned++, b++) {
+            if (b >= fs->sb.blocks_count) {
+                b = 0;
+                run = 0;    //Un tramo no da la vuelta
+            }
+            run = fs->bitmap[b / 8] & (1 << (b % 8)) ? run + 1 : 0;
+        }
+        if (run < n)
+            return -ENOSPC;
+        *start = b - n;
+    }
+
+    for (b = *start; b < *start + n; b++)
+        fs->bitmap[b / 8] &= ~(1 << (b % 8));
+    fs->sb.free_blocks -= n;
+    fs->next_free = *start + n;
+    for (b = *start / ASSOOFS_BITS_PER_BLOCK(fs->bs); b <= (*start + n - 1) / ASSOOFS_BITS_PER_BLOCK(fs->bs); b++) {
+        if ((ret = write_block(fs, fs->sb.bitmap_block + b, fs->bitmap + b * fs->bs)))
+            return ret;
+    }
+    return save_sb(fs);
+}
+
+//Lee el bloque de los contadores de referencias de block y devuelve su contador dentro de buf
+static int read_refcount(struct assoofs_fs *fs, uint64_t block, char *buf, uint16_t **ref) {
+    int ret;
+
+    if (block >= fs->sb.blocks_count)
+        return -EIO;
+    if ((ret = read_block(fs, fs->sb.refcount_block + block / ASSOOFS_REFCOUNTS_PER_BLOCK(fs->bs), buf)))
+        return ret;
+    *ref = (uint16_t *)buf + block % ASSOOFS_REFCOUNTS_PER_BLOCK(fs->bs);
+    return 0;
+}
+
+//true si block tiene mas de un duenno
+static bool block_shared(struct assoofs_fs *fs, uint64_t block) {
+    char buf[ASSOOFS_MAX_BLOCK_SIZE];
+    uint16_t *ref;
+
+    return (fs->sb.features & ASSOOFS_FEATURE_REFLINK) && !read_refcount(fs, block, buf, &ref) && *ref;
+}
+
+//Devuelve el bloque block como assoofs_bitmap_release: si es compartido solo pierde un duenno
+static int release_block(struct assoofs_fs *fs, uint64_t block) {
+    char buf[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t map_block = block / ASSOOFS_BITS_PER_BLOCK(fs->bs);
+    uint16_t *ref;
+    int ret;
+
+    if (fs->sb.features & ASSOOFS_FEATURE_REFLINK) {
+        if ((ret = read_refcount(fs, block, buf, &ref)))
+            return ret;
+        if (*ref) {
+            (*ref)--;
+            return write_block(fs, fs->sb.refcount_block + block / ASSOOFS_REFCOUNTS_PER_BLOCK(fs->bs), buf);
+        }
+    }
+
+    if (block >= fs->sb.blocks_count || (fs->bitmap[block / 8] & (1 << (block % 8))))
+        return -EIO;
+    fs->bitmap[block / 8] |= 1 << (block % 8);
+    fs->sb.free_blocks++;
+    ret = write_block(fs, fs->sb.bitmap_block + map_block, fs->bitmap + map_block * fs->bs);
+    if (!ret)
+        ret = save_sb(fs);
+    return ret;
+}
+
+/*
+ *  Tabla de inodos
+ */
+
+//Lee el bloque de la tabla con el inodo ino y devuelve su hueco dentro de block
+static int inode_slot(struct assoofs_fs *fs, uint64_t ino, char *block, struct assoofs_inode_info **slot) {
+    int ret;
+
+    if (ino < (uint64_t)ASSOOFS_ROOTDIR_INODE_NUMBER || ino > fs->sb.inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(fs->bs)) {
+        assoofs_format_error("Inode number out of range: %llu\n", (unsigned long long)ino);
+        return -EIO;
+    }
+    if ((ret = read_block(fs, ASSOOFS_INODE_BLOCK(fs->sb.inode_table_block, ino, fs->bs), block)))
+        return ret;
+    *slot = (struct assoofs_inode_info *)block + ASSOOFS_INODE_SLOT(ino, fs->bs);
+    return 0;
+}
+
+static int get_inode(struct assoofs_fs *fs, uint64_t ino, struct assoofs_inode_info *info) {
+    struct assoofs_inode_info *slot;
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    int ret;
+
+    if ((ret = inode_slot(fs, ino, block, &slot)))
+        return ret;
+    if (slot->inode_no != ino) //Hueco libre
+        return -EIO;
+    memcpy(info, slot, sizeof(*info));
+    return 0;
+}
+
+static int save_inode(struct assoofs_fs *fs, const struct assoofs_inode_info *info) {
+    struct assoofs_inode_info *slot;
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    int ret;
+
+    if ((ret = inode_slot(fs, info->inode_no, block, &slot)))
+        return ret;
+    memcpy(slot, info, sizeof(*slot));
+    return write_block(fs, ASSOOFS_INODE_BLOCK(fs->sb.inode_table_block, info->inode_no, fs->bs), block);
+}
+
+//Primer hueco libre de la tabla a partir de la pista next_ino, como assoofs_new_inode_no: los numeros de los inodos
+//que ha borrado el modulo se reutilizan. Un inodo borrado pendiente de liberar sigue ocupando su hueco
+static int new_inode_no(struct assoofs_fs *fs, uint64_t *ino) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_inode_info *slots = (struct assoofs_inode_info *)block;
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(fs->bs), max = fs->sb.inode_table_blocks * per_block, i, n;
+    int ret;
+
+    if (fs->sb.inodes_count >= max)
+        return -ENOSPC;
+    for (n = 0, i = fs->next_ino % max; n < max; n++, i = (i + 1) % max) {
+        if ((n == 0 || i % per_block == 0) && (ret = read_block(fs, fs->sb.inode_table_block + i / per_block, block)))
+            return ret;
+        if (slots[i % per_block].inode_no == i + 1)
+            continue;
+        fs->next_ino = i + 1;
+        *ino = i + 1;
+        fs->sb.inodes_count++;
+        return save_sb(fs);
+    }
+    return -ENOSPC;
+}
+
+/*
+ *  Mapa de extents
+ */
+
+//Copia en ext todos los extents del inodo (los del inodo y los del bloque de desbordamiento)
+static int load_extents(struct assoofs_fs *fs, const struct assoofs_inode_info *info, struct assoofs_extent *ext) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t n = info->extent_count;
+    int ret;
+
+    if (n > ASSOOFS_MAX_EXTENTS(fs->bs))
+        return -EIO;
+    memcpy(ext, info->extents, (n < ASSOOFS_INODE_EXTENTS ? n : ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    if (n > ASSOOFS_INODE_EXTENTS) {
+        if ((ret = read_block(fs, info->extent_block, block)))
+            return ret;
+        memcpy(ext + ASSOOFS_INODE_EXTENTS, block, (n - ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    }
+    return 0;
+}
+
+//Bloque fisico del bloque logico lblk (0 si es un hueco) y cuantos contiguos hay desde el
+static int map_block(struct assoofs_fs *fs, const struct assoofs_inode_info *info, uint64_t lblk, uint64_t *block, uint64_t *count) {
+    struct assoofs_extent ext[MAX_EXTENTS];
+    uint64_t i;
+    int ret;
+
+    *block = 0;
+    *count = 1;
+    if ((ret = load_extents(fs, info, ext)))
+        return ret;
+    for (i = 0; i < info->extent_count; i++) {
+        if (lblk >= ext[i].ee_block && lblk < ext[i].ee_block + ext[i].ee_len) {
+            *block = ext[i].ee_start + (lblk - ext[i].ee_block);
+            *count = ext[i].ee_len - (lblk - ext[i].ee_block);
+            break;
+        }
+    }
+    return 0;
+}
+
+//Asigna un bloque fisico al bloque logico lblk como assoofs_alloc_file_block: alarga el extent que termina justo
+//antes si el bloque siguiente esta libre y si no abre uno nuevo. Cambia info; guardarlo es cosa de quien llama
+static int alloc_file_block(struct assoofs_fs *fs, struct assoofs_inode_info *info, uint64_t lblk, uint64_t *block) {
+    struct assoofs_extent ext[MAX_EXTENTS];
+    char ext_block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t i, n = info->extent_count;
+    int ret;
+
+    if ((ret = load_extents(fs, info, ext)))
+        return ret;
+
+    for (i = 0; i < n; i++) {
+        if (ext[i].ee_block + ext[i].ee_len == lblk && !claim_block(fs, ext[i].ee_start + ext[i].ee_len)) {
+            *block = ext[i].ee_start + ext[i].ee_len;
+            ext[i].ee_len++;
+            goto out;
+        }
+    }
+
+    if (n >= ASSOOFS_MAX_EXTENTS(fs->bs))
+        return -EFBIG;
+    if (n == ASSOOFS_INODE_EXTENTS && !info->extent_block) {
+        if ((ret = alloc_block(fs, &info->extent_block)))
+            return ret;
+    }
+    if ((ret = alloc_block(fs, block)))
+        return ret;
+    ext[n].ee_block = lblk;
+    ext[n].ee_len = 1;
+    ext[n].ee_start = *block;
+    info->extent_count = ++n;
+
+out:
+    if (lblk == 0)
+        info->data_block_number = *block;
+    memcpy(info->extents, ext, (n < ASSOOFS_INODE_EXTENTS ? n : ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    if (n > ASSOOFS_INODE_EXTENTS) {
+        memset(ext_block, 0, fs->bs);
+        memcpy(ext_block, ext + ASSOOFS_INODE_EXTENTS, (n - ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+        return write_block(fs, info->extent_block, ext_block);
+    }
+    return 0;
+}
+
+//Apunta en el mapa de extents que los bloques logicos lblk..lblk+n-1 estan en los n bloques fisicos ya reservados que
+//empiezan en start, como assoofs_add_extent. Cambia info; guardarlo es cosa de quien llama
+static int add_extent(struct assoofs_fs *fs, struct assoofs_inode_info *info, uint64_t lblk, uint64_t start, uint64_t n) {
+    struct assoofs_extent ext[MAX_EXTENTS];
+    char ext_block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t i, count = info->extent_count;
+    int ret;
+
+    if ((ret = load_extents(fs, info, ext)))
+        return ret;
+
+    for (i = 0; i < count; i++) {
+        if (!(ext[i].ee_len & ASSOOFS_EXTENT_COMPRESSED) && ext[i].ee_block + ext[i].ee_len == lblk && ext[i].ee_start + ext[i].ee_len == start) {
+            ext[i].ee_len += n;
+            goto out;
+        }
+    }
+
+    if (count >= ASSOOFS_MAX_EXTENTS(fs->bs))
+        return -EFBIG;
+    if (count == ASSOOFS_INODE_EXTENTS && !info->extent_block) {
+        if ((ret = alloc_block(fs, &info->extent_block)))
+            return ret;
+    }
+    ext[count].ee_block = lblk;
+    ext[count].ee_len = n;
+    ext[count].ee_start = start;
+    info->extent_count = ++count;
+
+out:
+    if (lblk == 0)
+        info->data_block_number = start;
+    memcpy(info->extents, ext, (count < ASSOOFS_INODE_EXTENTS ? count : ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+    if (count > ASSOOFS_INODE_EXTENTS) {
+        memset(ext_block, 0, fs->bs);
+        memcpy(ext_block, ext + ASSOOFS_INODE_EXTENTS, (count - ASSOOFS_INODE_EXTENTS) * sizeof(*ext));
+        return write_block(fs, info->extent_block, ext_block);
+    }
+    return 0;
+}
+
+//Copia en escritura como assoofs_cow_block: el bloque logico lblk, que esta en el bloque compartido old, pasa a uno
+//nuevo (detras del que tiene lblk - 1 si esta libre) y old pierde un duenno. El contenido lo escribe quien llama,
+//que ya tiene el bloque entero en memoria. Cambia info; guardarlo es cosa de quien llama
+static int cow_block(struct assoofs_fs *fs, struct assoofs_inode_info *info, uint64_t lblk, uint64_t old, uint64_t *block) {
+    struct assoofs_extent ext[MAX_EXTENTS], out[MAX_EXTENTS + 2];
+    char ext_block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t i, n = 0, prev = 0, count, end;
+    int ret;
+
+    if ((ret = load_extents(fs, info, ext)))
+        return ret;
+    if (lblk && (ret = map_block(fs, info, lblk - 1, &prev, &count)))
+        return ret;
+    if (!prev || claim_block(fs, prev + 1)) {
+        if ((ret = alloc_block(fs, block)))
+            return ret;
+    } else {
+        *block = prev + 1;
+    }
+
+    //El extent que tiene lblk se parte y lblk va en uno propio o alargando el que termina justo antes
+    for (i = 0; i < info->extent_count; i++) {
+        end = ext[i].ee_block + ext[i].ee_len;
+        if (lblk < ext[i].ee_block || lblk >= end) {
+            out[n++] = ext[i];
+            continue;
+        }
+        if (lblk > ext[i].ee_block)
+            out[n++] = (struct assoofs_extent){ext[i].ee_block, lblk - ext[i].ee_block, ext[i].ee_start};
+        if (lblk + 1 < end)
+            out[n++] = (struct assoofs_extent){lblk + 1, end - lblk - 1, ext[i].ee_start + (lblk + 1 - ext[i].ee_block)};
+    }
+    for (i = 0; i < n; i++) {
+        if (out[i].ee_block + out[i].ee_len == lblk && out[i].ee_start + out[i].ee_len == *block) {
+            out[i].ee_len++;
+            break;
+        }
+    }
+    if (i == n)
+        out[n++] = (struct assoofs_extent){lblk, 1, *block};
+
+    if (n > ASSOOFS_MAX_EXTENTS(fs->bs)) {
+        release_block(fs, *block);
+        return -EFBIG;
+    }
+    if (n > ASSOOFS_INODE_EXTENTS && !info->extent_block && (ret = alloc_block(fs, &info->extent_block))) {
+        release_block(fs, *block);
+        return ret;
+    }
+    if (n > ASSOOFS_INODE_EXTENTS) {
+        memset(ext_block, 0, fs->bs);
+        memcpy(ext_block, out + ASSOOFS_INODE_EXTENTS, (n - ASSOOFS_INODE_EXTENTS) * sizeof(*out));
+        if ((ret = write_block(fs, info->extent_block, ext_block)))
+            return ret;
+    }
+    memset(info->extents, 0, sizeof(info->extents));
+    memcpy(info->extents, out, (n < ASSOOFS_INODE_EXTENTS ? n : ASSOOFS_INODE_EXTENTS) * sizeof(*out));
+    info->extent_count = n;
+    if (lblk == 0)
+        info->data_block_number = *block;
+    return release_block(fs, old);
+}
+
+/*
+ *  Ficheros comprimidos. Se leen igual que en el modulo (assoofs_read_cluster). Para escribir no hay compresor: un
+ *  fichero comprimido se puede escribir mientras todos sus extents sean normales (los bloques de un fichero que acaba
+ *  de salir del inodo, por ejemplo); si ya tiene clusters comprimidos la escritura devuelve -EOPNOTSUPP
+ */
+
+//Descompresor del formato de bloque de LZ4 (lo que deja LZ4_compress_default). Devuelve los bytes que deja en dst o
+//-1 si los datos no son validos
+static int lz4_decompress(const unsigned char *src, size_t slen, unsigned char *dst, size_t dcap) {
+    const unsigned char *ip = src, *iend = src + slen;
+    unsigned char *op = dst, *oend = dst + dcap;
+    size_t lit, mlen, off;
+    unsigned int token;
+
+    while (ip < iend) {
+        //Cada secuencia: token (literales | coincidencia), literales, desplazamiento y coincidencia
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                lit += *ip;
+            } while (*ip++ == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend)
+            break; //La ultima secuencia solo tiene literales
+
+        if (iend - ip < 2)
+            return -1;
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (!off || off > (size_t)(op - dst))
+            return -1;
+        mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                mlen += *ip;
+            } while (*ip++ == 255);
+        }
+        mlen += 4;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+        for (; mlen; mlen--, op++)
+            *op = *(op - off); //Puede solaparse con lo que se esta copiando: byte a byte
+    }
+    return op - dst;
+}
+
+//Deja en data el cluster cluster del fichero, como assoofs_read_cluster. zdata es para el cluster comprimido
+static int read_cluster(struct assoofs_fs *fs, const struct assoofs_inode_info *info, uint64_t cluster, char *data, char *zdata) {
+    struct assoofs_extent ext[MAX_EXTENTS];
+    struct assoofs_cluster_header *hdr = (struct assoofs_cluster_header *)zdata;
+    uint64_t cb = ASSOOFS_CLUSTER_BLOCKS(fs->bs), first = cluster * cb, i, b, len, plen, block;
+    int ret;
+
+    memset(data, 0, ASSOOFS_CLUSTER_SIZE);
+    if ((ret = load_extents(fs, info, ext)))
+        return ret;
+    for (i = 0; i < info->extent_count; i++) {
+        len = ASSOOFS_EXTENT_LEN(ext[i].ee_len);
+        if (ext[i].ee_block >= first + cb || ext[i].ee_block + len <= first)
+            continue;
+
+        if (ext[i].ee_len & ASSOOFS_EXTENT_COMPRESSED) {
+            plen = ASSOOFS_EXTENT_PLEN(ext[i].ee_len);
+            if (!plen || plen >= cb)
+                return -EIO;
+            block = ext[i].ee_start + (first - ext[i].ee_block) / cb * plen;
+            if (pread(fs->fd, zdata, plen * fs->bs, block * fs->bs) != (ssize_t)(plen * fs->bs))
+                return -EIO;
+            if (hdr->size > plen * fs->bs - sizeof(*hdr) || crc32_le(~0, (unsigned char *)(hdr + 1), hdr->size) != hdr->checksum ||
+                lz4_decompress((unsigned char *)(hdr + 1), hdr->size, (unsigned char *)data, ASSOOFS_CLUSTER_SIZE) < 0)
+                return -EIO;
+            return 0;
+        }
+
+        for (b = first > ext[i].ee_block ? first : ext[i].ee_block; b < first + cb && b < ext[i].ee_block + len; b++) {
+            if ((ret = read_block(fs, ext[i].ee_start + (b - ext[i].ee_block), data + (b - first) * fs->bs)))
+                return ret;
+        }
+    }
+    return 0;
+}
+
+//Lee len bytes desde off de un fichero comprimido que ya no es inline
+static int read_compressed(struct assoofs_fs *fs, const struct assoofs_inode_info *info, char *buf, size_t len, uint64_t off) {
+    char *data = malloc(2 * ASSOOFS_CLUSTER_SIZE);
+    size_t start, n;
+    int ret = 0;
+
+    if (!data)
+        return -ENOMEM;
+    while (len && !ret) {
+        start = off % ASSOOFS_CLUSTER_SIZE;
+        n = ASSOOFS_CLUSTER_SIZE - start < len ? ASSOOFS_CLUSTER_SIZE - start : len;
+        if (!(ret = read_cluster(fs, info, off / ASSOOFS_CLUSTER_SIZE, data, data + ASSOOFS_CLUSTER_SIZE)))
+            memcpy(buf, data + start, n);
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    free(data);
+    return ret;
+}
+
+//-EOPNOTSUPP si el fichero tiene algun cluster comprimido: libassoofs no sabe escribirlos
+static int check_writable(struct assoofs_fs *fs, const struct assoofs_inode_info *info) {
+    struct assoofs_extent ext[MAX_EXTENTS];
+    uint64_t i;
+    int ret;
+
+    if (!(info->flags & ASSOOFS_INODE_COMPRESSED) || (info->flags & ASSOOFS_INODE_INLINE))
+        return 0;
+    if ((ret = load_extents(fs, info, ext)))
+        return ret;
+    for (i = 0; i < info->extent_count; i++) {
+        if (ext[i].ee_len & ASSOOFS_EXTENT_COMPRESSED)
+            return -EOPNOTSUPP;
+    }
+    return 0;
+}
+
+/*
+ *  Contenido de los directorios: lo mismo que en el modulo, con los bloques en buffers de la pila
+ */
+
+//Lee el bloque logico lblk del directorio
+static int dir_read(struct assoofs_fs *fs, const struct assoofs_inode_info *dir, uint64_t lblk, char *buf, uint64_t *block) {
+    uint64_t count;
+    int ret;
+
+    if ((ret = map_block(fs, dir, lblk, block, &count)))
+        return ret;
+    if (!*block)
+        return -EIO;
+    return read_block(fs, *block, buf);
+}
+
+//Deja vacio en buf (sin escribirlo) el bloque logico lblk del directorio. Si aun no tiene bloque se reserva de una
+//vez un tramo para el y los siguientes detras del bloque logico anterior, como assoofs_dir_new_block
+static int dir_new_block(struct assoofs_fs *fs, struct assoofs_inode_info *dir, uint64_t lblk, char *buf, uint64_t *block) {
+    uint64_t count, n, hint = 0;
+    int ret;
+
+    if ((ret = map_block(fs, dir, lblk, block, &count)))
+        return ret;
+    if (!*block) {
+        n = assoofs_dir_prealloc(lblk);
+        if (lblk && !map_block(fs, dir, lblk - 1, &hint, &count) && hint)
+            hint++;
+        while ((ret = alloc_run(fs, n, hint, block)) == -ENOSPC && n > 1)
+            n /= 2;
+        if (ret)
+            return ret;
+        if ((ret = add_extent(fs, dir, lblk, *block, n))) {
+            for (count = 0; count < n; count++)
+                release_block(fs, *block + count);
+            return ret;
+        }
+    }
+    assoofs_dir_block_init(dir, buf, fs->bs);
+    return 0;
+}
+
+//Lee el indice de un directorio indexado comprobando que tiene sentido
+static int dx_read_root(struct assoofs_fs *fs, const struct assoofs_inode_info *dir, char *buf, uint64_t *block) {
+    int ret;
+
+    if ((ret = dir_read(fs, dir, 0, buf, block)))
+        return ret;
+    if (!assoofs_dx_valid((struct assoofs_dx_root *)buf, fs->bs, true)) {
+        assoofs_format_error("Corrupted directory index in inode %llu\n", (unsigned long long)dir->inode_no);
+        return -EIO;
+    }
+    return 0;
+}
+
+//Camino por el indice hasta la hoja de un hash, como assoofs_dx_path: la raiz y, con dos niveles, el nodo intermedio
+struct dx_path {
+    char buf[2][ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t block[2];
+    uint64_t index[2];
+    int depth;
+};
+
+#define DX_AT(path, level) ((struct assoofs_dx_root *)(path)->buf[level])
+#define DX_PATH_LEAF(path) (DX_AT(path, (path)->depth - 1)->entries[(path)->index[(path)->depth - 1]].block)
+
+//Baja por el indice siguiendo hash
+static int dx_walk(struct assoofs_fs *fs, const struct assoofs_inode_info *dir, uint64_t hash, struct dx_path *path) {
+    struct assoofs_dx_root *root = DX_AT(path, 0);
+    uint64_t lblk;
+    int ret;
+
+    if ((ret = dx_read_root(fs, dir, path->buf[0], &path->block[0])))
+        return ret;
+    path->index[0] = assoofs_dx_find(root, hash);
+    path->depth = 1;
+    if (!root->levels)
+        return 0;
+
+    lblk = root->entries[path->index[0]].block;
+    if (lblk < ASSOOFS_DX_NODE_BASE || (ret = dir_read(fs, dir, lblk, path->buf[1], &path->block[1])) ||
+        !assoofs_dx_valid(DX_AT(path, 1), fs->bs, false)) {
+        assoofs_format_error("Corrupted directory index in inode %llu\n", (unsigned long long)dir->inode_no);
+        return -EIO;
+    }
+    path->index[1] = assoofs_dx_find(DX_AT(path, 1), hash);
+    path->depth = 2;
+    return 0;
+}
+
+static int find_dir_entry(struct assoofs_fs *fs, const struct assoofs_inode_info *dir, const char *name, uint64_t *ino) {
+    struct dx_path *path;
+    struct assoofs_dirent de;
+    char buf[ASSOOFS_MAX_BLOCK_SIZE];
+    unsigned int len = strlen(name), offset = 0, limit;
+    uint64_t block, leaf = 0;
+    int ret;
+
+    if (dir->flags & ASSOOFS_INODE_DIR_INDEX) {
+        //Indexado: el hash del nombre dice en que hoja esta
+        if (!(path = malloc(sizeof(*path))))
+            return -ENOMEM;
+        if (!(ret = dx_walk(fs, dir, assoofs_name_hash(name, len), path)))
+            leaf = DX_PATH_LEAF(path);
+        free(path);
+        if (ret)
+            return ret;
+    }
+
+    if ((ret = dir_read(fs, dir, leaf, buf, &block)))
+        return ret;
+    limit = assoofs_dir_limit((struct assoofs_inode_info *)dir, fs->bs);
+    while (assoofs_dir_next((struct assoofs_inode_info *)dir, buf, limit, &offset, &de)) {
+        if (de.len == len && !memcmp(de.name, name, len)) {
+            *ino = de.inode_no;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+//Convierte un directorio lineal lleno en indexado: sus entradas pasan a la hoja 1 y el bloque 0 al indice
+static int dx_convert(struct assoofs_fs *fs, struct assoofs_inode_info *dir) {
+    char root_buf[ASSOOFS_MAX_BLOCK_SIZE], leaf_buf[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)root_buf;
+    uint64_t root_block, leaf_block;
+    int ret;
+
+    if ((ret = dir_read(fs, dir, 0, root_buf, &root_block)))
+        return ret;
+    if ((ret = dir_new_block(fs, dir, 1, leaf_buf, &leaf_block)))
+        return ret;
+
+    memcpy(leaf_buf, root_buf, assoofs_dir_limit(dir, fs->bs));
+    if ((ret = write_block(fs, leaf_block, leaf_buf)))
+        return ret;
+
+    memset(root_buf, 0, fs->bs);
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = 1;
+    if ((ret = write_block(fs, root_block, root_buf)))
+        return ret;
+
+    dir->flags |= ASSOOFS_INODE_DIR_INDEX;
+    return 0;
+}
+
+static int cmp_hash(const void *a, const void *b) {
+    uint64_t ha = *(const uint64_t *)a, hb = *(const uint64_t *)b;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+//Deja sitio para una entrada mas en el bloque del indice al final de path, como assoofs_dx_grow: la raiz llena de un
+//indice de un nivel baja entera al primer nodo intermedio y un nodo lleno se parte en dos
+static int dx_grow(struct assoofs_fs *fs, struct assoofs_inode_info *dir, struct dx_path *path, uint64_t hash) {
+    struct assoofs_dx_root *root = DX_AT(path, 0), *node = DX_AT(path, 1), *new_node;
+    uint64_t limit = ASSOOFS_DX_LIMIT(fs->bs), lblk, mid, split, new_block;
+    char new_buf[ASSOOFS_MAX_BLOCK_SIZE];
+    int ret;
+
+    if (DX_AT(path, path->depth - 1)->count < limit)
+        return 0;
+
+    if (path->depth == 1) {
+        if ((ret = dir_new_block(fs, dir, ASSOOFS_DX_NODE_LBLK(0), path->buf[1], &path->block[1])))
+            return ret;
+        memcpy(path->buf[1], path->buf[0], fs->bs);
+        if ((ret = write_block(fs, path->block[1], path->buf[1])))
+            return ret;
+        if (!(fs->sb.features & ASSOOFS_FEATURE_DX_TREE)) {
+            fs->sb.features |= ASSOOFS_FEATURE_DX_TREE;
+            if ((ret = save_sb(fs)))
+                return ret;
+        }
+        root->leaves = root->count;
+        root->levels = 1;
+        root->count = 1;
+        memset(root->entries, 0, limit * sizeof(struct assoofs_dx_entry));
+        root->entries[0].block = ASSOOFS_DX_NODE_LBLK(0);
+        if ((ret = write_block(fs, path->block[0], path->buf[0])))
+            return ret;
+        path->index[1] = path->index[0];
+        path->index[0] = 0;
+        path->depth = 2;
+    }
+
+    if (root->count >= limit)
+        return -ENOSPC;
+
+    lblk = ASSOOFS_DX_NODE_LBLK(root->count);
+    if ((ret = dir_new_block(fs, dir, lblk, new_buf, &new_block)))
+        return ret;
+    new_node = (struct assoofs_dx_root *)new_buf;
+    mid = node->count / 2;
+    split = node->entries[mid].hash;
+    memset(new_buf, 0, fs->bs);
+    new_node->count = node->count - mid;
+    memcpy(new_node->entries, &node->entries[mid], new_node->count * sizeof(struct assoofs_dx_entry));
+    node->count = mid;
+    if ((ret = write_block(fs, new_block, new_buf)) || (ret = write_block(fs, path->block[1], path->buf[1])))
+        return ret;
+
+    memmove(&root->entries[path->index[0] + 2], &root->entries[path->index[0] + 1], (root->count - path->index[0] - 1) * sizeof(struct assoofs_dx_entry));
+    root->entries[path->index[0] + 1].hash = split;
+    root->entries[path->index[0] + 1].block = lblk;
+    root->count++;
+    if ((ret = write_block(fs, path->block[0], path->buf[0])))
+        return ret;
+
+    if (hash >= split) {
+        memcpy(path->buf[1], new_buf, fs->bs);
+        path->block[1] = new_block;
+        path->index[0]++;
+    }
+    path->index[1] = assoofs_dx_find(node, hash);
+    return 0;
+}
+
+//Parte la hoja a la que lleva path (en leaf_buf, bloque *leaf_block) moviendo la mitad superior de sus hashes a una
+//hoja nueva. Al volver leaf_buf y *leaf_block son la hoja donde debe ir un nombre con hash hash
+static int dx_split(struct assoofs_fs *fs, struct assoofs_inode_info *dir, struct dx_path *path, char *leaf_buf, uint64_t *leaf_block, uint64_t hash) {
+    struct assoofs_dx_root *root = DX_AT(path, 0), *parent;
+    uint64_t hashes[ASSOOFS_MAX_BLOCK_SIZE / 16], split, new_lblk, new_block, index, i, n = 0;
+    char new_buf[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_dirent de;
+    unsigned int offset = 0;
+    int ret;
+
+    while (n < fs->bs / 16 && assoofs_dir_next(dir, leaf_buf, fs->bs, &offset, &de))
+        hashes[n++] = assoofs_name_hash(de.name, de.len);
+    if (n < 2)
+        return -ENOSPC;
+    qsort(hashes, n, sizeof(uint64_t), cmp_hash);
+
+    //El corte tiene que caer entre dos hashes distintos para que cada hash este en una sola hoja
+    for (i = n / 2; i < n && hashes[i] == hashes[i - 1]; i++)
+        ;
+    if (i == n)
+        for (i = n / 2 - 1; i > 0 && hashes[i] == hashes[i - 1]; i--)
+            ;
+    if (i == 0)
+        return -ENOSPC; //Todos los nombres de la hoja tienen el mismo hash
+    split = hashes[i];
+
+    if ((ret = dx_grow(fs, dir, path, hash)))
+        return ret;
+    parent = DX_AT(path, path->depth - 1);
+    index = path->index[path->depth - 1];
+
+    new_lblk = assoofs_dx_leaves(root) + 1;
+    if ((ret = dir_new_block(fs, dir, new_lblk, new_buf, &new_block)))
+        return ret;
+
+    offset = 0;
+    while (assoofs_dir_next(dir, leaf_buf, fs->bs, &offset, &de)) {
+        if (assoofs_name_hash(de.name, de.len) < split)
+            continue;
+        assoofs_dir_block_add(dir, new_buf, fs->bs, &de);
+        assoofs_dir_block_del(dir, leaf_buf, &de);
+    }
+    if ((ret = write_block(fs, new_block, new_buf)) || (ret = write_block(fs, *leaf_block, leaf_buf)))
+        return ret;
+
+    memmove(&parent->entries[index + 2], &parent->entries[index + 1], (parent->count - index - 1) * sizeof(struct assoofs_dx_entry));
+    parent->entries[index + 1].hash = split;
+    parent->entries[index + 1].block = new_lblk;
+    parent->count++;
+    if (root->levels)
+        root->leaves++;
+    if ((ret = write_block(fs, path->block[path->depth - 1], path->buf[path->depth - 1])))
+        return ret;
+    if (root->levels && (ret = write_block(fs, path->block[0], path->buf[0])))
+        return ret;
+
+    if (hash >= split) {
+        memcpy(leaf_buf, new_buf, fs->bs);
+        *leaf_block = new_block;
+    }
+    return 0;
+}
+
+static int dx_add(struct assoofs_fs *fs, struct assoofs_inode_info *dir, const struct assoofs_dirent *de) {
+    char leaf_buf[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t hash = assoofs_name_hash(de->name, de->len), leaf_block;
+    struct dx_path *path;
+    int ret;
+
+    if (!(path = malloc(sizeof(*path))))
+        return -ENOMEM;
+    if ((ret = dx_walk(fs, dir, hash, path)) || (ret = dir_read(fs, dir, DX_PATH_LEAF(path), leaf_buf, &leaf_block)))
+        goto out;
+
+    while ((ret = assoofs_dir_block_add(dir, leaf_buf, fs->bs, de)) == -ENOSPC) {
+        if ((ret = dx_split(fs, dir, path, leaf_buf, &leaf_block, hash)))
+            goto out;
+        path->index[path->depth - 1] = assoofs_dx_find(DX_AT(path, path->depth - 1), hash);
+    }
+    if (!ret)
+        ret = write_block(fs, leaf_block, leaf_buf);
+out:
+    free(path);
+    return ret;
+}
+
+//Annade la entrada <name, ino> al directorio y guarda su informacion persistente
+static int add_dir_entry(struct assoofs_fs *fs, struct assoofs_inode_info *dir, const char *name, uint64_t ino, unsigned char type) {
+    struct assoofs_dirent de = {
+        .name = name,
+        .len = strlen(name),
+        .inode_no = ino,
+        .type = type,
+    };
+    char buf[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t block;
+    int ret;
+
+    if (!(dir->flags & ASSOOFS_INODE_DIR_INDEX)) {
+        if ((ret = dir_read(fs, dir, 0, buf, &block)))
+            return ret;
+        ret = assoofs_dir_block_add(dir, buf, fs->bs, &de);
+        if (!ret) {
+            if ((ret = write_block(fs, block, buf)))
+                return ret;
+            goto out;
+        }
+        if (ret != -ENOSPC || (ret = dx_convert(fs, dir)))
+            return ret;
+    }
+
+    if ((ret = dx_add(fs, dir, &de))) {
+        save_inode(fs, dir); //Puede haber cambiado el mapa de bloques del directorio
+        return ret;
+    }
+
+out:
+    dir->dir_children_count++;
+    return save_inode(fs, dir);
+}
+
+//Emite las entradas del bloque lblk desde *pos. Devuelve 1 si filldir ha parado
+static int dir_block_emit(struct assoofs_fs *fs, struct assoofs_inode_info *dir, char *buf, uint64_t lblk, uint64_t *pos, assoofs_filldir_t filldir, void *arg) {
+    struct assoofs_dirent de;
+    unsigned int offset = 0, limit = assoofs_dir_limit(dir, fs->bs);
+
+    while (assoofs_dir_next(dir, buf, limit, &offset, &de)) {
+        if (DIR_POS(fs, lblk, de.offset) < *pos)
+            continue;
+        *pos = DIR_POS(fs, lblk, de.offset);
+        if (filldir(arg, de.name, de.len, de.inode_no, de.type, DIR_POS(fs, lblk, offset)))
+            return 1;
+    }
+    *pos = DIR_POS(fs, lblk + 1, 0);
+    return 0;
+}
+
+/*
+ *  Ficheros
+ */
+
+//Escribe len bytes de buf en la posicion off de un fichero que ya no es inline, reservando los bloques que falten
+static int write_blocks(struct assoofs_fs *fs, struct assoofs_inode_info *info, const char *buf, size_t len, uint64_t off) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t lblk, pblk, count;
+    size_t start, n;
+    int ret;
+
+    while (len) {
+        lblk = off / fs->bs;
+        start = off % fs->bs;
+        n = fs->bs - start < len ? fs->bs - start : len;
+
+        if ((ret = map_block(fs, info, lblk, &pblk, &count)))
+            return ret;
+        if (!pblk) {
+            //Bloque nuevo: lo que no cubra la escritura va a cero
+            if ((ret = alloc_file_block(fs, info, lblk, &pblk)))
+                return ret;
+            memset(block, 0, fs->bs);
+        } else {
+            if (n < fs->bs && (ret = read_block(fs, pblk, block)))
+                return ret;
+            //Un bloque compartido con un clon se escribe entero en uno nuevo
+            if ((info->flags & ASSOOFS_INODE_SHARED) && block_shared(fs, pblk) && (ret = cow_block(fs, info, lblk, pblk, &pblk)))
+                return ret;
+        }
+        memcpy(block + start, buf, n);
+        if ((ret = write_block(fs, pblk, block)))
+            return ret;
+
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+//Saca el contenido inline del inodo a bloques para que el fichero pueda crecer, como assoofs_inline_to_blocks
+static int inline_to_blocks(struct assoofs_fs *fs, struct assoofs_inode_info *info) {
+    char data[ASSOOFS_INLINE_DATA_MAX];
+    uint64_t size = info->file_size < ASSOOFS_INLINE_DATA_MAX ? info->file_size : ASSOOFS_INLINE_DATA_MAX;
+
+    memcpy(data, info->inline_data, size);
+    info->flags &= ~ASSOOFS_INODE_INLINE;
+    memset(info->inline_data, 0, ASSOOFS_INLINE_DATA_MAX);
+    info->extent_count = 0;
+    info->extent_block = 0;
+    info->data_block_number = 0;
+    return size ? write_blocks(fs, info, data, size, 0) : 0;
+}
+
+/*
+ *  Interfaz publica
+ */
+
+//Como assoofs_fill_super: si la imagen no se desmonto bien inodes_count y free_blocks pueden no estar al dia y se
+//cuentan en la tabla de inodos y en el mapa de bits
+static int recount(struct assoofs_fs *fs) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_inode_info *slots = (struct assoofs_inode_info *)block;
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(fs->bs), i, j, inodes = 0, free = 0;
+    int ret;
+
+    for (i = 0; i < fs->sb.bitmap_blocks * fs->bs; i++)
+        free += __builtin_popcount(fs->bitmap[i]);
+    for (i = 0; i < fs->sb.inode_table_blocks; i++) {
+        if ((ret = read_block(fs, fs->sb.inode_table_block + i, block)))
+            return ret;
+        for (j = 0; j < per_block; j++)
+            inodes += slots[j].inode_no == i * per_block + j + 1;
+    }
+    fs->sb.inodes_count = inodes;
+    fs->sb.free_blocks = free;
+    return 0;
+}
+
+int assoofs_open(const char *path, bool readonly, struct assoofs_fs **fsp) {
+    struct assoofs_fs *fs;
+    struct stat st;
+    uint64_t i;
+    int ret = -EINVAL;
+
+    fs = calloc(1, sizeof(*fs));
+    if (!fs)
+        return -ENOMEM;
+    fs->readonly = readonly;
+    pthread_mutex_init(&fs->lock, NULL);
+
+    fs->fd = open(path, readonly ? O_RDONLY : O_RDWR);
+    if (fs->fd == -1) {
+        ret = -errno;
+        free(fs);
+        return ret;
+    }
+    if (fstat(fs->fd, &st) || pread(fs->fd, &fs->sb, sizeof(fs->sb), 0) != sizeof(fs->sb)) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    //Las mismas comprobaciones que assoofs_fill_super
+    if (fs->sb.magic != ASSOOFS_MAGIC || !assoofs_block_size_valid(fs->sb.block_size, fs->sb.features)) {
+        assoofs_format_error("Not an assoofs image: magic %llx, block size %llu\n", (unsigned long long)fs->sb.magic, (unsigned long long)fs->sb.block_size);
+        goto fail;
+    }
+    fs->bs = fs->sb.block_size;
+    if (fs->sb.features & ~ASSOOFS_FEATURES_SUPPORTED) {
+        assoofs_format_error("Unsupported features:%llx\n", (unsigned long long)(fs->sb.features & ~ASSOOFS_FEATURES_SUPPORTED));
+        goto fail;
+    }
+    if (fs->sb.bitmap_blocks != (fs->sb.blocks_count + ASSOOFS_BITS_PER_BLOCK(fs->bs) - 1) / ASSOOFS_BITS_PER_BLOCK(fs->bs) ||
+        (S_ISREG(st.st_mode) && fs->sb.blocks_count * fs->bs > (uint64_t)st.st_size) ||
+        fs->sb.inode_table_block + fs->sb.inode_table_blocks > fs->sb.blocks_count ||
+        ((fs->sb.features & ASSOOFS_FEATURE_REFLINK) &&
+         (fs->sb.refcount_blocks != (fs->sb.blocks_count + ASSOOFS_REFCOUNTS_PER_BLOCK(fs->bs) - 1) / ASSOOFS_REFCOUNTS_PER_BLOCK(fs->bs) ||
+          fs->sb.refcount_block + fs->sb.refcount_blocks > fs->sb.blocks_count))) {
+        assoofs_format_error("The superblock does not match the image\n");
+        goto fail;
+    }
+
+    //La transaccion aplicada puede traer un superbloque mas nuevo
+    if ((ret = journal_replay(fs)))
+        goto fail;
+    if (pread(fs->fd, &fs->sb, sizeof(fs->sb), 0) != sizeof(fs->sb)) {
+        ret = -EIO;
+        goto fail;
+    }
+
+    ret = -ENOMEM;
+    fs->bitmap = malloc(fs->sb.bitmap_blocks * fs->bs);
+    if (!fs->bitmap)
+        goto fail;
+    for (i = 0; i < fs->sb.bitmap_blocks; i++) {
+        if ((ret = read_block(fs, fs->sb.bitmap_block + i, fs->bitmap + i * fs->bs)))
+            goto fail;
+    }
+    if (fs->sb.state != ASSOOFS_STATE_CLEAN && (ret = recount(fs)))
+        goto fail;
+
+    //Mientras este abierta para escribir la imagen no esta CLEAN, igual que montada con el modulo
+    fs->sb.state = 0;
+    if (!readonly && (ret = save_sb(fs)))
+        goto fail;
+
+    *fsp = fs;
+    return 0;
+
+fail:
+    free(fs->bitmap);
+    close(fs->fd);
+    free(fs);
+    return ret;
+}
+
+int assoofs_sync(struct assoofs_fs *fs) {
+    if (fs->readonly)
+        return 0;
+    return fsync(fs->fd) ? -errno : 0;
+}
+
+int assoofs_close(struct assoofs_fs *fs) {
+    int ret = assoofs_sync(fs);
+
+    if (!fs->readonly && !ret) {
+        fs->sb.state = ASSOOFS_STATE_CLEAN;
+        if (!(ret = save_sb(fs)))
+            ret = assoofs_sync(fs);
+    }
+
+    if (close(fs->fd) && !ret)
+        ret = -errno;
+    pthread_mutex_destroy(&fs->lock);
+    free(fs->bitmap);
+    free(fs);
+    return ret;
+}
+
+void assoofs_statfs(struct assoofs_fs *fs, struct assoofs_super_block_info *info) {
+    pthread_mutex_lock(&fs->lock);
+    memcpy(info, &fs->sb, sizeof(*info));
+    pthread_mutex_unlock(&fs->lock);
+}
+
+int assoofs_get_inode(struct assoofs_fs *fs, uint64_t ino, struct assoofs_inode_info *info) {
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = get_inode(fs, ino, info);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+//lookup sin el cerrojo: comprueba el nombre y que dir es un directorio
+static int lookup(struct assoofs_fs *fs, uint64_t dir, const char *name, uint64_t *ino) {
+    struct assoofs_inode_info dir_info;
+    int ret;
+
+    if (strlen(name) >= ASSOOFS_FILENAME_MAXLEN)
+        return -ENAMETOOLONG;
+    if ((ret = get_inode(fs, dir, &dir_info)))
+        return ret;
+    if (!S_ISDIR(dir_info.mode))
+        return -ENOTDIR;
+    return find_dir_entry(fs, &dir_info, name, ino);
+}
+
+int assoofs_lookup(struct assoofs_fs *fs, uint64_t dir, const char *name, uint64_t *ino) {
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = lookup(fs, dir, name, ino);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+int assoofs_resolve(struct assoofs_fs *fs, const char *path, uint64_t *ino) {
+    char *copy, *name, *save;
+    uint64_t cur = ASSOOFS_ROOTDIR_INODE_NUMBER;
+    int ret = 0;
+
+    copy = strdup(path);
+    if (!copy)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&fs->lock);
+    for (name = strtok_r(copy, "/", &save); name && !ret; name = strtok_r(NULL, "/", &save))
+        ret = lookup(fs, cur, name, &cur);
+    pthread_mutex_unlock(&fs->lock);
+
+    free(copy);
+    if (!ret)
+        *ino = cur;
+    return ret;
+}
+
+int assoofs_readdir(struct assoofs_fs *fs, uint64_t dir, uint64_t *pos, assoofs_filldir_t filldir, void *arg) {
+    struct assoofs_inode_info info;
+    char buf[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t lblk, count, block;
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((ret = get_inode(fs, dir, &info)))
+        goto out;
+    if (!S_ISDIR(info.mode)) {
+        ret = -ENOTDIR;
+        goto out;
+    }
+    if (*pos < 2)
+        *pos = 2;
+
+    if (!(info.flags & ASSOOFS_INODE_DIR_INDEX)) {
+        if (*pos < DIR_POS(fs, 1, 0) && !(ret = dir_read(fs, &info, 0, buf, &block)))
+            dir_block_emit(fs, &info, buf, 0, pos, filldir, arg);
+        goto out;
+    }
+
+    //Indexado: las hojas por numero de bloque, igual que assoofs_dx_iterate
+    if ((ret = dx_read_root(fs, &info, buf, &block)))
+        goto out;
+    count = assoofs_dx_leaves((struct assoofs_dx_root *)buf);
+    for (lblk = (*pos - 2) / fs->bs > 1 ? (*pos - 2) / fs->bs : 1; lblk <= count; lblk++) {
+        if ((ret = dir_read(fs, &info, lblk, buf, &block)))
+            break;
+        if (dir_block_emit(fs, &info, buf, lblk, pos, filldir, arg))
+            break;
+    }
+
+out:
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+//Deshace un new_entry que no ha podido enlazar el inodo, como assoofs_create en el modulo: el hueco de la tabla queda
+//libre, el numero se puede volver a usar y los bloques del directorio nuevo se devuelven
+static void new_entry_undo(struct assoofs_fs *fs, const struct assoofs_inode_info *info) {
+    struct assoofs_inode_info *slot;
+    char buf[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t i, b;
+
+    for (i = 0; i < info->extent_count && i < ASSOOFS_INODE_EXTENTS; i++)
+        for (b = 0; b < info->extents[i].ee_len; b++)
+            release_block(fs, info->extents[i].ee_start + b);
+    if (!inode_slot(fs, info->inode_no, buf, &slot)) {
+        memset(slot, 0, sizeof(*slot));
+        write_block(fs, ASSOOFS_INODE_BLOCK(fs->sb.inode_table_block, info->inode_no, fs->bs), buf);
+    }
+    fs->sb.inodes_count--;
+    fs->next_ino = info->inode_no - 1;
+    save_sb(fs);
+}
+
+//create y mkdir: reservan el inodo, lo guardan y lo enlazan en dir
+static int new_entry(struct assoofs_fs *fs, uint64_t dir, const char *name, mode_t mode, uint64_t *ino) {
+    struct assoofs_inode_info dir_info, info;
+    char buf[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t existing, block;
+    int ret;
+
+    if (fs->readonly)
+        return -EROFS;
+    ret = lookup(fs, dir, name, &existing);
+    if (ret != -ENOENT)
+        return ret ? ret : -EEXIST;
+    if ((ret = get_inode(fs, dir, &dir_info)) || (ret = new_inode_no(fs, ino)))
+        return ret;
+
+    memset(&info, 0, sizeof(info));
+    info.inode_no = *ino;
+    info.mode = mode;
+    if (S_ISDIR(mode)) {
+        //El bloque del directorio, vacio en el formato que toque
+        if (fs->sb.features & ASSOOFS_FEATURE_DIR_V2)
+            info.flags |= ASSOOFS_INODE_DIR_V2;
+        if ((ret = dir_new_block(fs, &info, 0, buf, &block)) || (ret = write_block(fs, block, buf)))
+            goto fail;
+    } else {
+        info.flags = ASSOOFS_INODE_INLINE; //Vacio: cabe en el inodo
+    }
+    if ((ret = save_inode(fs, &info)) ||
+        (ret = add_dir_entry(fs, &dir_info, name, *ino, S_ISDIR(mode) ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG_FILE)))
+        goto fail;
+    return 0;
+
+fail:
+    new_entry_undo(fs, &info);
+    return ret;
+}
+
+int assoofs_create(struct assoofs_fs *fs, uint64_t dir, const char *name, mode_t mode, uint64_t *ino) {
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = new_entry(fs, dir, name, S_IFREG | (mode & ~S_IFMT), ino);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+int assoofs_mkdir(struct assoofs_fs *fs, uint64_t dir, const char *name, mode_t mode, uint64_t *ino) {
+    int ret;
+
+    pthread_mutex_lock(&fs->lock);
+    ret = new_entry(fs, dir, name, S_IFDIR | (mode & ~S_IFMT), ino);
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
+
+ssize_t assoofs_read(struct assoofs_fs *fs, uint64_t ino, void *buf, size_t len, uint64_t off) {
+    struct assoofs_inode_info info;
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t pblk, count;
+    size_t done = 0, start, n;
+    ssize_t ret;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((ret = get_inode(fs, ino, &info)))
+        goto out;
+    if (S_ISDIR(info.mode)) {
+        ret = -EISDIR;
+        goto out;
+    }
+    if (off >= info.file_size)
+        goto out;
+    if (len > info.file_size - off)
+        len = info.file_size - off;
+
+    if (info.flags & ASSOOFS_INODE_INLINE) {
+        if (off + len > ASSOOFS_INLINE_DATA_MAX) {
+            ret = -EIO;
+            goto out;
+        }
+        memcpy(buf, info.inline_data + off, len);
+        done = len;
+        goto out;
+    }
+    if (info.flags & ASSOOFS_INODE_COMPRESSED) {
+        if (!(ret = read_compressed(fs, &info, buf, len, off)))
+            done = len;
+        goto out;
+    }
+
+    while (done < len) {
+        start = (off + done) % fs->bs;
+        n = fs->bs - start < len - done ? fs->bs - start : len - done;
+        if ((ret = map_block(fs, &info, (off + done) / fs->bs, &pblk, &count)))
+            goto out;
+        if (!pblk)
+            memset(block, 0, fs->bs); //Hueco
+        else if ((ret = read_block(fs, pblk, block)))
+            goto out;
+        memcpy((char *)buf + done, block + start, n);
+        done += n;
+    }
+
+out:
+    pthread_mutex_unlock(&fs->lock);
+    return ret ? ret : (ssize_t)done;
+}
+
+ssize_t assoofs_write(struct assoofs_fs *fs, uint64_t ino, const void *buf, size_t len, uint64_t off) {
+    struct assoofs_inode_info info;
+    ssize_t ret;
+
+    if (fs->readonly)
+        return -EROFS;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((ret = get_inode(fs, ino, &info)))
+        goto out;
+    if (S_ISDIR(info.mode)) {
+        ret = -EISDIR;
+        goto out;
+    }
+    if ((ret = check_writable(fs, &info)))
+        goto out;
+
+    if ((info.flags & ASSOOFS_INODE_INLINE) && off + len <= ASSOOFS_INLINE_DATA_MAX) {
+        //Sigue cabiendo en el inodo
+        memcpy(info.inline_data + off, buf, len);
+    } else {
+        if ((info.flags & ASSOOFS_INODE_INLINE) && (ret = inline_to_blocks(fs, &info)))
+            goto out;
+        ret = write_blocks(fs, &info, buf, len, off);
+    }
+    if (!ret && off + len > info.file_size)
+        info.file_size = off + len;
+    if (!ret || !(info.flags & ASSOOFS_INODE_INLINE))
+        ret = save_inode(fs, &info) ? -EIO : ret; //Los bloques reservados antes de un error tambien se guardan
+
+out:
+    pthread_mutex_unlock(&fs->lock);
+    return ret ? ret : (ssize_t)len;
+}
+
+int assoofs_set_size(struct assoofs_fs *fs, uint64_t ino, uint64_t size) {
+    struct assoofs_inode_info info;
+    char zeros[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t lblk, pblk, count;
+    int ret;
+
+    if (fs->readonly)
+        return -EROFS;
+
+    pthread_mutex_lock(&fs->lock);
+    if ((ret = get_inode(fs, ino, &info)))
+        goto out;
+    if (S_ISDIR(info.mode)) {
+        ret = -EISDIR;
+        goto out;
+    }
+    if (size < info.file_size && (ret = check_writable(fs, &info)))
+        goto out;
+
+    if (info.flags & ASSOOFS_INODE_INLINE) {
+        if (size > ASSOOFS_INLINE_DATA_MAX && (ret = inline_to_blocks(fs, &info)))
+            goto out;
+        if (size < info.file_size)
+            memset(info.inline_data + size, 0, info.file_size - size);
+    } else if (size < info.file_size) {
+        //Lo que queda detras del nuevo final se pone a cero para que no reaparezca si el fichero vuelve a crecer
+        memset(zeros, 0, fs->bs);
+        if (size % fs->bs && (ret = write_blocks(fs, &info, zeros, fs->bs - size % fs->bs, size)))
+            goto out;
+        for (lblk = (size + fs->bs - 1) / fs->bs; lblk * fs->bs < info.file_size; lblk++) {
+            if ((ret = map_block(fs, &info, lblk, &pblk, &count)))
+                goto out;
+            if (pblk && (ret = write_blocks(fs, &info, zeros, fs->bs, lblk * fs->bs))) //write_blocks: puede ser compartido
+                goto out;
+        }
+    }
+    info.file_size = size;
+    ret = save_inode(fs, &info);
+
+out:
+    pthread_mutex_unlock(&fs->lock);
+    return ret;
+}
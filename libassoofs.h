@@ -0,0 +1,49 @@
+//libassoofs: el formato de assoofs en espacio de usuario, sobre una imagen (o un dispositivo) abierta como fichero.
+//Hace lo mismo que el modulo del kernel: mapa de bits, tabla de inodos, directorios lineales e indexados (v1 y v2),
+//extents, ficheros inline y la lectura de los comprimidos, con las mismas funciones de assoofs.h para los bloques de directorio. No tiene cache de
+//bloques propia: cada bloque se lee y se escribe con pread/pwrite. Sirve para medir, perfilar y hacer fuzzing del
+//formato sin cargar el modulo ni ser root
+//Todas las funciones devuelven 0 (o los bytes leidos/escritos) si va bien y -errno si no, como en el kernel
+
+#ifndef LIBASSOOFS_H
+#define LIBASSOOFS_H
+
+#include <sys/types.h>
+#include "assoofs.h"
+
+struct assoofs_fs;
+
+//Abre la imagen path. Si el journal tiene una transaccion completa sin aplicar se aplica antes de nada (una imagen
+//que la necesita no se puede abrir de solo lectura)
+int assoofs_open(const char *path, bool readonly, struct assoofs_fs **fsp);
+//Lleva a disco lo escrito y cierra la imagen
+int assoofs_close(struct assoofs_fs *fs);
+int assoofs_sync(struct assoofs_fs *fs);
+//Copia del superbloque (contadores de bloques e inodos libres)
+void assoofs_statfs(struct assoofs_fs *fs, struct assoofs_super_block_info *info);
+
+//Informacion persistente del inodo ino
+int assoofs_get_inode(struct assoofs_fs *fs, uint64_t ino, struct assoofs_inode_info *info);
+//Busca name en el directorio dir
+int assoofs_lookup(struct assoofs_fs *fs, uint64_t dir, const char *name, uint64_t *ino);
+//Busca una ruta absoluta desde el directorio raiz
+int assoofs_resolve(struct assoofs_fs *fs, const char *path, uint64_t *ino);
+
+//Recibe cada entrada del directorio; next_pos es la posicion de la siguiente. Devuelve distinto de 0 para parar
+typedef int (*assoofs_filldir_t)(void *arg, const char *name, unsigned int len, uint64_t ino, unsigned int type, uint64_t next_pos);
+//Entradas de dir desde *pos, con la misma numeracion que readdir en el modulo. 0 y 1 son . y .., que no estan en
+//disco y los pone quien llama. Si filldir para, *pos queda en la entrada que no ha querido
+int assoofs_readdir(struct assoofs_fs *fs, uint64_t dir, uint64_t *pos, assoofs_filldir_t filldir, void *arg);
+
+//Crean un fichero (vacio e inline) o un directorio con nombre name dentro de dir
+int assoofs_create(struct assoofs_fs *fs, uint64_t dir, const char *name, mode_t mode, uint64_t *ino);
+int assoofs_mkdir(struct assoofs_fs *fs, uint64_t dir, const char *name, mode_t mode, uint64_t *ino);
+
+ssize_t assoofs_read(struct assoofs_fs *fs, uint64_t ino, void *buf, size_t len, uint64_t off);
+//Escribir en un fichero con clusters comprimidos devuelve -EOPNOTSUPP. Los bloques que un clon comparte se copian
+//antes de escribir en ellos
+ssize_t assoofs_write(struct assoofs_fs *fs, uint64_t ino, const void *buf, size_t len, uint64_t off);
+//Cambia el tamannio del fichero. Los bloques que quedan detras del final no se liberan, se ponen a cero
+int assoofs_set_size(struct assoofs_fs *fs, uint64_t ino, uint64_t size);
+
+#endif
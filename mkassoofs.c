@@ -5,32 +5,168 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <linux/fs.h>   //BLKGETSIZE64
 #include "assoofs.h"
 
-#define WELCOMEFILE_DATABLOCK_NUMBER (ASSOOFS_LAST_RESERVED_BLOCK + 1)
+#define REFCOUNT_BLOCK_NUMBER (ASSOOFS_BITMAP_BLOCK_NUMBER + bitmap_blocks) //Contadores de referencias tras el mapa de bits
+#define INODE_TABLE_BLOCK_NUMBER (REFCOUNT_BLOCK_NUMBER + refcount_blocks) //Tabla de inodos tras los contadores
+#define JOURNAL_BLOCK_NUMBER (INODE_TABLE_BLOCK_NUMBER + inode_table_blocks) //Journal tras la tabla de inodos
+#define ROOTDIR_DATABLOCK_NUMBER (JOURNAL_BLOCK_NUMBER + journal_blocks) //Primer bloque de datos
 #define WELCOMEFILE_INODE_NUMBER (ASSOOFS_LAST_RESERVED_INODE + 1)
+#define BLOCKS_PER_INODE 4  //Se reserva un inodo por cada 4 bloques del dispositivo
+#define MIN_INODES 64       //Y como minimo 64 inodos
+#define BLOCKS_PER_JOURNAL_BLOCK 64 //Un bloque de journal por cada 64 bloques del dispositivo
+#define MAX_JOURNAL_BLOCKS 1024     //Con bloques de 4K son 4MB: caben varias transacciones completas
+#define COPY_BATCH (4 << 20)        //Con -d cada hilo lee y escribe de una vez hasta 4MB: los ficheros pequennos que
+                                    //quedan seguidos en la imagen van juntos en una sola escritura
+#define MAX_EXTENT_BLOCKS 0xffffffffULL //Bloques de un extent (la parte baja de ee_len)
+
+static uint64_t block_size = ASSOOFS_DEFAULT_BLOCK_SIZE;    //Tamannio del bloque (-b)
+static uint64_t fs_size;        //Bytes del dispositivo que se formatean (-s; 0 para usarlo entero)
+static uint64_t inodes_wanted;  //Inodos de la tabla (-i; 0 para calcularlos a partir del tamannio)
+static uint64_t blocks_count;   //Numero de bloques del dispositivo
+static uint64_t bitmap_blocks;  //Numero de bloques del mapa de bits
+static uint64_t refcount_blocks;    //Numero de bloques de los contadores de referencias (0 sin -O reflink)
+static uint64_t inode_table_blocks; //Numero de bloques de la tabla de inodos
+static uint64_t journal_blocks; //Numero de bloques del journal
+static uint64_t features;       //Caracteristicas del formato elegidas con -O (ASSOOFS_FEATURE_*)
+static const char *source_dir;  //Arbol que se copia en la imagen (-d; NULL para dejar solo README.txt)
+static long threads;            //Hilos que leen los ficheros de origen (-j; 0 para uno por CPU)
+static uint64_t used_inodes = WELCOMEFILE_INODE_NUMBER; //Inodos ocupados al terminar (sin -d el raiz y README.txt)
+static uint64_t first_free_block;   //Primer bloque libre: todos los anteriores quedan ocupados
+
+//Arbol que se copia con -d. Los nodos van en el orden de sus numeros de inodo (el nodo i es el inodo i + 1): el raiz
+//primero y los hijos de cada directorio seguidos, en el orden del recorrido en anchura
+struct node {
+    char *path;                     //Ruta en el arbol de origen
+    const char *name;               //Nombre dentro de su directorio (apunta dentro de path)
+    struct assoofs_inode_info info; //Inodo tal cual va en la tabla
+    uint64_t first_child;           //Directorios: los dir_children_count hijos empiezan en este nodo
+    uint64_t block;                 //Primer bloque en la imagen (0 si no tiene)
+    uint64_t blocks;                //Bloques que ocupa
+};
+
+static struct node *nodes;
+static uint64_t node_count;
+
+//Calcula la geometria a partir del tamannio del dispositivo (o de la imagen si es un fichero normal)
+//Con -s el tamannio lo elige quien formatea: en un dispositivo no puede pasar de lo que mide y una imagen se alarga
+static int compute_geometry(int fd) {
+    struct stat st;
+    uint64_t size, inodes;
+
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading the device size");
+        return -1;
+    }
+
+    if (S_ISBLK(st.st_mode)) {  //Dispositivo de bloques: preguntar al driver
+        if (ioctl(fd, BLKGETSIZE64, &size) == -1) {
+            perror("Error reading the device size");
+            return -1;
+        }
+    } else {
+        size = st.st_size;
+    }
+
+    if (fs_size) {
+        if (fs_size > size && S_ISBLK(st.st_mode)) {
+            printf("The device only has %llu bytes.\n", (unsigned long long)size);
+            return -1;
+        }
+        if (fs_size > size && ftruncate(fd, fs_size) == -1) {
+            perror("Error growing the image");
+            return -1;
+        }
+        size = fs_size;
+    }
+
+    blocks_count = size / block_size;
+    bitmap_blocks = (blocks_count + ASSOOFS_BITS_PER_BLOCK(block_size) - 1) / ASSOOFS_BITS_PER_BLOCK(block_size);
+    if (features & ASSOOFS_FEATURE_REFLINK)
+        refcount_blocks = (blocks_count + ASSOOFS_REFCOUNTS_PER_BLOCK(block_size) - 1) / ASSOOFS_REFCOUNTS_PER_BLOCK(block_size);
+    inodes = inodes_wanted ? inodes_wanted : blocks_count / BLOCKS_PER_INODE;
+    if (inodes < MIN_INODES)
+        inodes = MIN_INODES;
+    if (!inodes_wanted && inodes < node_count)  //Con -d al menos los que necesita el arbol
+        inodes = node_count;
+    inode_table_blocks = (inodes + ASSOOFS_INODES_PER_BLOCK(block_size) - 1) / ASSOOFS_INODES_PER_BLOCK(block_size);
+    journal_blocks = blocks_count / BLOCKS_PER_JOURNAL_BLOCK;
+    if (journal_blocks < ASSOOFS_JOURNAL_MIN_BLOCKS)
+        journal_blocks = ASSOOFS_JOURNAL_MIN_BLOCKS;
+    if (journal_blocks > MAX_JOURNAL_BLOCKS)
+        journal_blocks = MAX_JOURNAL_BLOCKS;
+    if (blocks_count <= ROOTDIR_DATABLOCK_NUMBER) { //Tiene que caber al menos el directorio raiz
+        printf("The device is too small (%llu blocks).\n", (unsigned long long)blocks_count);
+        return -1;
+    }
+
+    printf("Device has %llu blocks of %llu bytes, %llu bitmap blocks, %llu refcount blocks, %llu inodes in %llu blocks, %llu journal blocks.\n",
+           (unsigned long long)blocks_count, (unsigned long long)block_size, (unsigned long long)bitmap_blocks, (unsigned long long)refcount_blocks,
+           (unsigned long long)(inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(block_size)), (unsigned long long)inode_table_blocks,
+           (unsigned long long)journal_blocks);
+    return 0;
+}
+
+//Numero con sufijo opcional K, M o G (potencias de 1024). Devuelve 0 si no es valido
+static uint64_t parse_size(const char *arg) {
+    char *end;
+    uint64_t n = strtoull(arg, &end, 0);
+
+    switch (*end) {
+    case 'G': case 'g':
+        n <<= 10;
+        //fallthrough
+    case 'M': case 'm':
+        n <<= 10;
+        //fallthrough
+    case 'K': case 'k':
+        n <<= 10;
+        end++;
+        break;
+    }
+    return *end ? 0 : n;
+}
 
 //Inicializacion estatica de una estructura
 static int write_superblock(int fd) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
     struct assoofs_super_block_info sb = {
         .version = 1,
         .magic = ASSOOFS_MAGIC,
-        .block_size = ASSOOFS_DEFAULT_BLOCK_SIZE,
-        .inodes_count = WELCOMEFILE_INODE_NUMBER,   //Definido al principio, para formatear y
-                                                    //y que meta directamente un archivo, seria
-                                                    //el ultimo inodo reservado +1
-        .free_blocks = (~0) & ~(15),    //Pone todos lo bloques a 0 menos los 4 primeros.
-    };                                  //Genera el mapa de bits.
-                                        //
+        .block_size = block_size,
+        .inodes_count = used_inodes,    //Sin -d el raiz y README.txt, seria el ultimo inodo reservado +1
+        .free_blocks = blocks_count - first_free_block, //Todos menos el superbloque, el mapa de bits, la tabla de
+                                                        //inodos, el journal, el directorio raiz (el README.txt va
+                                                        //dentro de su inodo) y lo que ocupe el arbol de -d
+        .blocks_count = blocks_count,
+        .bitmap_block = ASSOOFS_BITMAP_BLOCK_NUMBER,
+        .bitmap_blocks = bitmap_blocks,
+        .refcount_block = refcount_blocks ? REFCOUNT_BLOCK_NUMBER : 0,
+        .refcount_blocks = refcount_blocks,
+        .inode_table_block = INODE_TABLE_BLOCK_NUMBER,
+        .inode_table_blocks = inode_table_blocks,
+        .journal_block = JOURNAL_BLOCK_NUMBER,
+        .journal_blocks = journal_blocks,
+        .features = features,
+        .state = ASSOOFS_STATE_CLEAN,
+    };
     ssize_t ret;
 
-    //Escribe dentro del dispositvo el superbloque
-    ret = write(fd, &sb, sizeof(sb));
-    if (ret != ASSOOFS_DEFAULT_BLOCK_SIZE) {    //Si no coincide devuelve -1
-        printf("Bytes written [%d] are not equal to the default block size.\n", (int)ret);
+    //Escribe dentro del dispositvo el superbloque, con el resto del bloque 0 a cero
+    memset(block, 0, block_size);
+    memcpy(block, &sb, sizeof(sb));
+    ret = write(fd, block, block_size);
+    if (ret != (ssize_t)block_size) {    //Si no coincide devuelve -1
+        printf("Bytes written [%d] are not equal to the block size.\n", (int)ret);
         return -1;
     }
 
@@ -42,12 +178,18 @@ static int write_superblock(int fd) {
 static int write_root_inode(int fd) {
     ssize_t ret;
 
-    struct assoofs_inode_info root_inode;
+    struct assoofs_inode_info root_inode = { 0 };
 
     root_inode.mode = S_IFDIR;  //Flag que especifica un directorio
     root_inode.inode_no = ASSOOFS_ROOTDIR_INODE_NUMBER; //Especificado en la estructura
-    root_inode.data_block_number = ASSOOFS_ROOTDIR_BLOCK_NUMBER;
+    root_inode.data_block_number = ROOTDIR_DATABLOCK_NUMBER;
     root_inode.dir_children_count = 1;  //Se define directorio (union de la estructura)
+    root_inode.extent_count = 1;        //Un unico extent con el bloque del directorio
+    root_inode.extents[0].ee_block = 0;
+    root_inode.extents[0].ee_len = 1;
+    root_inode.extents[0].ee_start = ROOTDIR_DATABLOCK_NUMBER;
+    if (features & ASSOOFS_FEATURE_DIR_V2)
+        root_inode.flags = ASSOOFS_INODE_DIR_V2;    //Sus entradas son de longitud variable
 
     ret = write(fd, &root_inode, sizeof(root_inode));
 
@@ -62,6 +204,7 @@ static int write_root_inode(int fd) {
 
 //Guarfa el inodo del fichero README.txt en el almacen de inodos
 static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) { //assoofs_inode_info estructura del fichero de inicio
+    char zeros[ASSOOFS_MAX_BLOCK_SIZE];
     off_t nbytes;
     ssize_t ret;
 
@@ -72,58 +215,648 @@ static int write_welcome_inode(int fd, const struct assoofs_inode_info *i) { //a
     }
     printf("welcomefile inode written succesfully.\n");
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - (sizeof(*i) * 2); //Actualizar el puntero interno a despues del fichero
+    nbytes = block_size - (sizeof(*i) * 2); //Rellenar con ceros hasta el final del bloque
                                                             //*2 porque hay dos estructuras ya cargadas
-    ret = lseek(fd, nbytes, SEEK_CUR);  //Avanza el puntero, SEEK_CUR no importante
-    if (ret == (off_t)-1) {
-        printf("The padding bytes are not written properly.\n");
-        return -1;
+    //y los demas bloques de la tabla de inodos enteros: un hueco a cero es un inodo libre
+    nbytes += (inode_table_blocks - 1) * block_size;
+    memset(zeros, 0, sizeof(zeros));
+    while (nbytes > 0) {
+        ret = write(fd, zeros, nbytes < (off_t)sizeof(zeros) ? nbytes : (off_t)sizeof(zeros));
+        if (ret <= 0) {
+            printf("The padding bytes are not written properly.\n");
+            return -1;
+        }
+        nbytes -= ret;
     }
 
-    printf("inode store padding bytes (after two inodes) written sucessfully.\n");
+    printf("inode table padding bytes (after two inodes) written sucessfully.\n");
+    return 0;
+}
+
+//Inicializa el journal vacio: la primera transaccion sera la 1 y el resto del journal a cero
+static int write_journal(int fd) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_journal_super_block *jsb = (struct assoofs_journal_super_block *)block;
+    uint64_t i;
+
+    memset(block, 0, sizeof(block));
+    jsb->header.magic = ASSOOFS_JOURNAL_MAGIC;
+    jsb->header.type = ASSOOFS_JOURNAL_SUPERBLOCK;
+    jsb->header.sequence = 1;
+
+    for (i = 0; i < journal_blocks; i++) {
+        if (write(fd, block, block_size) != (ssize_t)block_size) {
+            printf("Writing the journal has failed.\n");
+            return -1;
+        }
+        memset(block, 0, block_size);
+    }
+
+    printf("Journal written succesfully.\n");
     return 0;
 }
 
 //Guarda una entrada <nombre,numero de inodo> para el fichero README.txt en el bloque que
-//almacena las entradas del directorio raiz
+//almacena las entradas del directorio raiz. Con -O dir_v2 la entrada se escribe en el formato v2
 int write_dirent(int fd, const struct assoofs_dir_record_entry *record) {
-    ssize_t nbytes = sizeof(*record), ret;
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    struct assoofs_dir_record_v2 *rec = (struct assoofs_dir_record_v2 *)block;
+    ssize_t ret;
+
+    memset(block, 0, block_size);   //El resto del bloque a cero: huecos libres
+    if (features & ASSOOFS_FEATURE_DIR_V2) {
+        //Un unico registro que llega hasta el final del bloque: el hueco tras el nombre es para las siguientes
+        rec->inode_no = record->inode_no;
+        rec->rec_len = block_size;
+        rec->name_len = strlen(record->filename);
+        rec->file_type = record->file_type;
+        memcpy(rec->name, record->filename, rec->name_len);
+    } else {
+        memcpy(block, record, sizeof(*record));
+    }
 
-    ret = write(fd, record, nbytes);    //Escribe dentro del dispositivo el record
-    if (ret != nbytes) {
+    ret = write(fd, block, block_size); //Escribe dentro del dispositivo el bloque del directorio
+    if (ret != (ssize_t)block_size) {
         printf("Writing the rootdirectory datablock (name+inode_no pair for welcomefile) has failed.\n");
         return -1;
     }
     printf("root directory datablocks (name+inode_no pair for welcomefile) written succesfully.\n");
+    return 0;
+}
+
+//Genera el mapa de bits: libres (1) todos los bloques desde first_free_block (el siguiente al directorio raiz, o al
+//ultimo que ocupa el arbol de -d)
+static int write_bitmap(int fd) {
+    unsigned char block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t i, b, first, last;
+    ssize_t ret;
+
+    for (i = 0; i < bitmap_blocks; i++) {
+        memset(block, 0, block_size);
+        first = i * ASSOOFS_BITS_PER_BLOCK(block_size);
+        last = first + ASSOOFS_BITS_PER_BLOCK(block_size);
+        for (b = first; b < last && b < blocks_count; b++)
+            if (b >= first_free_block)
+                block[(b - first) / 8] |= 1 << ((b - first) % 8);
+
+        ret = write(fd, block, block_size);
+        if (ret != (ssize_t)block_size) {
+            printf("Writing the free space bitmap has failed.\n");
+            return -1;
+        }
+    }
+
+    printf("Free space bitmap written succesfully.\n");
+    return 0;
+}
 
-    nbytes = ASSOOFS_DEFAULT_BLOCK_SIZE - sizeof(*record);  //Calcula el avance del puntero
-    ret = lseek(fd, nbytes, SEEK_CUR);  //Avanza el putero
-    if (ret == (off_t)-1) {
-        printf("Writing the padding for rootdirectory children datablock has failed.\n");
+//Contadores de referencias a cero: recien formateado ningun bloque esta compartido
+static int write_refcounts(int fd) {
+    char block[ASSOOFS_MAX_BLOCK_SIZE];
+    uint64_t i;
+
+    memset(block, 0, block_size);
+    for (i = 0; i < refcount_blocks; i++) {
+        if (write(fd, block, block_size) != (ssize_t)block_size) {
+            printf("Writing the reference counts has failed.\n");
+            return -1;
+        }
+    }
+
+    if (refcount_blocks)
+        printf("Reference counts written succesfully.\n");
+    return 0;
+}
+
+/*
+ *  -d: copiar un arbol de directorios en la imagen recien formateada. Primero se recorre el arbol (scan_tree), luego
+ *  se colocan los bloques de forma contigua (layout_tree) y al final se escribe todo con pwrite (write_tree): los
+ *  directorios, los datos de los ficheros leidos por varios hilos y la tabla de inodos de una vez
+ */
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+//Nodo nuevo al final de nodes. Devuelve NULL si no hay memoria
+static struct node *new_node(void) {
+    static uint64_t cap;
+    struct node *n;
+
+    if (node_count == cap) {
+        cap = cap ? cap * 2 : 1024;
+        n = realloc(nodes, cap * sizeof(*nodes));
+        if (!n)
+            return NULL;
+        nodes = n;
+    }
+    n = &nodes[node_count];
+    memset(n, 0, sizeof(*n));
+    n->info.inode_no = ++node_count;
+    n->info.remove_flag = NO_REMOVED;
+    return n;
+}
+
+//Lee los nombres del directorio path ordenados. Devuelve cuantos hay o -1
+static long read_names(const char *path, char ***names) {
+    struct dirent *de;
+    long count = 0, cap = 0;
+    char **list = NULL, **tmp;
+    DIR *dir = opendir(path);
+
+    if (!dir) {
+        perror(path);
+        return -1;
+    }
+    while ((de = readdir(dir))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 64;
+            tmp = realloc(list, cap * sizeof(*list));
+            if (!tmp)
+                break;
+            list = tmp;
+        }
+        if (!(list[count] = strdup(de->d_name)))
+            break;
+        count++;
+    }
+    closedir(dir);
+    if (de) {
+        printf("Out of memory reading %s.\n", path);
+        while (count--)
+            free(list[count]);
+        free(list);
+        return -1;
+    }
+    qsort(list, count, sizeof(*list), cmp_names); //Siempre la misma imagen para el mismo arbol
+    *names = list;
+    return count;
+}
+
+//Recorre en anchura el arbol de source_dir y deja sus nodos en nodes. Solo se copian ficheros normales y
+//directorios: el resto se avisa y se salta. Un fichero con varios enlaces se copia una vez por cada uno
+static int scan_tree(void) {
+    struct stat st;
+    struct node *n;
+    char **names, *path;
+    long count, i;
+    uint64_t d;
+    size_t plen;
+
+    if (stat(source_dir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("%s is not a directory.\n", source_dir);
         return -1;
     }
-    printf("Padding after the rootdirectory children written succesfully.\n");
+    if (!(n = new_node()) || !(n->path = strdup(source_dir)))
+        return -1;
+    n->name = "";
+    n->info.mode = S_IFDIR | (st.st_mode & 07777);
+
+    for (d = 0; d < node_count; d++) {
+        if (!S_ISDIR(nodes[d].info.mode))
+            continue;
+        if ((count = read_names(nodes[d].path, &names)) == -1)
+            return -1;
+        nodes[d].first_child = node_count;
+        plen = strlen(nodes[d].path);
+
+        for (i = 0; i < count; i++) {
+            if (strlen(names[i]) >= ASSOOFS_FILENAME_MAXLEN) {
+                printf("The name %s is too long (at most %d characters).\n", names[i], ASSOOFS_FILENAME_MAXLEN - 1);
+                return -1;
+            }
+            path = malloc(plen + strlen(names[i]) + 2);
+            if (!path)
+                return -1;
+            sprintf(path, "%s/%s", nodes[d].path, names[i]);
+            free(names[i]);
+            if (lstat(path, &st) == -1) {
+                perror(path);
+                return -1;
+            }
+            if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+                printf("Skipping %s: only regular files and directories are copied.\n", path);
+                free(path);
+                continue;
+            }
+
+            if (!(n = new_node()))  //nodes puede cambiar de sitio: a partir de aqui solo por indice
+                return -1;
+            n->path = path;
+            n->name = path + plen + 1;
+            n->info.mode = (S_ISDIR(st.st_mode) ? S_IFDIR : S_IFREG) | (st.st_mode & 07777);
+            if (S_ISREG(st.st_mode))
+                n->info.file_size = st.st_size;
+        }
+        free(names);
+        nodes[d].info.dir_children_count = node_count - nodes[d].first_child;
+    }
     return 0;
 }
 
-//Escribe un mensaje en el bloque que almacena los contenidos del fichero README.txt
-int write_block(int fd, char *block, size_t len) {
-    ssize_t ret;
+static uint64_t node_hash(uint64_t i) {
+    return assoofs_name_hash(nodes[i].name, strlen(nodes[i].name));
+}
 
-    ret = write(fd, block, len);    //Escribier en el fichero el bloque
-    if (ret != len) {
-        printf("Writing file body has failed.\n");
+static int cmp_hashes(const void *a, const void *b) {
+    uint64_t ha = node_hash(*(const uint64_t *)a), hb = node_hash(*(const uint64_t *)b);
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+//Bytes que ocupa la entrada de child en un bloque del directorio dir
+static unsigned int entry_size(struct node *dir, uint64_t child) {
+    if (assoofs_dir_is_v2(&dir->info))
+        return ASSOOFS_DIR_V2_REC_LEN(strlen(nodes[child].name));
+    return sizeof(struct assoofs_dir_record_entry);
+}
+
+static void add_entry(struct assoofs_inode_info *dir_info, char *data, uint64_t child) {
+    struct assoofs_dirent de = {
+        .name = nodes[child].name,
+        .len = strlen(nodes[child].name),
+        .inode_no = nodes[child].info.inode_no,
+        .type = S_ISDIR(nodes[child].info.mode) ? ASSOOFS_FT_DIR : ASSOOFS_FT_REG_FILE,
+    };
+
+    assoofs_dir_block_add(dir_info, data, block_size, &de);
+}
+
+//Bloques del directorio dir, como los deja el modulo: uno si todas las entradas caben en el bloque 0 y, si no, el
+//indice, las hojas llenas con los nombres ordenados por hash y, si las hojas no caben en la raiz, los nodos
+//intermedios repartidos a partes iguales (en *nodes, que van en los bloques logicos desde ASSOOFS_DX_NODE_BASE).
+//Con buf distinto de NULL ademas los construye ahi, uno detras de otro. Devuelve -1 si el directorio no cabe en un
+//indice de dos niveles
+static long dir_blocks(struct node *dir, char *buf, long *nodes) {
+    struct assoofs_inode_info info = dir->info;
+    struct assoofs_dx_root *root = (struct assoofs_dx_root *)buf, *node;
+    struct assoofs_dx_entry *dx = NULL;
+    uint64_t n = dir->info.dir_children_count, *order, total = 0, used = 0, size, limit = ASSOOFS_DX_LIMIT(block_size), first, i, j, k;
+    unsigned int cap = assoofs_dir_is_v2(&dir->info) ? block_size : ASSOOFS_DIR_RECORDS_PER_BLOCK(block_size) * sizeof(struct assoofs_dir_record_entry);
+    long leaves = 0;
+
+    *nodes = 0;
+
+    for (i = 0; i < n; i++)
+        total += entry_size(dir, dir->first_child + i);
+    if (total <= cap) {
+        //Lineal: en v1 cada entrada va en el hueco dir_children_count, que crece segun se annaden
+        if (buf) {
+            assoofs_dir_block_init(&info, buf, block_size);
+            for (i = 0; i < n; i++) {
+                info.dir_children_count = i;
+                add_entry(&info, buf, dir->first_child + i);
+            }
+        }
+        return 1;
+    }
+
+    order = malloc(n * sizeof(*order));
+    if (!order || (buf && !(dx = malloc(n * sizeof(*dx))))) {
+        free(order);
+        return -1;
+    }
+    for (i = 0; i < n; i++)
+        order[i] = dir->first_child + i;
+    qsort(order, n, sizeof(*order), cmp_hashes);
+    for (i = 0; i < n; i = j) {
+        //Los nombres con el mismo hash tienen que caer en la misma hoja
+        for (j = i, size = 0; j < n && node_hash(order[j]) == node_hash(order[i]); j++)
+            size += entry_size(dir, order[j]);
+        if (size > cap) {
+            printf("Too many names with the same hash in %s.\n", dir->path);
+            leaves = -1;
+            break;
+        }
+        if (!leaves || used + size > cap) {
+            if ((uint64_t)leaves == limit * limit) {
+                printf("The directory %s has too many entries.\n", dir->path);
+                leaves = -1;
+                break;
+            }
+            if (buf) {
+                dx[leaves].hash = leaves ? node_hash(order[i]) : 0;
+                dx[leaves].block = leaves + 1;
+                assoofs_dir_block_init(&info, buf + (leaves + 1) * block_size, block_size);
+            }
+            leaves++;
+            used = 0;
+        }
+        used += size;
+        for (k = i; buf && k < j; k++)
+            add_entry(&info, buf + leaves * block_size, order[k]);
+    }
+    free(order);
+    if (leaves < 0) {
+        free(dx);
+        return -1;
+    }
+    if ((uint64_t)leaves > limit)
+        *nodes = (leaves + limit - 1) / limit;
+    if (buf) {
+        memset(buf, 0, block_size);
+        if (!*nodes) {
+            root->count = leaves;
+            memcpy(root->entries, dx, leaves * sizeof(*dx));
+        } else {
+            //Dos niveles: el nodo k se queda con las hojas desde k * leaves / nodes, seguidas
+            root->count = *nodes;
+            root->levels = 1;
+            root->leaves = leaves;
+            for (k = 0; k < (uint64_t)*nodes; k++) {
+                node = (struct assoofs_dx_root *)(buf + (1 + leaves + k) * block_size);
+                first = k * leaves / *nodes;
+                node->count = (k + 1) * leaves / *nodes - first;
+                memcpy(node->entries, dx + first, node->count * sizeof(*dx));
+                root->entries[k].hash = dx[first].hash;
+                root->entries[k].block = ASSOOFS_DX_NODE_LBLK(k);
+            }
+        }
+    }
+    free(dx);
+    return 1 + leaves + *nodes;
+}
+
+//Asigna al nodo los blocks bloques que empiezan en block, en los extents que hagan falta dentro del inodo
+static int place(struct node *n, uint64_t block, uint64_t blocks) {
+    uint64_t len, done;
+
+    n->block = block;
+    n->blocks = blocks;
+    n->info.data_block_number = block;
+    for (done = 0; done < blocks; done += len) {
+        if (n->info.extent_count == ASSOOFS_INODE_EXTENTS) {
+            printf("%s is too big.\n", n->path);
+            return -1;
+        }
+        len = blocks - done < MAX_EXTENT_BLOCKS ? blocks - done : MAX_EXTENT_BLOCKS;
+        n->info.extents[n->info.extent_count++] = (struct assoofs_extent){ done, len, block + done };
+    }
+    return 0;
+}
+
+//Coloca los bloques a partir del del directorio raiz: cada directorio y justo detras los datos de sus ficheros, en el
+//orden de los inodos. Los ficheros pequenios van dentro del inodo. Con -O compress los ficheros quedan marcados para
+//que lo que se escriba despues se comprima, pero sus datos se copian tal cual en extents normales
+static int layout_tree(void) {
+    uint64_t next = ROOTDIR_DATABLOCK_NUMBER, i, c;
+    struct node *d, *f;
+    long n, dx_nodes;
+
+    if (node_count > inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(block_size)) {
+        printf("The tree has %llu inodes and the inode table only %llu (see -i).\n", (unsigned long long)node_count,
+               (unsigned long long)(inode_table_blocks * ASSOOFS_INODES_PER_BLOCK(block_size)));
+        return -1;
+    }
+
+    for (i = 0; i < node_count; i++) {
+        d = &nodes[i];
+        if (!S_ISDIR(d->info.mode))
+            continue;
+        if (features & ASSOOFS_FEATURE_DIR_V2)
+            d->info.flags |= ASSOOFS_INODE_DIR_V2;
+        if ((n = dir_blocks(d, NULL, &dx_nodes)) == -1)
+            return -1;
+        if (n > 1)
+            d->info.flags |= ASSOOFS_INODE_DIR_INDEX;
+        place(d, next, n - dx_nodes);
+        if (dx_nodes) {
+            //Los nodos intermedios van detras de las hojas en disco, pero en su propio tramo de bloques logicos
+            d->info.extents[d->info.extent_count++] = (struct assoofs_extent){ ASSOOFS_DX_NODE_BASE, dx_nodes, next + n - dx_nodes };
+            d->blocks = n;
+            features |= ASSOOFS_FEATURE_DX_TREE;
+        }
+        next += n;
+
+        for (c = d->first_child; c < d->first_child + d->info.dir_children_count; c++) {
+            f = &nodes[c];
+            if (S_ISDIR(f->info.mode))
+                continue;
+            if (features & ASSOOFS_FEATURE_COMPRESSION)
+                f->info.flags |= ASSOOFS_INODE_COMPRESSED;
+            if (f->info.file_size <= ASSOOFS_INLINE_DATA_MAX) {
+                f->info.flags |= ASSOOFS_INODE_INLINE;
+                continue;
+            }
+            if (place(f, next, (f->info.file_size + block_size - 1) / block_size))
+                return -1;
+            next += f->blocks;
+        }
+    }
+
+    if (next > blocks_count) {
+        printf("The tree needs %llu blocks and the device only has %llu.\n", (unsigned long long)next, (unsigned long long)blocks_count);
         return -1;
     }
-    printf("block has been written succesfully.\n");
+    first_free_block = next;
+    used_inodes = node_count;
     return 0;
 }
 
+static int pwrite_all(int fd, const char *buf, uint64_t len, uint64_t off) {
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, off);
+        if (ret <= 0)
+            return -1;
+        buf += ret;
+        len -= ret;
+        off += ret;
+    }
+    return 0;
+}
+
+//Copia de los datos: los hilos se reparten files (los ficheros en el orden de la imagen) por tandas
+static pthread_mutex_t copy_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *copy_files, copy_count, copy_next;
+static int copy_fd, copy_error;
+
+//Lee len bytes desde off del fichero de origen n en dst y rellena con ceros hasta space. Si el fichero ha encogido
+//desde que se recorrio el arbol lo que falta queda a cero
+static int read_source(struct node *n, int sfd, char *dst, uint64_t off, uint64_t len, uint64_t space) {
+    uint64_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        ret = pread(sfd, dst + done, len - done, off + done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret == -1) {
+            perror(n->path);
+            return -1;
+        }
+        if (ret == 0) {
+            printf("%s has shrunk while being copied.\n", n->path);
+            break;
+        }
+        done += ret;
+    }
+    memset(dst + done, 0, space - done);
+    return 0;
+}
+
+//Copia count ficheros de la tanda: los que ocupan bloques seguidos se juntan en buf y van en una sola escritura. Un
+//fichero mayor que COPY_BATCH va solo en su tanda y se copia por trozos
+static int copy_run(const uint64_t *list, uint64_t count, char *buf) {
+    uint64_t start = 0, pos = 0, off, len, i;
+    struct node *n;
+    int sfd, ret = 0;
+
+    for (i = 0; i < count && !ret; i++) {
+        n = &nodes[list[i]];
+        sfd = open(n->path, O_RDONLY);
+        if (sfd == -1) {
+            perror(n->path);
+            return -1;
+        }
+        posix_fadvise(sfd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        if (!n->blocks) {
+            ret = read_source(n, sfd, n->info.inline_data, 0, n->info.file_size, n->info.file_size);
+        } else if (n->blocks * block_size > COPY_BATCH) {
+            for (off = 0; off < n->blocks * block_size && !ret; off += COPY_BATCH) {
+                len = n->blocks * block_size - off < COPY_BATCH ? n->blocks * block_size - off : COPY_BATCH;
+                ret = read_source(n, sfd, buf, off, n->info.file_size - off < len ? n->info.file_size - off : len, len);
+                if (!ret && (ret = pwrite_all(copy_fd, buf, len, (n->block * block_size) + off)))
+                    perror("Error writing the image");
+            }
+        } else {
+            if (!pos)
+                start = n->block;
+            ret = read_source(n, sfd, buf + pos, 0, n->info.file_size, n->blocks * block_size);
+            pos += n->blocks * block_size;
+        }
+        close(sfd);
+    }
+
+    if (!ret && pos && (ret = pwrite_all(copy_fd, buf, pos, start * block_size)))
+        perror("Error writing the image");
+    return ret;
+}
+
+static int cmp_blocks(const void *a, const void *b) {
+    const struct node *na = &nodes[*(const uint64_t *)a], *nb = &nodes[*(const uint64_t *)b];
+
+    return na->block < nb->block ? -1 : na->block > nb->block;
+}
+
+static void *copy_worker(void *arg) {
+    char *buf = malloc(COPY_BATCH);
+    uint64_t first, end, bytes, next_block, len;
+    void *ret = buf ? NULL : (void *)1; //Sin buffer el hilo no copia nada y la copia falla
+    struct node *n;
+
+    (void)arg;
+    while (buf) {
+        //La siguiente tanda: ficheros seguidos en la imagen hasta COPY_BATCH bytes. Los inline no ocupan bloques
+        pthread_mutex_lock(&copy_lock);
+        first = end = copy_error ? copy_count : copy_next;
+        for (bytes = next_block = 0; end < copy_count; end++) {
+            n = &nodes[copy_files[end]];
+            len = n->blocks * block_size;
+            if (len && end > first && (bytes + len > COPY_BATCH || (next_block && n->block != next_block)))
+                break;
+            bytes += len;
+            if (len)
+                next_block = n->block + n->blocks;
+        }
+        copy_next = end;
+        pthread_mutex_unlock(&copy_lock);
+
+        if (first == end)
+            break;
+        if (copy_run(copy_files + first, end - first, buf)) {
+            pthread_mutex_lock(&copy_lock);
+            copy_error = 1;
+            pthread_mutex_unlock(&copy_lock);
+            break;
+        }
+    }
+    free(buf);
+    return ret;
+}
+
+//Escribe el arbol colocado por layout_tree: los bloques de los directorios, los datos de los ficheros (leidos por
+//threads hilos) y la tabla de inodos entera, los huecos libres incluidos
+static int write_tree(int fd) {
+    uint64_t per_block = ASSOOFS_INODES_PER_BLOCK(block_size), used_blocks = (node_count + per_block - 1) / per_block, i;
+    pthread_t *tids;
+    char *buf = NULL;
+    long n, dx_nodes, started;
+    void *res;
+    int ret = -1;
+
+    //Directorios
+    for (i = 0; i < node_count; i++) {
+        if (!S_ISDIR(nodes[i].info.mode))
+            continue;
+        if (!(buf = calloc(nodes[i].blocks, block_size)) || (n = dir_blocks(&nodes[i], buf, &dx_nodes)) == -1 ||
+            pwrite_all(fd, buf, n * block_size, nodes[i].block * block_size)) {
+            printf("Writing the directory %s has failed.\n", nodes[i].path);
+            free(buf);
+            return -1;
+        }
+        free(buf);
+    }
+
+    //Datos, en el orden en que quedan en la imagen (layout_tree los pone detras de su directorio)
+    copy_files = malloc(node_count * sizeof(*copy_files));
+    tids = calloc(threads, sizeof(*tids));
+    if (!copy_files || !tids)
+        goto out;
+    for (i = 0; i < node_count; i++) {
+        if (!S_ISDIR(nodes[i].info.mode) && nodes[i].info.file_size)
+            copy_files[copy_count++] = i;
+    }
+    qsort(copy_files, copy_count, sizeof(*copy_files), cmp_blocks);
+    copy_fd = fd;
+    for (started = 0; started < threads && !pthread_create(&tids[started], NULL, copy_worker, NULL); started++)
+        ;
+    if (!started)
+        copy_error = 1;
+    while (started--) {
+        pthread_join(tids[started], &res);
+        if (res)
+            copy_error = 1;
+    }
+    if (copy_error)
+        goto out;
+
+    //Tabla de inodos: los que estan en uso de una vez y despues el resto a cero (un hueco a cero es un inodo libre)
+    buf = calloc(COPY_BATCH > used_blocks * block_size ? COPY_BATCH : used_blocks * block_size, 1);
+    if (!buf)
+        goto out;
+    for (i = 0; i < node_count; i++)
+        memcpy(buf + i * sizeof(struct assoofs_inode_info), &nodes[i].info, sizeof(struct assoofs_inode_info));
+    if (pwrite_all(fd, buf, used_blocks * block_size, INODE_TABLE_BLOCK_NUMBER * block_size))
+        goto out;
+    memset(buf, 0, used_blocks * block_size);
+    for (i = used_blocks; i < inode_table_blocks; i += n) {
+        n = inode_table_blocks - i < COPY_BATCH / block_size ? inode_table_blocks - i : COPY_BATCH / block_size;
+        if (pwrite_all(fd, buf, n * block_size, (INODE_TABLE_BLOCK_NUMBER + i) * block_size))
+            goto out;
+    }
+
+    printf("Copied %llu inodes from %s (%llu blocks) with %ld threads.\n", (unsigned long long)node_count, source_dir,
+           (unsigned long long)(first_free_block - ROOTDIR_DATABLOCK_NUMBER), threads);
+    ret = 0;
+out:
+    if (ret && !copy_error)
+        printf("Writing the tree has failed.\n");
+    free(buf);
+    free(tids);
+    free(copy_files);
+    return ret;
+}
+
 int main(int argc, char *argv[])
 {
     //Codigo para generar el documento incial de bienvenida
     //Descriptor del fichero
-    int fd;
+    int fd, opt;
     ssize_t ret;
     char welcomefile_body[] = "Hola mundo, os saludo desde un sistema de ficheros ASSOOFS.\n";
     
@@ -131,47 +864,116 @@ int main(int argc, char *argv[])
     struct assoofs_inode_info welcome = {
         .mode = S_IFREG,    //Flag de archivo
         .inode_no = WELCOMEFILE_INODE_NUMBER,   //Definido al principio
-        .data_block_number = WELCOMEFILE_DATABLOCK_NUMBER,  //Definido al principio
         .file_size = sizeof(welcomefile_body),  //Tamannio de la cadena anterior "Hola mundo, ..."
 	.remove_flag = NO_REMOVED,
+        .flags = ASSOOFS_INODE_INLINE,  //Es pequenio: el contenido va dentro del inodo y no ocupa ningun bloque
     };
     
     struct assoofs_dir_record_entry record = {
         .filename = "README.txt", //Nombre del archivo dentro del directorio
+        .file_type = ASSOOFS_FT_REG_FILE, //readdir devuelve el tipo sin tener que leer el inodo
         .inode_no = WELCOMEFILE_INODE_NUMBER,
 	.remove_flag = NO_REMOVED,
     };
 
-    if (argc != 2) {    //No se le pasa dispositivo (USB, imagen ISO,...) Error
-        printf("Usage: mkassoofs <device>\n"); 
+    //Opciones: -O dir_v2 crea los directorios con entradas de longitud variable, -O compress hace que los ficheros
+    //nuevos se compriman, -O reflink reserva los contadores para clonar ficheros compartiendo bloques, -b el tamannio del bloque, -i el numero de inodos y -s los bytes del dispositivo que se usan
+    //-d copia un arbol de directorios en la imagen en lugar de README.txt, leyendolo con -j hilos
+    while ((opt = getopt(argc, argv, "O:b:i:s:d:j:")) != -1) {
+        if (opt == 'O' && !strcmp(optarg, "dir_v2")) {
+            features |= ASSOOFS_FEATURE_DIR_V2;
+        } else if (opt == 'O' && !strcmp(optarg, "compress")) {
+            features |= ASSOOFS_FEATURE_COMPRESSION;
+        } else if (opt == 'O' && !strcmp(optarg, "reflink")) {
+            features |= ASSOOFS_FEATURE_REFLINK;
+        } else if (opt == 'b') {
+            block_size = parse_size(optarg);
+        } else if (opt == 'i') {
+            inodes_wanted = parse_size(optarg);
+            if (!inodes_wanted)
+                break;
+        } else if (opt == 's') {
+            fs_size = parse_size(optarg);
+            if (!fs_size)
+                break;
+        } else if (opt == 'd') {
+            source_dir = optarg;
+        } else if (opt == 'j') {
+            threads = atol(optarg);
+            if (threads <= 0)
+                break;
+        } else {
+            break;
+        }
+    }
+
+    if (opt != -1 || optind != argc - 1) {    //No se le pasa dispositivo (USB, imagen ISO,...) Error
+        printf("Usage: mkassoofs [-O dir_v2] [-O compress] [-O reflink] [-b block size] [-i inodes] [-s size] [-d dir [-j threads]] <device>\n"); 
+        return -1;
+    }
+
+    if (!assoofs_block_size_valid(block_size, features)) {
+        printf("The block size must be a power of 2 between %d and %d (%d with dir_v2).\n",
+               ASSOOFS_MIN_BLOCK_SIZE, ASSOOFS_MAX_BLOCK_SIZE, ASSOOFS_DIR_V2_MAX_BLOCK_SIZE);
         return -1;
     }
 
     //fd = descriptor del fichero
-    fd = open(argv[1], O_RDWR); //El dispositivo fd se abre igual que un fichero
+    fd = open(argv[optind], O_RDWR); //El dispositivo fd se abre igual que un fichero
     if (fd == -1) { //Si es -1 Error
         perror("Error opening the device");
         return -1;
     }   //Sino
 
+    if (!threads)
+        threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+
     ret = 1;
+    if (source_dir) {
+        do {
+            if (scan_tree() || compute_geometry(fd) || layout_tree())   //Con -d la tabla de inodos crece si hace falta
+                break;
+            if (write_superblock(fd) || write_bitmap(fd) || write_refcounts(fd))
+                break;
+            if (write_tree(fd)) //Directorios, datos y tabla de inodos, cada uno en su sitio
+                break;
+            if (lseek(fd, JOURNAL_BLOCK_NUMBER * block_size, SEEK_SET) == -1 || write_journal(fd))
+                break;
+            ret = 0;
+        } while (0);
+        close(fd);
+        return ret;
+    }
+
     do {
+        if (compute_geometry(fd))   //Tamannio del dispositivo y del mapa de bits
+            break;
+        first_free_block = ROOTDIR_DATABLOCK_NUMBER + 1;    //Solo el bloque del directorio raiz
+        memcpy(welcome.inline_data, welcomefile_body, sizeof(welcomefile_body));
+        if (features & ASSOOFS_FEATURE_COMPRESSION)
+            welcome.flags |= ASSOOFS_INODE_COMPRESSED;  //Si crece y sale del inodo sus datos se comprimen
+
         if (write_superblock(fd)) //Escribe el superbloque en el bloque 0
             break;
 
+        if (write_bitmap(fd))   //Escribe el mapa de bits de bloques libres a continuacion
+            break;
+
+        if (write_refcounts(fd))    //Y detras los contadores de referencias (-O reflink)
+            break;
+
         if (write_root_inode(fd))   //Guarda el inodo de directorio raiz en el amacen de inodos
             break;
         
         if (write_welcome_inode(fd, &welcome))  //Guarfa el inodo del fichero README.txt en el almacen de inodos
             break;
 
+        if (write_journal(fd))  //Journal de metadatos vacio entre la tabla de inodos y los datos
+            break;
+
         if (write_dirent(fd, &record))  //Guarda una entrada <nombre,numero de inodo> para el fichero README.txt en el bloque que
                                         //almacena las entradas del directorio raiz
             break;
-        
-        if (write_block(fd, welcomefile_body, welcome.file_size))   //Escribe un mensaje en el bloque que almacena los contenidos
-                                                                    //del fichero README.txt
-            break;
 
         ret = 0;
     } while (0);